@@ -0,0 +1,439 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// Runs the command buffer shapes of the scenarios to completion, to measure
+// the overhead of a layer when nothing goes wrong. The shapes are run once
+// with the layers of --layer only, and once more with --compare_layer too if
+// it is set.
+
+#include <cstring>
+#include <fstream>
+
+#include "common.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint64_t kFenceTimeoutNs = 10 * 1000 * 1000 * 1000ULL;
+
+static int64_t ElapsedNs(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count();
+}
+
+// Total times of the iterations of a shape.
+struct ShapeResult {
+  std::string name;
+  const char* op;  // What ops counts: dispatches, copies, events, semaphores.
+  uint64_t iterations = 0;
+  uint64_t submits = 0;  // QueueSubmit and QueueBindSparse calls.
+  uint64_t ops = 0;
+  int64_t record_ns = 0;
+  int64_t submit_ns = 0;
+  int64_t wait_ns = 0;
+
+  double NsPerSubmit() const {
+    return submits ? static_cast<double>(submit_ns) / submits : 0;
+  }
+  // Host time of recording and submitting, per op.
+  double NsPerOp() const {
+    return ops ? static_cast<double>(record_ns + submit_ns) / ops : 0;
+  }
+};
+
+struct Bench {
+  VulkanDevice* device;
+  uint64_t iterations;
+  uint32_t ops;
+  VkCommandBuffer command_buffer;
+  VkFence fence;
+};
+
+// Runs the iterations of a shape: resets and records the command buffer with
+// record, then calls submit, which must signal the fence and return its
+// number of QueueSubmit and QueueBindSparse calls, then waits for the fence.
+static ShapeResult RunShape(Bench& bench, const char* name, const char* op,
+                            uint64_t ops_per_iteration,
+                            std::function<void(VkCommandBuffer)> record,
+                            std::function<uint32_t()> submit) {
+  auto device = bench.device;
+  auto vk_device = device->device;
+  ShapeResult result;
+  result.name = name;
+  result.op = op;
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  for (uint64_t i = 0; i < bench.iterations; i++) {
+    auto start = Clock::now();
+    VK_CHECK_RESULT(
+        device->vk.ResetCommandPool(vk_device, bench.device->commandPool, 0));
+    VK_CHECK_RESULT(
+        device->vk.BeginCommandBuffer(bench.command_buffer, &begin_info));
+    record(bench.command_buffer);
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(bench.command_buffer));
+    auto recorded = Clock::now();
+    result.submits += submit();
+    auto submitted = Clock::now();
+    VK_CHECK_RESULT(
+        device->vk.WaitForFences(vk_device, 1, &bench.fence, VK_TRUE,
+                                 kFenceTimeoutNs));
+    VK_CHECK_RESULT(device->vk.ResetFences(vk_device, 1, &bench.fence));
+    auto waited = Clock::now();
+
+    result.record_ns += ElapsedNs(start, recorded);
+    result.submit_ns += ElapsedNs(recorded, submitted);
+    result.wait_ns += ElapsedNs(submitted, waited);
+  }
+  result.iterations = bench.iterations;
+  result.ops = ops_per_iteration * bench.iterations;
+  LOG("%-20s %8.0f ns/submit %8.0f ns/%s\n", name, result.NsPerSubmit(),
+      result.NsPerOp(), op);
+  return result;
+}
+
+static std::vector<ShapeResult> RunShapes(VulkanContext& context,
+                                          bool timeline_supported) {
+  auto device = context.GetSingleDevice();
+  auto vk_device = device->device;
+
+  AllocateInputOutputBuffers(device, BufferInitialization::Default);
+  CreateDescriptorSets(device);
+
+  Bench bench = {};
+  bench.device = device;
+  bench.iterations = GetFlagUint("--iterations", 1000);
+  bench.ops =
+      static_cast<uint32_t>(std::max<uint64_t>(GetFlagUint("--ops", 16), 1));
+  auto ops = bench.ops;
+
+  VkCommandBufferAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = device->commandPool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &allocate_info,
+                                        &bench.command_buffer));
+
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VK_CHECK_RESULT(vkCreateFence(vk_device, &fence_info, nullptr, &bench.fence));
+
+  VkEventCreateInfo event_info = {};
+  event_info.sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO;
+  VkEvent event;
+  VK_CHECK_RESULT(vkCreateEvent(vk_device, &event_info, nullptr, &event));
+
+  std::vector<VkSemaphore> semaphores(ops);
+  CreateBinarySemaphores(device, semaphores.data(), ops);
+
+  auto submit_command_buffer = [&]() -> uint32_t {
+    VkSubmitInfo submit_info = CreateSubmitInfo(&bench.command_buffer);
+    VK_CHECK_RESULT(QueueSubmit(device, device->queue, 1, &submit_info,
+                                bench.fence));
+    return 1;
+  };
+
+  std::vector<ShapeResult> results;
+
+  results.push_back(RunShape(
+      bench, "dispatch", "dispatch", ops,
+      [&](VkCommandBuffer cb) {
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
+        for (uint32_t i = 0; i < ops; i++) {
+          device->vk.CmdDispatch(cb, 1, 1, 1);
+        }
+      },
+      submit_command_buffer));
+
+  results.push_back(RunShape(
+      bench, "copy", "copy", ops,
+      [&](VkCommandBuffer cb) {
+        VkBufferCopy region = {0, 0, device->bufferSize};
+        for (uint32_t i = 0; i < ops; i++) {
+          device->vk.CmdCopyBuffer(cb, device->bufferIn, device->bufferOut, 1,
+                                   &region);
+        }
+      },
+      submit_command_buffer));
+
+  results.push_back(RunShape(
+      bench, "event", "event", ops,
+      [&](VkCommandBuffer cb) {
+        for (uint32_t i = 0; i < ops; i++) {
+          device->vk.CmdSetEvent(cb, event, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+          device->vk.CmdWaitEvents(cb, 1, &event,
+                                   VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                   VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+                                   nullptr, 0, nullptr, 0, nullptr);
+          device->vk.CmdResetEvent(cb, event,
+                                   VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+        }
+      },
+      submit_command_buffer));
+
+  // A chain of ops + 1 submits in a single call, each waiting on the binary
+  // semaphore signaled by the previous one.
+  const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  results.push_back(RunShape(
+      bench, "binary_semaphore", "semaphore", 2 * ops, [](VkCommandBuffer) {},
+      [&]() -> uint32_t {
+        std::vector<VkSubmitInfo> submit_infos(ops + 1);
+        for (uint32_t i = 0; i <= ops; i++) {
+          auto& submit_info = submit_infos[i];
+          submit_info = CreateSubmitInfo(&bench.command_buffer);
+          submit_info.commandBufferCount = i == 0 ? 1 : 0;
+          if (i > 0) {
+            submit_info.waitSemaphoreCount = 1;
+            submit_info.pWaitSemaphores = &semaphores[i - 1];
+            submit_info.pWaitDstStageMask = &wait_stage;
+          }
+          if (i < ops) {
+            submit_info.signalSemaphoreCount = 1;
+            submit_info.pSignalSemaphores = &semaphores[i];
+          }
+        }
+        VK_CHECK_RESULT(QueueSubmit(device, device->queue, ops + 1,
+                                    submit_infos.data(), bench.fence));
+        return 1;
+      }));
+
+  if (timeline_supported) {
+    // Same chain with increasing values of a single timeline semaphore.
+    VkSemaphore timeline_semaphore;
+    CreateTimelineSemaphores(device, &timeline_semaphore);
+    uint64_t value = 0;
+    results.push_back(RunShape(
+        bench, "timeline_semaphore", "semaphore", 2 * ops - 1,
+        [](VkCommandBuffer) {},
+        [&]() -> uint32_t {
+          std::vector<uint64_t> wait_values(ops), signal_values(ops);
+          std::vector<VkTimelineSemaphoreSubmitInfoKHR> timeline_infos(ops);
+          std::vector<VkSubmitInfo> submit_infos(ops);
+          for (uint32_t i = 0; i < ops; i++) {
+            wait_values[i] = value + i;
+            signal_values[i] = value + i + 1;
+            timeline_infos[i] = {};
+            timeline_infos[i].sType =
+                VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+            timeline_infos[i].signalSemaphoreValueCount = 1;
+            timeline_infos[i].pSignalSemaphoreValues = &signal_values[i];
+
+            auto& submit_info = submit_infos[i];
+            submit_info = CreateSubmitInfo(&bench.command_buffer, nullptr,
+                                           nullptr, nullptr,
+                                           &timeline_infos[i]);
+            submit_info.commandBufferCount = i == 0 ? 1 : 0;
+            submit_info.signalSemaphoreCount = 1;
+            submit_info.pSignalSemaphores = &timeline_semaphore;
+            if (i > 0) {
+              timeline_infos[i].waitSemaphoreValueCount = 1;
+              timeline_infos[i].pWaitSemaphoreValues = &wait_values[i];
+              submit_info.waitSemaphoreCount = 1;
+              submit_info.pWaitSemaphores = &timeline_semaphore;
+              submit_info.pWaitDstStageMask = &wait_stage;
+            }
+          }
+          value += ops;
+          VK_CHECK_RESULT(QueueSubmit(device, device->queue, ops,
+                                      submit_infos.data(), bench.fence));
+          return 1;
+        }));
+  }
+
+  // A chain of ops bind sparse infos without binds, then a submit waiting on
+  // the last one.
+  uint32_t queue_family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &queue_family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(
+      device->physicalDevice, &queue_family_count, queue_families.data());
+  if (queue_families[device->queueFamilyIndices.front()].queueFlags &
+      VK_QUEUE_SPARSE_BINDING_BIT) {
+    results.push_back(RunShape(
+        bench, "bind_sparse", "semaphore", 2 * ops, [](VkCommandBuffer) {},
+        [&]() -> uint32_t {
+          std::vector<VkBindSparseInfo> bind_infos(ops);
+          for (uint32_t i = 0; i < ops; i++) {
+            bind_infos[i] = CreateBindSparseInfo(nullptr, nullptr, nullptr);
+            if (i > 0) {
+              bind_infos[i].waitSemaphoreCount = 1;
+              bind_infos[i].pWaitSemaphores = &semaphores[i - 1];
+            }
+            bind_infos[i].signalSemaphoreCount = 1;
+            bind_infos[i].pSignalSemaphores = &semaphores[i];
+          }
+          VK_CHECK_RESULT(QueueBindSparse(device, device->queue, ops,
+                                          bind_infos.data(), VK_NULL_HANDLE));
+          VkSubmitInfo submit_info = CreateSubmitInfo(&bench.command_buffer);
+          submit_info.waitSemaphoreCount = 1;
+          submit_info.pWaitSemaphores = &semaphores[ops - 1];
+          submit_info.pWaitDstStageMask = &wait_stage;
+          VK_CHECK_RESULT(QueueSubmit(device, device->queue, 1, &submit_info,
+                                      bench.fence));
+          return 2;
+        }));
+  } else {
+    LOG("The queue does not support sparse binding, skipping bind_sparse.\n");
+  }
+
+  VK_CHECK_RESULT(vkDeviceWaitIdle(vk_device));
+  return results;
+}
+
+// Runs the shapes on a new context with the given extra instance layer, and
+// returns false if the context could not be created.
+static bool RunPass(const char* layer, std::string* device_name,
+                    std::vector<ShapeResult>* results) {
+  VulkanContext context;
+  if (layer != nullptr) {
+    context.instanceLayers.push_back(layer);
+  }
+  if (!InitVulkanInstance(&context)) {
+    return false;
+  }
+
+  std::vector<const char*> device_extensions;
+  auto infos = GetPhysicalDeviceInfos(&context);
+  auto info = FindPhysicalDevice(infos, GetFlag("--device"));
+  bool timeline_supported =
+      info != nullptr &&
+      HasDeviceExtension(info->physicalDevice, "VK_KHR_timeline_semaphore");
+  if (timeline_supported) {
+    device_extensions.push_back("VK_KHR_timeline_semaphore");
+  } else {
+    LOG("VK_KHR_timeline_semaphore is not supported, skipping "
+        "timeline_semaphore.\n");
+  }
+  if (InitVulkanDevice(&context, &device_extensions, "read_write.comp.spv") ==
+      VK_NULL_HANDLE) {
+    return false;
+  }
+  SetupWatchdogTimer(&context);
+
+  LOG("Benchmark pass with layer %s\n", layer ? layer : "(none)");
+  *device_name = info->properties.deviceName;
+  *results = RunShapes(context, timeline_supported);
+  CleanupVulkan(&context);
+  // Each pass gets the whole watchdog budget.
+  WaitForWatchdogThread();
+  return true;
+}
+
+static std::string ShapesToJson(const std::vector<ShapeResult>& results) {
+  std::string json = "{";
+  char buffer[512];
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto& r = results[i];
+    snprintf(buffer, sizeof(buffer),
+             "%s\"%s\": {\"op\": \"%s\", \"iterations\": %llu, "
+             "\"submits\": %llu, \"ops\": %llu, \"record_ns\": %lld, "
+             "\"submit_ns\": %lld, \"wait_ns\": %lld, \"ns_per_submit\": "
+             "%.1f, \"ns_per_%s\": %.1f}",
+             i ? ", " : "", r.name.c_str(), r.op,
+             static_cast<unsigned long long>(r.iterations),
+             static_cast<unsigned long long>(r.submits),
+             static_cast<unsigned long long>(r.ops),
+             static_cast<long long>(r.record_ns),
+             static_cast<long long>(r.submit_ns),
+             static_cast<long long>(r.wait_ns), r.NsPerSubmit(), r.op,
+             r.NsPerOp());
+    json += buffer;
+  }
+  return json + "}";
+}
+
+// Per shape difference of the per submit and per op times of the layer pass
+// relative to the baseline pass.
+static std::string OverheadToJson(const std::vector<ShapeResult>& baseline,
+                                  const std::vector<ShapeResult>& layer) {
+  std::string json = "{";
+  char buffer[256];
+  for (const auto& b : baseline) {
+    for (const auto& l : layer) {
+      if (l.name != b.name) {
+        continue;
+      }
+      snprintf(buffer, sizeof(buffer),
+               "%s\"%s\": {\"ns_per_submit\": %.1f, \"ns_per_%s\": %.1f}",
+               json.size() > 1 ? ", " : "", b.name.c_str(),
+               l.NsPerSubmit() - b.NsPerSubmit(), b.op,
+               l.NsPerOp() - b.NsPerOp());
+      json += buffer;
+    }
+  }
+  return json + "}";
+}
+
+int main(int argc, char* argv[]) {
+  DefineFlag("--iterations", "Number of iterations of each shape.");
+  DefineFlag("--ops",
+             "Number of dispatches, copies, events or semaphore signals per "
+             "iteration.");
+  DefineFlag("--compare_layer",
+             "Instance layer to measure, the shapes are also run without it.");
+  DefineFlag("--benchmark_json", "Write the results as JSON to this file.");
+  Initialize();
+  InitFlags(argc, argv);
+
+  std::string device_name;
+  std::vector<ShapeResult> baseline;
+  if (!RunPass(nullptr, &device_name, &baseline)) {
+    return 1;
+  }
+
+  std::string json = "{\"device_name\": \"" + JsonEscape(device_name) +
+                     "\", \"iterations\": " +
+                     std::to_string(GetFlagUint("--iterations", 1000)) +
+                     ", \"ops\": " + std::to_string(GetFlagUint("--ops", 16)) +
+                     ", \"layers\": \"" +
+                     JsonEscape(GetFlag("--layer") ? GetFlag("--layer") : "") +
+                     "\", \"baseline\": " + ShapesToJson(baseline);
+
+  const char* compare_layer = GetFlag("--compare_layer");
+  if (compare_layer != nullptr && compare_layer[0] != '\0') {
+    std::vector<ShapeResult> layer;
+    if (!RunPass(compare_layer, &device_name, &layer)) {
+      return 1;
+    }
+    json += ", \"compare_layer\": \"" + JsonEscape(compare_layer) +
+            "\", \"layer\": " + ShapesToJson(layer) +
+            ", \"overhead\": " + OverheadToJson(baseline, layer);
+  }
+  json += "}";
+
+  const char* json_path = GetFlag("--benchmark_json");
+  if (json_path != nullptr && json_path[0] != '\0') {
+    std::ofstream out(json_path);
+    out << json << "\n";
+    if (!out) {
+      LOG("Could not write %s\n", json_path);
+      return 1;
+    }
+  } else {
+    LOG("Benchmark: %s\n", json.c_str());
+  }
+
+  Finalize();
+  return 0;
+}
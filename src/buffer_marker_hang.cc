@@ -24,9 +24,17 @@ void TestVulkan(VulkanContext& context) {
 
   LOG("Creating Buffer Marker Buffer\n");
 
-  // Marker buffer
+  // Marker ring mode, see --marker_ring.
+  uint32_t ringMarkers =
+      static_cast<uint32_t>(GetFlagUint("--marker_ring", 0));
+
+  // Marker buffer, and the marker ring, in a block sized for them. The slack
+  // covers the alignment of the buffers.
+  MemoryArena arena;
+  InitMemoryArena(&arena, device,
+                  device->bufferSize + ringMarkers * sizeof(uint32_t) +
+                      (64 << 10));
   VkBuffer markerBuffer;
-  VkDeviceMemory markerBufferMemory;
   void* markerBufferPointer;
   {
     VkBufferCreateInfo bufferCreateInfo = {};
@@ -36,36 +44,22 @@ void TestVulkan(VulkanContext& context) {
         VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    VK_CHECK_RESULT(
-        vkCreateBuffer(vk_device, &bufferCreateInfo, nullptr, &markerBuffer));
-
-    VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(vk_device, markerBuffer, &memoryRequirements);
-
     int bufferMemoryType = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
-    VkMemoryAllocateInfo allocateInfo = {};
-    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocateInfo.allocationSize = device->memorySize;
-    allocateInfo.memoryTypeIndex =
-        FindMemoryType(context.physicalDevice,
-                       memoryRequirements.memoryTypeBits, bufferMemoryType);
-
-    VK_CHECK_RESULT(vkAllocateMemory(vk_device, &allocateInfo, nullptr,
-                                     &markerBufferMemory));
-
-    VK_CHECK_RESULT(
-        vkBindBufferMemory(vk_device, markerBuffer, markerBufferMemory, 0));
+    MemoryAllocation markerAllocation;
+    VK_CHECK_RESULT(ArenaCreateBuffer(&arena, bufferCreateInfo,
+                                      bufferMemoryType, &markerBuffer,
+                                      &markerAllocation));
+    SetObjectDebugName(device, markerBuffer, VK_OBJECT_TYPE_BUFFER,
+                       "Marker Buffer");
+    markerBufferPointer = markerAllocation.mapped;
 
-    // initialize input and output buffers
+    // initialize the markers
     {
-      VK_CHECK_RESULT(vkMapMemory(vk_device, markerBufferMemory, 0,
-                                  VK_WHOLE_SIZE, 0, &markerBufferPointer));
-
-      int* pBufferData = (int*)markerBufferPointer;
-      for (int i = 0; i < device->numBufferEntries; ++i) {
-        *pBufferData++ = i;
+      uint32_t* pBufferData = (uint32_t*)markerBufferPointer;
+      for (VkDeviceSize i = 0; i < device->numBufferEntries; ++i) {
+        *pBufferData++ = static_cast<uint32_t>(i);
       }
     }
   }
@@ -78,6 +72,11 @@ void TestVulkan(VulkanContext& context) {
     }
   }
 
+  MarkerRing ring;
+  if (ringMarkers > 0) {
+    VK_CHECK_RESULT(CreateMarkerRing(&arena, ringMarkers, &ring));
+  }
+
   CreateDescriptorSets(device);
 
   // Create command buffers
@@ -89,11 +88,13 @@ void TestVulkan(VulkanContext& context) {
   commandBufferAllocateInfo.commandBufferCount = 1;
 
   VkCommandBuffer commandBuffer;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer));
   VkCommandBuffer commandBuffer2;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer2));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer2));
 
   // build a second command buffer
   VkCommandBufferBeginInfo commandBufferBeginInfo = {};
@@ -101,71 +102,98 @@ void TestVulkan(VulkanContext& context) {
   commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
   VK_CHECK_RESULT(
-      vkBeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
+      device->vk.BeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer2,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer2, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer2, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer2));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer2));
 
-  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  VK_CHECK_RESULT(
+      device->vk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+
+  device->vk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindDescriptorSets(commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  CmdWriteBufferMarker(device, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       markerBuffer, 0, 0xDEADBEEF);
 
-  device->CmdWriteBufferMarkerAMD(commandBuffer,
-                                  VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                                  markerBuffer, 0, 0xDEADBEEF);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  CmdWriteBufferMarker(device, commandBuffer,
+                       VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       markerBuffer, 4, 0x0BADF00D);
 
-  device->CmdWriteBufferMarkerAMD(commandBuffer,
-                                  VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                                  markerBuffer, 4, 0x0BADF00D);
+  // Half of the ring markers land before the hang, the poller sees them stop.
+  if (ringMarkers > 0) {
+    CmdWriteRingMarkers(commandBuffer, &ring, ringMarkers / 2,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        [device](VkCommandBuffer cb) {
+                          device->vk.CmdDispatch(cb, 1, 1, 1);
+                        });
+  }
 
   WaitOnEventThatNeverSignals(device, commandBuffer);
 
+  if (ringMarkers > 0) {
+    CmdWriteRingMarkers(commandBuffer, &ring, ringMarkers - ringMarkers / 2,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        [device](VkCommandBuffer cb) {
+                          device->vk.CmdDispatch(cb, 1, 1, 1);
+                        });
+  }
+
   // dispatch again to see if the command is executed after the wait event
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
-  device->CmdWriteBufferMarkerAMD(commandBuffer,
-                                  VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-                                  markerBuffer, 8, 0x0D15EA5E);
+  CmdWriteBufferMarker(device, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       markerBuffer, 8, 0x0D15EA5E);
 
   // Dispatch twice to see if the command if executed after event
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-  device->CmdWriteBufferMarkerAMD(commandBuffer,
-                                  VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-                                  markerBuffer, 12, 0x0DEFACED);
+  CmdWriteBufferMarker(device, commandBuffer,
+                       VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       markerBuffer, 12, 0x0DEFACED);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
   // submit buffer to queue
   VkSubmitInfo submitInfo = CreateSubmitInfo(&commandBuffer);
 
+  if (ringMarkers > 0) {
+    StartMarkerRingPoller(&ring);
+  }
+
+  RunStressSubmits(device, device->queue);
   for (int i = 0; i < 1; ++i) {
     LOG("Submitting %d\n", i);
     VK_CHECK_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
     LOG("Submitted %d\n", i);
   }
 
   // NOTE: vkQueueWaitIdle will return VK_SUCCESS when this hang is detected
   LOG("Waiting for idle...\n");
-  VK_CHECK_RESULT(vkQueueWaitIdle(device->queue));
+  VK_CHECK_RESULT(device->vk.QueueWaitIdle(device->queue));
+
+  if (ringMarkers > 0) {
+    StopMarkerRingPoller(&ring);
+  }
 
   // Expected program output:
   /*
@@ -211,6 +239,12 @@ MARKERS
       LOG("%4d: %08X\n", i, markers[i]);
     }
   }
+
+  if (ringMarkers > 0) {
+    DestroyMarkerRing(&ring);
+  }
+  vkDestroyBuffer(vk_device, markerBuffer, nullptr);
+  DestroyMemoryArena(&arena);
 }
 
 // Run our test.
@@ -16,70 +16,2260 @@
 
 #include "common.h"
 
+#include <sys/stat.h>
+#ifndef WINDOWS
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
 #include <atomic>
 #include <chrono>
+#include <cctype>
+#include <cmath>
 #include <condition_variable>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
 
-using namespace std::chrono_literals;
+using namespace std::chrono_literals;
+
+// Logging
+// Each thread appends its complete lines, prefixed with the time since the
+// first log and a thread index, to a ring of its own without taking a lock. A
+// background thread drains the rings to stderr. When a ring is full, or with
+// --sync_log, the thread drains the rings itself. The ring of a thread is
+// drained and freed when the thread exits, and the rings are written out by
+// the handler of SIGABRT, SIGSEGV and SIGBUS, so that the last lines before a
+// crash (e.g. the Fatal line of VK_CHECK_RESULT) are not lost.
+struct LogRing {
+  static constexpr size_t kSize = 256 * 1024;
+  uint32_t threadIndex;
+  std::atomic<size_t> head{0};  // Written by the thread.
+  std::atomic<size_t> tail{0};  // Written by the drain.
+  char data[kSize];
+  std::string pending;  // Current line, not pushed until complete.
+};
+
+// Header of each ring record, followed by the text.
+struct LogRecord {
+  int64_t ns;
+  uint32_t size;
+};
+
+constexpr auto kLogDrainInterval = 5ms;
+
+static std::mutex log_rings_lock;
+// Never freed, as threads may still log during exit.
+static std::vector<LogRing*>& log_rings = *new std::vector<LogRing*>();
+static uint32_t log_thread_count = 0;
+// The rings drained by the fatal signal handler, which can't lock.
+constexpr size_t kMaxSignalLogRings = 256;
+static std::atomic<LogRing*> log_signal_rings[kMaxSignalLogRings];
+// Set once the ring of the thread is freed, its later logs are written
+// directly.
+static thread_local bool log_ring_released = false;
+static std::mutex log_drain_lock;
+static std::thread* log_thread;
+static std::atomic<bool> log_thread_stop;
+static std::atomic<bool> log_async{true};
+static const auto log_start = std::chrono::steady_clock::now();
+
+// Writes the records of every ring to stderr, merged in time order. Must be
+// called with log_drain_lock.
+static void DrainLogsLocked() {
+  std::vector<LogRing*> rings;
+  {
+    std::lock_guard<std::mutex> lock(log_rings_lock);
+    rings = log_rings;
+  }
+  struct Line {
+    int64_t ns;
+    std::string text;
+  };
+  std::vector<Line> lines;
+  for (auto ring : rings) {
+    size_t head = ring->head.load(std::memory_order_acquire);
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    auto read = [&](void* dst, size_t size) {
+      for (size_t i = 0; i < size; i++) {
+        static_cast<char*>(dst)[i] = ring->data[tail++ % LogRing::kSize];
+      }
+    };
+    while (tail != head) {
+      LogRecord record;
+      read(&record, sizeof(record));
+      Line line = {record.ns, std::string(record.size, '\0')};
+      read(&line.text[0], record.size);
+      lines.push_back(std::move(line));
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+  std::stable_sort(lines.begin(), lines.end(),
+                   [](const Line& a, const Line& b) { return a.ns < b.ns; });
+  for (const auto& line : lines) {
+    fwrite(line.text.data(), 1, line.text.size(), stderr);
+  }
+  fflush(stderr);
+}
+
+static void DrainLogs() {
+  std::lock_guard<std::mutex> drain_lock(log_drain_lock);
+  DrainLogsLocked();
+}
+
+#ifndef WINDOWS
+// Writes the records left in the rings with write(2), ring by ring, and
+// raises the signal again with its default action.
+static void OnFatalSignal(int signal_number) {
+  for (auto& slot : log_signal_rings) {
+    LogRing* ring = slot.load(std::memory_order_acquire);
+    if (ring == nullptr) {
+      continue;
+    }
+    size_t head = ring->head.load(std::memory_order_acquire);
+    size_t tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail > LogRing::kSize) {
+      continue;
+    }
+    while (tail != head) {
+      LogRecord record;
+      for (size_t i = 0; i < sizeof(record); i++) {
+        reinterpret_cast<char*>(&record)[i] =
+            ring->data[tail++ % LogRing::kSize];
+      }
+      // The text may wrap around the end of the ring.
+      for (size_t left = record.size; left > 0;) {
+        size_t begin = tail % LogRing::kSize;
+        size_t n = std::min(left, LogRing::kSize - begin);
+        if (write(STDERR_FILENO, ring->data + begin, n) < 0) {
+          break;
+        }
+        tail += n;
+        left -= n;
+      }
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+  signal(signal_number, SIG_DFL);
+  raise(signal_number);
+}
+
+// Installs OnFatalSignal for the signals that still have their default
+// action.
+static void InstallFatalSignalHandlers() {
+  for (int signal_number : {SIGABRT, SIGSEGV, SIGBUS}) {
+    struct sigaction previous;
+    if (sigaction(signal_number, nullptr, &previous) != 0 ||
+        previous.sa_handler != SIG_DFL) {
+      continue;
+    }
+    struct sigaction action = {};
+    action.sa_handler = OnFatalSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESETHAND;
+    sigaction(signal_number, &action, nullptr);
+  }
+}
+#endif
+
+static void LogThread() {
+  while (!log_thread_stop) {
+    std::this_thread::sleep_for(kLogDrainInterval);
+    DrainLogs();
+  }
+}
+
+void FlushLogs() {
+  if (log_thread != nullptr && !log_thread_stop.exchange(true) &&
+      log_thread->get_id() != std::this_thread::get_id()) {
+    log_thread->join();
+  }
+  // Logs of later exit handlers and threads are written directly. The
+  // partial lines of the other threads are left to them, they are written
+  // when the threads exit.
+  log_async = false;
+  DrainLogs();
+}
+
+static LogRing* RegisterLogRing() {
+  auto ring = new LogRing();
+  for (auto& slot : log_signal_rings) {
+    LogRing* empty = nullptr;
+    if (slot.compare_exchange_strong(empty, ring)) {
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(log_rings_lock);
+  ring->threadIndex = log_thread_count++;
+  log_rings.push_back(ring);
+  if (log_thread == nullptr) {
+    log_thread = new std::thread(LogThread);
+    std::atexit(FlushLogs);
+#ifndef WINDOWS
+    InstallFatalSignalHandlers();
+#endif
+  }
+  return ring;
+}
+
+static void PushLogLine(LogRing* ring, int64_t ns, const std::string& line);
+
+// Writes the rest of the ring of an exiting thread, and frees it.
+static void ReleaseLogRing(LogRing* ring) {
+  if (!ring->pending.empty()) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - log_start)
+                     .count();
+    PushLogLine(ring, ns, ring->pending + "\n");
+  }
+  std::lock_guard<std::mutex> drain_lock(log_drain_lock);
+  DrainLogsLocked();
+  for (auto& slot : log_signal_rings) {
+    LogRing* expected = ring;
+    slot.compare_exchange_strong(expected, nullptr);
+  }
+  {
+    std::lock_guard<std::mutex> lock(log_rings_lock);
+    log_rings.erase(std::find(log_rings.begin(), log_rings.end(), ring));
+  }
+  delete ring;
+}
+
+// The ring of the calling thread, released when the thread exits.
+static LogRing* ThreadLogRing() {
+  struct Owner {
+    LogRing* ring = RegisterLogRing();
+    ~Owner() {
+      ReleaseLogRing(ring);
+      log_ring_released = true;
+    }
+  };
+  thread_local Owner owner;
+  return owner.ring;
+}
+
+// Appends a complete line to the ring of the thread.
+static void PushLogLine(LogRing* ring, int64_t ns, const std::string& line) {
+  LogRecord record = {ns, static_cast<uint32_t>(line.size())};
+  size_t size = sizeof(record) + line.size();
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  if (size > LogRing::kSize) {
+    std::lock_guard<std::mutex> drain_lock(log_drain_lock);
+    fwrite(line.data(), 1, line.size(), stderr);
+    return;
+  }
+  while (LogRing::kSize - (head - ring->tail.load(std::memory_order_acquire)) <
+         size) {
+    DrainLogs();
+  }
+  auto write = [&](const void* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      ring->data[head++ % LogRing::kSize] = static_cast<const char*>(src)[i];
+    }
+  };
+  write(&record, sizeof(record));
+  write(line.data(), line.size());
+  ring->head.store(head, std::memory_order_release);
+}
+
+void LOG(const char* format, ...) {
+  va_list args;
+  char str[8 * 1024];
+  va_start(args, format);
+  vsnprintf(str, sizeof(str), format, args);
+  va_end(args);
+
+  if (log_ring_released) {
+    std::lock_guard<std::mutex> drain_lock(log_drain_lock);
+    fputs(str, stderr);
+    fflush(stderr);
+    return;
+  }
+  LogRing* ring = ThreadLogRing();
+  int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - log_start)
+                   .count();
+  for (const char* c = str; *c != '\0'; c++) {
+    if (ring->pending.empty()) {
+      char prefix[32];
+      snprintf(prefix, sizeof(prefix), "[%10.6f T%u] ", ns / 1e9,
+               ring->threadIndex);
+      ring->pending = prefix;
+    }
+    ring->pending += *c;
+    if (*c == '\n') {
+      PushLogLine(ring, ns, ring->pending);
+      ring->pending.clear();
+    }
+  }
+  if (!log_async) {
+    DrainLogs();
+  }
+}
+
+std::string JsonEscape(const std::string& s) {
+  std::string escaped;
+  escaped.reserve(s.size());
+  for (char c : s) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\r':
+        escaped += "\\r";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          escaped += buf;
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
+static void CommonFlags() {
+  DefineFlag("--queue",
+             "Type of queue to use, can be graphics/compute/transfer.");
+  DefineFlag("--secondary", "Use secondary command buffer.");
+  DefineFlag("--debug_utils", "Add debug utils names and labels.");
+  DefineFlag("--layer", "Comma separated instance layers to enable.");
+  DefineFlag("--sync_log",
+             "Write the logs from the logging thread instead of a background "
+             "thread.");
+  DefineFlag("--hang_target_ms",
+             "GPU time of the infinite loop hangs, the loop count is "
+             "calibrated for it.");
+  DefineFlag("--marker_ring",
+             "Number of markers written to the marker ring by the buffer "
+             "marker scenarios.");
+  DefineFlag("--marker_ring_stall_ms",
+             "Time without new markers after which the marker ring poller "
+             "stops (default 1000).");
+  DefineFlag("--tdr_ms",
+             "Driver TDR delay, the default --hang_target_ms is twice it.");
+  DefineFlag("--timestamps",
+             "Write GPU timestamps around the recorded commands and report "
+             "their duration.");
+  DefineFlag("--secondary_count",
+             "Number of secondary command buffers to record with --secondary "
+             "(default 1).");
+  DefineFlag("--record_threads",
+             "Number of threads recording the secondary command buffers "
+             "(default 1).");
+  DefineFlag("--device",
+             "Physical device to use, as an index, a device UUID or a PCI "
+             "address ([domain:]bus:device.function).");
+  DefineFlag("--latency_json",
+             "Write the hang/crash detection latency report to this file.");
+  DefineFlag("--fence_timeout_ms",
+             "Time to wait for the hang/crash detection fence (default "
+             "30000).");
+  DefineFlag("--setup_timeout_ms",
+             "Terminate the test if nothing is submitted within this time "
+             "(disabled by default).");
+  DefineFlag("--submit_timeout_ms",
+             "Terminate the test if a queue submission blocks longer (default "
+             "4 times --tdr_ms, disabled without it).");
+  DefineFlag("--detection_timeout_ms",
+             "Terminate the test if no device lost or crash dump is observed "
+             "within this time after the last submission (default 4 times "
+             "--tdr_ms, disabled without it).");
+  DefineFlag("--dump_flush_timeout_ms",
+             "Time to wait for the crash dump after the fault was observed "
+             "(default 10000).");
+  DefineFlag("--dump_quiet_ms",
+             "Time the crash dump must stop changing to be considered "
+             "flushed (default 1000).");
+  DefineFlag("--buffer_size",
+             "Size of the input and output buffers, in bytes or with a K/M/G "
+             "suffix (default 1K).");
+  DefineFlag("--workgroup_size",
+             "Workgroup size X[,Y,Z] of the compute shaders, set with "
+             "specialization constants (default 4,1,1).");
+  DefineFlag("--dispatch",
+             "Workgroup count X[,Y,Z] of the dispatches that hang or fault "
+             "(default 1,1,1), e.g. enough to fill every compute unit.");
+  DefineFlag("--device_local",
+             "Allocate the input and output buffers in device local memory.");
+  DefineFlag("--stress_fault_at",
+             "Submit this many empty command buffers before the submission "
+             "triggering the fault.");
+  DefineFlag("--stress_batch",
+             "Number of VkSubmitInfo per stress vkQueueSubmit (default 16).");
+  DefineFlag("--stress_submits_per_sec",
+             "Rate of the stress submissions (default unlimited).");
+  DefineFlag("--shader_dir",
+             "Load the shaders from this directory instead of the ones "
+             "embedded in the binary.");
+  DefineFlag("--pipeline_cache_dir",
+             "Directory of the pipeline cache files (default TMPDIR or /tmp).");
+  DefineFlag("--no_pipeline_cache", "Don't persist the pipeline cache.");
+  DefineFlag("--dump_path",
+             "Crash dump file or directory to watch, GFR_OUTPUT_PATH by "
+             "default.");
+  DefineFlag("--loader_dispatch",
+             "Call the device functions through the loader trampolines "
+             "instead of the dispatch table of the device.");
+  DefineFlag("--sync2",
+             "Submit with vkQueueSubmit2KHR and record the events, markers "
+             "and barriers with VK_KHR_synchronization2.");
+  DefineFlag("--trace",
+             "Write the calls made to the device to this file, to be replayed "
+             "with hcf_replay. Disables --sync2.");
+  DefineFlag("--trace_max_contents",
+             "Largest buffer whose initial content is written to the trace, "
+             "in bytes or with a K/M/G suffix (default 64M).");
+  DefineFlag("--load_queues",
+             "Comma separated queue types (see --queue) to create besides the "
+             "ones of the scenario, and keep busy with dispatches and copies "
+             "while the fault is injected.");
+  DefineFlag("--load_ops",
+             "Dispatches and copies per load command buffer (default 16).");
+  DefineFlag("--load_copy_size",
+             "Size of the load buffers, in bytes or with a K/M/G suffix "
+             "(default 1M).");
+  DefineFlag("--load_submits_per_sec",
+             "Rate of the load submissions on each queue (default "
+             "unlimited).");
+  DefineFlag("--load_warmup_ms",
+             "Time the load runs before the scenario starts (default 1000).");
+}
+
+static VKAPI_ATTR VkBool32 VKAPI_CALL VulkanDebugCallback(
+    VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objType,
+    uint64_t obj, size_t location, int32_t code, const char* layerPrefix,
+    const char* msg, void* userData) {
+  LOG("validation layer: %s\n", msg);
+
+  return VK_FALSE;
+}
+
+void PrintPhysicalDeviceMemory(VkPhysicalDevice d) {
+  VkPhysicalDeviceMemoryProperties memProps;
+  vkGetPhysicalDeviceMemoryProperties(d, &memProps);
+}
+
+// Run report
+using ReportClock = std::chrono::steady_clock;
+static std::mutex report_mutex;
+static std::map<std::string, std::string> report_values;
+static bool report_dirty = false;
+static ReportClock::time_point report_start = ReportClock::now();
+// ReportClock time in nanoseconds of each RunPhase, or 0 if not reached.
+static std::atomic<int64_t> phase_ns[static_cast<int>(RunPhase::Count)];
+static std::atomic<uint32_t> report_submit_count;
+static std::atomic<int32_t> first_error;
+// Number of QueueSubmit/QueueBindSparse calls that did not return yet, and
+// the time the oldest of them started.
+static std::atomic<uint32_t> submits_in_flight;
+static std::atomic<int64_t> submit_begin_ns;
+
+static int64_t ReportNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             ReportClock::now().time_since_epoch())
+      .count();
+}
+
+static const char* RunPhaseToString(RunPhase phase) {
+  switch (phase) {
+    case RunPhase::Submit:
+      return "submit";
+    case RunPhase::WaitIdleReturn:
+      return "wait_idle_return";
+    case RunPhase::EmptySubmit:
+      return "empty_submit";
+    case RunPhase::DeviceLost:
+      return "device_lost";
+    case RunPhase::FenceReturn:
+      return "fence_return";
+    default:
+      return "";
+  }
+}
+
+static int64_t PhaseNs(RunPhase phase) {
+  return phase_ns[static_cast<int>(phase)].load();
+}
+
+static void MarkRunReportDirty() {
+  std::lock_guard<std::mutex> lock(report_mutex);
+  report_dirty = true;
+}
+
+void RecordRunPhase(RunPhase phase) {
+  int64_t now = ReportNowNs();
+  auto& slot = phase_ns[static_cast<int>(phase)];
+  if (phase == RunPhase::Submit) {
+    slot.store(now);
+  } else {
+    int64_t unset = 0;
+    if (!slot.compare_exchange_strong(unset, now)) {
+      return;
+    }
+  }
+  MarkRunReportDirty();
+}
+
+void OnVulkanError(VkResult result) {
+  int32_t none = VK_SUCCESS;
+  first_error.compare_exchange_strong(none, result);
+  if (result == VK_ERROR_DEVICE_LOST) {
+    RecordRunPhase(RunPhase::DeviceLost);
+  }
+  MarkRunReportDirty();
+}
+
+void SetRunReportValue(const std::string& key, const std::string& json_value) {
+  std::lock_guard<std::mutex> lock(report_mutex);
+  report_values[key] = json_value;
+  report_dirty = true;
+}
+
+std::string FormatUs(int64_t ns) {
+  if (ns < 0) {
+    return "null";
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+  return buf;
+}
+
+// Peak resident set size of the process in kilobytes, as JSON.
+static std::string PeakRssKb() {
+#ifdef WINDOWS
+  return "null";
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return "null";
+  }
+#ifdef __APPLE__
+  usage.ru_maxrss /= 1024;  // Bytes on macOS.
+#endif
+  return std::to_string(usage.ru_maxrss);
+#endif
+}
+
+void WriteRunReport() {
+  std::lock_guard<std::mutex> lock(report_mutex);
+  if (!report_dirty) {
+    return;
+  }
+  report_dirty = false;
+
+  int64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      report_start.time_since_epoch())
+                      .count();
+  // Phase times relative to the start of the run, -1 if not reached.
+  auto since_start = [start](int64_t ns) { return ns ? ns - start : -1; };
+
+  std::string json = "{";
+  for (auto& kv : report_values) {
+    json += (json.size() > 1 ? ", \"" : "\"") + JsonEscape(kv.first) +
+            "\": " + kv.second;
+  }
+  json += std::string(json.size() > 1 ? ", " : "") + "\"submits\": " +
+          std::to_string(report_submit_count.load());
+  json += ", \"first_error\": " + std::to_string(first_error.load());
+  json += ", \"phases_us\": {";
+  for (int i = 0; i < static_cast<int>(RunPhase::Count); i++) {
+    RunPhase phase = static_cast<RunPhase>(i);
+    json += std::string(i ? ", " : "") + "\"" + RunPhaseToString(phase) +
+            "\": " + FormatUs(since_start(PhaseNs(phase)));
+  }
+  json += "}";
+
+  // Time from the last submission to the first sign of the fault.
+  int64_t submit = PhaseNs(RunPhase::Submit);
+  int64_t lost = PhaseNs(RunPhase::DeviceLost);
+  json += ", \"detection_latency_us\": " +
+          FormatUs(submit && lost ? lost - submit : -1);
+  json += ", \"peak_rss_kb\": " + PeakRssKb();
+  json += ", \"report_us\": " + FormatUs(since_start(ReportNowNs())) + "}";
+
+  const char* path = GetFlag("--latency_json");
+  if (path == nullptr || path[0] == '\0') {
+    LOG("Run report: %s\n", json.c_str());
+    return;
+  }
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) {
+    LOG("Failed to open %s: %s\n", path, strerror(errno));
+    return;
+  }
+  fprintf(file, "%s\n", json.c_str());
+  fclose(file);
+}
+
+// Device of the run report and the memory budget samples taken so far, by
+// point.
+static std::mutex budget_mutex;
+static VulkanDevice* budget_device = nullptr;
+static std::map<std::string, std::string> budget_samples;
+
+// Starts a new run report for the given device.
+static void ResetRunReport(VulkanDevice* device) {
+  static bool registered = false;
+  if (!registered) {
+    registered = true;
+    std::atexit(WriteRunReport);
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+
+  {
+    std::lock_guard<std::mutex> lock(report_mutex);
+    report_start = ReportClock::now();
+    for (auto& ns : phase_ns) {
+      ns.store(0);
+    }
+    report_submit_count = 0;
+    first_error = VK_SUCCESS;
+    report_values.erase("result");
+    report_dirty = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(budget_mutex);
+    budget_device = device;
+    budget_samples.clear();
+  }
+  SetRunReportValue("device_name",
+                    "\"" + JsonEscape(properties.deviceName) + "\"");
+  SetRunReportValue("vendor_id", std::to_string(properties.vendorID));
+  SetRunReportValue("device_id", std::to_string(properties.deviceID));
+  SetRunReportValue("driver_version",
+                    std::to_string(properties.driverVersion));
+  SetRunReportValue("sync2", device->sync2 ? "true" : "false");
+  SetRunReportValue("dispatch",
+                    device->loaderDispatch ? "\"loader\"" : "\"device\"");
+  SetRunReportValue("workgroup_size", DimensionsToJson(device->workgroupSize));
+  SetRunReportValue("dispatch_size", DimensionsToJson(device->dispatchSize));
+}
+
+void SampleMemoryBudget(const char* point) {
+  std::lock_guard<std::mutex> lock(budget_mutex);
+  if (budget_device == nullptr ||
+      budget_device->GetPhysicalDeviceMemoryProperties2 == nullptr ||
+      budget_samples.count(point)) {
+    return;
+  }
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {};
+  budget.sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+  VkPhysicalDeviceMemoryProperties2KHR properties = {};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR;
+  properties.pNext = &budget;
+  budget_device->GetPhysicalDeviceMemoryProperties2(
+      budget_device->physicalDevice, &properties);
+
+  std::string heaps = "[";
+  for (uint32_t i = 0; i < properties.memoryProperties.memoryHeapCount; i++) {
+    char heap[160];
+    snprintf(heap, sizeof(heap),
+             "%s{\"heap\": %u, \"usage\": %llu, \"budget\": %llu}",
+             i ? ", " : "", i,
+             static_cast<unsigned long long>(budget.heapUsage[i]),
+             static_cast<unsigned long long>(budget.heapBudget[i]));
+    heaps += heap;
+  }
+  budget_samples[point] = heaps + "]";
+
+  std::string json = "{";
+  for (auto& kv : budget_samples) {
+    json += (json.size() > 1 ? ", \"" : "\"") + JsonEscape(kv.first) +
+            "\": " + kv.second;
+  }
+  SetRunReportValue("memory_budget", json + "}");
+}
+
+static void BeginSubmit() {
+  if (submits_in_flight++ == 0) {
+    submit_begin_ns = ReportNowNs();
+  }
+}
+
+static void EndSubmit() { submits_in_flight--; }
+
+// Submits with vkQueueSubmit, or with vkQueueSubmit2KHR in --sync2 mode. The
+// semaphores signaled by a VkSubmitInfo are signaled once all its commands
+// completed, the timeline semaphore values are taken from the
+// VkTimelineSemaphoreSubmitInfoKHR chained to it.
+static VkResult DeviceQueueSubmit(VulkanDevice* device, VkQueue queue,
+                                  uint32_t submit_count,
+                                  const VkSubmitInfo* submits, VkFence fence) {
+  if (device->QueueSubmit2KHR == nullptr) {
+    return device->vk.QueueSubmit(queue, submit_count, submits, fence);
+  }
+  // Reserved so that the pointers of submits2 stay valid.
+  size_t semaphore_count = 0;
+  size_t command_buffer_count = 0;
+  for (uint32_t i = 0; i < submit_count; i++) {
+    semaphore_count +=
+        submits[i].waitSemaphoreCount + submits[i].signalSemaphoreCount;
+    command_buffer_count += submits[i].commandBufferCount;
+  }
+  std::vector<VkSemaphoreSubmitInfoKHR> semaphores;
+  semaphores.reserve(semaphore_count);
+  std::vector<VkCommandBufferSubmitInfoKHR> command_buffers;
+  command_buffers.reserve(command_buffer_count);
+  std::vector<VkSubmitInfo2KHR> submits2(submit_count);
+
+  auto add_semaphore = [&](VkSemaphore semaphore, uint32_t index,
+                           uint32_t value_count, const uint64_t* values,
+                           VkPipelineStageFlags2KHR stages) {
+    VkSemaphoreSubmitInfoKHR info = {};
+    info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO_KHR;
+    info.semaphore = semaphore;
+    info.value = index < value_count ? values[index] : 0;
+    info.stageMask = stages;
+    semaphores.push_back(info);
+  };
+  for (uint32_t i = 0; i < submit_count; i++) {
+    const VkSubmitInfo& submit = submits[i];
+    const VkTimelineSemaphoreSubmitInfoKHR* timeline = nullptr;
+    for (auto next = static_cast<const VkBaseInStructure*>(submit.pNext);
+         next != nullptr; next = next->pNext) {
+      if (next->sType ==
+          VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR) {
+        timeline =
+            reinterpret_cast<const VkTimelineSemaphoreSubmitInfoKHR*>(next);
+      }
+    }
+    VkSubmitInfo2KHR& submit2 = submits2[i];
+    submit2.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2_KHR;
+
+    submit2.waitSemaphoreInfoCount = submit.waitSemaphoreCount;
+    submit2.pWaitSemaphoreInfos = semaphores.data() + semaphores.size();
+    for (uint32_t j = 0; j < submit.waitSemaphoreCount; j++) {
+      add_semaphore(submit.pWaitSemaphores[j], j,
+                    timeline ? timeline->waitSemaphoreValueCount : 0,
+                    timeline ? timeline->pWaitSemaphoreValues : nullptr,
+                    submit.pWaitDstStageMask[j]);
+    }
+
+    submit2.commandBufferInfoCount = submit.commandBufferCount;
+    submit2.pCommandBufferInfos =
+        command_buffers.data() + command_buffers.size();
+    for (uint32_t j = 0; j < submit.commandBufferCount; j++) {
+      VkCommandBufferSubmitInfoKHR info = {};
+      info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO_KHR;
+      info.commandBuffer = submit.pCommandBuffers[j];
+      command_buffers.push_back(info);
+    }
+
+    submit2.signalSemaphoreInfoCount = submit.signalSemaphoreCount;
+    submit2.pSignalSemaphoreInfos = semaphores.data() + semaphores.size();
+    for (uint32_t j = 0; j < submit.signalSemaphoreCount; j++) {
+      add_semaphore(submit.pSignalSemaphores[j], j,
+                    timeline ? timeline->signalSemaphoreValueCount : 0,
+                    timeline ? timeline->pSignalSemaphoreValues : nullptr,
+                    VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR);
+    }
+  }
+  return device->QueueSubmit2KHR(queue, submit_count, submits2.data(), fence);
+}
+
+// Stress submissions
+static std::atomic<bool> stress_active;
+
+// Submitted --stress_batch at a time, at --stress_submits_per_sec.
+void RunStressSubmits(VulkanDevice* device, VkQueue queue) {
+  static std::mutex stress_mutex;
+  static bool stress_done = false;
+  std::lock_guard<std::mutex> lock(stress_mutex);
+  if (stress_done || GetFlag("--stress_fault_at") == nullptr) {
+    return;
+  }
+  stress_done = true;
+
+  const uint64_t fault_at = GetFlagUint("--stress_fault_at", 0);
+  const uint32_t batch = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--stress_batch", 16), 1));
+  const uint64_t rate = GetFlagUint("--stress_submits_per_sec", 0);
+  if (fault_at == 0) {
+    return;
+  }
+  auto vk_device = device->device;
+
+  // The command pool must belong to the queue family of queue.
+  auto queue_it =
+      std::find(device->queues.begin(), device->queues.end(), queue);
+  VkCommandPool pool =
+      queue_it == device->queues.end()
+          ? device->commandPool
+          : device->commandPools[queue_it - device->queues.begin()];
+
+  // A single empty command buffer, pending in many submissions at once.
+  VkCommandBufferAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VkCommandBuffer cb;
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &allocate_info, &cb));
+  SetObjectDebugName(device, cb, VK_OBJECT_TYPE_COMMAND_BUFFER,
+                     "Stress CommandBuffer");
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+  VK_CHECK_RESULT(device->vk.BeginCommandBuffer(cb, &begin_info));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(cb));
+  std::vector<VkSubmitInfo> submit_infos(batch, CreateSubmitInfo(&cb));
+
+  // Fences bound the number of batches in flight.
+  constexpr size_t kFenceRingSize = 16;
+  std::vector<VkFence> fences(kFenceRingSize);
+  std::vector<bool> fence_pending(kFenceRingSize, false);
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  for (auto& fence : fences) {
+    VK_CHECK_RESULT(vkCreateFence(vk_device, &fence_info, nullptr, &fence));
+  }
+
+  LOG("Stress: %llu submits in batches of %u at %llu/s...\n",
+      static_cast<unsigned long long>(fault_at), batch,
+      static_cast<unsigned long long>(rate));
+  stress_active = true;
+  auto start = ReportClock::now();
+  uint64_t submitted = 0;
+  uint64_t calls = 0;
+  VkResult result = VK_SUCCESS;
+  while (submitted < fault_at && result == VK_SUCCESS) {
+    if (rate != 0) {
+      std::this_thread::sleep_until(
+          start + std::chrono::nanoseconds(submitted * 1000000000ull / rate));
+    }
+    size_t f = calls % kFenceRingSize;
+    if (fence_pending[f]) {
+      result = device->vk.WaitForFences(vk_device, 1, &fences[f], VK_TRUE,
+                                        UINT64_MAX);
+      if (result == VK_SUCCESS) {
+        result = device->vk.ResetFences(vk_device, 1, &fences[f]);
+      }
+      if (result != VK_SUCCESS) {
+        break;
+      }
+      fence_pending[f] = false;
+    }
+    uint32_t count =
+        static_cast<uint32_t>(std::min<uint64_t>(batch, fault_at - submitted));
+    BeginSubmit();
+    result = DeviceQueueSubmit(device, queue, count, submit_infos.data(),
+                               fences[f]);
+    EndSubmit();
+    fence_pending[f] = true;
+    submitted += count;
+    calls++;
+  }
+  auto duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         ReportClock::now() - start)
+                         .count();
+  stress_active = false;
+  if (result != VK_SUCCESS) {
+    OnVulkanError(result);
+    LOG("Stress: VkResult is %d after %llu submits\n", result,
+        static_cast<unsigned long long>(submitted));
+  }
+
+  double per_sec = duration_ns ? submitted * 1e9 / duration_ns : 0.0;
+  LOG("Stress: %llu submits in %llu calls, %.0f submits/s\n",
+      static_cast<unsigned long long>(submitted),
+      static_cast<unsigned long long>(calls), per_sec);
+  char json[256];
+  snprintf(json, sizeof(json),
+           "{\"submits\": %llu, \"calls\": %llu, \"batch\": %u, "
+           "\"target_per_sec\": %llu, \"submits_per_sec\": %.1f, "
+           "\"duration_us\": %s}",
+           static_cast<unsigned long long>(submitted),
+           static_cast<unsigned long long>(calls), batch,
+           static_cast<unsigned long long>(rate), per_sec,
+           FormatUs(duration_ns).c_str());
+  SetRunReportValue("stress", json);
+  // The fences and the command buffer are left to the device, some of the
+  // submissions may still be pending when the fault hits.
+}
+
+// Trace
+//
+// The helpers register the objects they create, whose records are written
+// before the first call using them. The objects the trace doesn't know get a
+// stand-in: a buffer of the same size without contents, an unsignaled event
+// or fence, a binary semaphore, or a command pool of the default queue family.
+// Pipelines and descriptor sets can't be stood in for and are Unsupported.
+enum class TraceObject {
+  Buffer,
+  Pipeline,
+  DescriptorSet,
+  Semaphore,
+  Event,
+  Fence,
+  CommandPool,
+};
+using TraceKey = std::pair<TraceObject, uint64_t>;
+
+struct TraceEntry {
+  std::vector<uint64_t> record;  // TraceRecord and operands.
+  std::vector<TraceKey> uses;    // Objects written before it.
+  // Why the uses of the object can't be replayed, written after its record.
+  const char* unsupported = nullptr;
+};
+
+// Guards everything below except trace_paused.
+static std::mutex trace_lock;
+static FILE* trace_file = nullptr;
+static VkDevice trace_device = VK_NULL_HANDLE;
+// The functions of the traced device, called by the Trace* functions.
+static DeviceDispatchTable trace_vk;
+static PFN_vkCmdWriteBufferMarkerAMD trace_write_buffer_marker = nullptr;
+static PFN_vkSignalSemaphoreKHR trace_signal_semaphore = nullptr;
+static std::vector<VkQueue> trace_queues;
+static uint32_t trace_default_family = 0;
+// The shaders and objects registered by the helpers, by device. Once a device
+// is traced, only the ones of trace_device are kept.
+static std::map<std::pair<VkDevice, uint64_t>, std::vector<uint32_t>>
+    trace_shaders;  // By module.
+static std::map<VkDevice, std::map<TraceKey, TraceEntry>> trace_objects;
+static std::set<TraceKey> trace_written;
+// Set by the helpers whose calls are traced as the objects they initialize.
+static thread_local bool trace_paused = false;
+
+static bool TraceEnabled() {
+  return GetFlag("--trace") != nullptr && !trace_paused;
+}
+
+template <typename T>
+static uint64_t TraceId(T handle) {
+  return reinterpret_cast<uint64_t>(handle);
+}
+
+static std::vector<uint64_t> TraceBegin(TraceOp op) {
+  TraceRecord header = {static_cast<uint32_t>(op), 0};
+  std::vector<uint64_t> record(1);
+  memcpy(record.data(), &header, sizeof(header));
+  return record;
+}
+
+static void TraceBytes(std::vector<uint64_t>* record, const void* data,
+                       size_t size) {
+  record->push_back(size);
+  size_t begin = record->size();
+  record->resize(begin + (size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  if (size > 0) {
+    memcpy(record->data() + begin, data, size);
+  }
+}
+
+// Must be called with trace_lock.
+static void TraceWrite(std::vector<uint64_t>* record) {
+  TraceRecord header;
+  memcpy(&header, record->data(), sizeof(header));
+  header.words = static_cast<uint32_t>(record->size() - 1);
+  memcpy(record->data(), &header, sizeof(header));
+  fwrite(record->data(), sizeof(uint64_t), record->size(), trace_file);
+}
+
+static void TraceUnsupported(const std::string& description) {
+  LOG("Not replayable: %s\n", description.c_str());
+  auto record = TraceBegin(TraceOp::Unsupported);
+  TraceBytes(&record, description.data(), description.size());
+  TraceWrite(&record);
+}
+
+// Writes the record of the object if it wasn't yet, and returns its id. Must
+// be called with trace_lock.
+static uint64_t TraceUse(TraceObject type, uint64_t handle) {
+  TraceKey key(type, handle);
+  if (handle == 0 || !trace_written.insert(key).second) {
+    return handle;
+  }
+
+  auto& objects = trace_objects[trace_device];
+  auto it = objects.find(key);
+  if (it != objects.end()) {
+    for (const auto& use : it->second.uses) {
+      TraceUse(use.first, use.second);
+    }
+    auto record = it->second.record;
+    TraceWrite(&record);
+    if (it->second.unsupported != nullptr) {
+      TraceUnsupported(it->second.unsupported);
+    }
+    return handle;
+  }
+
+  std::vector<uint64_t> record;
+  switch (type) {
+    case TraceObject::Buffer: {
+      VkMemoryRequirements requirements;
+      vkGetBufferMemoryRequirements(
+          trace_device, reinterpret_cast<VkBuffer>(handle), &requirements);
+      record = TraceBegin(TraceOp::Buffer);
+      record.insert(record.end(), {handle, requirements.size, 0});
+      TraceBytes(&record, nullptr, 0);
+      break;
+    }
+    case TraceObject::Semaphore:
+      record = TraceBegin(TraceOp::Semaphore);
+      record.insert(record.end(), {handle, VK_SEMAPHORE_TYPE_BINARY_KHR, 0});
+      break;
+    case TraceObject::Event:
+      record = TraceBegin(TraceOp::Event);
+      record.push_back(handle);
+      break;
+    case TraceObject::Fence:
+      record = TraceBegin(TraceOp::Fence);
+      record.push_back(handle);
+      break;
+    case TraceObject::CommandPool:
+      record = TraceBegin(TraceOp::CommandPool);
+      record.insert(record.end(), {handle, trace_default_family});
+      break;
+    case TraceObject::Pipeline:
+      TraceUnsupported("pipeline not created by CreateComputePipeline with "
+                       "the pipeline layout of the device");
+      return handle;
+    case TraceObject::DescriptorSet:
+      TraceUnsupported("descriptor set of unknown bindings");
+      return handle;
+  }
+  TraceWrite(&record);
+  return handle;
+}
+
+template <typename T>
+static uint64_t TraceUse(TraceObject type, T handle) {
+  return TraceUse(type, TraceId(handle));
+}
+
+// Returns the index of the queue in the queues of the device. Must be called
+// with trace_lock.
+static uint64_t TraceQueue(VkQueue queue) {
+  for (size_t i = 0; i < trace_queues.size(); i++) {
+    if (trace_queues[i] == queue) {
+      return i;
+    }
+  }
+  TraceUnsupported("queue not created by InitVulkanDevice");
+  return trace_queues.size();
+}
+
+// Registers an object of device, ignored if another device is traced.
+static void TraceRegister(VkDevice device, TraceObject type, uint64_t handle,
+                          std::vector<uint64_t> record,
+                          std::vector<TraceKey> uses = {},
+                          const char* unsupported = nullptr) {
+  std::lock_guard<std::mutex> lock(trace_lock);
+  if (trace_device != VK_NULL_HANDLE && device != trace_device) {
+    return;
+  }
+  TraceKey key(type, handle);
+  // The handle may be reused by a new object.
+  if (device == trace_device) {
+    trace_written.erase(key);
+  }
+  trace_objects[device][key] = {std::move(record), std::move(uses),
+                                unsupported};
+}
+
+static void TraceShaderModule(VkDevice device, VkShaderModule module,
+                              const uint32_t* code, size_t code_size) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(trace_lock);
+  if (trace_device != VK_NULL_HANDLE && device != trace_device) {
+    return;
+  }
+  trace_shaders[{device, TraceId(module)}].assign(
+      code, code + code_size / sizeof(uint32_t));
+}
+
+static void TracePipeline(VulkanDevice* device, VkShaderModule module,
+                          VkPipelineLayout layout, VkPipeline pipeline) {
+  if (!TraceEnabled() || layout != device->pipelineLayout) {
+    return;
+  }
+  auto record = TraceBegin(TraceOp::Pipeline);
+  record.insert(record.end(),
+                {TraceId(pipeline), device->workgroupSize[0],
+                 device->workgroupSize[1], device->workgroupSize[2]});
+  {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto it = trace_shaders.find({device->device, TraceId(module)});
+    if (it == trace_shaders.end()) {
+      return;
+    }
+    TraceBytes(&record, it->second.data(),
+               it->second.size() * sizeof(uint32_t));
+  }
+  TraceRegister(device->device, TraceObject::Pipeline, TraceId(pipeline),
+                std::move(record));
+}
+
+// Registers a set of the descriptor set layout of the device.
+static void TraceDescriptorSet(VkDevice device, VkDescriptorSet set,
+                               const VkDescriptorBufferInfo* bindings) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  auto record = TraceBegin(TraceOp::DescriptorSet);
+  record.push_back(TraceId(set));
+  std::vector<TraceKey> uses;
+  for (uint32_t i = 0; i < 2; i++) {
+    record.insert(record.end(), {TraceId(bindings[i].buffer),
+                                 bindings[i].offset, bindings[i].range});
+    uses.emplace_back(TraceObject::Buffer, TraceId(bindings[i].buffer));
+  }
+  TraceRegister(device, TraceObject::DescriptorSet, TraceId(set),
+                std::move(record), std::move(uses));
+}
+
+// The host accesses of a mapped buffer are not traced, its uses are
+// Unsupported.
+static void TraceBuffer(VkDevice device, VkBuffer buffer, VkDeviceSize size,
+                        VkBufferUsageFlags usage,
+                        const std::vector<uint8_t>& contents = {},
+                        bool mapped = false) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  auto record = TraceBegin(TraceOp::Buffer);
+  record.insert(record.end(), {TraceId(buffer), size, usage});
+  TraceBytes(&record, contents.data(), contents.size());
+  TraceRegister(device, TraceObject::Buffer, TraceId(buffer),
+                std::move(record), {},
+                mapped ? "buffer in mapped memory, written by the host"
+                       : nullptr);
+}
+
+static void TraceSemaphore(VkDevice device, VkSemaphore semaphore,
+                           VkSemaphoreTypeKHR type, uint64_t initial_value) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  auto record = TraceBegin(TraceOp::Semaphore);
+  record.insert(record.end(),
+                {TraceId(semaphore), static_cast<uint64_t>(type),
+                 initial_value});
+  TraceRegister(device, TraceObject::Semaphore, TraceId(semaphore),
+                std::move(record));
+}
+
+static void TraceCommandPool(VkDevice device, VkCommandPool pool,
+                             uint32_t queue_family) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  auto record = TraceBegin(TraceOp::CommandPool);
+  record.insert(record.end(), {TraceId(pool), queue_family});
+  TraceRegister(device, TraceObject::CommandPool, TraceId(pool),
+                std::move(record));
+}
+
+// Appends the memory and buffer barriers of a barrier or wait command.
+static void TraceBarriers(std::vector<uint64_t>* record,
+                          uint32_t memory_barrier_count,
+                          const VkMemoryBarrier* memory_barriers,
+                          uint32_t buffer_barrier_count,
+                          const VkBufferMemoryBarrier* buffer_barriers,
+                          uint32_t image_barrier_count) {
+  if (image_barrier_count > 0) {
+    TraceUnsupported("image memory barrier");
+  }
+  record->push_back(memory_barrier_count);
+  for (uint32_t i = 0; i < memory_barrier_count; i++) {
+    record->insert(record->end(), {memory_barriers[i].srcAccessMask,
+                                   memory_barriers[i].dstAccessMask});
+  }
+  record->push_back(buffer_barrier_count);
+  for (uint32_t i = 0; i < buffer_barrier_count; i++) {
+    const auto& barrier = buffer_barriers[i];
+    record->insert(record->end(),
+                   {barrier.srcAccessMask, barrier.dstAccessMask,
+                    barrier.srcQueueFamilyIndex, barrier.dstQueueFamilyIndex,
+                    TraceUse(TraceObject::Buffer, barrier.buffer),
+                    barrier.offset, barrier.size});
+  }
+}
+
+// The functions installed in the dispatch table of the traced device. Each
+// writes its record before calling the device, so that the trace is complete
+// up to a call that hangs or crashes. Timestamps are not traced.
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceQueueSubmit(VkQueue queue, uint32_t submit_count,
+                 const VkSubmitInfo* submits, VkFence fence) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::QueueSubmit);
+    record.insert(record.end(), {TraceQueue(queue),
+                                 TraceUse(TraceObject::Fence, fence),
+                                 submit_count});
+    for (uint32_t i = 0; i < submit_count; i++) {
+      const auto& submit = submits[i];
+      const VkTimelineSemaphoreSubmitInfoKHR* timeline = nullptr;
+      for (auto next = static_cast<const VkBaseInStructure*>(submit.pNext);
+           next != nullptr; next = next->pNext) {
+        if (next->sType ==
+            VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR) {
+          timeline =
+              reinterpret_cast<const VkTimelineSemaphoreSubmitInfoKHR*>(next);
+        }
+      }
+      auto value = [](uint32_t count, const uint64_t* values, uint32_t j) {
+        return values != nullptr && j < count ? values[j] : 0;
+      };
+      record.push_back(submit.waitSemaphoreCount);
+      for (uint32_t j = 0; j < submit.waitSemaphoreCount; j++) {
+        record.insert(
+            record.end(),
+            {TraceUse(TraceObject::Semaphore, submit.pWaitSemaphores[j]),
+             submit.pWaitDstStageMask[j],
+             timeline ? value(timeline->waitSemaphoreValueCount,
+                              timeline->pWaitSemaphoreValues, j)
+                      : 0});
+      }
+      record.push_back(submit.commandBufferCount);
+      for (uint32_t j = 0; j < submit.commandBufferCount; j++) {
+        record.push_back(TraceId(submit.pCommandBuffers[j]));
+      }
+      record.push_back(submit.signalSemaphoreCount);
+      for (uint32_t j = 0; j < submit.signalSemaphoreCount; j++) {
+        record.insert(
+            record.end(),
+            {TraceUse(TraceObject::Semaphore, submit.pSignalSemaphores[j]),
+             timeline ? value(timeline->signalSemaphoreValueCount,
+                              timeline->pSignalSemaphoreValues, j)
+                      : 0});
+      }
+    }
+    TraceWrite(&record);
+    fflush(trace_file);
+  }
+  return trace_vk.QueueSubmit(queue, submit_count, submits, fence);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceQueueBindSparse(VkQueue queue, uint32_t bind_info_count,
+                     const VkBindSparseInfo* bind_infos, VkFence fence) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    TraceUnsupported("vkQueueBindSparse");
+    fflush(trace_file);
+  }
+  return trace_vk.QueueBindSparse(queue, bind_info_count, bind_infos, fence);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL TraceQueueWaitIdle(VkQueue queue) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::QueueWaitIdle);
+    record.push_back(TraceQueue(queue));
+    TraceWrite(&record);
+    fflush(trace_file);
+  }
+  return trace_vk.QueueWaitIdle(queue);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceWaitForFences(VkDevice device, uint32_t fence_count,
+                   const VkFence* fences, VkBool32 wait_all,
+                   uint64_t timeout) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::WaitForFences);
+    record.push_back(fence_count);
+    for (uint32_t i = 0; i < fence_count; i++) {
+      record.push_back(TraceUse(TraceObject::Fence, fences[i]));
+    }
+    record.insert(record.end(), {wait_all, timeout});
+    TraceWrite(&record);
+    fflush(trace_file);
+  }
+  return trace_vk.WaitForFences(device, fence_count, fences, wait_all,
+                                timeout);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL TraceResetFences(VkDevice device,
+                                                       uint32_t fence_count,
+                                                       const VkFence* fences) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::ResetFences);
+    record.push_back(fence_count);
+    for (uint32_t i = 0; i < fence_count; i++) {
+      record.push_back(TraceUse(TraceObject::Fence, fences[i]));
+    }
+    TraceWrite(&record);
+  }
+  return trace_vk.ResetFences(device, fence_count, fences);
+}
+
+// The host operations on events and semaphores change what the GPU waits on,
+// and are not replayed.
+static VKAPI_ATTR VkResult VKAPI_CALL TraceSetEvent(VkDevice device,
+                                                    VkEvent event) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    TraceUnsupported("vkSetEvent");
+    fflush(trace_file);
+  }
+  return trace_vk.SetEvent(device, event);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL TraceResetEvent(VkDevice device,
+                                                      VkEvent event) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    TraceUnsupported("vkResetEvent");
+    fflush(trace_file);
+  }
+  return trace_vk.ResetEvent(device, event);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceSignalSemaphoreKHR(VkDevice device,
+                        const VkSemaphoreSignalInfoKHR* signal_info) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    TraceUnsupported("vkSignalSemaphoreKHR");
+    fflush(trace_file);
+  }
+  return trace_signal_semaphore(device, signal_info);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceAllocateCommandBuffers(VkDevice device,
+                            const VkCommandBufferAllocateInfo* allocate_info,
+                            VkCommandBuffer* command_buffers) {
+  VkResult result = trace_vk.AllocateCommandBuffers(device, allocate_info,
+                                                    command_buffers);
+  // Written after the call, which returns the command buffers.
+  if (!trace_paused && result == VK_SUCCESS) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::AllocateCommandBuffers);
+    record.insert(
+        record.end(),
+        {TraceUse(TraceObject::CommandPool, allocate_info->commandPool),
+         static_cast<uint64_t>(allocate_info->level),
+         allocate_info->commandBufferCount});
+    for (uint32_t i = 0; i < allocate_info->commandBufferCount; i++) {
+      record.push_back(TraceId(command_buffers[i]));
+    }
+    TraceWrite(&record);
+  }
+  return result;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceResetCommandPool(VkDevice device, VkCommandPool pool,
+                      VkCommandPoolResetFlags flags) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::ResetCommandPool);
+    record.insert(record.end(),
+                  {TraceUse(TraceObject::CommandPool, pool), flags});
+    TraceWrite(&record);
+  }
+  return trace_vk.ResetCommandPool(device, pool, flags);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceBeginCommandBuffer(VkCommandBuffer command_buffer,
+                        const VkCommandBufferBeginInfo* begin_info) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::BeginCommandBuffer);
+    record.insert(record.end(), {TraceId(command_buffer), begin_info->flags});
+    TraceWrite(&record);
+  }
+  return trace_vk.BeginCommandBuffer(command_buffer, begin_info);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL
+TraceEndCommandBuffer(VkCommandBuffer command_buffer) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::EndCommandBuffer);
+    record.push_back(TraceId(command_buffer));
+    TraceWrite(&record);
+  }
+  return trace_vk.EndCommandBuffer(command_buffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdBindPipeline(VkCommandBuffer command_buffer,
+                     VkPipelineBindPoint bind_point, VkPipeline pipeline) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdBindPipeline);
+    record.insert(record.end(), {TraceId(command_buffer),
+                                 static_cast<uint64_t>(bind_point),
+                                 TraceUse(TraceObject::Pipeline, pipeline)});
+    TraceWrite(&record);
+  }
+  trace_vk.CmdBindPipeline(command_buffer, bind_point, pipeline);
+}
+
+static VKAPI_ATTR void VKAPI_CALL TraceCmdBindDescriptorSets(
+    VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point,
+    VkPipelineLayout layout, uint32_t first_set, uint32_t set_count,
+    const VkDescriptorSet* sets, uint32_t dynamic_offset_count,
+    const uint32_t* dynamic_offsets) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdBindDescriptorSets);
+    record.insert(record.end(), {TraceId(command_buffer),
+                                 static_cast<uint64_t>(bind_point), first_set,
+                                 set_count});
+    for (uint32_t i = 0; i < set_count; i++) {
+      record.push_back(TraceUse(TraceObject::DescriptorSet, sets[i]));
+    }
+    record.push_back(dynamic_offset_count);
+    record.insert(record.end(), dynamic_offsets,
+                  dynamic_offsets + dynamic_offset_count);
+    TraceWrite(&record);
+  }
+  trace_vk.CmdBindDescriptorSets(command_buffer, bind_point, layout,
+                                 first_set, set_count, sets,
+                                 dynamic_offset_count, dynamic_offsets);
+}
+
+static VKAPI_ATTR void VKAPI_CALL TraceCmdDispatch(
+    VkCommandBuffer command_buffer, uint32_t x, uint32_t y, uint32_t z) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdDispatch);
+    record.insert(record.end(), {TraceId(command_buffer), x, y, z});
+    TraceWrite(&record);
+  }
+  trace_vk.CmdDispatch(command_buffer, x, y, z);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdCopyBuffer(VkCommandBuffer command_buffer, VkBuffer src, VkBuffer dst,
+                   uint32_t region_count, const VkBufferCopy* regions) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdCopyBuffer);
+    record.insert(record.end(),
+                  {TraceId(command_buffer), TraceUse(TraceObject::Buffer, src),
+                   TraceUse(TraceObject::Buffer, dst), region_count});
+    for (uint32_t i = 0; i < region_count; i++) {
+      record.insert(record.end(), {regions[i].srcOffset, regions[i].dstOffset,
+                                   regions[i].size});
+    }
+    TraceWrite(&record);
+  }
+  trace_vk.CmdCopyBuffer(command_buffer, src, dst, region_count, regions);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdFillBuffer(VkCommandBuffer command_buffer, VkBuffer buffer,
+                   VkDeviceSize offset, VkDeviceSize size, uint32_t data) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdFillBuffer);
+    record.insert(record.end(),
+                  {TraceId(command_buffer),
+                   TraceUse(TraceObject::Buffer, buffer), offset, size, data});
+    TraceWrite(&record);
+  }
+  trace_vk.CmdFillBuffer(command_buffer, buffer, offset, size, data);
+}
+
+static VKAPI_ATTR void VKAPI_CALL TraceCmdPipelineBarrier(
+    VkCommandBuffer command_buffer, VkPipelineStageFlags src_stages,
+    VkPipelineStageFlags dst_stages, VkDependencyFlags dependency_flags,
+    uint32_t memory_barrier_count, const VkMemoryBarrier* memory_barriers,
+    uint32_t buffer_barrier_count,
+    const VkBufferMemoryBarrier* buffer_barriers,
+    uint32_t image_barrier_count,
+    const VkImageMemoryBarrier* image_barriers) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdPipelineBarrier);
+    record.insert(record.end(), {TraceId(command_buffer), src_stages,
+                                 dst_stages, dependency_flags});
+    TraceBarriers(&record, memory_barrier_count, memory_barriers,
+                  buffer_barrier_count, buffer_barriers, image_barrier_count);
+    TraceWrite(&record);
+  }
+  trace_vk.CmdPipelineBarrier(command_buffer, src_stages, dst_stages,
+                              dependency_flags, memory_barrier_count,
+                              memory_barriers, buffer_barrier_count,
+                              buffer_barriers, image_barrier_count,
+                              image_barriers);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdSetEvent(VkCommandBuffer command_buffer, VkEvent event,
+                 VkPipelineStageFlags stages) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdSetEvent);
+    record.insert(record.end(), {TraceId(command_buffer),
+                                 TraceUse(TraceObject::Event, event), stages});
+    TraceWrite(&record);
+  }
+  trace_vk.CmdSetEvent(command_buffer, event, stages);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdResetEvent(VkCommandBuffer command_buffer, VkEvent event,
+                   VkPipelineStageFlags stages) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdResetEvent);
+    record.insert(record.end(), {TraceId(command_buffer),
+                                 TraceUse(TraceObject::Event, event), stages});
+    TraceWrite(&record);
+  }
+  trace_vk.CmdResetEvent(command_buffer, event, stages);
+}
+
+static VKAPI_ATTR void VKAPI_CALL TraceCmdWaitEvents(
+    VkCommandBuffer command_buffer, uint32_t event_count,
+    const VkEvent* events, VkPipelineStageFlags src_stages,
+    VkPipelineStageFlags dst_stages, uint32_t memory_barrier_count,
+    const VkMemoryBarrier* memory_barriers, uint32_t buffer_barrier_count,
+    const VkBufferMemoryBarrier* buffer_barriers,
+    uint32_t image_barrier_count,
+    const VkImageMemoryBarrier* image_barriers) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdWaitEvents);
+    record.insert(record.end(), {TraceId(command_buffer), event_count});
+    for (uint32_t i = 0; i < event_count; i++) {
+      record.push_back(TraceUse(TraceObject::Event, events[i]));
+    }
+    record.insert(record.end(), {src_stages, dst_stages});
+    TraceBarriers(&record, memory_barrier_count, memory_barriers,
+                  buffer_barrier_count, buffer_barriers, image_barrier_count);
+    TraceWrite(&record);
+  }
+  trace_vk.CmdWaitEvents(command_buffer, event_count, events, src_stages,
+                         dst_stages, memory_barrier_count, memory_barriers,
+                         buffer_barrier_count, buffer_barriers,
+                         image_barrier_count, image_barriers);
+}
+
+static VKAPI_ATTR void VKAPI_CALL
+TraceCmdExecuteCommands(VkCommandBuffer command_buffer, uint32_t count,
+                        const VkCommandBuffer* command_buffers) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdExecuteCommands);
+    record.insert(record.end(), {TraceId(command_buffer), count});
+    for (uint32_t i = 0; i < count; i++) {
+      record.push_back(TraceId(command_buffers[i]));
+    }
+    TraceWrite(&record);
+  }
+  trace_vk.CmdExecuteCommands(command_buffer, count, command_buffers);
+}
+
+static VKAPI_ATTR void VKAPI_CALL TraceCmdWriteBufferMarkerAMD(
+    VkCommandBuffer command_buffer, VkPipelineStageFlagBits stage,
+    VkBuffer buffer, VkDeviceSize offset, uint32_t marker) {
+  if (!trace_paused) {
+    std::lock_guard<std::mutex> lock(trace_lock);
+    auto record = TraceBegin(TraceOp::CmdWriteBufferMarker);
+    record.insert(record.end(), {TraceId(command_buffer),
+                                 static_cast<uint64_t>(stage),
+                                 TraceUse(TraceObject::Buffer, buffer), offset,
+                                 marker});
+    TraceWrite(&record);
+  }
+  trace_write_buffer_marker(command_buffer, stage, buffer, offset, marker);
+}
+
+// Starts tracing the device with --trace, if no device is traced yet. Called
+// by InitVulkanDevice once the queues and pipelines of the device exist.
+static void TraceDevice(VulkanDevice* device,
+                        const std::vector<const char*>& extensions) {
+  const char* path = GetFlag("--trace");
+  if (path == nullptr || *path == '\0') {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(trace_lock);
+  if (trace_file != nullptr) {
+    LOG("Only the first device is traced\n");
+    return;
+  }
+  trace_file = fopen(path, "wb");
+  if (trace_file == nullptr) {
+    LOG("Can't open the trace %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  LOG("Tracing the calls of the device to %s\n", path);
+  TraceHeader header = {kTraceMagic, kTraceVersion};
+  fwrite(&header, sizeof(header), 1, trace_file);
+
+  auto record = TraceBegin(TraceOp::Device);
+  record.push_back(device->queueTypes.size());
+  for (auto type : device->queueTypes) {
+    record.push_back(static_cast<uint64_t>(type));
+  }
+  record.push_back(extensions.size());
+  for (const char* extension : extensions) {
+    TraceBytes(&record, extension, strlen(extension));
+  }
+  TraceWrite(&record);
+
+  trace_device = device->device;
+  // The objects of the other devices will never be used.
+  for (auto it = trace_objects.begin(); it != trace_objects.end();) {
+    it = it->first == trace_device ? std::next(it) : trace_objects.erase(it);
+  }
+  for (auto it = trace_shaders.begin(); it != trace_shaders.end();) {
+    it = it->first.first == trace_device ? std::next(it)
+                                         : trace_shaders.erase(it);
+  }
+  trace_queues = device->queues;
+  trace_default_family = device->queueFamilyIndices.empty()
+                             ? 0
+                             : device->queueFamilyIndices.front();
+  trace_vk = device->vk;
+  trace_write_buffer_marker = device->CmdWriteBufferMarkerAMD;
+  trace_signal_semaphore = device->SignalSemaphoreKHR;
+  // CmdWriteTimestamp and CmdResetQueryPool are left out of the trace.
+  device->vk.QueueSubmit = TraceQueueSubmit;
+  device->vk.QueueBindSparse = TraceQueueBindSparse;
+  device->vk.QueueWaitIdle = TraceQueueWaitIdle;
+  device->vk.WaitForFences = TraceWaitForFences;
+  device->vk.ResetFences = TraceResetFences;
+  device->vk.SetEvent = TraceSetEvent;
+  device->vk.ResetEvent = TraceResetEvent;
+  device->vk.AllocateCommandBuffers = TraceAllocateCommandBuffers;
+  device->vk.ResetCommandPool = TraceResetCommandPool;
+  device->vk.BeginCommandBuffer = TraceBeginCommandBuffer;
+  device->vk.EndCommandBuffer = TraceEndCommandBuffer;
+  device->vk.CmdBindPipeline = TraceCmdBindPipeline;
+  device->vk.CmdBindDescriptorSets = TraceCmdBindDescriptorSets;
+  device->vk.CmdDispatch = TraceCmdDispatch;
+  device->vk.CmdCopyBuffer = TraceCmdCopyBuffer;
+  device->vk.CmdFillBuffer = TraceCmdFillBuffer;
+  device->vk.CmdPipelineBarrier = TraceCmdPipelineBarrier;
+  device->vk.CmdSetEvent = TraceCmdSetEvent;
+  device->vk.CmdResetEvent = TraceCmdResetEvent;
+  device->vk.CmdWaitEvents = TraceCmdWaitEvents;
+  device->vk.CmdExecuteCommands = TraceCmdExecuteCommands;
+  if (trace_write_buffer_marker != nullptr) {
+    device->CmdWriteBufferMarkerAMD = TraceCmdWriteBufferMarkerAMD;
+  }
+  if (trace_signal_semaphore != nullptr) {
+    device->SignalSemaphoreKHR = TraceSignalSemaphoreKHR;
+  }
+}
+
+// Background load
+//
+// With --load_queues, InitVulkanDevice creates more queues after the ones of
+// the scenario, and RunWithCrashCheck keeps each of them busy from a worker
+// thread with command buffers of --load_ops dispatches and copies (copies
+// only on the queues that can't dispatch), so that the fault is injected
+// while the rest of the GPU is saturated.
+struct LoadCompletion {
+  int64_t ns;  // ReportClock time at which the command buffer was seen done.
+  uint32_t ops;
+};
+
+struct LoadWorker {
+  VulkanDevice* device = nullptr;
+  size_t queue_index = 0;
+  bool compute = false;
+  uint32_t ops_per_cb = 0;
+  std::thread thread;
+
+  std::mutex lock;
+  int64_t start_ns = 0;
+  uint64_t submits = 0;
+  VkResult result = VK_SUCCESS;
+  std::vector<LoadCompletion> completions;
+};
+
+static std::atomic<bool> load_stop;
+static std::vector<std::unique_ptr<LoadWorker>> load_workers;
+static MemoryArena load_arena;
+static VkPipeline load_pipeline = VK_NULL_HANDLE;
+static VkDescriptorSet load_descriptor_set = VK_NULL_HANDLE;
+static VkBuffer load_buffers[2];
+static VkDeviceSize load_copy_size = 0;
+
+// Records ops_per_cb alternating dispatches of read_write.comp and copies
+// between the load buffers, or only copies without compute.
+static VkResult RecordLoadCommandBuffer(LoadWorker* worker,
+                                        VkCommandBuffer cb) {
+  auto device = worker->device;
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  VK_RETURN_IF_FAIL(device->vk.BeginCommandBuffer(cb, &begin_info));
+  if (worker->compute) {
+    device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                               load_pipeline);
+    device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                     device->pipelineLayout, 0, 1,
+                                     &load_descriptor_set, 0, nullptr);
+  }
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  const uint32_t group_count = static_cast<uint32_t>(std::min<VkDeviceSize>(
+      std::max<VkDeviceSize>(
+          load_copy_size / (sizeof(float) * WorkgroupInvocations(device)), 1),
+      properties.limits.maxComputeWorkGroupCount[0]));
+  const VkBufferCopy region = {0, 0, load_copy_size};
+  // Every dispatch and copy writes the output load buffer.
+  const VkPipelineStageFlags stages =
+      worker->compute ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                            VK_PIPELINE_STAGE_TRANSFER_BIT
+                      : VK_PIPELINE_STAGE_TRANSFER_BIT;
+  const VkAccessFlags access =
+      worker->compute ? VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                            VK_ACCESS_TRANSFER_WRITE_BIT
+                      : VK_ACCESS_TRANSFER_WRITE_BIT;
+  for (uint32_t i = 0; i < worker->ops_per_cb; i++) {
+    if (worker->compute && i % 2 == 0) {
+      device->vk.CmdDispatch(cb, group_count, 1, 1);
+    } else {
+      device->vk.CmdCopyBuffer(cb, load_buffers[0], load_buffers[1], 1,
+                               &region);
+    }
+    CmdMemoryBarrier(device, cb, stages, access, stages, access);
+  }
+  return device->vk.EndCommandBuffer(cb);
+}
+
+// Keeps the queue of the worker busy with a few command buffers in flight,
+// at --load_submits_per_sec, until StopBackgroundLoad or an error.
+static void RunLoadWorker(LoadWorker* worker) {
+  auto device = worker->device;
+  auto vk_device = device->device;
+  auto queue = device->queues[worker->queue_index];
+  const uint64_t rate = GetFlagUint("--load_submits_per_sec", 0);
+
+  // The command pool of a load queue is only used by its worker.
+  constexpr size_t kInFlight = 4;
+  VkCommandBufferAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = device->commandPools[worker->queue_index];
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = kInFlight;
+  VkCommandBuffer cbs[kInFlight];
+  VkFence fences[kInFlight];
+  bool pending[kInFlight] = {};
+  VkResult result =
+      device->vk.AllocateCommandBuffers(vk_device, &allocate_info, cbs);
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  for (size_t i = 0; i < kInFlight && result == VK_SUCCESS; i++) {
+    SetObjectDebugName(device, cbs[i], VK_OBJECT_TYPE_COMMAND_BUFFER,
+                       "Load CommandBuffer");
+    result = RecordLoadCommandBuffer(worker, cbs[i]);
+    if (result == VK_SUCCESS) {
+      result = vkCreateFence(vk_device, &fence_info, nullptr, &fences[i]);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(worker->lock);
+    worker->start_ns = ReportNowNs();
+  }
+  const auto start = ReportClock::now();
+  uint64_t submits = 0;
+  while (result == VK_SUCCESS && !load_stop) {
+    size_t f = submits % kInFlight;
+    if (pending[f]) {
+      // Short waits, to notice StopBackgroundLoad while the GPU is hung.
+      result = device->vk.WaitForFences(vk_device, 1, &fences[f], VK_TRUE,
+                                        100 * 1000 * 1000);
+      if (result == VK_TIMEOUT) {
+        result = VK_SUCCESS;
+        continue;
+      }
+      if (result != VK_SUCCESS) {
+        break;
+      }
+      pending[f] = false;
+      {
+        std::lock_guard<std::mutex> lock(worker->lock);
+        worker->completions.push_back({ReportNowNs(), worker->ops_per_cb});
+      }
+      result = device->vk.ResetFences(vk_device, 1, &fences[f]);
+      if (result != VK_SUCCESS) {
+        break;
+      }
+    }
+    if (rate != 0) {
+      std::this_thread::sleep_until(
+          start + std::chrono::nanoseconds(submits * 1000000000ull / rate));
+    }
+    VkSubmitInfo submit_info = CreateSubmitInfo(&cbs[f]);
+    result = DeviceQueueSubmit(device, queue, 1, &submit_info, fences[f]);
+    if (result == VK_SUCCESS) {
+      pending[f] = true;
+      submits++;
+      std::lock_guard<std::mutex> lock(worker->lock);
+      worker->submits = submits;
+    }
+  }
+  if (result != VK_SUCCESS) {
+    OnVulkanError(result);
+    LOG("Load on queue %zu: VkResult is %d after %llu submits\n",
+        worker->queue_index, result, static_cast<unsigned long long>(submits));
+  }
+  std::lock_guard<std::mutex> lock(worker->lock);
+  worker->result = result;
+  // The fences and the command buffers are left to the device, some of the
+  // submissions may still be pending when the fault hits.
+}
+
+// Adds the throughput of each load queue before and after the last
+// submission of the scenario (the one expected to fault) to the run report.
+// "after" ends when the device was lost, if it was.
+static void ReportBackgroundLoad() {
+  if (load_workers.empty()) {
+    return;
+  }
+  const int64_t now = ReportNowNs();
+  const int64_t fault = PhaseNs(RunPhase::Submit);
+  const int64_t lost = PhaseNs(RunPhase::DeviceLost);
+  auto window = [](uint64_t ops, int64_t begin, int64_t end) {
+    char json[128];
+    snprintf(json, sizeof(json), "{\"ops\": %llu, \"ops_per_sec\": %.1f}",
+             static_cast<unsigned long long>(ops),
+             end > begin ? ops * 1e9 / (end - begin) : 0.0);
+    return std::string(json);
+  };
+
+  std::string json = "{\"copy_size\": " + std::to_string(load_copy_size) +
+                     ", \"queues\": [";
+  for (size_t i = 0; i < load_workers.size(); i++) {
+    auto worker = load_workers[i].get();
+    std::lock_guard<std::mutex> lock(worker->lock);
+    const int64_t split = fault > worker->start_ns ? fault : now;
+    const int64_t end = lost > split ? lost : now;
+    uint64_t before = 0, after = 0;
+    for (const auto& completion : worker->completions) {
+      (completion.ns <= split ? before : after) += completion.ops;
+    }
+    auto device = worker->device;
+    json += std::string(i ? ", " : "") +
+            "{\"queue\": " + std::to_string(worker->queue_index) +
+            ", \"type\": \"" +
+            QueueTypeToString(device->queueTypes[worker->queue_index]) +
+            "\", \"family\": " +
+            std::to_string(device->queueFamilyIndices[worker->queue_index]) +
+            ", \"ops_per_cb\": " + std::to_string(worker->ops_per_cb) +
+            ", \"submits\": " + std::to_string(worker->submits) +
+            ", \"result\": " + std::to_string(worker->result) +
+            ", \"before\": " + window(before, worker->start_ns, split) +
+            ", \"after\": " + window(after, split, end) + "}";
+  }
+  json += "]}";
+  SetRunReportValue("background_load", json);
+}
 
-void LOG(const char* format, ...) {
-  va_list args;
-  char str[8 * 1024];
-  va_start(args, format);
-  vsnprintf(str, sizeof(str), format, args);
-  va_end(args);
+void StartBackgroundLoad(VulkanDevice* device) {
+  if (!load_workers.empty() ||
+      device->loadQueueBegin >= device->queues.size()) {
+    return;
+  }
+  auto vk_device = device->device;
+  load_copy_size = std::max<VkDeviceSize>(
+      ParseSize(GetFlag("--load_copy_size") && *GetFlag("--load_copy_size")
+                    ? GetFlag("--load_copy_size")
+                    : "1M"),
+      sizeof(float));
+  load_copy_size &= ~VkDeviceSize(sizeof(float) - 1);
+
+  InitMemoryArena(&load_arena, device);
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = load_copy_size;
+  buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  // Shared by the load queues, the contents don't matter. Concurrent when
+  // they span several families, as they use the buffers without ownership
+  // transfers.
+  std::vector<uint32_t> load_families;
+  for (size_t i = device->loadQueueBegin; i < device->queues.size(); i++) {
+    uint32_t family = device->queueFamilyIndices[i];
+    if (std::find(load_families.begin(), load_families.end(), family) ==
+        load_families.end()) {
+      load_families.push_back(family);
+    }
+  }
+  if (load_families.size() > 1) {
+    buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    buffer_info.queueFamilyIndexCount =
+        static_cast<uint32_t>(load_families.size());
+    buffer_info.pQueueFamilyIndices = load_families.data();
+  } else {
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  }
+  for (auto& buffer : load_buffers) {
+    if (ArenaCreateBuffer(&load_arena, buffer_info,
+                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                          &buffer) != VK_SUCCESS) {
+      VK_CHECK_RESULT(ArenaCreateBuffer(&load_arena, buffer_info, 0, &buffer));
+    }
+  }
 
-  fprintf(stderr, "%s", str);
-}
+  // read_write.comp from the input to the output load buffer, with the
+  // descriptor set layout of the device.
+  bool compute = false;
+  VkShaderModule module;
+  if (device->pipelineLayout != VK_NULL_HANDLE &&
+      LoadShader(vk_device, "read_write.comp.spv", module)) {
+    compute = CreateComputePipeline(device, module, device->pipelineLayout,
+                                    &load_pipeline) == VK_SUCCESS;
+    vkDestroyShaderModule(vk_device, module, nullptr);
+  }
+  if (compute) {
+    VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2};
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+    VkDescriptorPool descriptor_pool;
+    VK_CHECK_RESULT(vkCreateDescriptorPool(vk_device, &pool_info, nullptr,
+                                           &descriptor_pool));
+    VkDescriptorSetAllocateInfo set_info = {};
+    set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_info.descriptorPool = descriptor_pool;
+    set_info.descriptorSetCount = 1;
+    set_info.pSetLayouts = &device->descriptorSetLayout;
+    VK_CHECK_RESULT(
+        vkAllocateDescriptorSets(vk_device, &set_info, &load_descriptor_set));
+    VkDescriptorBufferInfo descriptor_buffers[2] = {
+        {load_buffers[0], 0, VK_WHOLE_SIZE},
+        {load_buffers[1], 0, VK_WHOLE_SIZE}};
+    VkWriteDescriptorSet writes[2] = {};
+    for (uint32_t i = 0; i < 2; i++) {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = load_descriptor_set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &descriptor_buffers[i];
+    }
+    vkUpdateDescriptorSets(vk_device, 2, writes, 0, nullptr);
+    TraceDescriptorSet(vk_device, load_descriptor_set, descriptor_buffers);
+  }
 
-static void CommonFlags() {
-  DefineFlag("--queue",
-             "Type of queue to use, can be graphics/compute/transfer.");
-  DefineFlag("--secondary", "Use secondary command buffer.");
-  DefineFlag("--debug_utils", "Add debug utils names and labels.");
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, families.data());
+  const uint32_t ops = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--load_ops", 16), 1));
+  load_stop = false;
+  for (size_t i = device->loadQueueBegin; i < device->queues.size(); i++) {
+    load_workers.emplace_back(new LoadWorker);
+    auto worker = load_workers.back().get();
+    worker->device = device;
+    worker->queue_index = i;
+    worker->compute = compute && (families[device->queueFamilyIndices[i]]
+                                      .queueFlags &
+                                  VK_QUEUE_COMPUTE_BIT) != 0;
+    worker->ops_per_cb = ops;
+    LOG("Load on queue %zu (%s): %u %s of %llu bytes per command buffer\n", i,
+        QueueTypeToString(device->queueTypes[i]), ops,
+        worker->compute ? "dispatches and copies" : "copies",
+        static_cast<unsigned long long>(load_copy_size));
+    worker->thread = std::thread(RunLoadWorker, worker);
+  }
+
+  // Let the load reach its steady state before the fault.
+  std::this_thread::sleep_for(
+      std::chrono::milliseconds(GetFlagUint("--load_warmup_ms", 1000)));
 }
 
-static VKAPI_ATTR VkBool32 VKAPI_CALL VulkanDebugCallback(
-    VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objType,
-    uint64_t obj, size_t location, int32_t code, const char* layerPrefix,
-    const char* msg, void* userData) {
-  LOG("validation layer: %s\n", msg);
+void StopBackgroundLoad() {
+  load_stop = true;
+  for (auto& worker : load_workers) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+  ReportBackgroundLoad();
+}
 
-  return VK_FALSE;
+VkResult QueueSubmit(VulkanDevice* device, VkQueue queue, uint32_t submit_count,
+                     const VkSubmitInfo* submits, VkFence fence) {
+  if (PhaseNs(RunPhase::DeviceLost) == 0) {
+    RecordRunPhase(RunPhase::Submit);
+  }
+  report_submit_count++;
+  BeginSubmit();
+  VkResult result =
+      DeviceQueueSubmit(device, queue, submit_count, submits, fence);
+  EndSubmit();
+  return result;
 }
 
-void PrintPhysicalDeviceMemory(VkPhysicalDevice d) {
-  VkPhysicalDeviceMemoryProperties memProps;
-  vkGetPhysicalDeviceMemoryProperties(d, &memProps);
+VkResult QueueBindSparse(VulkanDevice* device, VkQueue queue,
+                         uint32_t bind_info_count,
+                         const VkBindSparseInfo* bind_infos, VkFence fence) {
+  if (PhaseNs(RunPhase::DeviceLost) == 0) {
+    RecordRunPhase(RunPhase::Submit);
+  }
+  report_submit_count++;
+  BeginSubmit();
+  VkResult result = device->vk.QueueBindSparse(queue, bind_info_count,
+                                               bind_infos, fence);
+  EndSubmit();
+  return result;
 }
 
 // Watchdog
 static std::thread* watchdog_thread;
 static std::mutex watchdog_mutex;
 static std::condition_variable test_is_finished;
+static bool test_finished = false;
 static std::atomic<bool> test_timedout;
 
+// How often the watchdog checks the phase deadlines.
+constexpr auto kWatchdogPollInterval = 50ms;
+
+static std::chrono::milliseconds FlagMs(const char* name,
+                                        uint64_t default_ms) {
+  const char* value = GetFlag(name);
+  if (value == nullptr || value[0] == '\0') {
+    return std::chrono::milliseconds(default_ms);
+  }
+  return std::chrono::milliseconds(std::strtoull(value, nullptr, 10));
+}
+
+// Size and modification time of the crash dump, summed over the files of the
+// directory if the dump path is a directory.
+struct DumpState {
+  bool exists = false;
+  uint64_t size = 0;
+  int64_t mtime = 0;
+
+  bool operator!=(const DumpState& o) const {
+    return exists != o.exists || size != o.size || mtime != o.mtime;
+  }
+};
+
+static DumpState GetDumpState(const std::string& path) {
+  DumpState state;
+  struct stat st;
+  if (path.empty() || stat(path.c_str(), &st) != 0) {
+    return state;
+  }
+  state.exists = true;
+#ifndef WINDOWS
+  if (S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      return state;
+    }
+    while (dirent* entry = readdir(dir)) {
+      struct stat entry_st;
+      std::string entry_path = path + "/" + entry->d_name;
+      if (stat(entry_path.c_str(), &entry_st) == 0 &&
+          S_ISREG(entry_st.st_mode)) {
+        state.size += entry_st.st_size;
+        state.mtime = std::max<int64_t>(state.mtime, entry_st.st_mtime);
+      }
+    }
+    closedir(dir);
+    return state;
+  }
+#endif
+  state.size = st.st_size;
+  state.mtime = st.st_mtime;
+  return state;
+}
+
+// Deadline of each phase of the test, zero when disabled.
+struct WatchdogDeadlines {
+  std::chrono::milliseconds total;
+  std::chrono::milliseconds setup;
+  std::chrono::milliseconds submit;
+  std::chrono::milliseconds detection;
+  std::chrono::milliseconds dump_flush;
+  std::chrono::milliseconds dump_quiet;
+  std::string dump_path;
+};
+
+static WatchdogDeadlines GetWatchdogDeadlines(
+    uint64_t test_termination_timer_ms) {
+  WatchdogDeadlines deadlines;
+  deadlines.total = std::chrono::milliseconds(test_termination_timer_ms);
+  // A submission should not block, and the fault should be observed, within a
+  // few TDR delays. The setup time depends on the scenario, not on the TDR.
+  const uint64_t tdr_ms = GetFlagUint("--tdr_ms", 0);
+  deadlines.setup = FlagMs("--setup_timeout_ms", 0);
+  deadlines.submit = FlagMs("--submit_timeout_ms", 4 * tdr_ms);
+  deadlines.detection = FlagMs("--detection_timeout_ms", 4 * tdr_ms);
+  deadlines.dump_flush = FlagMs("--dump_flush_timeout_ms", 10000);
+  deadlines.dump_quiet = FlagMs("--dump_quiet_ms", 1000);
+  const char* dump_path = GetFlag("--dump_path");
+  if (dump_path == nullptr || dump_path[0] == '\0') {
+    dump_path = getenv("GFR_OUTPUT_PATH");
+  }
+  deadlines.dump_path = dump_path ? dump_path : "";
+  return deadlines;
+}
+
+// Terminates the test from the watchdog thread.
+static void TerminateTest(std::unique_lock<std::mutex>& lock,
+                          const char* phase) {
+  test_timedout = true;
+  SetRunReportValue("watchdog_phase", std::string("\"") + phase + "\"");
+  lock.unlock();
+  ReportBackgroundLoad();
+  // The logs explain the termination, write them before anything else runs.
+  FlushLogs();
+  exit(0);
+}
+
 void WatchdogTimer(uint64_t test_termination_timer_ms) {
   LOG("Begin test watchdog [%lu ms]\n", test_termination_timer_ms);
 
-  auto duration_ms = test_termination_timer_ms * 1ms;
+  const WatchdogDeadlines deadlines =
+      GetWatchdogDeadlines(test_termination_timer_ms);
+  const auto start = ReportClock::now();
+  const auto from_ns = [](int64_t ns) {
+    return ReportClock::time_point(std::chrono::nanoseconds(ns));
+  };
+
+  // Dumps left by a previous run don't count.
+  const DumpState initial_dump = GetDumpState(deadlines.dump_path);
+  DumpState dump = initial_dump;
+  auto dump_changed = start;
+  auto first_dump = start;
+  bool dump_written = false;
+  // Checks the dump and reports its size and how long the layer took to
+  // write it, from the device loss (or the first write if it was not seen) to
+  // the last write.
+  auto update_dump = [&](ReportClock::time_point now, int64_t lost) {
+    DumpState current = GetDumpState(deadlines.dump_path);
+    if (current != dump) {
+      dump = current;
+      dump_changed = now;
+      if (!dump_written) {
+        first_dump = now;
+        dump_written = true;
+      }
+      auto capture_start = lost ? std::min(from_ns(lost), first_dump)
+                                : first_dump;
+      int64_t bytes = static_cast<int64_t>(current.size) -
+                      static_cast<int64_t>(initial_dump.size);
+      char json[128];
+      snprintf(json, sizeof(json), "{\"bytes\": %lld, \"capture_us\": %s}",
+               static_cast<long long>(std::max<int64_t>(bytes, 0)),
+               FormatUs(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            now - capture_start)
+                            .count())
+                   .c_str());
+      SetRunReportValue("dump", json);
+    }
+  };
+
+  std::unique_lock<std::mutex> lock(watchdog_mutex);
+  while (!test_is_finished.wait_for(lock, kWatchdogPollInterval,
+                                    [] { return test_finished; })) {
+    const auto now = ReportClock::now();
+    const int64_t submit = PhaseNs(RunPhase::Submit);
+    const int64_t lost = PhaseNs(RunPhase::DeviceLost);
+
+    if (now - start > deadlines.total) {
+      LOG("Test watchdog expired [%lu ms]. Terminating the test.\n",
+          test_termination_timer_ms);
+      SetRunReportValue("watchdog_expired", "true");
+      TerminateTest(lock, "total");
+    }
+    if (deadlines.setup.count() && submit == 0 && !stress_active &&
+        now - start > deadlines.setup) {
+      LOG("Test watchdog expired [setup, %lld ms]. Terminating the test.\n",
+          static_cast<long long>(deadlines.setup.count()));
+      SetRunReportValue("watchdog_expired", "true");
+      TerminateTest(lock, "setup");
+    }
+    if (deadlines.submit.count() && submits_in_flight > 0 &&
+        now - from_ns(submit_begin_ns) > deadlines.submit) {
+      LOG("Test watchdog expired [submit, %lld ms]. Terminating the test.\n",
+          static_cast<long long>(deadlines.submit.count()));
+      SetRunReportValue("watchdog_expired", "true");
+      TerminateTest(lock, "submit");
+    }
+
+    update_dump(now, lost);
+    if (lost != 0 || dump_written) {
+      // The GPU memory held when the fault is first seen.
+      SampleMemoryBudget("fault");
+    }
 
-  std::cv_status status;
-  {
-    std::unique_lock<std::mutex> lock(watchdog_mutex);
-    status = test_is_finished.wait_for(lock, duration_ms);
-  }
+    if (lost == 0 && !dump_written) {
+      if (deadlines.detection.count() && submit != 0 &&
+          now - from_ns(submit) > deadlines.detection) {
+        LOG("Test watchdog expired [detection, %lld ms]. Terminating the "
+            "test.\n",
+            static_cast<long long>(deadlines.detection.count()));
+        SetRunReportValue("watchdog_expired", "true");
+        TerminateTest(lock, "detection");
+      }
+      continue;
+    }
 
-  if (status == std::cv_status::timeout) {
-    test_timedout = true;
-    LOG("Test watchdog expired [%lu ms]. Terminating the test.\n",
-        test_termination_timer_ms);
-    exit(0);
+    // The fault was observed, wait for the dump to be flushed. It is
+    // considered complete once it stopped changing for dump_quiet. Without a
+    // dump to watch, give the layer dump_flush to write it.
+    if (deadlines.dump_path.empty()) {
+      if (now - from_ns(lost) >= deadlines.dump_flush) {
+        LOG("Device lost. Terminating the test.\n");
+        TerminateTest(lock, "device_lost");
+      }
+      continue;
+    }
+    if (dump_written && now - dump_changed >= deadlines.dump_quiet) {
+      LOG("Crash dump flushed. Terminating the test.\n");
+      TerminateTest(lock, "dump_flushed");
+    }
+    auto flush_start = lost ? from_ns(lost) : first_dump;
+    if (dump_written) {
+      flush_start = std::min(flush_start, first_dump);
+    }
+    if (now - flush_start > deadlines.dump_flush) {
+      LOG("Test watchdog expired [dump flush, %lld ms]. Terminating the "
+          "test.\n",
+          static_cast<long long>(deadlines.dump_flush.count()));
+      SetRunReportValue("watchdog_expired", "true");
+      TerminateTest(lock, "dump_flush");
+    }
   }
+  // The test finished, report the dump written since the last poll.
+  update_dump(ReportClock::now(), PhaseNs(RunPhase::DeviceLost));
 }
 
 void WaitForWatchdogThread() {
@@ -90,14 +2280,102 @@ void WaitForWatchdogThread() {
   LOG("Waiting for the watchdog thread to finish...\n");
   {
     std::unique_lock<std::mutex> lock(watchdog_mutex);
+    test_finished = true;
     test_is_finished.notify_all();
   }
   if (watchdog_thread && watchdog_thread->joinable()) {
     watchdog_thread->join();
   }
+  delete watchdog_thread;
+  watchdog_thread = nullptr;
   LOG("Done.\n");
 }
 
+static bool HasInstanceExtension(const char* name) {
+  uint32_t count = 0;
+  if (vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr) !=
+      VK_SUCCESS) {
+    return false;
+  }
+  std::vector<VkExtensionProperties> properties(count);
+  if (vkEnumerateInstanceExtensionProperties(nullptr, &count,
+                                             properties.data()) != VK_SUCCESS) {
+    return false;
+  }
+  for (const auto& p : properties) {
+    if (strcmp(p.extensionName, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool HasInstanceLayer(const char* name) {
+  uint32_t count = 0;
+  if (vkEnumerateInstanceLayerProperties(&count, nullptr) != VK_SUCCESS) {
+    return false;
+  }
+  std::vector<VkLayerProperties> properties(count);
+  if (vkEnumerateInstanceLayerProperties(&count, properties.data()) !=
+      VK_SUCCESS) {
+    return false;
+  }
+  for (const auto& p : properties) {
+    if (strcmp(p.layerName, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void AddUniqueExtension(std::vector<const char*>* extensions,
+                               const char* name) {
+  for (auto ext : *extensions) {
+    if (strcmp(ext, name) == 0) {
+      return;
+    }
+  }
+  extensions->push_back(name);
+}
+
+bool HasDeviceExtension(VkPhysicalDevice physical_device, const char* name) {
+  uint32_t count = 0;
+  if (vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+                                           nullptr) != VK_SUCCESS) {
+    return false;
+  }
+  std::vector<VkExtensionProperties> properties(count);
+  if (vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &count,
+                                           properties.data()) != VK_SUCCESS) {
+    return false;
+  }
+  for (const auto& p : properties) {
+    if (strcmp(p.extensionName, name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool GetDescriptorIndexingFeatures(
+    VulkanContext* context, VkPhysicalDevice physical_device,
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features) {
+  *features = {};
+  features->sType =
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  if (context->GetPhysicalDeviceFeatures2 == nullptr ||
+      !HasDeviceExtension(physical_device, "VK_EXT_descriptor_indexing") ||
+      !HasDeviceExtension(physical_device, "VK_KHR_maintenance3")) {
+    return false;
+  }
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+  features2.pNext = features;
+  context->GetPhysicalDeviceFeatures2(physical_device, &features2);
+  features->pNext = nullptr;
+  return true;
+}
+
 // Initialize a Vulkan context with no device.
 bool InitVulkanInstance(VulkanContext* context) {
 // Use validation layers if this is a debug build.
@@ -106,10 +2384,37 @@ bool InitVulkanInstance(VulkanContext* context) {
 #endif
 
   if (GetFlag("--debug_utils") != nullptr) {
-    if (std::find(context->instanceExtensions.begin(),
-                  context->instanceExtensions.end(),
-                  "VK_EXT_debug_utils") == context->instanceExtensions.end()) {
-      context->instanceExtensions.push_back("VK_EXT_debug_utils");
+    AddUniqueExtension(&context->instanceExtensions, "VK_EXT_debug_utils");
+  }
+  // Layers of --layer, kept for the lifetime of the process as the context
+  // only references their names.
+  static std::vector<std::string> flag_layers;
+  if (flag_layers.empty() && GetFlag("--layer") != nullptr) {
+    std::stringstream layers(GetFlag("--layer"));
+    std::string layer;
+    while (std::getline(layers, layer, ',')) {
+      if (!layer.empty()) {
+        flag_layers.push_back(layer);
+      }
+    }
+  }
+  for (const auto& layer : flag_layers) {
+    if (!HasInstanceLayer(layer.c_str())) {
+      LOG("Instance layer %s is not available.\n", layer.c_str());
+      return false;
+    }
+    AddUniqueExtension(&context->instanceLayers, layer.c_str());
+  }
+  // Needed to identify physical devices by UUID and PCI address.
+  bool properties2_supported =
+      HasInstanceExtension("VK_KHR_get_physical_device_properties2");
+  if (properties2_supported) {
+    AddUniqueExtension(&context->instanceExtensions,
+                       "VK_KHR_get_physical_device_properties2");
+    if (HasInstanceExtension("VK_KHR_external_memory_capabilities")) {
+      AddUniqueExtension(&context->instanceExtensions,
+                         "VK_KHR_external_memory_capabilities");
+      context->deviceIDPropertiesSupported = true;
     }
   }
   // VkApplicationInfo allows the programmer to specify some basic information
@@ -149,6 +2454,21 @@ bool InitVulkanInstance(VulkanContext* context) {
     return false;
   }
 
+  if (properties2_supported) {
+    context->GetPhysicalDeviceProperties2 =
+        (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(
+            context->instance, "vkGetPhysicalDeviceProperties2KHR");
+    context->GetPhysicalDeviceMemoryProperties2 =
+        (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)vkGetInstanceProcAddr(
+            context->instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+    context->GetPhysicalDeviceFeatures2 =
+        (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(
+            context->instance, "vkGetPhysicalDeviceFeatures2KHR");
+  }
+  if (context->GetPhysicalDeviceProperties2 == nullptr) {
+    context->deviceIDPropertiesSupported = false;
+  }
+
   // Setup debug validation callbacks
   VkDebugReportCallbackCreateInfoEXT createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_REPORT_CALLBACK_CREATE_INFO_EXT;
@@ -190,11 +2510,307 @@ uint32_t SelectQueue(VkPhysicalDevice physical_device, QueueType queue_type) {
   return queue_index;
 }
 
+std::vector<PhysicalDeviceInfo> GetPhysicalDeviceInfos(VulkanContext* context) {
+  uint32_t count = 0;
+  VK_CHECK_RESULT(
+      vkEnumeratePhysicalDevices(context->instance, &count, nullptr));
+  std::vector<VkPhysicalDevice> physical_devices(count);
+  VK_CHECK_RESULT(vkEnumeratePhysicalDevices(context->instance, &count,
+                                             physical_devices.data()));
+
+  std::vector<PhysicalDeviceInfo> infos(count);
+  for (uint32_t i = 0; i < count; i++) {
+    auto& info = infos[i];
+    info.index = i;
+    info.physicalDevice = physical_devices[i];
+    vkGetPhysicalDeviceProperties(info.physicalDevice, &info.properties);
+
+    if (context->GetPhysicalDeviceProperties2 == nullptr) {
+      continue;
+    }
+    VkPhysicalDeviceProperties2KHR properties2 = {};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+
+    VkPhysicalDeviceIDPropertiesKHR id_properties = {};
+    id_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES_KHR;
+    if (context->deviceIDPropertiesSupported) {
+      id_properties.pNext = properties2.pNext;
+      properties2.pNext = &id_properties;
+    }
+
+    VkPhysicalDevicePCIBusInfoPropertiesEXT pci_properties = {};
+    pci_properties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT;
+    bool has_pci_bus_info =
+        HasDeviceExtension(info.physicalDevice, "VK_EXT_pci_bus_info");
+    if (has_pci_bus_info) {
+      pci_properties.pNext = properties2.pNext;
+      properties2.pNext = &pci_properties;
+    }
+
+    context->GetPhysicalDeviceProperties2(info.physicalDevice, &properties2);
+
+    if (context->deviceIDPropertiesSupported) {
+      info.hasDeviceUUID = true;
+      memcpy(info.deviceUUID, id_properties.deviceUUID, VK_UUID_SIZE);
+    }
+    if (has_pci_bus_info) {
+      info.hasPciBusInfo = true;
+      info.pciDomain = pci_properties.pciDomain;
+      info.pciBus = pci_properties.pciBus;
+      info.pciDevice = pci_properties.pciDevice;
+      info.pciFunction = pci_properties.pciFunction;
+    }
+  }
+  return infos;
+}
+
+std::string UUIDToString(const uint8_t uuid[VK_UUID_SIZE]) {
+  char str[2 * VK_UUID_SIZE + 1];
+  for (int i = 0; i < VK_UUID_SIZE; i++) {
+    snprintf(str + 2 * i, 3, "%02x", uuid[i]);
+  }
+  return str;
+}
+
+const PhysicalDeviceInfo* FindPhysicalDevice(
+    const std::vector<PhysicalDeviceInfo>& infos, const char* selector) {
+  if (selector == nullptr || *selector == '\0') {
+    return infos.empty() ? nullptr : &infos.front();
+  }
+  std::string s = selector;
+
+  // PCI address: [domain:]bus:device.function
+  if (s.find(':') != std::string::npos) {
+    unsigned domain = 0, bus = 0, dev = 0, function = 0;
+    bool parsed =
+        sscanf(s.c_str(), "%x:%x:%x.%x", &domain, &bus, &dev, &function) == 4;
+    if (!parsed) {
+      domain = 0;
+      parsed = sscanf(s.c_str(), "%x:%x.%x", &bus, &dev, &function) == 3;
+    }
+    if (!parsed) {
+      return nullptr;
+    }
+    for (const auto& info : infos) {
+      if (info.hasPciBusInfo && info.pciDomain == domain &&
+          info.pciBus == bus && info.pciDevice == dev &&
+          info.pciFunction == function) {
+        return &info;
+      }
+    }
+    return nullptr;
+  }
+
+  // Device UUID
+  s.erase(std::remove(s.begin(), s.end(), '-'), s.end());
+  if (s.size() == 2 * VK_UUID_SIZE) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    for (const auto& info : infos) {
+      if (info.hasDeviceUUID && UUIDToString(info.deviceUUID) == s) {
+        return &info;
+      }
+    }
+    return nullptr;
+  }
+
+  // Index
+  char* end = nullptr;
+  unsigned long index = strtoul(selector, &end, 10);
+  if (end == selector || *end != '\0' || index >= infos.size()) {
+    return nullptr;
+  }
+  return &infos[index];
+}
+
+std::vector<QueueType> ParseQueueList(VulkanContext* context,
+                                      const char* spec) {
+  auto infos = GetPhysicalDeviceInfos(context);
+  auto info = FindPhysicalDevice(infos, GetFlag("--device"));
+  if (info == nullptr) {
+    fprintf(stderr, "No physical device matches --device=%s\n",
+            GetFlag("--device") ? GetFlag("--device") : "");
+    exit(EXIT_FAILURE);
+  }
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(info->physicalDevice, &family_count,
+                                           nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(info->physicalDevice, &family_count,
+                                           families.data());
+
+  std::vector<QueueType> queues;
+  if (spec != nullptr && std::strcmp(spec, "all") == 0) {
+    for (auto queue_type :
+         {QueueType::Graphics, QueueType::Compute, QueueType::Transfer}) {
+      uint32_t family = SelectQueue(info->physicalDevice, queue_type);
+      if (family < family_count) {
+        queues.insert(queues.end(), families[family].queueCount, queue_type);
+        families[family].queueCount = 0;
+      }
+    }
+    for (uint32_t family = 0; family < family_count; family++) {
+      if (families[family].queueCount > 0) {
+        LOG("Queue family %u is not covered by all, skipping its %u queues\n",
+            family, families[family].queueCount);
+      }
+    }
+    return queues;
+  }
+
+  std::map<uint32_t, uint32_t> family_queue_counts;
+  std::stringstream ss(spec != nullptr ? spec : "");
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    auto queue_type = QueueTypeFromString(name.c_str());
+    uint32_t family = SelectQueue(info->physicalDevice, queue_type);
+    if (family >= family_count ||
+        ++family_queue_counts[family] > families[family].queueCount) {
+      fprintf(stderr, "Device %u has not enough %s queues for --queues=%s\n",
+              info->index, name.c_str(), spec);
+      exit(EXIT_FAILURE);
+    }
+    queues.push_back(queue_type);
+  }
+  return queues;
+}
+
 VkResult DummySetDebugUtilsObjectNameEXT(
     VkDevice device, const VkDebugUtilsObjectNameInfoEXT* pNameInfo) {
   return VK_SUCCESS;
 }
 
+VkDeviceSize ParseSize(const char* s) {
+  // strtoull accepts a sign, and wraps negative values around.
+  const char* digits = s;
+  while (std::isspace(static_cast<unsigned char>(*digits))) {
+    digits++;
+  }
+  char* end = const_cast<char*>(digits);
+  errno = 0;
+  VkDeviceSize size = 0;
+  if (std::isdigit(static_cast<unsigned char>(*digits))) {
+    size = std::strtoull(digits, &end, 10);
+  }
+  bool overflow = errno == ERANGE;
+  int shift = 0;
+  switch (std::toupper(*end)) {
+    case 'G':
+      shift = 30;
+      end++;
+      break;
+    case 'M':
+      shift = 20;
+      end++;
+      break;
+    case 'K':
+      shift = 10;
+      end++;
+      break;
+  }
+  overflow |= size > (UINT64_MAX >> shift);
+  if (end == digits || *end != '\0' || size == 0 || overflow) {
+    LOG("Invalid size: %s\n", s);
+    exit(EXIT_FAILURE);
+  }
+  return size << shift;
+}
+
+void ParseDimensions(const char* s, uint32_t dims[3]) {
+  dims[0] = dims[1] = dims[2] = 1;
+  const char* p = s;
+  for (int i = 0; i < 3; i++) {
+    char* end = nullptr;
+    unsigned long value = strtoul(p, &end, 10);
+    if (end == p || value == 0 || value > UINT32_MAX) {
+      break;
+    }
+    dims[i] = static_cast<uint32_t>(value);
+    if (*end == '\0') {
+      return;
+    }
+    if (*end != ',') {
+      break;
+    }
+    p = end + 1;
+  }
+  fprintf(stderr, "Invalid dimensions: %s\n", s);
+  exit(EXIT_FAILURE);
+}
+
+std::string DimensionsToJson(const uint32_t dims[3]) {
+  return "[" + std::to_string(dims[0]) + ", " + std::to_string(dims[1]) +
+         ", " + std::to_string(dims[2]) + "]";
+}
+
+// Device table
+
+static uint32_t DeviceTableSlot(VkDevice vk_device) {
+  auto key = reinterpret_cast<uintptr_t>(vk_device);
+  return static_cast<uint32_t>((key >> 4) * 2654435761u) % kMaxDevices;
+}
+
+// Takes ownership of the device and adds it to the table of the context.
+// Returns its handle, or VK_NULL_HANDLE if the table is full, in which case
+// the device is destroyed. Must be called with devices_lock held.
+static VkDevice AddDevice(VulkanContext* context, const VulkanDevice& device) {
+  auto vk_device = device.device;
+  uint32_t slot = DeviceTableSlot(vk_device);
+  uint32_t free_slot = kMaxDevices;
+  for (uint32_t i = 0; i < kMaxDevices; i++, slot = (slot + 1) % kMaxDevices) {
+    auto handle =
+        context->device_table[slot].handle.load(std::memory_order_relaxed);
+    if (handle == vk_device) {
+      // The driver reused the handle of a deleted device.
+      free_slot = slot;
+      break;
+    }
+    if (handle == VK_NULL_HANDLE) {
+      if (free_slot == kMaxDevices) {
+        free_slot = slot;
+      }
+      break;
+    }
+    if (free_slot == kMaxDevices &&
+        context->device_table[slot].device.load(std::memory_order_relaxed) ==
+            nullptr) {
+      free_slot = slot;
+    }
+  }
+  if (free_slot == kMaxDevices) {
+    LOG("More than %u devices, unable to add another one.\n", kMaxDevices);
+    vkDestroyDevice(vk_device, nullptr);
+    return VK_NULL_HANDLE;
+  }
+
+  context->devices.push_back(std::make_unique<VulkanDevice>(device));
+  auto& entry = context->device_table[free_slot];
+  // A deleted slot of another handle is cleared before being reused, so a
+  // reader racing with the reuse never pairs the new handle with the device
+  // it looked up before (see GetDevice).
+  entry.device.store(nullptr, std::memory_order_release);
+  entry.handle.store(vk_device, std::memory_order_release);
+  entry.device.store(context->devices.back().get(), std::memory_order_release);
+  return vk_device;
+}
+
+// Marks the device as deleted in the table of the context. Must be called with
+// devices_lock held.
+static void RemoveDevice(VulkanContext* context, VkDevice vk_device) {
+  uint32_t slot = DeviceTableSlot(vk_device);
+  for (uint32_t i = 0; i < kMaxDevices; i++, slot = (slot + 1) % kMaxDevices) {
+    auto& entry = context->device_table[slot];
+    auto handle = entry.handle.load(std::memory_order_relaxed);
+    if (handle == VK_NULL_HANDLE) {
+      return;
+    }
+    if (handle == vk_device) {
+      entry.device.store(nullptr, std::memory_order_release);
+      return;
+    }
+  }
+}
+
 // Initialize a device for the given context, which should already have the
 // instance.
 VkDevice InitVulkanDevice(VulkanContext* context,
@@ -207,30 +2823,65 @@ VkDevice InitVulkanDevice(VulkanContext* context,
     queues = &default_queues;
   }
   // Create device
-  uint32_t numPhysicalDevices = 0;
-  VK_CHECK_RESULT(vkEnumeratePhysicalDevices(context->instance,
-                                             &numPhysicalDevices, nullptr));
-  LOG("%d physical devices\n", numPhysicalDevices);
-
-  vector<VkPhysicalDevice> physicalDevices(numPhysicalDevices);
-  VK_CHECK_RESULT(vkEnumeratePhysicalDevices(
-      context->instance, &numPhysicalDevices, physicalDevices.data()));
-
-  vector<VkPhysicalDeviceProperties> physicalDeviceProperties;
-  for (const auto& d : physicalDevices) {
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(d, &properties);
-    physicalDeviceProperties.push_back(properties);
+  auto physicalDeviceInfos = GetPhysicalDeviceInfos(context);
+  LOG("%d physical devices\n", (int)physicalDeviceInfos.size());
 
-    LOG("Device: %s\n", properties.deviceName);
+  for (const auto& info : physicalDeviceInfos) {
+    LOG("Device %u: %s", info.index, info.properties.deviceName);
+    if (info.hasDeviceUUID) {
+      LOG(" [uuid %s]", UUIDToString(info.deviceUUID).c_str());
+    }
+    if (info.hasPciBusInfo) {
+      LOG(" [pci %04x:%02x:%02x.%x]", info.pciDomain, info.pciBus,
+          info.pciDevice, info.pciFunction);
+    }
+    LOG("\n");
 
-    PrintPhysicalDeviceMemory(d);
+    PrintPhysicalDeviceMemory(info.physicalDevice);
   }
 
-  auto physicalDevice = physicalDevices.front();
+  auto selectedInfo =
+      FindPhysicalDevice(physicalDeviceInfos, GetFlag("--device"));
+  if (selectedInfo == nullptr) {
+    LOG("No physical device matches --device=%s\n",
+        GetFlag("--device") ? GetFlag("--device") : "");
+    return VK_NULL_HANDLE;
+  }
+  LOG("Using device %u: %s\n", selectedInfo->index,
+      selectedInfo->properties.deviceName);
+  auto physicalDevice = selectedInfo->physicalDevice;
   context->physicalDevice = physicalDevice;
 
-  std::vector<float> queue_priorites(queues->size(), 1.0f);
+  // The --load_queues follow the queues of the scenario, as many of them as
+  // their families have left. See StartBackgroundLoad.
+  std::vector<QueueType> device_queues = *queues;
+  const size_t load_queue_begin = device_queues.size();
+  if (GetFlag("--load_queues") != nullptr) {
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &family_count,
+                                             nullptr);
+    std::vector<VkQueueFamilyProperties> families(family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &family_count,
+                                             families.data());
+    std::map<uint32_t, uint32_t> family_queue_counts;
+    for (auto queue_type : device_queues) {
+      family_queue_counts[SelectQueue(physicalDevice, queue_type)]++;
+    }
+    for (auto queue_type :
+         ParseQueueList(context, GetFlag("--load_queues"))) {
+      uint32_t family = SelectQueue(physicalDevice, queue_type);
+      if (++family_queue_counts[family] > families[family].queueCount) {
+        LOG("No %s queue left for the background load\n",
+            QueueTypeToString(queue_type));
+        continue;
+      }
+      device_queues.push_back(queue_type);
+    }
+  }
+  queues = &device_queues;
+
+  // One more for the transfer queue.
+  std::vector<float> queue_priorites(queues->size() + 1, 1.0f);
   vector<VkDeviceQueueCreateInfo> queue_create_infos;
   vector<std::pair<uint32_t, uint32_t> > queue_indices;
   std::map<uint32_t, size_t> create_info_indices;
@@ -251,37 +2902,183 @@ VkDevice InitVulkanDevice(VulkanContext* context,
     queue_indices.push_back(std::make_pair(queue_family_index, queue_index));
   }
 
+  // Dedicated queue for the uploads to device local memory, if available.
+  bool has_transfer_queue = false;
+  std::pair<uint32_t, uint32_t> transfer_queue_index;
+  if (GetFlag("--device_local") != nullptr && !queue_indices.empty()) {
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice,
+                                             &queue_family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> queue_families(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        physicalDevice, &queue_family_count, queue_families.data());
+
+    auto queue_family_index = SelectQueue(physicalDevice, QueueType::Transfer);
+    if (queue_family_index < queue_family_count) {
+      if (create_info_indices.count(queue_family_index) == 0) {
+        VkDeviceQueueCreateInfo queue_info = {};
+        queue_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_info.queueFamilyIndex = queue_family_index;
+        queue_info.queueCount = 0;
+        queue_info.pQueuePriorities = queue_priorites.data();
+        create_info_indices[queue_family_index] = queue_create_infos.size();
+        queue_create_infos.push_back(queue_info);
+      }
+      auto& queue_info =
+          queue_create_infos[create_info_indices[queue_family_index]];
+      if (queue_info.queueCount <
+          queue_families[queue_family_index].queueCount) {
+        transfer_queue_index =
+            std::make_pair(queue_family_index, queue_info.queueCount);
+        queue_info.queueCount++;
+        has_transfer_queue = true;
+      }
+    }
+  }
+
   VkDeviceCreateInfo deviceInfo = {};
   deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
   deviceInfo.pQueueCreateInfos = queue_create_infos.data();
   deviceInfo.queueCreateInfoCount = (uint32_t)queue_create_infos.size();
 
+  // The extensions of the scenario, and the ones of the common flags.
+  std::vector<const char*> enabled_extensions;
   if (device_extensions != nullptr) {
-    for (const auto& ext : *device_extensions) {
-      LOG("Device Extension: \"%s\"\n", ext);
+    enabled_extensions = *device_extensions;
+  }
+  auto has_extension = [&enabled_extensions](const char* name) {
+    return std::find_if(enabled_extensions.begin(), enabled_extensions.end(),
+                        [name](const char* ext) {
+                          return strcmp(ext, name) == 0;
+                        }) != enabled_extensions.end();
+  };
+  bool sync2 = false;
+  if (GetFlag("--sync2") != nullptr && GetFlag("--trace") != nullptr) {
+    LOG("The VK_KHR_synchronization2 calls can't be traced, --sync2 is "
+        "ignored.\n");
+  } else if (GetFlag("--sync2") != nullptr) {
+    sync2 = HasDeviceExtension(physicalDevice, "VK_KHR_synchronization2");
+    if (!sync2) {
+      LOG("VK_KHR_synchronization2 is not supported, --sync2 is ignored.\n");
+    } else if (!has_extension("VK_KHR_synchronization2")) {
+      enabled_extensions.push_back("VK_KHR_synchronization2");
     }
-    deviceInfo.ppEnabledExtensionNames = device_extensions->data();
-    deviceInfo.enabledExtensionCount =
-        static_cast<uint32_t>(device_extensions->size());
-  } else {
+  }
+  for (const auto& ext : enabled_extensions) {
+    LOG("Device Extension: \"%s\"\n", ext);
+  }
+  if (enabled_extensions.empty()) {
     LOG("Device Extension: None\n");
   }
+  deviceInfo.ppEnabledExtensionNames = enabled_extensions.data();
+  deviceInfo.enabledExtensionCount =
+      static_cast<uint32_t>(enabled_extensions.size());
 
   VulkanDevice device;
-  if (device_extensions != nullptr &&
-      std::find(device_extensions->begin(), device_extensions->end(),
-                "VK_KHR_timeline_semaphore") != device_extensions->end()) {
-    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR
-        physicalDeviceTimelineSemaphoreFeatures = {};
+  // The feature structs must outlive vkCreateDevice, which reads them through
+  // deviceInfo.pNext.
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR
+      physicalDeviceTimelineSemaphoreFeatures = {};
+  if (has_extension("VK_KHR_timeline_semaphore")) {
     physicalDeviceTimelineSemaphoreFeatures.sType =
         VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
     physicalDeviceTimelineSemaphoreFeatures.timelineSemaphore = true;
+    physicalDeviceTimelineSemaphoreFeatures.pNext =
+        const_cast<void*>(deviceInfo.pNext);
     deviceInfo.pNext = &physicalDeviceTimelineSemaphoreFeatures;
   }
+  // Runtime sized arrays of storage buffers, indexed by workgroup, when
+  // supported.
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT
+      physicalDeviceDescriptorIndexingFeatures = {};
+  if (has_extension("VK_EXT_descriptor_indexing")) {
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported;
+    GetDescriptorIndexingFeatures(context, physicalDevice, &supported);
+    physicalDeviceDescriptorIndexingFeatures.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    physicalDeviceDescriptorIndexingFeatures.runtimeDescriptorArray =
+        supported.runtimeDescriptorArray;
+    physicalDeviceDescriptorIndexingFeatures
+        .descriptorBindingStorageBufferUpdateAfterBind =
+        supported.descriptorBindingStorageBufferUpdateAfterBind;
+    physicalDeviceDescriptorIndexingFeatures.pNext =
+        const_cast<void*>(deviceInfo.pNext);
+    deviceInfo.pNext = &physicalDeviceDescriptorIndexingFeatures;
+  }
+
+  VkPhysicalDeviceSynchronization2FeaturesKHR
+      physicalDeviceSynchronization2Features = {};
+  if (sync2) {
+    physicalDeviceSynchronization2Features.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR;
+    physicalDeviceSynchronization2Features.synchronization2 = true;
+    physicalDeviceSynchronization2Features.pNext =
+        const_cast<void*>(deviceInfo.pNext);
+    deviceInfo.pNext = &physicalDeviceSynchronization2Features;
+  }
+
+  // Sparse binding and dynamic indexing of storage buffer arrays are enabled
+  // whenever they are supported, for the scenarios that use them.
+  VkPhysicalDeviceFeatures supportedFeatures;
+  vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+  VkPhysicalDeviceFeatures enabledFeatures = {};
+  enabledFeatures.sparseBinding = supportedFeatures.sparseBinding;
+  enabledFeatures.shaderStorageBufferArrayDynamicIndexing =
+      supportedFeatures.shaderStorageBufferArrayDynamicIndexing;
+  deviceInfo.pEnabledFeatures = &enabledFeatures;
   VK_CHECK_RESULT(
-      vkCreateDevice(physicalDevices[0], &deviceInfo, nullptr, &device.device));
-  device.physicalDevice = physicalDevices[0];
+      vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device.device));
+  device.physicalDevice = physicalDevice;
   auto vk_device = device.device;
+
+  // The workgroup size and the dispatch dimensions, within the limits of the
+  // device.
+  const VkPhysicalDeviceLimits& limits = selectedInfo->properties.limits;
+  if (GetFlag("--workgroup_size") != nullptr) {
+    ParseDimensions(GetFlag("--workgroup_size"), device.workgroupSize);
+  }
+  if (GetFlag("--dispatch") != nullptr) {
+    ParseDimensions(GetFlag("--dispatch"), device.dispatchSize);
+  }
+  for (int i = 0; i < 3; i++) {
+    device.workgroupSize[i] =
+        std::min(device.workgroupSize[i], limits.maxComputeWorkGroupSize[i]);
+    device.dispatchSize[i] =
+        std::min(device.dispatchSize[i], limits.maxComputeWorkGroupCount[i]);
+  }
+  uint32_t max_invocations = limits.maxComputeWorkGroupInvocations;
+  device.workgroupSize[2] = std::min(device.workgroupSize[2], max_invocations);
+  device.workgroupSize[1] = std::min(device.workgroupSize[1],
+                                     max_invocations / device.workgroupSize[2]);
+  device.workgroupSize[0] =
+      std::min(device.workgroupSize[0],
+               max_invocations /
+                   (device.workgroupSize[1] * device.workgroupSize[2]));
+  LOG("Workgroup size %ux%ux%u, dispatch %ux%ux%u\n", device.workgroupSize[0],
+      device.workgroupSize[1], device.workgroupSize[2], device.dispatchSize[0],
+      device.dispatchSize[1], device.dispatchSize[2]);
+
+  // Keep whole workgroups, of one float per invocation, in the buffers.
+  VkDeviceSize group_size = sizeof(float) * WorkgroupInvocations(&device);
+  VkDeviceSize size = device.bufferSize;
+  const char* buffer_size = GetFlag("--buffer_size");
+  if (buffer_size != nullptr && buffer_size[0] != '\0') {
+    size = ParseSize(buffer_size);
+  }
+  size = (size + group_size - 1) / group_size * group_size;
+  device.numBufferEntries = size / sizeof(float);
+  device.bufferSize = size;
+  device.memorySize = 2 * size;
+  device.bufferOutOffset = size;
+  device.loaderDispatch = GetFlag("--loader_dispatch") != nullptr;
+#define LOAD_DEVICE_FUNCTION(name)                                     \
+  device.vk.name = device.loaderDispatch                               \
+                       ? vk##name                                      \
+                       : (PFN_vk##name)vkGetDeviceProcAddr(vk_device,  \
+                                                           "vk" #name);
+  VULKAN_DEVICE_FUNCTIONS(LOAD_DEVICE_FUNCTION)
+#undef LOAD_DEVICE_FUNCTION
+
   device.CmdWriteBufferMarkerAMD =
       (PFN_vkCmdWriteBufferMarkerAMD)vkGetDeviceProcAddr(
           vk_device, "vkCmdWriteBufferMarkerAMD");
@@ -292,6 +3089,29 @@ VkDevice InitVulkanDevice(VulkanContext* context,
   device.WaitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(
       vk_device, "vkWaitSemaphoresKHR");
 
+  if (sync2) {
+    device.sync2 = true;
+    device.QueueSubmit2KHR = (PFN_vkQueueSubmit2KHR)vkGetDeviceProcAddr(
+        vk_device, "vkQueueSubmit2KHR");
+    device.CmdPipelineBarrier2KHR =
+        (PFN_vkCmdPipelineBarrier2KHR)vkGetDeviceProcAddr(
+            vk_device, "vkCmdPipelineBarrier2KHR");
+    device.CmdWaitEvents2KHR = (PFN_vkCmdWaitEvents2KHR)vkGetDeviceProcAddr(
+        vk_device, "vkCmdWaitEvents2KHR");
+    // Only available along with VK_AMD_buffer_marker.
+    if (has_extension("VK_AMD_buffer_marker")) {
+      device.CmdWriteBufferMarker2AMD =
+          (PFN_vkCmdWriteBufferMarker2AMD)vkGetDeviceProcAddr(
+              vk_device, "vkCmdWriteBufferMarker2AMD");
+    }
+  }
+
+  // A physical device query, the extension doesn't need to be enabled.
+  if (HasDeviceExtension(physicalDevice, "VK_EXT_memory_budget")) {
+    device.GetPhysicalDeviceMemoryProperties2 =
+        context->GetPhysicalDeviceMemoryProperties2;
+  }
+
   if (GetFlag("--debug_utils") != nullptr) {
     device.SetDebugUtilsObjectNameEXT =
         (PFN_vkSetDebugUtilsObjectNameEXT)vkGetDeviceProcAddr(
@@ -308,14 +3128,16 @@ VkDevice InitVulkanDevice(VulkanContext* context,
 
   if (queue_indices.empty()) {
     std::lock_guard<std::mutex> lock(context->devices_lock);
-    context->devices.push_back(device);
-    return vk_device;
+    return AddDevice(context, device);
   }
 
-  for (auto queue_index : queue_indices) {
+  for (size_t i = 0; i < queue_indices.size(); i++) {
+    auto queue_index = queue_indices[i];
     VkQueue queue;
     vkGetDeviceQueue(vk_device, queue_index.first, queue_index.second, &queue);
     device.queues.push_back(queue);
+    device.queueFamilyIndices.push_back(queue_index.first);
+    device.queueTypes.push_back((*queues)[i]);
 
     VkCommandPool pool;
     // create the command pool and command buffers
@@ -324,10 +3146,12 @@ VkDevice InitVulkanDevice(VulkanContext* context,
     commandPoolCreateInfo.queueFamilyIndex = queue_index.first;
     VK_CHECK_RESULT(
         vkCreateCommandPool(vk_device, &commandPoolCreateInfo, nullptr, &pool));
+    TraceCommandPool(vk_device, pool, queue_index.first);
     device.commandPools.push_back(pool);
   }
 
   device.queue = device.queues.front();
+  device.loadQueueBegin = load_queue_begin;
   SetObjectDebugName(&device, device.queue, VK_OBJECT_TYPE_QUEUE,
                      "Default Queue");
 
@@ -335,6 +3159,19 @@ VkDevice InitVulkanDevice(VulkanContext* context,
   SetObjectDebugName(&device, device.commandPool, VK_OBJECT_TYPE_COMMAND_POOL,
                      "Default CommandPool");
 
+  if (has_transfer_queue) {
+    vkGetDeviceQueue(vk_device, transfer_queue_index.first,
+                     transfer_queue_index.second, &device.transferQueue);
+    device.transferQueueFamilyIndex = transfer_queue_index.first;
+    SetObjectDebugName(&device, device.transferQueue, VK_OBJECT_TYPE_QUEUE,
+                       "Transfer Queue");
+  } else {
+    device.transferQueue = device.queue;
+    device.transferQueueFamilyIndex = device.queueFamilyIndices.front();
+  }
+
+  CreatePipelineCache(&device, *selectedInfo);
+
   // load shader module
   if (nullptr != shader_module_path) {
     LoadShader(vk_device, shader_module_path, device.computeShaderModule);
@@ -395,40 +3232,34 @@ VkDevice InitVulkanDevice(VulkanContext* context,
                        VK_OBJECT_TYPE_PIPELINE_LAYOUT,
                        "Default PipelineLayout");
 
-    VkPipelineShaderStageCreateInfo pipelineStageCreateInfo = {};
-    pipelineStageCreateInfo.sType =
-        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    pipelineStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-    pipelineStageCreateInfo.module = device.computeShaderModule;
-    pipelineStageCreateInfo.pName = "main";
-
-    VkComputePipelineCreateInfo pipelineCreateInfo = {};
-    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    pipelineCreateInfo.flags = 0;  // none
-    pipelineCreateInfo.stage = pipelineStageCreateInfo;
-    pipelineCreateInfo.layout = device.pipelineLayout;
-
-    VK_CHECK_RESULT(vkCreateComputePipelines(vk_device,
-                                             VK_NULL_HANDLE,  // pipeline cache
-                                             1,  // pipelines to create
-                                             &pipelineCreateInfo, nullptr,
-                                             &device.pipeline));
+    VK_CHECK_RESULT(CreateComputePipeline(&device, device.computeShaderModule,
+                                          device.pipelineLayout,
+                                          &device.pipeline));
     SetObjectDebugName(&device, device.pipeline, VK_OBJECT_TYPE_PIPELINE,
                        "Default ComputePipeline");
   }
 
+  TraceDevice(&device, enabled_extensions);
+
   std::lock_guard<std::mutex> lock(context->devices_lock);
-  context->devices.push_back(device);
-  return vk_device;
+  return AddDevice(context, device);
 }
 
 void SetupWatchdogTimer(VulkanContext* context) {
   // Set up the watchdog for exiting the test forcefully after
   // test_termination_timer_ms milliseconds
+  static bool registered = false;
   if (!watchdog_thread) {
+    {
+      std::lock_guard<std::mutex> lock(watchdog_mutex);
+      test_finished = false;
+    }
     watchdog_thread =
         new std::thread(WatchdogTimer, context->test_termination_timer_ms);
-    std::atexit(WaitForWatchdogThread);
+    if (!registered) {
+      std::atexit(WaitForWatchdogThread);
+      registered = true;
+    }
   }
 }
 
@@ -447,17 +3278,214 @@ bool InitVulkan(VulkanContext* context,
   return true;
 }
 
+// Returns the index of a memory type with the given properties whose heap can
+// hold size bytes, or -1 if there is none.
+static uint32_t FindMemoryTypeForSize(VkPhysicalDevice physical_device,
+                                      uint32_t memoryTypeBits,
+                                      int memoryProperties, VkDeviceSize size) {
+  VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &deviceMemoryProperties);
+
+  for (uint32_t i = 0; i < deviceMemoryProperties.memoryTypeCount; ++i) {
+    const auto& type = deviceMemoryProperties.memoryTypes[i];
+    if ((memoryTypeBits & (1 << i)) &&
+        (type.propertyFlags & memoryProperties) == memoryProperties &&
+        deviceMemoryProperties.memoryHeaps[type.heapIndex].size >= size)
+      return i;
+  }
+
+  return -1;
+}
+
+// Writes entries [first, first + count) of the initial content of bufferIn
+// (input) or bufferOut.
+static void FillBufferEntries(void* dst, VkDeviceSize first,
+                              VkDeviceSize count, bool input,
+                              BufferInitialization initialization,
+                              uint32_t loop_count) {
+  if (!input) {
+    memset(dst, 0, count * sizeof(float));
+    return;
+  }
+  if (initialization == BufferInitialization::Default) {
+    float* pBufferData = (float*)dst;
+    for (VkDeviceSize i = first; i < first + count; ++i) {
+      *pBufferData++ = 2 + i * 2.0f;
+    }
+  } else if (initialization == BufferInitialization::MinusOne) {
+    float* pBufferData = (float*)dst;
+    for (VkDeviceSize i = 0; i < count; ++i) {
+      *pBufferData++ = -1.0f;
+    }
+  } else if (initialization == BufferInitialization::_64K) {
+    uint32_t* pBufferData = (uint32_t*)dst;
+    for (VkDeviceSize i = 0; i < count; ++i) {
+      *pBufferData++ = loop_count;
+    }
+  }
+}
+
+// Initializes the buffers in device local memory that can't be mapped,
+// through a host visible staging buffer copied on the transfer queue.
+static void UploadBuffers(VulkanDevice* device,
+                          BufferInitialization initialization) {
+  // The staging buffer is reused for every chunk of the buffers.
+  constexpr VkDeviceSize kStagingSize = 64 << 20;
+  auto vk_device = device->device;
+  VkDeviceSize staging_size = std::min(kStagingSize, device->bufferSize);
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = staging_size;
+  bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VkBuffer staging;
+  VK_CHECK_RESULT(
+      vkCreateBuffer(vk_device, &bufferCreateInfo, nullptr, &staging));
+  SetObjectDebugName(device, staging, VK_OBJECT_TYPE_BUFFER, "Staging Buffer");
+
+  VkMemoryRequirements memoryRequirements;
+  vkGetBufferMemoryRequirements(vk_device, staging, &memoryRequirements);
+  VkMemoryAllocateInfo allocateInfo = {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.allocationSize = memoryRequirements.size;
+  allocateInfo.memoryTypeIndex = FindMemoryType(
+      device->physicalDevice, memoryRequirements.memoryTypeBits,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  VkDeviceMemory staging_memory;
+  VK_CHECK_RESULT(
+      vkAllocateMemory(vk_device, &allocateInfo, nullptr, &staging_memory));
+  VK_CHECK_RESULT(vkBindBufferMemory(vk_device, staging, staging_memory, 0));
+  void* pStaging;
+  VK_CHECK_RESULT(vkMapMemory(vk_device, staging_memory, 0, VK_WHOLE_SIZE, 0,
+                              &pStaging));
+
+  // The command buffer is recorded again for every chunk.
+  VkCommandPool pool;
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                   VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  poolInfo.queueFamilyIndex = device->transferQueueFamilyIndex;
+  VK_CHECK_RESULT(vkCreateCommandPool(vk_device, &poolInfo, nullptr, &pool));
+
+  VkCommandBuffer cb;
+  VkCommandBufferAllocateInfo cbAllocateInfo = {};
+  cbAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cbAllocateInfo.commandPool = pool;
+  cbAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cbAllocateInfo.commandBufferCount = 1;
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &cbAllocateInfo, &cb));
+
+  VkFence fence;
+  VkFenceCreateInfo fenceInfo = {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VK_CHECK_RESULT(vkCreateFence(vk_device, &fenceInfo, nullptr, &fence));
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VkSubmitInfo submitInfo = CreateSubmitInfo(&cb);
+  auto submit_and_wait = [&]() {
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(cb));
+    VK_CHECK_RESULT(DeviceQueueSubmit(device, device->transferQueue, 1,
+                                      &submitInfo, fence));
+    VK_CHECK_RESULT(
+        device->vk.WaitForFences(vk_device, 1, &fence, VK_TRUE, UINT64_MAX));
+    VK_CHECK_RESULT(device->vk.ResetFences(vk_device, 1, &fence));
+  };
+
+  VkBuffer buffers[] = {device->bufferIn, device->bufferOut};
+  for (int b = 0; b < 2; b++) {
+    bool input = b == 0;
+    if (input && initialization == BufferInitialization::Transfer) {
+      continue;
+    }
+    for (VkDeviceSize offset = 0; offset < device->bufferSize;
+         offset += staging_size) {
+      VkDeviceSize size = std::min(staging_size, device->bufferSize - offset);
+      FillBufferEntries(pStaging, offset / sizeof(float), size / sizeof(float),
+                        input, initialization, device->loopCount);
+
+      VK_CHECK_RESULT(device->vk.BeginCommandBuffer(cb, &beginInfo));
+      VkBufferCopy region = {};
+      region.dstOffset = offset;
+      region.size = size;
+      device->vk.CmdCopyBuffer(cb, staging, buffers[b], 1, &region);
+      submit_and_wait();
+    }
+  }
+
+  vkDestroyFence(vk_device, fence, nullptr);
+  vkDestroyCommandPool(vk_device, pool, nullptr);
+  vkUnmapMemory(vk_device, staging_memory);
+  vkDestroyBuffer(vk_device, staging, nullptr);
+  vkFreeMemory(vk_device, staging_memory, nullptr);
+}
+
+// Registers the I/O buffers with the trace, with their initial content up to
+// --trace_max_contents bytes.
+static void TraceInputOutputBuffers(VulkanDevice* device,
+                                    BufferInitialization initialization,
+                                    VkBufferUsageFlags usage) {
+  if (!TraceEnabled()) {
+    return;
+  }
+  const char* max_contents = GetFlag("--trace_max_contents");
+  VkDeviceSize limit =
+      ParseSize(max_contents && *max_contents ? max_contents : "64M");
+  VkBuffer buffers[] = {device->bufferIn, device->bufferOut};
+  for (int b = 0; b < 2; b++) {
+    bool input = b == 0;
+    std::vector<uint8_t> contents;
+    if (initialization == BufferInitialization::None ||
+        (input && initialization == BufferInitialization::Transfer)) {
+      // Left undefined.
+    } else if (device->bufferSize > limit) {
+      LOG("The content of the %s buffer is not traced [%llu bytes]\n",
+          input ? "input" : "output",
+          static_cast<unsigned long long>(device->bufferSize));
+    } else {
+      contents.resize(device->bufferSize);
+      FillBufferEntries(contents.data(), 0,
+                        std::min<VkDeviceSize>(device->numBufferEntries,
+                                               contents.size() / sizeof(float)),
+                        input, initialization, device->loopCount);
+    }
+    TraceBuffer(device->device, buffers[b], device->bufferSize, usage,
+                contents);
+  }
+}
+
 void AllocateInputOutputBuffers(VulkanDevice* device,
                                 BufferInitialization initialization) {
+  bool device_local = GetFlag("--device_local") != nullptr;
+
   VkBufferCreateInfo bufferCreateInfo = {};
   bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   bufferCreateInfo.size = device->bufferSize;
   bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+  // Device local buffers may be initialized on the transfer queue.
+  VkBufferUsageFlags upload_usage = 0;
+  uint32_t queue_families[] = {device->queueFamilyIndices.front(),
+                               device->transferQueueFamilyIndex};
+  if (device_local) {
+    upload_usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    if (queue_families[0] != queue_families[1]) {
+      bufferCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+      bufferCreateInfo.queueFamilyIndexCount = 2;
+      bufferCreateInfo.pQueueFamilyIndices = queue_families;
+    }
+  }
+  bufferCreateInfo.usage |= upload_usage;
+
   if (initialization == BufferInitialization::Transfer) {
-    bufferCreateInfo.usage =
-        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_SRC_BIT | upload_usage;
   }
 
   auto vk_device = device->device;
@@ -466,8 +3494,8 @@ void AllocateInputOutputBuffers(VulkanDevice* device,
   SetObjectDebugName(device, device->bufferIn, VK_OBJECT_TYPE_BUFFER,
                      "Input Buffer");
   if (initialization == BufferInitialization::Transfer) {
-    bufferCreateInfo.usage =
-        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                             VK_BUFFER_USAGE_TRANSFER_DST_BIT;
   }
 
   VK_CHECK_RESULT(vkCreateBuffer(vk_device, &bufferCreateInfo, nullptr,
@@ -475,19 +3503,51 @@ void AllocateInputOutputBuffers(VulkanDevice* device,
   SetObjectDebugName(device, device->bufferOut, VK_OBJECT_TYPE_BUFFER,
                      "Output Buffer");
 
-  VkMemoryRequirements memoryRequirements;
-  vkGetBufferMemoryRequirements(vk_device, device->bufferIn,
-                                &memoryRequirements);
+  VkMemoryRequirements inRequirements, outRequirements;
+  vkGetBufferMemoryRequirements(vk_device, device->bufferIn, &inRequirements);
+  vkGetBufferMemoryRequirements(vk_device, device->bufferOut,
+                                &outRequirements);
+  uint32_t memoryTypeBits =
+      inRequirements.memoryTypeBits & outRequirements.memoryTypeBits;
+  device->bufferOutOffset =
+      (inRequirements.size + outRequirements.alignment - 1) /
+      outRequirements.alignment * outRequirements.alignment;
+  device->memorySize = device->bufferOutOffset + outRequirements.size;
 
   int bufferMemoryType = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  uint32_t memoryTypeIndex = FindMemoryTypeForSize(
+      device->physicalDevice, memoryTypeBits, bufferMemoryType,
+      device->memorySize);
+  device->bufferMemoryHostVisible = true;
+  if (device_local) {
+    // With resizable BAR the whole VRAM is host visible, which avoids the
+    // staging buffer.
+    memoryTypeIndex = FindMemoryTypeForSize(
+        device->physicalDevice, memoryTypeBits,
+        bufferMemoryType | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        device->memorySize);
+    if (memoryTypeIndex == static_cast<uint32_t>(-1)) {
+      memoryTypeIndex = FindMemoryTypeForSize(
+          device->physicalDevice, memoryTypeBits,
+          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, device->memorySize);
+      device->bufferMemoryHostVisible = false;
+    }
+    LOG("Using %s device local memory for %llu bytes of I/O buffers\n",
+        device->bufferMemoryHostVisible ? "host visible" : "staged",
+        static_cast<unsigned long long>(device->memorySize));
+  }
+  if (memoryTypeIndex == static_cast<uint32_t>(-1)) {
+    LOG("No memory heap can hold the %llu bytes of I/O buffers, use a "
+        "smaller --buffer_size\n",
+        static_cast<unsigned long long>(device->memorySize));
+    exit(EXIT_FAILURE);
+  }
 
   VkMemoryAllocateInfo allocateInfo = {};
   allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
   allocateInfo.allocationSize = device->memorySize;
-  allocateInfo.memoryTypeIndex =
-      FindMemoryType(device->physicalDevice, memoryRequirements.memoryTypeBits,
-                     bufferMemoryType);
+  allocateInfo.memoryTypeIndex = memoryTypeIndex;
 
   VK_CHECK_RESULT(vkAllocateMemory(vk_device, &allocateInfo, nullptr,
                                    &device->bufferMemory));
@@ -497,40 +3557,139 @@ void AllocateInputOutputBuffers(VulkanDevice* device,
   VK_CHECK_RESULT(
       vkBindBufferMemory(vk_device, device->bufferIn, device->bufferMemory, 0));
   VK_CHECK_RESULT(vkBindBufferMemory(vk_device, device->bufferOut,
-                                     device->bufferMemory, device->bufferSize));
+                                     device->bufferMemory,
+                                     device->bufferOutOffset));
+  TraceInputOutputBuffers(device, initialization, bufferCreateInfo.usage);
+
+  if (initialization == BufferInitialization::None) {
+    return;
+  }
+  if (!device->bufferMemoryHostVisible) {
+    // Traced as the content of the buffers.
+    trace_paused = true;
+    UploadBuffers(device, initialization);
+    trace_paused = false;
+    return;
+  }
 
-  if (initialization != BufferInitialization::None) {
-    // initialize input and output buffers
-    void* pBuffer;
-    VK_CHECK_RESULT(vkMapMemory(vk_device, device->bufferMemory, 0,
-                                VK_WHOLE_SIZE, 0, &pBuffer));
+  // initialize input and output buffers
+  uint8_t* pBuffer;
+  VK_CHECK_RESULT(vkMapMemory(vk_device, device->bufferMemory, 0, VK_WHOLE_SIZE,
+                              0, reinterpret_cast<void**>(&pBuffer)));
+  if (initialization != BufferInitialization::Transfer) {
+    FillBufferEntries(pBuffer, 0, device->numBufferEntries, true,
+                      initialization, device->loopCount);
+  }
+  FillBufferEntries(pBuffer + device->bufferOutOffset, 0,
+                    device->numBufferEntries, false, initialization,
+                    device->loopCount);
+  vkUnmapMemory(vk_device, device->bufferMemory);
+}
 
-    if (initialization == BufferInitialization::Default) {
-      float* pBufferData = (float*)pBuffer;
-      for (int i = 0; i < device->numBufferEntries; ++i) {
-        *pBufferData++ = 2 + i * 2.0f;
-      }
-    } else if (initialization == BufferInitialization::MinusOne) {
-      float* pBufferData = (float*)pBuffer;
-      for (int i = 0; i < device->numBufferEntries; ++i) {
-        *pBufferData++ = -1.0f;
-      }
-    } else if (initialization == BufferInitialization::_64K) {
-      uint32_t* pBufferData = (uint32_t*)pBuffer;
-      for (int i = 0; i < device->numBufferEntries; ++i) {
-        *pBufferData++ = 65535;
-      }
+// Memory arena
+void InitMemoryArena(MemoryArena* arena, VulkanDevice* device,
+                     VkDeviceSize block_size) {
+  arena->device = device;
+  arena->blockSize = block_size;
+}
+
+VkResult ArenaAllocate(MemoryArena* arena,
+                       const VkMemoryRequirements& requirements,
+                       int memory_properties, MemoryAllocation* allocation) {
+  VulkanDevice* device = arena->device;
+  uint32_t memoryTypeIndex =
+      FindMemoryType(device->physicalDevice, requirements.memoryTypeBits,
+                     memory_properties);
+  if (memoryTypeIndex == static_cast<uint32_t>(-1)) {
+    return VK_ERROR_FEATURE_NOT_PRESENT;
+  }
+  VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+
+  std::lock_guard<std::mutex> lock(arena->lock);
+  auto& pool = arena->pools[memoryTypeIndex];
+  MemoryArena::Block* block = nullptr;
+  VkDeviceSize offset = 0;
+  for (auto& b : pool) {
+    offset = (b.used + alignment - 1) / alignment * alignment;
+    if (offset + requirements.size <= b.size) {
+      block = &b;
+      break;
     }
+  }
 
-    {
-      float* pBufferData = (float*)pBuffer + device->numBufferEntries;
-      for (int i = 0; i < device->numBufferEntries; ++i) {
-        *pBufferData++ = 0;
-      }
+  if (block == nullptr) {
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize =
+        std::max(arena->blockSize, requirements.size);
+    allocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+    MemoryArena::Block new_block = {};
+    new_block.size = allocateInfo.allocationSize;
+    VK_RETURN_IF_FAIL(vkAllocateMemory(device->device, &allocateInfo, nullptr,
+                                       &new_block.memory));
+    std::string name =
+        "Arena Block " + std::to_string(arena->blockCount++) + " [type " +
+        std::to_string(memoryTypeIndex) + "]";
+    SetObjectDebugName(device, new_block.memory, VK_OBJECT_TYPE_DEVICE_MEMORY,
+                       name.c_str());
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(device->physicalDevice,
+                                        &memoryProperties);
+    if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+      VK_RETURN_IF_FAIL(vkMapMemory(device->device, new_block.memory, 0,
+                                    VK_WHOLE_SIZE, 0, &new_block.mapped));
     }
+    pool.push_back(new_block);
+    block = &pool.back();
+    offset = 0;
+  }
+
+  block->used = offset + requirements.size;
+  allocation->memory = block->memory;
+  allocation->offset = offset;
+  allocation->size = requirements.size;
+  allocation->memoryTypeIndex = memoryTypeIndex;
+  allocation->mapped =
+      block->mapped ? static_cast<uint8_t*>(block->mapped) + offset : nullptr;
+  return VK_SUCCESS;
+}
+
+VkResult ArenaCreateBuffer(MemoryArena* arena,
+                           const VkBufferCreateInfo& create_info,
+                           int memory_properties, VkBuffer* buffer,
+                           MemoryAllocation* allocation) {
+  auto vk_device = arena->device->device;
+  VK_RETURN_IF_FAIL(vkCreateBuffer(vk_device, &create_info, nullptr, buffer));
+
+  VkMemoryRequirements memoryRequirements;
+  vkGetBufferMemoryRequirements(vk_device, *buffer, &memoryRequirements);
+
+  MemoryAllocation buffer_allocation;
+  VK_RETURN_IF_FAIL(ArenaAllocate(arena, memoryRequirements, memory_properties,
+                                  &buffer_allocation));
+  VK_RETURN_IF_FAIL(vkBindBufferMemory(vk_device, *buffer,
+                                       buffer_allocation.memory,
+                                       buffer_allocation.offset));
+  // The buffers asked host visible are the ones the host writes.
+  TraceBuffer(vk_device, *buffer, create_info.size, create_info.usage, {},
+              (memory_properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0);
+  if (allocation != nullptr) {
+    *allocation = buffer_allocation;
+  }
+  return VK_SUCCESS;
+}
 
-    vkUnmapMemory(vk_device, device->bufferMemory);
+void DestroyMemoryArena(MemoryArena* arena) {
+  std::lock_guard<std::mutex> lock(arena->lock);
+  for (auto& kv : arena->pools) {
+    for (auto& block : kv.second) {
+      vkFreeMemory(arena->device->device, block.memory, nullptr);
+    }
   }
+  arena->pools.clear();
 }
 
 void CreateDescriptorSets(VulkanDevice* device) {
@@ -548,6 +3707,16 @@ void CreateDescriptorSets(VulkanDevice* device) {
   SetObjectDebugName(device, device->descriptorSet,
                      VK_OBJECT_TYPE_DESCRIPTOR_SET, "Default DescriptorSet");
 
+  // Huge buffers are only partially visible to the shaders.
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  VkDeviceSize range = std::min<VkDeviceSize>(
+      device->bufferSize, properties.limits.maxStorageBufferRange);
+  if (range < device->bufferSize) {
+    LOG("Buffer range limited to maxStorageBufferRange [%llu bytes]\n",
+        static_cast<unsigned long long>(range));
+  }
+
   VkBuffer buffers[] = {device->bufferIn, device->bufferOut};
   std::vector<VkDescriptorBufferInfo> bufferInfo(device->numBuffers);
   std::vector<VkWriteDescriptorSet> writeDescriptorSets(device->numBuffers);
@@ -555,7 +3724,7 @@ void CreateDescriptorSets(VulkanDevice* device) {
   for (int i = 0; i < device->numBuffers; ++i) {
     bufferInfo[i] = {};
     bufferInfo[i].buffer = buffers[i];
-    bufferInfo[i].range = VK_WHOLE_SIZE;
+    bufferInfo[i].range = range;
 
     writeDescriptorSets[i] = {};
     writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -567,15 +3736,18 @@ void CreateDescriptorSets(VulkanDevice* device) {
   }
 
   vkUpdateDescriptorSets(vk_device, 2, writeDescriptorSets.data(), 0, nullptr);
+  TraceDescriptorSet(vk_device, device->descriptorSet, bufferInfo.data());
 }
 
-void BeginAndEndCommandBuffer(VkCommandBuffer command_buffer) {
+void BeginAndEndCommandBuffer(VulkanDevice* device,
+                              VkCommandBuffer command_buffer) {
   VkCommandBufferBeginInfo command_buffer_begin_info = {};
   command_buffer_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   command_buffer_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
   VK_CHECK_RESULT(
-      vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info));
-  VK_CHECK_RESULT(vkEndCommandBuffer(command_buffer));
+      device->vk.BeginCommandBuffer(command_buffer,
+                                    &command_buffer_begin_info));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(command_buffer));
 }
 
 void WaitOnEventThatNeverSignals(VulkanDevice* device,
@@ -592,20 +3764,87 @@ void WaitOnEventThatNeverSignals(VulkanDevice* device,
                      "Never-signaled Event");
   // We wait on a host-signaled event that is never signaled
   // This should cause a timeout/hang which should get detected eventually
-  vkCmdWaitEvents(command_buffer,
-                  1,  // eventCount,
-                  &event,
-                  VK_PIPELINE_STAGE_HOST_BIT,         // srcStageMask,
-                  VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,  // dstStageMask,
-                  0,                                  // memoryBarrierCount,
-                  nullptr,                            // pMemoryBarriers,
-                  0,        // bufferMemoryBarrierCount,
-                  nullptr,  // pBufferMemoryBarriers,
-                  0,        // imageMemoryBarrierCount,
-                  nullptr   // pImageMemoryBarriers,
+  if (device->CmdWaitEvents2KHR != nullptr) {
+    // The first scope of the wait on an event set by the host must only
+    // include host operations.
+    VkMemoryBarrier2KHR barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_HOST_BIT_KHR;
+    barrier.srcAccessMask = VK_ACCESS_2_HOST_WRITE_BIT_KHR;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT_KHR;
+    barrier.dstAccessMask =
+        VK_ACCESS_2_MEMORY_READ_BIT_KHR | VK_ACCESS_2_MEMORY_WRITE_BIT_KHR;
+    VkDependencyInfoKHR dependency_info = {};
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dependency_info.memoryBarrierCount = 1;
+    dependency_info.pMemoryBarriers = &barrier;
+    device->CmdWaitEvents2KHR(command_buffer, 1, &event, &dependency_info);
+    return;
+  }
+  device->vk.CmdWaitEvents(command_buffer,
+                           1,  // eventCount,
+                           &event,
+                           VK_PIPELINE_STAGE_HOST_BIT,  // srcStageMask,
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,  // dstStageMask,
+                           0,        // memoryBarrierCount,
+                           nullptr,  // pMemoryBarriers,
+                           0,        // bufferMemoryBarrierCount,
+                           nullptr,  // pBufferMemoryBarriers,
+                           0,        // imageMemoryBarrierCount,
+                           nullptr   // pImageMemoryBarriers,
   );
 }
 
+void CmdWriteBufferMarker(VulkanDevice* device, VkCommandBuffer command_buffer,
+                          VkPipelineStageFlagBits stage, VkBuffer buffer,
+                          VkDeviceSize offset, uint32_t marker) {
+  if (device->CmdWriteBufferMarker2AMD != nullptr) {
+    device->CmdWriteBufferMarker2AMD(command_buffer, stage, buffer, offset,
+                                     marker);
+    return;
+  }
+  device->CmdWriteBufferMarkerAMD(command_buffer, stage, buffer, offset,
+                                  marker);
+}
+
+void CmdMemoryBarrier(VulkanDevice* device, VkCommandBuffer command_buffer,
+                      VkPipelineStageFlags src_stages, VkAccessFlags src_access,
+                      VkPipelineStageFlags dst_stages,
+                      VkAccessFlags dst_access) {
+  if (device->CmdPipelineBarrier2KHR != nullptr) {
+    // The VkPipelineStageFlags2 and VkAccessFlags2 bits have the values of
+    // their legacy equivalents.
+    VkMemoryBarrier2KHR barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR;
+    barrier.srcStageMask = src_stages;
+    barrier.srcAccessMask = src_access;
+    barrier.dstStageMask = dst_stages;
+    barrier.dstAccessMask = dst_access;
+    VkDependencyInfoKHR dependency_info = {};
+    dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dependency_info.memoryBarrierCount = 1;
+    dependency_info.pMemoryBarriers = &barrier;
+    device->CmdPipelineBarrier2KHR(command_buffer, &dependency_info);
+    return;
+  }
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = src_access;
+  barrier.dstAccessMask = dst_access;
+  device->vk.CmdPipelineBarrier(command_buffer, src_stages, dst_stages, 0, 1,
+                                &barrier, 0, nullptr, 0, nullptr);
+}
+
+void CmdDispatchFault(VulkanDevice* device, VkCommandBuffer command_buffer) {
+  device->vk.CmdDispatch(command_buffer, device->dispatchSize[0],
+                         device->dispatchSize[1], device->dispatchSize[2]);
+}
+
+uint32_t WorkgroupInvocations(const VulkanDevice* device) {
+  return device->workgroupSize[0] * device->workgroupSize[1] *
+         device->workgroupSize[2];
+}
+
 VkSubmitInfo CreateSubmitInfo(
     const VkCommandBuffer* command_buffer,
     std::vector<VkSemaphore>* wait_semaphores,
@@ -642,6 +3881,7 @@ void CreateSemaphores(VulkanDevice* device, VkSemaphore* semaphores,
     for (uint32_t i = 0; i < count; i++) {
       VK_CHECK_RESULT(vkCreateSemaphore(vk_device, &binarySemaphoreCreateInfo,
                                         nullptr, &semaphores[i]));
+      TraceSemaphore(vk_device, semaphores[i], type, 0);
     }
     return;
   }
@@ -657,69 +3897,715 @@ void CreateSemaphores(VulkanDevice* device, VkSemaphore* semaphores,
   timelineSemaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
   timelineSemaphoreCreateInfo.pNext = &semaphoreTypeCreateInfo;
 
-  for (uint32_t i = 0; i < count; i++) {
-    VK_CHECK_RESULT(vkCreateSemaphore(vk_device, &timelineSemaphoreCreateInfo,
-                                      nullptr, &semaphores[i]));
+  for (uint32_t i = 0; i < count; i++) {
+    VK_CHECK_RESULT(vkCreateSemaphore(vk_device, &timelineSemaphoreCreateInfo,
+                                      nullptr, &semaphores[i]));
+    TraceSemaphore(vk_device, semaphores[i], type, initial_value);
+  }
+}
+
+void CreateBinarySemaphores(VulkanDevice* device, VkSemaphore* semaphores,
+                            uint32_t count) {
+  CreateSemaphores(device, semaphores, count, VK_SEMAPHORE_TYPE_BINARY_KHR, 0);
+}
+
+void CreateTimelineSemaphores(VulkanDevice* device, VkSemaphore* semaphores,
+                              uint32_t count, uint64_t initial_value) {
+  CreateSemaphores(device, semaphores, count, VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+                   initial_value);
+}
+
+VkTimelineSemaphoreSubmitInfoKHR CreateTimelineSemaphoreSubmitInfo(
+    std::vector<uint64_t>* wait_values, std::vector<uint64_t>* signal_values) {
+  VkTimelineSemaphoreSubmitInfoKHR timelineSemaphoreSubmitInfo = {};
+  timelineSemaphoreSubmitInfo.sType =
+      VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+  if (wait_values) {
+    timelineSemaphoreSubmitInfo.waitSemaphoreValueCount =
+        static_cast<uint32_t>(wait_values->size());
+    timelineSemaphoreSubmitInfo.pWaitSemaphoreValues = wait_values->data();
+  }
+  if (signal_values) {
+    timelineSemaphoreSubmitInfo.signalSemaphoreValueCount =
+        static_cast<uint32_t>(signal_values->size());
+    timelineSemaphoreSubmitInfo.pSignalSemaphoreValues = signal_values->data();
+  }
+  return timelineSemaphoreSubmitInfo;
+}
+
+VkBindSparseInfo CreateBindSparseInfo(
+    std::vector<VkSemaphore>* wait_semaphores,
+    std::vector<VkSemaphore>* signal_semaphores, void* pnext) {
+  VkBindSparseInfo bind_sparse_info = {};
+  bind_sparse_info.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
+  if (wait_semaphores) {
+    bind_sparse_info.waitSemaphoreCount =
+        static_cast<uint32_t>(wait_semaphores->size());
+    bind_sparse_info.pWaitSemaphores = wait_semaphores->data();
+  }
+  if (signal_semaphores) {
+    bind_sparse_info.signalSemaphoreCount =
+        static_cast<uint32_t>(signal_semaphores->size());
+    bind_sparse_info.pSignalSemaphores = signal_semaphores->data();
+  }
+  bind_sparse_info.pNext = pnext;
+  return bind_sparse_info;
+}
+
+// GPU timestamps
+struct TimestampRange {
+  std::string label;
+  uint32_t query;  // Begin timestamp, the end timestamp is the next query.
+  uint64_t mask;   // timestampValidBits of the queue family of the range.
+};
+
+struct TimestampQueries {
+  VkQueryPool pool = VK_NULL_HANDLE;
+  uint32_t used = 0;
+  bool full = false;  // The pool ran out, logged once.
+  std::vector<TimestampRange> ranges;
+};
+
+// Enough for the scenarios, command buffers recorded past it are not timed.
+constexpr uint32_t kTimestampQueryCount = 512;
+
+// Returns the timestampValidBits of the queue family, 0 if vkCmdResetQueryPool
+// is not supported by the family.
+static uint32_t TimestampValidBits(VkPhysicalDevice physical_device,
+                                   uint32_t queue_family_index) {
+  uint32_t count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(count);
+  vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count,
+                                           families.data());
+  if (queue_family_index >= count ||
+      (families[queue_family_index].queueFlags &
+       (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == 0) {
+    return 0;
+  }
+  return families[queue_family_index].timestampValidBits;
+}
+
+static std::mutex timestamp_lock;
+static std::map<VkDevice, TimestampQueries> timestamp_queries;
+
+// Resets all the queries of pool on the first queue of the device that can,
+// so that the queries of command buffers that are never submitted read as
+// unavailable.
+static bool ResetTimestampQueryPool(VulkanDevice* device, VkQueryPool pool) {
+  auto vk_device = device->device;
+  size_t q = 0;
+  while (q < device->queues.size() &&
+         TimestampValidBits(device->physicalDevice,
+                            device->queueFamilyIndices[q]) == 0) {
+    q++;
+  }
+  if (q == device->queues.size()) {
+    return false;
+  }
+
+  VkCommandPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = device->queueFamilyIndices[q];
+  VkCommandPool command_pool;
+  if (vkCreateCommandPool(vk_device, &pool_info, nullptr, &command_pool) !=
+      VK_SUCCESS) {
+    return false;
+  }
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence = VK_NULL_HANDLE;
+  VkCommandBuffer cb;
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VkCommandBufferAllocateInfo allocate_info = {};
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  VkSubmitInfo submit_info = CreateSubmitInfo(&cb);
+  VkResult result = vkCreateFence(vk_device, &fence_info, nullptr, &fence);
+  if (result == VK_SUCCESS) {
+    result = device->vk.AllocateCommandBuffers(vk_device, &allocate_info, &cb);
+  }
+  if (result == VK_SUCCESS) {
+    result = device->vk.BeginCommandBuffer(cb, &begin_info);
+  }
+  if (result == VK_SUCCESS) {
+    device->vk.CmdResetQueryPool(cb, pool, 0, kTimestampQueryCount);
+    result = device->vk.EndCommandBuffer(cb);
+  }
+  if (result == VK_SUCCESS) {
+    result = DeviceQueueSubmit(device, device->queues[q], 1, &submit_info,
+                               fence);
+  }
+  if (result == VK_SUCCESS) {
+    result = device->vk.WaitForFences(vk_device, 1, &fence, VK_TRUE,
+                                      UINT64_MAX);
+  }
+  vkDestroyFence(vk_device, fence, nullptr);
+  vkDestroyCommandPool(vk_device, command_pool, nullptr);
+  return result == VK_SUCCESS;
+}
+
+// Reserves two consecutive timestamp queries of the query pool of the device,
+// creating it on first use, for commands of a queue family with valid_bits
+// timestampValidBits. Returns false if the pool is full.
+static bool AllocateTimestampQueries(VulkanDevice* device, const char* label,
+                                     uint32_t valid_bits, VkQueryPool* pool,
+                                     uint32_t* query) {
+  std::lock_guard<std::mutex> lock(timestamp_lock);
+  auto& queries = timestamp_queries[device->device];
+  if (queries.pool == VK_NULL_HANDLE) {
+    VkQueryPoolCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    info.queryCount = kTimestampQueryCount;
+    if (vkCreateQueryPool(device->device, &info, nullptr, &queries.pool) !=
+        VK_SUCCESS) {
+      LOG("Could not create the timestamp query pool.\n");
+      queries.pool = VK_NULL_HANDLE;
+      return false;
+    }
+    SetObjectDebugName(device, queries.pool, VK_OBJECT_TYPE_QUERY_POOL,
+                       "Timestamp QueryPool");
+    if (!ResetTimestampQueryPool(device, queries.pool)) {
+      LOG("Could not reset the timestamp query pool.\n");
+      vkDestroyQueryPool(device->device, queries.pool, nullptr);
+      queries.pool = VK_NULL_HANDLE;
+      return false;
+    }
+  }
+  if (queries.used + 2 > kTimestampQueryCount) {
+    if (!queries.full) {
+      LOG("The %u timestamp queries are used up, %s and the later command "
+          "buffers are not timed.\n",
+          kTimestampQueryCount, label);
+      queries.full = true;
+    }
+    return false;
+  }
+  *pool = queries.pool;
+  *query = queries.used;
+  queries.used += 2;
+  uint64_t mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+  queries.ranges.push_back({label, *query, mask});
+  return true;
+}
+
+void RecordWithTimestamps(VulkanDevice* device, VkCommandBuffer command_buffer,
+                          uint32_t queue_family_index, const char* label,
+                          std::function<void(VkCommandBuffer)> f) {
+  VkQueryPool pool;
+  uint32_t query;
+  uint32_t valid_bits =
+      GetFlag("--timestamps") == nullptr
+          ? 0
+          : TimestampValidBits(device->physicalDevice, queue_family_index);
+  if (valid_bits == 0 ||
+      !AllocateTimestampQueries(device, label, valid_bits, &pool, &query)) {
+    f(command_buffer);
+    return;
+  }
+  device->vk.CmdResetQueryPool(command_buffer, pool, query, 2);
+  device->vk.CmdWriteTimestamp(command_buffer,
+                               VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pool, query);
+  f(command_buffer);
+  device->vk.CmdWriteTimestamp(command_buffer,
+                               VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pool,
+                               query + 1);
+}
+
+void ReportTimestamps(VulkanDevice* device, const std::string& key) {
+  std::lock_guard<std::mutex> lock(timestamp_lock);
+  auto it = timestamp_queries.find(device->device);
+  if (it == timestamp_queries.end() || it->second.used == 0) {
+    return;
+  }
+  const auto& queries = it->second;
+
+  // Timestamp and availability of each query. Does not wait, the timestamps
+  // of the work that did not run are reported as null. All the queries were
+  // reset when the pool was created.
+  std::vector<uint64_t> results(2 * queries.used);
+  VkResult result = device->vk.GetQueryPoolResults(
+      device->device, queries.pool, 0, queries.used,
+      results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (result != VK_SUCCESS && result != VK_NOT_READY) {
+    LOG("Could not read the GPU timestamps [%d].\n", result);
+    SetRunReportValue(key, "null");
+    return;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  double period = properties.limits.timestampPeriod;
+  auto available = [&](uint32_t query) { return results[2 * query + 1] != 0; };
+  auto timestamp = [&](const TimestampRange& range, uint32_t query) {
+    return results[2 * query] & range.mask;
+  };
+
+  // Begin times are relative to the first timestamp.
+  uint64_t first = ~0ull;
+  for (const auto& range : queries.ranges) {
+    if (available(range.query)) {
+      first = std::min(first, timestamp(range, range.query));
+    }
+  }
+
+  std::string json = "[";
+  for (size_t i = 0; i < queries.ranges.size(); i++) {
+    const auto& range = queries.ranges[i];
+    int64_t begin_ns = -1;
+    int64_t duration_ns = -1;
+    if (available(range.query)) {
+      begin_ns = static_cast<int64_t>(
+          ((timestamp(range, range.query) - first) & range.mask) * period);
+      if (available(range.query + 1)) {
+        duration_ns = static_cast<int64_t>(
+            ((timestamp(range, range.query + 1) -
+              timestamp(range, range.query)) &
+             range.mask) *
+            period);
+      }
+    }
+    if (duration_ns >= 0) {
+      LOG("GPU time of %s: %.3f ms\n", range.label.c_str(), duration_ns / 1e6);
+    } else {
+      LOG("GPU time of %s: %s\n", range.label.c_str(),
+          begin_ns >= 0 ? "did not finish" : "did not start");
+    }
+    json += std::string(i ? ", " : "") + "{\"label\": \"" +
+            JsonEscape(range.label) + "\", \"begin_us\": " +
+            FormatUs(begin_ns) + ", \"duration_us\": " +
+            FormatUs(duration_ns) + "}";
+  }
+  SetRunReportValue(key, json + "]");
+}
+
+// Destroys the timestamp query pool of the device, before the device.
+static void DestroyTimestampQueries(VkDevice vk_device) {
+  std::lock_guard<std::mutex> lock(timestamp_lock);
+  auto it = timestamp_queries.find(vk_device);
+  if (it == timestamp_queries.end()) {
+    return;
+  }
+  vkDestroyQueryPool(vk_device, it->second.pool, nullptr);
+  timestamp_queries.erase(it);
+}
+
+// Marker ring
+VkResult CreateMarkerRing(MemoryArena* arena, uint32_t size, MarkerRing* ring) {
+  VulkanDevice* device = arena->device;
+  ring->device = device;
+  ring->size = std::max(size, 1u);
+
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = ring->size * sizeof(uint32_t);
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  MemoryAllocation allocation;
+  VK_RETURN_IF_FAIL(ArenaCreateBuffer(
+      arena, buffer_info,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      &ring->buffer, &allocation));
+  SetObjectDebugName(device, ring->buffer, VK_OBJECT_TYPE_BUFFER,
+                     "Marker Ring Buffer");
+  ring->markers = static_cast<volatile uint32_t*>(allocation.mapped);
+  for (uint32_t i = 0; i < ring->size; i++) {
+    ring->markers[i] = 0;
+  }
+
+  if (TimestampValidBits(device->physicalDevice,
+                         device->queueFamilyIndices.front()) != 0) {
+    VkQueryPoolCreateInfo query_info = {};
+    query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_info.queryCount = ring->size;
+    VK_RETURN_IF_FAIL(vkCreateQueryPool(device->device, &query_info, nullptr,
+                                        &ring->queryPool));
+  }
+  return VK_SUCCESS;
+}
+
+void CmdWriteRingMarkers(VkCommandBuffer command_buffer, MarkerRing* ring,
+                         uint32_t count, VkPipelineStageFlagBits stage,
+                         std::function<void(VkCommandBuffer)> between) {
+  count = std::min(count, ring->size);
+  uint32_t first = ring->recorded % ring->size;
+  if (ring->queryPool != VK_NULL_HANDLE) {
+    // Two ranges if the markers wrap around.
+    uint32_t n = std::min(count, ring->size - first);
+    ring->device->vk.CmdResetQueryPool(command_buffer, ring->queryPool, first,
+                                       n);
+    if (n < count) {
+      ring->device->vk.CmdResetQueryPool(command_buffer, ring->queryPool, 0,
+                                         count - n);
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (between) {
+      between(command_buffer);
+    }
+    uint32_t entry = ring->recorded % ring->size;
+    ring->recorded++;
+    CmdWriteBufferMarker(ring->device, command_buffer, stage, ring->buffer,
+                         entry * sizeof(uint32_t), ring->recorded);
+    if (ring->queryPool != VK_NULL_HANDLE) {
+      ring->device->vk.CmdWriteTimestamp(command_buffer, stage, ring->queryPool,
+                                         entry);
+    }
+  }
+}
+
+// Returns the given percentile of sorted values.
+static int64_t Percentile(const std::vector<int64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return -1;
+  }
+  size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// Adds the marker ring statistics to the run report. The GPU and host clocks
+// are not calibrated against each other, so the delay between a marker landing
+// and the host seeing it is reported relative to the smallest one.
+static void ReportMarkerRing(MarkerRing* ring, uint64_t polls) {
+  uint32_t seen = static_cast<uint32_t>(ring->seenNs.size());
+  double host_rate = 0;
+  if (seen > 1) {
+    host_rate = (seen - 1) * 1e9 / (ring->seenNs.back() - ring->seenNs[0]);
+  }
+
+  // GPU timestamps of the markers seen in the last round of the ring.
+  std::vector<int64_t> delays;
+  double gpu_rate = 0;
+  uint32_t first = seen > ring->size ? seen - ring->size : 0;
+  if (ring->queryPool != VK_NULL_HANDLE && seen > first) {
+    std::vector<uint64_t> results(2 * ring->size);
+    VkResult result = ring->device->vk.GetQueryPoolResults(
+        ring->device->device, ring->queryPool, 0, ring->size,
+        results.size() * sizeof(uint64_t), results.data(),
+        2 * sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (result == VK_SUCCESS || result == VK_NOT_READY) {
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties(ring->device->physicalDevice, &properties);
+      double period = properties.limits.timestampPeriod;
+      int64_t min_delay = INT64_MAX;
+      std::vector<int64_t> gpu_ns;
+      for (uint32_t i = first; i < seen; i++) {
+        uint32_t entry = i % ring->size;
+        if (results[2 * entry + 1] == 0) {
+          continue;
+        }
+        int64_t gpu = static_cast<int64_t>(results[2 * entry] * period);
+        gpu_ns.push_back(gpu);
+        delays.push_back(ring->seenNs[i] - gpu);
+        min_delay = std::min(min_delay, delays.back());
+      }
+      for (auto& delay : delays) {
+        delay -= min_delay;
+      }
+      if (gpu_ns.size() > 1 && gpu_ns.back() > gpu_ns.front()) {
+        gpu_rate = (gpu_ns.size() - 1) * 1e9 / (gpu_ns.back() - gpu_ns.front());
+      }
+    }
+  }
+  std::sort(delays.begin(), delays.end());
+
+  LOG("Marker ring: %u/%u markers seen, %.0f markers/s on the host, %.0f "
+      "markers/s on the GPU\n",
+      seen, ring->recorded, host_rate, gpu_rate);
+  char json[512];
+  snprintf(json, sizeof(json),
+           "{\"size\": %u, \"recorded\": %u, \"seen\": %u, \"polls\": %llu, "
+           "\"host_markers_per_sec\": %.1f, \"gpu_markers_per_sec\": %.1f, "
+           "\"delay_us\": {\"p50\": %s, \"p99\": %s, \"max\": %s}}",
+           ring->size, ring->recorded, seen,
+           static_cast<unsigned long long>(polls), host_rate, gpu_rate,
+           FormatUs(Percentile(delays, 0.5)).c_str(),
+           FormatUs(Percentile(delays, 0.99)).c_str(),
+           FormatUs(delays.empty() ? -1 : delays.back()).c_str());
+  SetRunReportValue("marker_ring", json);
+  WriteRunReport();
+}
+
+static void PollMarkerRing(MarkerRing* ring) {
+  auto stall = std::chrono::milliseconds(
+      GetFlagUint("--marker_ring_stall_ms", 1000));
+  auto last_progress = std::chrono::steady_clock::now();
+  uint64_t polls = 0;
+  while (true) {
+    polls++;
+    bool stop = ring->stopPolling;
+    uint32_t seen = static_cast<uint32_t>(ring->seenNs.size());
+    auto now = std::chrono::steady_clock::now();
+    // Markers land in order, check the entry of the next one.
+    while (seen < ring->recorded &&
+           ring->markers[seen % ring->size] >= seen + 1) {
+      ring->seenNs.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              now.time_since_epoch())
+              .count());
+      seen++;
+      last_progress = now;
+    }
+    if ((seen == ring->recorded && seen > 0) || stop) {
+      break;
+    }
+    if (now - last_progress > stall) {
+      LOG("Marker ring stalled after %u markers\n", seen);
+      break;
+    }
+    std::this_thread::yield();
   }
+  ReportMarkerRing(ring, polls);
 }
 
-void CreateBinarySemaphores(VulkanDevice* device, VkSemaphore* semaphores,
-                            uint32_t count) {
-  CreateSemaphores(device, semaphores, count, VK_SEMAPHORE_TYPE_BINARY_KHR, 0);
+void StartMarkerRingPoller(MarkerRing* ring) {
+  ring->stopPolling = false;
+  ring->seenNs.reserve(ring->recorded);
+  ring->poller = std::thread(PollMarkerRing, ring);
 }
 
-void CreateTimelineSemaphores(VulkanDevice* device, VkSemaphore* semaphores,
-                              uint32_t count, uint64_t initial_value) {
-  CreateSemaphores(device, semaphores, count, VK_SEMAPHORE_TYPE_TIMELINE_KHR,
-                   initial_value);
+void StopMarkerRingPoller(MarkerRing* ring) {
+  ring->stopPolling = true;
+  if (ring->poller.joinable()) {
+    ring->poller.join();
+  }
 }
 
-VkTimelineSemaphoreSubmitInfoKHR CreateTimelineSemaphoreSubmitInfo(
-    std::vector<uint64_t>* wait_values, std::vector<uint64_t>* signal_values) {
-  VkTimelineSemaphoreSubmitInfoKHR timelineSemaphoreSubmitInfo = {};
-  timelineSemaphoreSubmitInfo.sType =
-      VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
-  if (wait_values) {
-    timelineSemaphoreSubmitInfo.waitSemaphoreValueCount =
-        static_cast<uint32_t>(wait_values->size());
-    timelineSemaphoreSubmitInfo.pWaitSemaphoreValues = wait_values->data();
+void DestroyMarkerRing(MarkerRing* ring) {
+  StopMarkerRingPoller(ring);
+  if (ring->device == nullptr) {
+    return;
   }
-  if (signal_values) {
-    timelineSemaphoreSubmitInfo.signalSemaphoreValueCount =
-        static_cast<uint32_t>(signal_values->size());
-    timelineSemaphoreSubmitInfo.pSignalSemaphoreValues = signal_values->data();
+  auto vk_device = ring->device->device;
+  if (ring->queryPool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(vk_device, ring->queryPool, nullptr);
+    ring->queryPool = VK_NULL_HANDLE;
   }
-  return timelineSemaphoreSubmitInfo;
+  vkDestroyBuffer(vk_device, ring->buffer, nullptr);
+  ring->buffer = VK_NULL_HANDLE;
+  ring->markers = nullptr;
 }
 
-VkBindSparseInfo CreateBindSparseInfo(
-    std::vector<VkSemaphore>* wait_semaphores,
-    std::vector<VkSemaphore>* signal_semaphores, void* pnext) {
-  VkBindSparseInfo bind_sparse_info = {};
-  bind_sparse_info.sType = VK_STRUCTURE_TYPE_BIND_SPARSE_INFO;
-  if (wait_semaphores) {
-    bind_sparse_info.waitSemaphoreCount =
-        static_cast<uint32_t>(wait_semaphores->size());
-    bind_sparse_info.pWaitSemaphores = wait_semaphores->data();
+// Frame loop
+// Formats the mean, p50, p99 and max of values in nanoseconds as JSON, in
+// microseconds.
+static std::string FrameStatsToJson(std::vector<int64_t> values) {
+  std::sort(values.begin(), values.end());
+  int64_t sum = 0;
+  for (auto value : values) {
+    sum += value;
   }
-  if (signal_semaphores) {
-    bind_sparse_info.signalSemaphoreCount =
-        static_cast<uint32_t>(signal_semaphores->size());
-    bind_sparse_info.pSignalSemaphores = signal_semaphores->data();
+  return "{\"mean_us\": " +
+         FormatUs(values.empty() ? -1 : sum / int64_t(values.size())) +
+         ", \"p50_us\": " + FormatUs(Percentile(values, 0.5)) +
+         ", \"p99_us\": " + FormatUs(Percentile(values, 0.99)) +
+         ", \"max_us\": " + FormatUs(values.empty() ? -1 : values.back()) +
+         "}";
+}
+
+VkResult RunFrameLoop(VulkanDevice* device, const FrameLoopOptions& options,
+                      std::function<void(VkCommandBuffer, uint32_t, bool)>
+                          record_frame) {
+  auto vk_device = device->device;
+  const uint32_t in_flight = std::max(options.framesInFlight, 1u);
+
+  // A command pool, command buffer and fence per frame in flight.
+  std::vector<VkCommandPool> pools(in_flight);
+  std::vector<VkCommandBuffer> cbs(in_flight);
+  std::vector<VkFence> fences(in_flight);
+  std::vector<bool> pending(in_flight, false);
+  for (uint32_t i = 0; i < in_flight; i++) {
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = device->queueFamilyIndices.front();
+    VK_RETURN_IF_FAIL(
+        vkCreateCommandPool(vk_device, &pool_info, nullptr, &pools[i]));
+    TraceCommandPool(vk_device, pools[i], pool_info.queueFamilyIndex);
+    VkCommandBufferAllocateInfo allocate_info = {};
+    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocate_info.commandPool = pools[i];
+    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocate_info.commandBufferCount = 1;
+    VK_RETURN_IF_FAIL(
+        device->vk.AllocateCommandBuffers(vk_device, &allocate_info, &cbs[i]));
+    VkFenceCreateInfo fence_info = {};
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VK_RETURN_IF_FAIL(
+        vkCreateFence(vk_device, &fence_info, nullptr, &fences[i]));
   }
-  bind_sparse_info.pNext = pnext;
-  return bind_sparse_info;
+
+  // Frame i waits for frame i - 1 and signals i + 1, so the frames after the
+  // fault can't run either.
+  VkSemaphore timeline;
+  CreateTimelineSemaphores(device, &timeline, 1, 0);
+  SetObjectDebugName(device, timeline, VK_OBJECT_TYPE_SEMAPHORE,
+                     "Frame TimelineSemaphore");
+  std::vector<VkSemaphore> semaphores{timeline};
+  std::vector<VkPipelineStageFlags> wait_stages{
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+
+  // The frames faulting and in flight after it are submitted, the next one
+  // would block on the fence of the fault.
+  const uint32_t last_frame =
+      options.faultFrame < options.frames
+          ? std::min(options.frames, options.faultFrame + in_flight)
+          : options.frames;
+  LOG("Frame loop: %u frames, %u in flight, fault at frame %u, %llu us per "
+      "frame\n",
+      options.frames, in_flight, options.faultFrame,
+      static_cast<unsigned long long>(options.frameTimeUs));
+
+  std::vector<int64_t> record_ns, submit_ns, interval_ns;
+  uint32_t completed = 0;
+  VkResult result = VK_SUCCESS;
+  const auto start = ReportClock::now();
+  auto previous_start = start;
+  uint32_t frame = 0;
+  for (; frame < last_frame && result == VK_SUCCESS; frame++) {
+    const uint32_t slot = frame % in_flight;
+    std::this_thread::sleep_until(
+        start + std::chrono::microseconds(frame * options.frameTimeUs));
+    const auto frame_start = ReportClock::now();
+    if (frame != 0) {
+      interval_ns.push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(frame_start -
+                                                               previous_start)
+              .count());
+    }
+    previous_start = frame_start;
+
+    if (pending[slot]) {
+      result = device->vk.WaitForFences(vk_device, 1, &fences[slot], VK_TRUE,
+                                        UINT64_MAX);
+      if (result != VK_SUCCESS) {
+        break;
+      }
+      completed++;
+      device->vk.ResetFences(vk_device, 1, &fences[slot]);
+      pending[slot] = false;
+    }
+
+    device->vk.ResetCommandPool(vk_device, pools[slot], 0);
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    result = device->vk.BeginCommandBuffer(cbs[slot], &begin_info);
+    if (result != VK_SUCCESS) {
+      break;
+    }
+    // Named after the frame, so that the crash dump tells which one faulted.
+    SetObjectDebugName(device, cbs[slot], VK_OBJECT_TYPE_COMMAND_BUFFER,
+                       ("Frame " + std::to_string(frame)).c_str());
+    record_frame(cbs[slot], frame, frame == options.faultFrame);
+    result = device->vk.EndCommandBuffer(cbs[slot]);
+    if (result != VK_SUCCESS) {
+      break;
+    }
+    const auto recorded = ReportClock::now();
+    record_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            recorded - frame_start)
+                            .count());
+
+    std::vector<uint64_t> wait_values{frame};
+    std::vector<uint64_t> signal_values{frame + 1ull};
+    auto timeline_info =
+        CreateTimelineSemaphoreSubmitInfo(&wait_values, &signal_values);
+    VkSubmitInfo submit_info = CreateSubmitInfo(
+        &cbs[slot], &semaphores, &wait_stages, &semaphores, &timeline_info);
+    if (frame == options.faultFrame) {
+      RunStressSubmits(device, device->queue);
+    }
+    result = QueueSubmit(device, device->queue, 1, &submit_info, fences[slot]);
+    submit_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            ReportClock::now() - recorded)
+                            .count());
+    pending[slot] = result == VK_SUCCESS;
+  }
+  if (result != VK_SUCCESS) {
+    OnVulkanError(result);
+    LOG("Frame loop: VkResult is %d at frame %u\n", result, frame);
+  }
+
+  // Without a fault the last frames complete, otherwise only count the frames
+  // done without waiting for them.
+  const bool faulted = options.faultFrame < options.frames;
+  for (uint32_t i = 0; i < in_flight; i++) {
+    if (!pending[i]) {
+      continue;
+    }
+    VkResult status =
+        !faulted && result == VK_SUCCESS
+            ? device->vk.WaitForFences(vk_device, 1, &fences[i], VK_TRUE,
+                                       UINT64_MAX)
+            : device->vk.GetFenceStatus(vk_device, fences[i]);
+    if (status == VK_SUCCESS) {
+      completed++;
+      pending[i] = false;
+    }
+  }
+  LOG("Frame loop: %u frames submitted, %u completed\n", frame, completed);
+
+  // The frame time jitter is the standard deviation of the interval between
+  // the starts of consecutive frames.
+  double mean = 0, variance = 0;
+  for (auto ns : interval_ns) {
+    mean += ns;
+  }
+  mean = interval_ns.empty() ? 0 : mean / interval_ns.size();
+  for (auto ns : interval_ns) {
+    variance += (ns - mean) * (ns - mean);
+  }
+  variance = interval_ns.empty() ? 0 : variance / interval_ns.size();
+  char json[256];
+  snprintf(json, sizeof(json),
+           "{\"frames\": %u, \"frames_in_flight\": %u, \"fault_frame\": %s, "
+           "\"frame_time_us\": %llu, \"submitted\": %u, \"completed\": %u, "
+           "\"jitter_us\": %.1f, ",
+           options.frames, in_flight,
+           options.faultFrame < options.frames
+               ? std::to_string(options.faultFrame).c_str()
+               : "null",
+           static_cast<unsigned long long>(options.frameTimeUs), frame,
+           completed, std::sqrt(variance) / 1e3);
+  SetRunReportValue("frame_loop",
+                    json + std::string("\"record\": ") +
+                        FrameStatsToJson(record_ns) + ", \"submit\": " +
+                        FrameStatsToJson(submit_ns) + ", \"interval\": " +
+                        FrameStatsToJson(interval_ns) + "}");
+  // After a fault the pools, fences and semaphore are left to the device, the
+  // frames after it never complete.
+  if (std::find(pending.begin(), pending.end(), true) == pending.end()) {
+    for (uint32_t i = 0; i < in_flight; i++) {
+      vkDestroyFence(vk_device, fences[i], nullptr);
+      vkDestroyCommandPool(vk_device, pools[i], nullptr);
+    }
+    vkDestroySemaphore(vk_device, timeline, nullptr);
+  }
+  return result;
 }
 
 // Destroys the device object with the given VkHandle
 void DeleteVulkanDevice(VulkanContext* context, VkDevice vk_device) {
   std::lock_guard<std::mutex> lock(context->devices_lock);
+  RemoveDevice(context, vk_device);
   for (auto it = context->devices.begin(); it != context->devices.end(); it++) {
-    if (it->device == vk_device) {
+    if ((*it)->device == vk_device) {
       context->devices.erase(it);
       break;
     }
   }
+  DestroyTimestampQueries(vk_device);
   vkDestroyDevice(vk_device, nullptr);
 }
 
@@ -727,7 +4613,9 @@ void DeleteVulkanDevice(VulkanContext* context, VkDevice vk_device) {
 void CleanupVulkan(VulkanContext* context) {
   std::lock_guard<std::mutex> lock(context->devices_lock);
   for (auto& device : context->devices) {
-    vkDestroyDevice(device.device, nullptr);
+    RemoveDevice(context, device->device);
+    DestroyTimestampQueries(device->device);
+    vkDestroyDevice(device->device, nullptr);
   }
   context->devices.clear();
   vkDestroyInstance(context->instance, nullptr);
@@ -735,17 +4623,25 @@ void CleanupVulkan(VulkanContext* context) {
 
 VulkanDevice* VulkanContext::GetSingleDevice() {
   assert(devices.size() == 1);
-  return &devices[0];
+  return devices[0].get();
 }
 
 VulkanDevice* VulkanContext::GetDevice(VkDevice vk_device) {
-  std::lock_guard<std::mutex> lock(devices_lock);
-  auto it = find_if(devices.begin(), devices.end(),
-                    [&vk_device](const VulkanDevice& device) {
-                      return device.device == vk_device;
-                    });
-  if (it != devices.end()) {
-    return &(*it);
+  uint32_t slot = DeviceTableSlot(vk_device);
+  for (uint32_t i = 0; i < kMaxDevices; i++, slot = (slot + 1) % kMaxDevices) {
+    auto& entry = device_table[slot];
+    auto handle = entry.handle.load(std::memory_order_acquire);
+    if (handle == VK_NULL_HANDLE) {
+      return nullptr;
+    }
+    if (handle == vk_device) {
+      auto device = entry.device.load(std::memory_order_acquire);
+      // The slot may have been reused for another handle meanwhile.
+      if (entry.handle.load(std::memory_order_acquire) != vk_device) {
+        return nullptr;
+      }
+      return device;
+    }
   }
   return nullptr;
 }
@@ -760,12 +4656,50 @@ bool CreateShader(VkDevice device, const uint32_t* code, size_t codeSize,
 
   VK_CHECK_RESULT(
       vkCreateShaderModule(device, &shaderCreateInfo, nullptr, &shader));
+  TraceShaderModule(device, shader, code, codeSize);
 
   return true;
 }
 
-// Load a SPIRV file and create a new VkShaderModule.
-bool LoadShader(VkDevice device, const char* filename, VkShaderModule& shader) {
+// Generated by the add_embedded_shaders CMake function.
+extern const EmbeddedShader kEmbeddedShaders[];
+extern const size_t kEmbeddedShaderCount;
+
+const EmbeddedShader* FindEmbeddedShader(const char* name) {
+  for (size_t i = 0; i < kEmbeddedShaderCount; i++) {
+    if (strcmp(kEmbeddedShaders[i].name, name) == 0) {
+      return &kEmbeddedShaders[i];
+    }
+  }
+  return nullptr;
+}
+
+// Create a VkShaderModule from a SPIRV file, mapping it if possible.
+static bool LoadShaderFile(VkDevice device, const char* filename,
+                           VkShaderModule& shader) {
+#ifndef WINDOWS
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    LOG("Invalid File '%s' - %d: %s\n", filename, errno, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    LOG("Invalid length '%s' - %d: %s\n", filename, errno, strerror(errno));
+    close(fd);
+    return false;
+  }
+  void* code = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (code == MAP_FAILED) {
+    LOG("Unable to map '%s' - %d: %s\n", filename, errno, strerror(errno));
+    return false;
+  }
+  auto result = CreateShader(device, static_cast<const uint32_t*>(code),
+                             st.st_size, shader);
+  munmap(code, st.st_size);
+  return result;
+#else
   FILE* f = fopen(filename, "rb");
   if (!f) {
     LOG("Invalid File '%s' - %d: %s\n", filename, errno, strerror(errno));
@@ -776,20 +4710,494 @@ bool LoadShader(VkDevice device, const char* filename, VkShaderModule& shader) {
   auto fileLen = ftell(f);
   if (-1 == fileLen) {
     LOG("Invalid length '%s' - %d: %s\n", filename, errno, strerror(errno));
+    fclose(f);
     return false;
   }
   fseek(f, 0, SEEK_SET);
 
-  uint8_t* buffer = new uint8_t[fileLen];
+  // uint32_t storage keeps the code aligned as vkCreateShaderModule expects.
+  std::vector<uint32_t> buffer((fileLen + 3) / 4);
+
+  fread(buffer.data(), 1, fileLen, f);
+  fclose(f);
+
+  return CreateShader(device, buffer.data(), fileLen, shader);
+#endif
+}
+
+bool LoadShader(VkDevice device, const char* filename, VkShaderModule& shader) {
+  const char* shader_dir = GetFlag("--shader_dir");
+  if (shader_dir != nullptr && shader_dir[0] != '\0') {
+    std::string path = std::string(shader_dir) + "/" + filename;
+    LOG("Loading shader %s\n", path.c_str());
+    return LoadShaderFile(device, path.c_str(), shader);
+  }
+
+  // Embedded shaders are referred to by file name only.
+  const EmbeddedShader* embedded = FindEmbeddedShader(filename);
+  if (embedded != nullptr) {
+    LOG("Loading embedded shader %s\n", filename);
+    return CreateShader(device, embedded->code, embedded->size, shader);
+  }
+  LOG("Loading shader %s\n", filename);
+  return LoadShaderFile(device, filename, shader);
+}
+
+// Pipeline cache
+static std::string PipelineCacheDir() {
+  const char* dir = GetFlag("--pipeline_cache_dir");
+  if (dir == nullptr || dir[0] == '\0') {
+    dir = getenv("TMPDIR");
+  }
+#ifdef WINDOWS
+  if (dir == nullptr || dir[0] == '\0') {
+    dir = getenv("TEMP");
+  }
+  return dir ? dir : ".";
+#else
+  return dir ? dir : "/tmp";
+#endif
+}
+
+// Returns true if data starts with a pipeline cache header matching the
+// physical device.
+static bool IsPipelineCacheValid(const std::vector<uint8_t>& data,
+                                 const VkPhysicalDeviceProperties& properties) {
+  // VkPipelineCacheHeaderVersionOne
+  struct {
+    uint32_t headerSize;
+    uint32_t headerVersion;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+  } header;
+  if (data.size() < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data.data(), sizeof(header));
+  return header.headerSize >= sizeof(header) &&
+         header.headerSize <= data.size() &&
+         header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+         header.vendorID == properties.vendorID &&
+         header.deviceID == properties.deviceID &&
+         memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID,
+                VK_UUID_SIZE) == 0;
+}
 
-  fread(buffer, 1, fileLen, f);
+static std::vector<uint8_t> ReadFile(const std::string& path) {
+  std::vector<uint8_t> data;
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    return data;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size > 0) {
+    data.resize(size);
+    if (fread(data.data(), 1, data.size(), f) != data.size()) {
+      data.clear();
+    }
+  }
   fclose(f);
+  return data;
+}
 
-  auto result = CreateShader(device, (uint32_t*)buffer, fileLen, shader);
+void CreatePipelineCache(VulkanDevice* device, const PhysicalDeviceInfo& info) {
+  // The cache header only identifies the driver build through
+  // pipelineCacheUUID, so also key the file by device and driver version.
+  char key[64];
+  snprintf(key, sizeof(key), "%04x_%04x_%08x", info.properties.vendorID,
+           info.properties.deviceID, info.properties.driverVersion);
+  device->cacheKey =
+      (info.hasDeviceUUID ? UUIDToString(info.deviceUUID) + "_" : "") + key;
+
+  std::vector<uint8_t> data;
+  if (GetFlag("--no_pipeline_cache") == nullptr) {
+    device->pipelineCachePath =
+        PipelineCacheDir() + "/hcf_pipeline_cache_" + device->cacheKey + ".bin";
+    data = ReadFile(device->pipelineCachePath);
+    if (!data.empty() && !IsPipelineCacheValid(data, info.properties)) {
+      LOG("Ignoring invalid pipeline cache %s\n",
+          device->pipelineCachePath.c_str());
+      data.clear();
+    }
+    if (!data.empty()) {
+      LOG("Using pipeline cache %s [%zu bytes]\n",
+          device->pipelineCachePath.c_str(), data.size());
+    }
+  }
 
-  delete[] buffer;
+  VkPipelineCacheCreateInfo create_info = {};
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  create_info.initialDataSize = data.size();
+  create_info.pInitialData = data.empty() ? nullptr : data.data();
+  VkResult result = vkCreatePipelineCache(device->device, &create_info,
+                                          nullptr, &device->pipelineCache);
+  if (result != VK_SUCCESS && !data.empty()) {
+    // Some drivers reject the data instead of ignoring it.
+    create_info.initialDataSize = 0;
+    create_info.pInitialData = nullptr;
+    data.clear();
+    result = vkCreatePipelineCache(device->device, &create_info, nullptr,
+                                   &device->pipelineCache);
+  }
+  VK_CHECK_RESULT(result);
+  device->pipelineCacheSize = data.size();
+  SetObjectDebugName(device, device->pipelineCache,
+                     VK_OBJECT_TYPE_PIPELINE_CACHE, "Default PipelineCache");
+}
 
-  return result;
+void SavePipelineCache(VulkanDevice* device) {
+  if (device->pipelineCache == VK_NULL_HANDLE ||
+      device->pipelineCachePath.empty()) {
+    return;
+  }
+  size_t size = 0;
+  VK_CHECK_RESULT(vkGetPipelineCacheData(device->device, device->pipelineCache,
+                                         &size, nullptr));
+  if (size == 0 || size == device->pipelineCacheSize) {
+    return;
+  }
+  std::vector<uint8_t> data(size);
+  VK_CHECK_RESULT(vkGetPipelineCacheData(device->device, device->pipelineCache,
+                                         &size, data.data()));
+  data.resize(size);
+
+  // Write to a temporary file and rename it, so that concurrent runs never
+  // read a partial cache.
+#ifdef WINDOWS
+  std::string tmp_path = device->pipelineCachePath + ".tmp";
+#else
+  std::string tmp_path =
+      device->pipelineCachePath + "." + std::to_string(getpid()) + ".tmp";
+#endif
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (f == nullptr) {
+    LOG("Unable to write pipeline cache '%s' - %d: %s\n", tmp_path.c_str(),
+        errno, strerror(errno));
+    return;
+  }
+  bool written = fwrite(data.data(), 1, data.size(), f) == data.size();
+  written = fclose(f) == 0 && written;
+#ifdef WINDOWS
+  remove(device->pipelineCachePath.c_str());
+#endif
+  if (!written || rename(tmp_path.c_str(), device->pipelineCachePath.c_str())) {
+    LOG("Unable to write pipeline cache '%s' - %d: %s\n",
+        device->pipelineCachePath.c_str(), errno, strerror(errno));
+    remove(tmp_path.c_str());
+    return;
+  }
+  device->pipelineCacheSize = data.size();
+}
+
+VkResult CreateComputePipeline(VulkanDevice* device,
+                               VkShaderModule shader_module,
+                               VkPipelineLayout layout, VkPipeline* pipeline) {
+  VkPipelineShaderStageCreateInfo pipelineStageCreateInfo = {};
+  pipelineStageCreateInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineStageCreateInfo.module = shader_module;
+  pipelineStageCreateInfo.pName = "main";
+
+  // The workgroup size of the shaders is given by the specialization
+  // constants 0 to 2 (local_size_x_id etc.), the shaders with a fixed size
+  // ignore them.
+  VkSpecializationMapEntry specializationEntries[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    specializationEntries[i].constantID = i;
+    specializationEntries[i].offset = i * sizeof(uint32_t);
+    specializationEntries[i].size = sizeof(uint32_t);
+  }
+  VkSpecializationInfo specializationInfo = {};
+  specializationInfo.mapEntryCount = 3;
+  specializationInfo.pMapEntries = specializationEntries;
+  specializationInfo.dataSize = sizeof(device->workgroupSize);
+  specializationInfo.pData = device->workgroupSize;
+  pipelineStageCreateInfo.pSpecializationInfo = &specializationInfo;
+
+  VkComputePipelineCreateInfo pipelineCreateInfo = {};
+  pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineCreateInfo.flags = 0;  // none
+  pipelineCreateInfo.stage = pipelineStageCreateInfo;
+  pipelineCreateInfo.layout = layout;
+
+  VK_RETURN_IF_FAIL(vkCreateComputePipelines(device->device,
+                                             device->pipelineCache,
+                                             1,  // pipelines to create
+                                             &pipelineCreateInfo, nullptr,
+                                             pipeline));
+  TracePipeline(device, shader_module, layout, *pipeline);
+  SavePipelineCache(device);
+  return VK_SUCCESS;
+}
+
+// Hang calibration
+// Cost of a dispatch of infinite_loop.comp with a loop count of cnt, which
+// runs cnt^3 iterations: fixed_ns + ns_per_iteration * cnt^3.
+struct LoopCost {
+  double fixed_ns;
+  double ns_per_iteration;
+};
+
+// Returns the GPU time of a single dispatch of pipeline with loop count cnt,
+// or -1 on error.
+static double TimeLoopDispatch(VulkanDevice* device, VkPipeline pipeline,
+                               VkDescriptorSet descriptor_set,
+                               uint32_t* input, VkQueryPool query_pool,
+                               VkCommandBuffer cb, VkFence fence,
+                               uint32_t cnt) {
+  *input = cnt;
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  if (device->vk.BeginCommandBuffer(cb, &begin_info) != VK_SUCCESS) {
+    return -1;
+  }
+  device->vk.CmdResetQueryPool(cb, query_pool, 0, 2);
+  device->vk.CmdWriteTimestamp(cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                               query_pool, 0);
+  device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+  device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &descriptor_set, 0, nullptr);
+  CmdDispatchFault(device, cb);
+  device->vk.CmdWriteTimestamp(cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                               query_pool, 1);
+  if (device->vk.EndCommandBuffer(cb) != VK_SUCCESS) {
+    return -1;
+  }
+
+  VkSubmitInfo submit_info = CreateSubmitInfo(&cb);
+  if (DeviceQueueSubmit(device, device->queue, 1, &submit_info, fence) !=
+          VK_SUCCESS ||
+      device->vk.WaitForFences(device->device, 1, &fence, VK_TRUE,
+                               10 * 1000 * 1000 * 1000ULL) != VK_SUCCESS ||
+      device->vk.ResetFences(device->device, 1, &fence) != VK_SUCCESS) {
+    return -1;
+  }
+  uint64_t timestamps[2];
+  if (device->vk.GetQueryPoolResults(
+          device->device, query_pool, 0, 2, sizeof(timestamps), timestamps,
+          sizeof(uint64_t),
+          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+    return -1;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  uint32_t valid_bits = TimestampValidBits(device->physicalDevice,
+                                           device->queueFamilyIndices.front());
+  uint64_t mask = valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+  return ((timestamps[1] - timestamps[0]) & mask) *
+         static_cast<double>(properties.limits.timestampPeriod);
+}
+
+// Times dispatches of infinite_loop.comp with increasing loop counts, until
+// one takes max_ns, and fits the cubic cost to them.
+static bool MeasureLoopCost(VulkanDevice* device, double max_ns,
+                            LoopCost* cost) {
+  auto vk_device = device->device;
+  if (TimestampValidBits(device->physicalDevice,
+                         device->queueFamilyIndices.front()) == 0) {
+    LOG("The queue can not write timestamps, the loop count is not "
+        "calibrated.\n");
+    return false;
+  }
+
+  VkShaderModule module;
+  if (!LoadShader(vk_device, "infinite_loop.comp.spv", module)) {
+    return false;
+  }
+  VkPipeline pipeline;
+  VkResult result =
+      CreateComputePipeline(device, module, device->pipelineLayout, &pipeline);
+  vkDestroyShaderModule(vk_device, module, nullptr);
+  if (result != VK_SUCCESS) {
+    return false;
+  }
+
+  // Small host visible copies of bufferIn and bufferOut.
+  MemoryArena arena;
+  InitMemoryArena(&arena, device, 1 << 16);
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = 16;
+  buffer_info.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  const int host_visible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                           VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  VkBuffer buffers[2];
+  MemoryAllocation input;
+  VK_CHECK_RESULT(ArenaCreateBuffer(&arena, buffer_info, host_visible,
+                                    &buffers[0], &input));
+  VK_CHECK_RESULT(
+      ArenaCreateBuffer(&arena, buffer_info, host_visible, &buffers[1]));
+
+  VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2};
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  VkDescriptorPool descriptor_pool;
+  VK_CHECK_RESULT(vkCreateDescriptorPool(vk_device, &pool_info, nullptr,
+                                         &descriptor_pool));
+  VkDescriptorSetAllocateInfo set_info = {};
+  set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  set_info.descriptorPool = descriptor_pool;
+  set_info.descriptorSetCount = 1;
+  set_info.pSetLayouts = &device->descriptorSetLayout;
+  VkDescriptorSet descriptor_set;
+  VK_CHECK_RESULT(
+      vkAllocateDescriptorSets(vk_device, &set_info, &descriptor_set));
+  VkDescriptorBufferInfo descriptor_buffers[2] = {
+      {buffers[0], 0, VK_WHOLE_SIZE}, {buffers[1], 0, VK_WHOLE_SIZE}};
+  VkWriteDescriptorSet writes[2] = {};
+  for (uint32_t i = 0; i < 2; i++) {
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = descriptor_set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pBufferInfo = &descriptor_buffers[i];
+  }
+  vkUpdateDescriptorSets(vk_device, 2, writes, 0, nullptr);
+  TraceDescriptorSet(vk_device, descriptor_set, descriptor_buffers);
+
+  VkQueryPoolCreateInfo query_info = {};
+  query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  query_info.queryCount = 2;
+  VkQueryPool query_pool;
+  VK_CHECK_RESULT(
+      vkCreateQueryPool(vk_device, &query_info, nullptr, &query_pool));
+
+  VkCommandBufferAllocateInfo cb_info = {};
+  cb_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  cb_info.commandPool = device->commandPool;
+  cb_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  cb_info.commandBufferCount = 1;
+  VkCommandBuffer cb;
+  VK_CHECK_RESULT(device->vk.AllocateCommandBuffers(vk_device, &cb_info, &cb));
+  VkFenceCreateInfo fence_info = {};
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence;
+  VK_CHECK_RESULT(vkCreateFence(vk_device, &fence_info, nullptr, &fence));
+
+  // Least squares fit of the time against cnt^3, keeping the fastest of a
+  // few dispatches of each count.
+  constexpr int kRepeats = 3;
+  constexpr uint32_t kMaxCalibrationCount = 4096;
+  double n = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  bool failed = false;
+  for (uint32_t cnt = 16; cnt <= kMaxCalibrationCount && !failed; cnt *= 2) {
+    double ns = -1;
+    for (int i = 0; i < kRepeats; i++) {
+      double t = TimeLoopDispatch(device, pipeline, descriptor_set,
+                                  static_cast<uint32_t*>(input.mapped),
+                                  query_pool, cb, fence, cnt);
+      if (t < 0) {
+        failed = true;
+        break;
+      }
+      ns = ns < 0 ? t : std::min(ns, t);
+    }
+    if (failed) {
+      break;
+    }
+    LOG("Loop count %u: %.3f ms\n", cnt, ns / 1e6);
+    double x = static_cast<double>(cnt) * cnt * cnt;
+    n++;
+    sum_x += x;
+    sum_y += ns;
+    sum_xx += x * x;
+    sum_xy += x * ns;
+    if (ns >= max_ns) {
+      break;
+    }
+  }
+
+  vkDestroyFence(vk_device, fence, nullptr);
+  vkFreeCommandBuffers(vk_device, device->commandPool, 1, &cb);
+  vkDestroyQueryPool(vk_device, query_pool, nullptr);
+  vkDestroyDescriptorPool(vk_device, descriptor_pool, nullptr);
+  vkDestroyBuffer(vk_device, buffers[0], nullptr);
+  vkDestroyBuffer(vk_device, buffers[1], nullptr);
+  DestroyMemoryArena(&arena);
+  vkDestroyPipeline(vk_device, pipeline, nullptr);
+
+  double denominator = n * sum_xx - sum_x * sum_x;
+  if (failed || n < 2 || denominator <= 0) {
+    LOG("Could not time the loop, the loop count is not calibrated.\n");
+    return false;
+  }
+  cost->ns_per_iteration = (n * sum_xy - sum_x * sum_y) / denominator;
+  cost->fixed_ns =
+      std::max((sum_y - cost->ns_per_iteration * sum_x) / n, 0.0);
+  return cost->ns_per_iteration > 0;
+}
+
+uint32_t CalibrateLoopCount(VulkanDevice* device) {
+  uint64_t target_ms =
+      GetFlagUint("--hang_target_ms", 2 * GetFlagUint("--tdr_ms", 0));
+  if (target_ms == 0) {
+    return device->loopCount;
+  }
+  double target_ns = target_ms * 1e6;
+
+  // The fit only depends on the device, the driver and the shape of the
+  // dispatch, so it is cached with the pipeline cache.
+  char shape[64];
+  snprintf(shape, sizeof(shape), "_%ux%ux%u_%ux%ux%u",
+           device->workgroupSize[0], device->workgroupSize[1],
+           device->workgroupSize[2], device->dispatchSize[0],
+           device->dispatchSize[1], device->dispatchSize[2]);
+  std::string path = PipelineCacheDir() + "/hcf_loop_calibration_" +
+                     device->cacheKey + shape + ".txt";
+  LoopCost cost;
+  bool cached = false;
+  if (GetFlag("--no_pipeline_cache") == nullptr) {
+    std::vector<uint8_t> data = ReadFile(path);
+    std::string text(data.begin(), data.end());
+    cached = sscanf(text.c_str(), "%lf %lf", &cost.fixed_ns,
+                    &cost.ns_per_iteration) == 2 &&
+             cost.ns_per_iteration > 0;
+  }
+  if (!cached) {
+    // A dispatch of a twentieth of the target is long enough for the fit, and
+    // keeps the calibration short.
+    if (!MeasureLoopCost(device, target_ns / 20, &cost)) {
+      return device->loopCount;
+    }
+    if (GetFlag("--no_pipeline_cache") == nullptr) {
+      FILE* f = fopen(path.c_str(), "w");
+      if (f != nullptr) {
+        fprintf(f, "%.17g %.17g\n", cost.fixed_ns, cost.ns_per_iteration);
+        fclose(f);
+      }
+    }
+  }
+
+  double cnt = std::cbrt(std::max(target_ns - cost.fixed_ns, 0.0) /
+                         cost.ns_per_iteration);
+  device->loopCount = static_cast<uint32_t>(
+      std::min(std::max(std::round(cnt), 1.0), double(kMaxLoopCount)));
+  LOG("Loop count %u for a %llu ms hang%s\n", device->loopCount,
+      static_cast<unsigned long long>(target_ms),
+      cached ? " (cached calibration)" : "");
+
+  char json[256];
+  snprintf(json, sizeof(json),
+           "{\"target_ms\": %llu, \"loop_count\": %u, \"fixed_ns\": %.1f, "
+           "\"ns_per_iteration\": %.6g, \"cached\": %s}",
+           static_cast<unsigned long long>(target_ms), device->loopCount,
+           cost.fixed_ns, cost.ns_per_iteration, cached ? "true" : "false");
+  SetRunReportValue("loop_calibration", json);
+  return device->loopCount;
 }
 
 uint32_t FindMemoryType(VkPhysicalDevice physical_device,
@@ -838,6 +5246,14 @@ void DefineFlag(const char* name, const char* help) {
 
 void InitFlags(int argc, char** argv) {
   CommonFlags();
+  if (argc > 0) {
+    std::string program = argv[0];
+    size_t slash = program.find_last_of("/\\");
+    if (slash != std::string::npos) {
+      program = program.substr(slash + 1);
+    }
+    SetRunReportValue("scenario", "\"" + JsonEscape(program) + "\"");
+  }
   for (int i = 1; i < argc; i++) {
     std::string k = argv[i];
     std::string v = "";
@@ -851,6 +5267,9 @@ void InitFlags(int argc, char** argv) {
     }
     GlobalFlags().values[k] = v;
   }
+  if (GetFlag("--sync_log") != nullptr) {
+    log_async = false;
+  }
 }
 
 const char* GetFlag(const char* key) {
@@ -860,6 +5279,14 @@ const char* GetFlag(const char* key) {
   return GlobalFlags().values[key].c_str();
 }
 
+uint64_t GetFlagUint(const char* name, uint64_t default_value) {
+  const char* value = GetFlag(name);
+  if (value == nullptr || value[0] == '\0') {
+    return default_value;
+  }
+  return std::strtoull(value, nullptr, 10);
+}
+
 QueueType QueueTypeFromString(const char* s, QueueType default_type) {
   if (s == nullptr || std::strcmp(s, "") == 0) {
     return default_type;
@@ -878,10 +5305,22 @@ QueueType QueueTypeFromString(const char* s, QueueType default_type) {
   return QueueType::Undefined;
 }
 
-VkResult RunWithCrashCheck(VulkanContext& ctx,
-                           std::function<void(VulkanContext&)> f) {
-  auto device = ctx.GetSingleDevice();
+const char* QueueTypeToString(QueueType queue_type) {
+  switch (queue_type) {
+    case QueueType::Graphics:
+      return "graphics";
+    case QueueType::Compute:
+      return "compute";
+    case QueueType::Transfer:
+      return "transfer";
+    default:
+      return "";
+  }
+}
 
+static VkResult RunAndDetectCrash(VulkanContext& ctx,
+                                  std::function<void(VulkanContext&)> f) {
+  auto device = ctx.GetSingleDevice();
   VkCommandBufferAllocateInfo allocate_info = {};
   allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocate_info.commandPool = device->commandPool;
@@ -891,7 +5330,7 @@ VkResult RunWithCrashCheck(VulkanContext& ctx,
   // Helper command buffer to catch the device lost error
   VkCommandBuffer cb;
   VK_RETURN_IF_FAIL(
-      vkAllocateCommandBuffers(device->device, &allocate_info, &cb));
+      device->vk.AllocateCommandBuffers(device->device, &allocate_info, &cb));
 
   SetObjectDebugName(device, cb, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "Hang/crash detection CommandBuffer");
@@ -900,8 +5339,8 @@ VkResult RunWithCrashCheck(VulkanContext& ctx,
   begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  VK_RETURN_IF_FAIL(vkBeginCommandBuffer(cb, &begin_info));
-  VK_RETURN_IF_FAIL(vkEndCommandBuffer(cb));
+  VK_RETURN_IF_FAIL(device->vk.BeginCommandBuffer(cb, &begin_info));
+  VK_RETURN_IF_FAIL(device->vk.EndCommandBuffer(cb));
 
   // Helper fence to catch the device lost error
   VkFence fence;
@@ -913,27 +5352,60 @@ VkResult RunWithCrashCheck(VulkanContext& ctx,
                        "Hang/crash detection Fence");
   }
 
+  ResetRunReport(device);
+  StartBackgroundLoad(device);
+  SampleMemoryBudget("start");
   f(ctx);
+  SampleMemoryBudget("submitted");
 
   // NOTE: vkQueueWaitIdle will return VK_SUCCESS occasionally
   LOG("Waiting for idle...\n");
-  VK_RETURN_IF_FAIL(vkQueueWaitIdle(device->queue));
+  VkResult result = device->vk.QueueWaitIdle(device->queue);
+  RecordRunPhase(RunPhase::WaitIdleReturn);
+  VK_RETURN_IF_FAIL(result);
 
   // NOTE: this is where an error gets detected by some version of our driver
   LOG("Submit empty command buffer...\n");
   VkSubmitInfo submit_info = CreateSubmitInfo(&cb);
-  VK_RETURN_IF_FAIL(vkQueueSubmit(device->queue, 1, &submit_info, fence));
+  result = DeviceQueueSubmit(device, device->queue, 1, &submit_info, fence);
+  RecordRunPhase(RunPhase::EmptySubmit);
+  VK_RETURN_IF_FAIL(result);
 
   // 30s should be enough waiting for to detect hang/crash.
-  constexpr std::chrono::nanoseconds kFenceTimeout = 30s;
+  std::chrono::nanoseconds fence_timeout = 30s;
+  const char* fence_timeout_ms = GetFlag("--fence_timeout_ms");
+  if (fence_timeout_ms != nullptr && fence_timeout_ms[0] != '\0') {
+    fence_timeout = std::strtoull(fence_timeout_ms, nullptr, 10) * 1ms;
+  }
 
-  VK_RETURN_IF_FAIL(vkWaitForFences(device->device, 1, &fence, VK_TRUE,
-                                    kFenceTimeout.count()));
+  result = device->vk.WaitForFences(device->device, 1, &fence, VK_TRUE,
+                                    fence_timeout.count());
+  RecordRunPhase(RunPhase::FenceReturn);
+  VK_RETURN_IF_FAIL(result);
 
   // NOTE: this vkQueueWaitIdle is not expected to be reached, as a previous
   // Vulkan command is expected to return VK_ERROR_DEVICE_LOST
   LOG("[NOT REACHABLE(if crash/hang)] Waiting for idle...\n");
-  return vkQueueWaitIdle(device->queue);
+  return device->vk.QueueWaitIdle(device->queue);
+}
+
+VkResult RunWithCrashCheck(VulkanContext& ctx,
+                           std::function<void(VulkanContext&)> f) {
+  VkResult result = RunAndDetectCrash(ctx, f);
+  SampleMemoryBudget("fault");
+  StopBackgroundLoad();
+  SetRunReportValue("result", std::to_string(result));
+  {
+    std::lock_guard<std::mutex> lock(ctx.devices_lock);
+    for (size_t i = 0; i < ctx.devices.size(); i++) {
+      ReportTimestamps(ctx.devices[i].get(),
+                       ctx.devices.size() == 1
+                           ? "gpu_timestamps"
+                           : "gpu_timestamps_" + std::to_string(i));
+    }
+  }
+  WriteRunReport();
+  return result;
 }
 
 VkResult AllocateDefaultCommandBuffer(VulkanDevice* device, VkCommandBuffer* cb,
@@ -949,7 +5421,119 @@ VkResult AllocateDefaultCommandBuffer(VulkanDevice* device, VkCommandBuffer* cb,
   allocate_info.level = level;
   allocate_info.commandBufferCount = 1;
 
-  return vkAllocateCommandBuffers(device->device, &allocate_info, cb);
+  return device->vk.AllocateCommandBuffers(device->device, &allocate_info, cb);
+}
+
+// Returns the queue family of a command pool of the device.
+static uint32_t CommandPoolQueueFamily(VulkanDevice* device,
+                                       VkCommandPool pool) {
+  for (size_t i = 0; i < device->commandPools.size(); i++) {
+    if (device->commandPools[i] == pool) {
+      return device->queueFamilyIndices[i];
+    }
+  }
+  return device->queueFamilyIndices.front();
+}
+
+VkResult RecordSecondaryCommandBuffers(
+    VulkanDevice* device, VkCommandBuffer primary, uint32_t secondary_count,
+    uint32_t thread_count, std::function<void(VkCommandBuffer, uint32_t)> f,
+    const char* debug_name, VkCommandPool pool,
+    std::vector<VkCommandBuffer>* secondaries) {
+  if (pool == VK_NULL_HANDLE) {
+    pool = device->commandPool;
+  }
+  secondary_count = std::max(secondary_count, 1u);
+  thread_count = std::min(std::max(thread_count, 1u), secondary_count);
+  auto vk_device = device->device;
+
+  // Command pools are externally synchronized, give each thread its own. They
+  // are never destroyed, as the command buffers may be pending until exit.
+  std::vector<VkCommandPool> pools(thread_count);
+  for (auto& thread_pool : pools) {
+    VkCommandPoolCreateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    info.queueFamilyIndex = CommandPoolQueueFamily(device, pool);
+    VK_RETURN_IF_FAIL(
+        vkCreateCommandPool(vk_device, &info, nullptr, &thread_pool));
+    TraceCommandPool(vk_device, thread_pool, info.queueFamilyIndex);
+  }
+
+  std::vector<VkCommandBuffer> command_buffers(secondary_count);
+  std::vector<VkResult> results(thread_count, VK_SUCCESS);
+  auto record = [&](uint32_t thread) {
+    VkCommandBufferInheritanceInfo inheritance_info = {};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+
+    for (uint32_t i = thread; i < secondary_count; i += thread_count) {
+      VkResult& result = results[thread];
+      result = AllocateDefaultCommandBuffer(device, &command_buffers[i],
+                                            VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                                            pools[thread]);
+      if (result == VK_SUCCESS) {
+        result = device->vk.BeginCommandBuffer(command_buffers[i], &begin_info);
+      }
+      if (result != VK_SUCCESS) {
+        return;
+      }
+      f(command_buffers[i], i);
+      result = device->vk.EndCommandBuffer(command_buffers[i]);
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < thread_count; t++) {
+    threads.emplace_back(record, t);
+  }
+  record(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto record_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  for (auto result : results) {
+    VK_RETURN_IF_FAIL(result);
+  }
+
+  if (secondary_count > 1 || thread_count > 1) {
+    LOG("Recorded %u secondary command buffers on %u threads in %.3f ms\n",
+        secondary_count, thread_count, record_ns / 1e6);
+    char json[160];
+    snprintf(json, sizeof(json),
+             "{\"secondaries\": %u, \"threads\": %u, \"record_us\": %s}",
+             secondary_count, thread_count, FormatUs(record_ns).c_str());
+    SetRunReportValue("recording", json);
+  }
+
+  if (debug_name != nullptr) {
+    for (uint32_t i = 0; i < secondary_count; i++) {
+      std::string name = std::string(debug_name) + " Secondary Command Buffer";
+      if (secondary_count > 1) {
+        name += " " + std::to_string(i);
+      }
+      SetObjectDebugName(device, command_buffers[i],
+                         VK_OBJECT_TYPE_COMMAND_BUFFER, name.c_str());
+    }
+  }
+
+  VkCommandBufferBeginInfo begin_info = {};
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_RETURN_IF_FAIL(device->vk.BeginCommandBuffer(primary, &begin_info));
+  device->vk.CmdExecuteCommands(primary, secondary_count,
+                                command_buffers.data());
+  VK_RETURN_IF_FAIL(device->vk.EndCommandBuffer(primary));
+
+  if (secondaries != nullptr) {
+    *secondaries = command_buffers;
+  }
+  return VK_SUCCESS;
 }
 
 VkResult CreateAndRecordCommandBuffers(VulkanDevice* device,
@@ -977,27 +5561,36 @@ VkResult CreateAndRecordCommandBuffers(VulkanDevice* device,
                        name.c_str());
   }
 
-  VkCommandBuffer cb = *primary;
-  if (secondary != nullptr) {
-    VK_CHECK_RESULT(AllocateDefaultCommandBuffer(
-        device, secondary, VK_COMMAND_BUFFER_LEVEL_SECONDARY, pool));
-    cb = *secondary;
-    if (debug_name != nullptr) {
-      std::string name = std::string(debug_name) + " Secondary Command Buffer";
-      SetObjectDebugName(device, *secondary, VK_OBJECT_TYPE_COMMAND_BUFFER,
-                         name.c_str());
-    }
-  }
-
-  VK_CHECK_RESULT(vkBeginCommandBuffer(cb, &begin_info));
-  f(cb);
-  VK_CHECK_RESULT(vkEndCommandBuffer(cb));
+  // Time the commands of f with --timestamps.
+  uint32_t queue_family_index =
+      CommandPoolQueueFamily(device, pool ? pool : device->commandPool);
+  const char* label = debug_name ? debug_name : "Command Buffer";
+  auto record = [&](VkCommandBuffer cb) {
+    RecordWithTimestamps(device, cb, queue_family_index, label, f);
+  };
 
   if (secondary != nullptr) {
-    VK_CHECK_RESULT(vkBeginCommandBuffer(*primary, &begin_info));
-    vkCmdExecuteCommands(*primary, 1, &cb);
-    VK_CHECK_RESULT(vkEndCommandBuffer(*primary));
+    // Each secondary command buffer gets the commands of f. The scenarios'
+    // f are not written to be reentrant, so they run one at a time, the
+    // threads still record their secondaries from their own pools.
+    std::vector<VkCommandBuffer> secondaries;
+    std::mutex record_lock;
+    VK_CHECK_RESULT(RecordSecondaryCommandBuffers(
+        device, *primary,
+        static_cast<uint32_t>(GetFlagUint("--secondary_count", 1)),
+        static_cast<uint32_t>(GetFlagUint("--record_threads", 1)),
+        [&](VkCommandBuffer cb, uint32_t) {
+          std::lock_guard<std::mutex> lock(record_lock);
+          record(cb);
+        },
+        debug_name, pool, &secondaries));
+    *secondary = secondaries.front();
+    return VK_SUCCESS;
   }
+
+  VK_CHECK_RESULT(device->vk.BeginCommandBuffer(*primary, &begin_info));
+  record(*primary);
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(*primary));
   return VK_SUCCESS;
 }
 
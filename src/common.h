@@ -20,10 +20,13 @@
 #include <errno.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -44,6 +47,13 @@ using std::vector;
 
 const uint64_t kTestTerminationTimerMsDefault = 120000;
 
+// Default and maximum loop count of infinite_loop.comp, which runs it cubed
+// iterations.
+const uint32_t kMaxLoopCount = 65535;
+
+// Number of slots of the VkDevice to VulkanDevice table of a context.
+const uint32_t kMaxDevices = 256;
+
 enum class QueueType {
   Undefined,
   Graphics,
@@ -56,30 +66,112 @@ enum class QueueType {
 QueueType QueueTypeFromString(const char* s,
                               QueueType default_type = QueueType::Graphics);
 
+// Returns the string accepted by --queue for the given QueueType.
+const char* QueueTypeToString(QueueType queue_type);
+
+// Returns the index of the queue family used for queue_type, or the number of
+// queue families of the physical device if there is no such family.
+uint32_t SelectQueue(VkPhysicalDevice physical_device, QueueType queue_type);
+
+// The device level entry points called per submission, per recorded command or
+// on the host events, which are dispatched through the table of their
+// VulkanDevice.
+#define VULKAN_DEVICE_FUNCTIONS(X) \
+  X(QueueSubmit)                   \
+  X(QueueBindSparse)               \
+  X(QueueWaitIdle)                 \
+  X(WaitForFences)                 \
+  X(ResetFences)                   \
+  X(GetFenceStatus)                \
+  X(GetQueryPoolResults)           \
+  X(SetEvent)                      \
+  X(ResetEvent)                    \
+  X(AllocateCommandBuffers)        \
+  X(ResetCommandPool)              \
+  X(BeginCommandBuffer)            \
+  X(EndCommandBuffer)              \
+  X(CmdBindPipeline)               \
+  X(CmdBindDescriptorSets)         \
+  X(CmdDispatch)                   \
+  X(CmdCopyBuffer)                 \
+  X(CmdFillBuffer)                 \
+  X(CmdPipelineBarrier)            \
+  X(CmdSetEvent)                   \
+  X(CmdResetEvent)                 \
+  X(CmdWaitEvents)                 \
+  X(CmdWriteTimestamp)             \
+  X(CmdResetQueryPool)             \
+  X(CmdExecuteCommands)
+
+// Resolved with vkGetDeviceProcAddr by InitVulkanDevice, so that the calls
+// skip the loader trampolines, or set to the loader entry points with
+// --loader_dispatch.
+struct DeviceDispatchTable {
+#define DECLARE_DEVICE_FUNCTION(name) PFN_vk##name name = nullptr;
+  VULKAN_DEVICE_FUNCTIONS(DECLARE_DEVICE_FUNCTION)
+#undef DECLARE_DEVICE_FUNCTION
+};
+
 struct VulkanDevice {
   VkDevice device;
   VkPhysicalDevice physicalDevice;
   std::vector<VkQueue> queues;
+  std::vector<uint32_t> queueFamilyIndices;  // One per queue.
+  std::vector<QueueType> queueTypes;         // One per queue.
   VkQueue queue;  // The default queue to use.
+  // Index of the first of the --load_queues in queues, the queues of the
+  // scenario come before it.
+  size_t loadQueueBegin = 0;
+
+  // Queue used to upload device local buffers through a staging buffer. It is
+  // a dedicated transfer queue with --device_local if the device has one,
+  // the default queue otherwise.
+  VkQueue transferQueue = VK_NULL_HANDLE;
+  uint32_t transferQueueFamilyIndex = 0;
+
+  // Called as device->vk.QueueSubmit(...) instead of vkQueueSubmit(...).
+  DeviceDispatchTable vk;
+  bool loaderDispatch = false;
 
   PFN_vkCmdWriteBufferMarkerAMD CmdWriteBufferMarkerAMD;
   PFN_vkSignalSemaphoreKHR SignalSemaphoreKHR;
   PFN_vkWaitSemaphoresKHR WaitSemaphoresKHR;
 
+  // VK_KHR_synchronization2 entry points, only set with --sync2 when the
+  // device supports it. QueueSubmit, WaitOnEventThatNeverSignals,
+  // CmdWriteBufferMarker and CmdMemoryBarrier use them when they are set.
+  bool sync2 = false;
+  PFN_vkQueueSubmit2KHR QueueSubmit2KHR = nullptr;
+  PFN_vkCmdPipelineBarrier2KHR CmdPipelineBarrier2KHR = nullptr;
+  PFN_vkCmdWaitEvents2KHR CmdWaitEvents2KHR = nullptr;
+  PFN_vkCmdWriteBufferMarker2AMD CmdWriteBufferMarker2AMD = nullptr;
+
   PFN_vkSetDebugUtilsObjectNameEXT SetDebugUtilsObjectNameEXT;
 
+  // Queries the VK_EXT_memory_budget heap usage and budgets, nullptr if the
+  // physical device doesn't support the extension.
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR
+      GetPhysicalDeviceMemoryProperties2 = nullptr;
+
   std::vector<VkCommandPool> commandPools;  // One per queue.
   VkCommandPool commandPool;                // The default CommandPool.
   std::vector<const char*>* deviceExtensions;
 
   // shader module
   VkShaderModule computeShaderModule;
-  VkDescriptorSetLayout descriptorSetLayout;
+  VkDescriptorSetLayout descriptorSetLayout = VK_NULL_HANDLE;
 
   // pipeline
-  VkPipelineLayout pipelineLayout;
+  VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
   VkPipeline pipeline;
 
+  // Pipeline cache persisted to pipelineCachePath, which is empty if the
+  // cache is not persisted. pipelineCacheSize is the size of the data last
+  // loaded or saved.
+  VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+  std::string pipelineCachePath;
+  size_t pipelineCacheSize = 0;
+
   // descriptor sets
   VkDescriptorPool descriptorPool;
   VkDescriptorSet descriptorSet;
@@ -90,18 +182,75 @@ struct VulkanDevice {
   VkDeviceMemory bufferMemory;
 
   int numBuffers = 2;
-  int numBufferEntries = 256;
-  int bufferSize = sizeof(float) * numBufferEntries;
-  int memorySize = 2 * bufferSize;
+  // Workgroup size of the compute shaders (--workgroup_size), set with
+  // specialization constants, and workgroup count of the dispatches that hang
+  // or fault (--dispatch).
+  uint32_t workgroupSize[3] = {4, 1, 1};
+  uint32_t dispatchSize[3] = {1, 1, 1};
+
+  // Size of each buffer, set with --buffer_size, in whole workgroups.
+  VkDeviceSize numBufferEntries = 256;
+  VkDeviceSize bufferSize = sizeof(float) * numBufferEntries;
+  VkDeviceSize memorySize = 2 * bufferSize;
+  // Offset of bufferOut in bufferMemory.
+  VkDeviceSize bufferOutOffset = bufferSize;
+  // bufferMemory can be mapped, device local memory is only when the whole
+  // VRAM is host visible (resizable BAR).
+  bool bufferMemoryHostVisible = true;
+
+  // Loop count of infinite_loop.comp, written to bufferIn by
+  // BufferInitialization::_64K. See CalibrateLoopCount.
+  uint32_t loopCount = kMaxLoopCount;
+
+  // Identifies the physical device and its driver in the names of the cache
+  // files.
+  std::string cacheKey;
+};
+
+// Identification of a physical device, used to select it with --device.
+struct PhysicalDeviceInfo {
+  uint32_t index;  // Index in vkEnumeratePhysicalDevices.
+  VkPhysicalDevice physicalDevice;
+  VkPhysicalDeviceProperties properties;
+
+  bool hasDeviceUUID = false;
+  uint8_t deviceUUID[VK_UUID_SIZE] = {};
+
+  bool hasPciBusInfo = false;
+  uint32_t pciDomain = 0;
+  uint32_t pciBus = 0;
+  uint32_t pciDevice = 0;
+  uint32_t pciFunction = 0;
 };
 
 // This is a single physical device / multiple logical device Vulkan context.
 struct VulkanContext {
   VkInstance instance;
 
+  // Set by InitVulkanInstance when VK_KHR_get_physical_device_properties2 is
+  // available, nullptr otherwise.
+  PFN_vkGetPhysicalDeviceProperties2KHR GetPhysicalDeviceProperties2 = nullptr;
+  // VkPhysicalDeviceIDProperties can be queried.
+  bool deviceIDPropertiesSupported = false;
+  // Set by InitVulkanInstance along with GetPhysicalDeviceProperties2.
+  PFN_vkGetPhysicalDeviceMemoryProperties2KHR
+      GetPhysicalDeviceMemoryProperties2 = nullptr;
+  PFN_vkGetPhysicalDeviceFeatures2KHR GetPhysicalDeviceFeatures2 = nullptr;
+
   VkPhysicalDevice physicalDevice;
   std::mutex devices_lock;
-  std::vector<VulkanDevice> devices;
+  // The devices are heap allocated so their addresses don't change when
+  // devices are added or deleted.
+  std::vector<std::unique_ptr<VulkanDevice>> devices;
+
+  // Open addressing table of the devices, keyed by VkDevice. Written under
+  // devices_lock, read without locking by GetDevice. Deleted devices keep
+  // their handle with a null device.
+  struct DeviceSlot {
+    std::atomic<VkDevice> handle{VK_NULL_HANDLE};
+    std::atomic<VulkanDevice*> device{nullptr};
+  };
+  DeviceSlot device_table[kMaxDevices];
 
   uint32_t apiVersion = VK_API_VERSION_1_0;
   std::vector<const char*> instanceExtensions;
@@ -111,17 +260,75 @@ struct VulkanContext {
   // If the instance only has one logical device, return that logical device.
   VulkanDevice* GetSingleDevice();
 
-  // Returns the logical device with the given VkDevice handle.
+  // Returns the logical device with the given VkDevice handle. Doesn't lock,
+  // so it can be called concurrently from any number of device threads.
   VulkanDevice* GetDevice(VkDevice vk_device);
 };
 
+// Logs to stderr, with the time since the first log and the index of the
+// logging thread at the start of each line. Complete lines are queued without
+// locking and written by a background thread (see --sync_log).
 void LOG(const char* format, ...);
 
+// Writes the queued logs and stops the background thread, the logs are written
+// directly from then on. Called at exit and when the watchdog terminates the
+// test.
+void FlushLogs();
+
+// Escapes a string so it can be embedded in a JSON string literal.
+std::string JsonEscape(const std::string& s);
+
+// Formats nanoseconds as microseconds for a JSON report, null if negative.
+std::string FormatUs(int64_t ns);
+
 // Initialize a Vulkan context with no device.
 bool InitVulkanInstance(VulkanContext* context);
 
+// Returns the identification of every physical device of the instance.
+std::vector<PhysicalDeviceInfo> GetPhysicalDeviceInfos(VulkanContext* context);
+
+// Returns the physical device matching selector, which is either an index, a
+// device UUID (32 hex digits, dashes ignored) or a PCI address
+// ([domain:]bus:device.function). Returns nullptr if there is no such device.
+const PhysicalDeviceInfo* FindPhysicalDevice(
+    const std::vector<PhysicalDeviceInfo>& infos, const char* selector);
+
+// Parses a comma separated list of queue types (see --queue) for the device
+// selected with --device, or "all" for every queue of the family SelectQueue
+// picks for each queue type. Other families of the same type are left out, as
+// the device queues are only described by their type. Exits if the list can
+// not be parsed or if the device doesn't have that many queues.
+std::vector<QueueType> ParseQueueList(VulkanContext* context,
+                                      const char* spec);
+
+// Parses a size in bytes with an optional K, M or G suffix. Exits if the size
+// can not be parsed.
+VkDeviceSize ParseSize(const char* s);
+
+// Parses X[,Y,Z] dimensions, the missing ones are 1. Exits if the dimensions
+// can not be parsed.
+void ParseDimensions(const char* s, uint32_t dims[3]);
+
+// Formats dimensions as a JSON array.
+std::string DimensionsToJson(const uint32_t dims[3]);
+
+// Formats a UUID as 32 hex digits.
+std::string UUIDToString(const uint8_t uuid[VK_UUID_SIZE]);
+
+// Returns true if the physical device supports the given device extension.
+bool HasDeviceExtension(VkPhysicalDevice physical_device, const char* name);
+
+// Queries the VK_EXT_descriptor_indexing features of the physical device.
+// Returns false, with all the features unset, if the device lacks
+// VK_EXT_descriptor_indexing or VK_KHR_maintenance3, or if the instance lacks
+// VK_KHR_get_physical_device_properties2.
+bool GetDescriptorIndexingFeatures(
+    VulkanContext* context, VkPhysicalDevice physical_device,
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT* features);
+
 // Initialize a device for the given context, which should already have the
-// instance.
+// instance. The physical device is the one selected with --device, or the
+// first one.
 VkDevice InitVulkanDevice(VulkanContext* context,
                           std::vector<const char*>* device_extensions = nullptr,
                           const char* shader_module_path = nullptr,
@@ -129,6 +336,10 @@ VkDevice InitVulkanDevice(VulkanContext* context,
 
 void SetupWatchdogTimer(VulkanContext* context);
 
+// Stops the watchdog started by SetupWatchdogTimer. The next
+// SetupWatchdogTimer starts a new one, with the full time budget.
+void WaitForWatchdogThread();
+
 // Initialize a basic single device Vulkan context.
 bool InitVulkan(VulkanContext* context,
                 std::vector<const char*>* device_extensions = nullptr,
@@ -144,16 +355,224 @@ enum class BufferInitialization {
   Transfer,
 };
 
+// Creates bufferIn and bufferOut in a single allocation, bound to bufferMemory.
+// The memory is host visible, or device local with --device_local, in which
+// case the buffers are initialized through a staging buffer unless the memory
+// is also host visible.
 void AllocateInputOutputBuffers(VulkanDevice* device,
                                 BufferInitialization initialization);
 
 void CreateDescriptorSets(VulkanDevice* device);
 
-void BeginAndEndCommandBuffer(VkCommandBuffer command_buffer);
+// A range of a VkDeviceMemory block of a MemoryArena.
+struct MemoryAllocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  uint32_t memoryTypeIndex = 0;
+  void* mapped = nullptr;  // Pointer to offset if the memory is host visible.
+};
+
+// Sub-allocates memory from a few large VkDeviceMemory blocks, with one pool
+// of blocks per memory type. Host visible blocks are persistently mapped.
+// Allocations are never freed individually, only all together by
+// DestroyMemoryArena. The I/O buffers keep their own allocation, so that the
+// scenarios can free it to cause faults.
+struct MemoryArena {
+  struct Block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    VkDeviceSize used;
+    void* mapped;
+  };
+
+  VulkanDevice* device = nullptr;
+  VkDeviceSize blockSize = 0;
+  uint32_t blockCount = 0;
+  std::map<uint32_t, std::vector<Block>> pools;  // By memory type index.
+  std::mutex lock;
+};
+
+// 64MB blocks, larger allocations get a block of their own.
+constexpr VkDeviceSize kMemoryArenaBlockSizeDefault = 64ull << 20;
+
+void InitMemoryArena(MemoryArena* arena, VulkanDevice* device,
+                     VkDeviceSize block_size = kMemoryArenaBlockSizeDefault);
+
+// Allocates memory matching requirements, from a memory type with the given
+// properties.
+VkResult ArenaAllocate(MemoryArena* arena,
+                       const VkMemoryRequirements& requirements,
+                       int memory_properties, MemoryAllocation* allocation);
+
+// Creates a buffer and binds it to memory allocated from the arena.
+VkResult ArenaCreateBuffer(MemoryArena* arena,
+                           const VkBufferCreateInfo& create_info,
+                           int memory_properties, VkBuffer* buffer,
+                           MemoryAllocation* allocation = nullptr);
+
+// Frees all the memory of the arena. The buffers bound to it must have been
+// destroyed.
+void DestroyMemoryArena(MemoryArena* arena);
+
+// Ring of VK_AMD_buffer_marker values in persistently mapped memory, polled
+// live by a host thread to measure how fast the markers land and how soon the
+// host sees them. Marker i (from 1) is written to entry (i - 1) % size, with a
+// GPU timestamp next to it when the queue supports them.
+struct MarkerRing {
+  VulkanDevice* device = nullptr;
+  VkBuffer buffer = VK_NULL_HANDLE;
+  volatile uint32_t* markers = nullptr;
+  uint32_t size = 0;
+  uint32_t recorded = 0;  // Markers recorded so far.
+  VkQueryPool queryPool = VK_NULL_HANDLE;
+
+  std::thread poller;
+  std::atomic<bool> stopPolling{false};
+  // Host time at which each marker was first seen by the poller.
+  std::vector<int64_t> seenNs;
+};
+
+// Creates a ring of size markers, with memory from arena.
+VkResult CreateMarkerRing(MemoryArena* arena, uint32_t size, MarkerRing* ring);
+
+// Records count markers at the given stage, calling between before each of
+// them (e.g. to record a dispatch), at most ring->size markers per command
+// buffer.
+void CmdWriteRingMarkers(VkCommandBuffer command_buffer, MarkerRing* ring,
+                         uint32_t count, VkPipelineStageFlagBits stage,
+                         std::function<void(VkCommandBuffer)> between);
+
+// Starts the host thread polling the ring. It stops when all the recorded
+// markers were seen, when none landed for --marker_ring_stall_ms, or with
+// StopMarkerRingPoller, and then adds its statistics to the run report.
+void StartMarkerRingPoller(MarkerRing* ring);
+void StopMarkerRingPoller(MarkerRing* ring);
+
+// Stops the poller and destroys the buffer and query pool of the ring. Its
+// memory is freed with the arena.
+void DestroyMarkerRing(MarkerRing* ring);
+
+// Pacing of RunFrameLoop.
+struct FrameLoopOptions {
+  uint32_t frames = 600;
+  uint32_t framesInFlight = 2;
+  // The frame whose work faults, none if it is not below frames.
+  uint32_t faultFrame = 300;
+  // 60 fps by default, as kTimePerFrame of ggp_common.h. 0 doesn't pace.
+  uint64_t frameTimeUs = 16666;
+};
+
+// Submits frames to the default queue like a renderer: each frame has its own
+// command pool, command buffer and fence, reused framesInFlight frames later,
+// and waits on the timeline value signaled by the previous frame.
+// record_frame(command_buffer, frame, fault) records the work of a frame, the
+// one of faultFrame with fault set. After the fault, only the frames already in
+// flight are submitted. Adds the CPU record and submit time of the frames and
+// the frame time jitter to the run report as frame_loop. Without a fault, waits
+// for the last frames and destroys the pools, fences and semaphore. The device
+// needs VK_KHR_timeline_semaphore. Returns the first error.
+VkResult RunFrameLoop(VulkanDevice* device, const FrameLoopOptions& options,
+                      std::function<void(VkCommandBuffer, uint32_t, bool)>
+                          record_frame);
+
+// With --trace=file, the calls made through the dispatch table of the first
+// device (see DeviceDispatchTable) are written to a binary trace, along with
+// the objects they use: the SPIR-V and workgroup size of the pipelines, the
+// initial content of the I/O buffers, the bindings of the descriptor sets.
+// hcf_replay issues them again on a new device.
+//
+// The trace is a TraceHeader followed by records, each a TraceRecord and its
+// operands as native-endian 64-bit words, so that a mapped trace can be read
+// in place. Handles are written as 64-bit ids, as they were when recorded.
+// Byte strings are written as their size followed by the bytes, padded to a
+// word. An object record comes before the first call using the object.
+constexpr uint32_t kTraceMagic = 0x54464348;  // "HCFT"
+constexpr uint32_t kTraceVersion = 1;
+
+struct TraceHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct TraceRecord {
+  uint32_t op;     // A TraceOp.
+  uint32_t words;  // Number of operands following the record.
+};
+
+// Operands of each record. Queues are indices into the queues of the device.
+// Barriers are (src access, dst access) for memory barriers, and (src access,
+// dst access, src family, dst family, buffer, offset, size) for buffer
+// barriers.
+enum class TraceOp : uint32_t {
+  // Objects.
+  Device = 1,     // queue count, QueueType of each, extension count, names.
+  Buffer,         // buffer, size, usage, contents (empty if unknown).
+  Pipeline,       // pipeline, workgroup size x, y, z, SPIR-V.
+  DescriptorSet,  // set, (buffer, offset, range) of bindings 0 and 1.
+  Semaphore,      // semaphore, VkSemaphoreTypeKHR, initial value.
+  Event,          // event.
+  Fence,          // fence.
+  CommandPool,    // pool, queue family index.
+  // Calls.
+  AllocateCommandBuffers,  // pool, level, count, command buffers.
+  ResetCommandPool,        // pool, flags.
+  BeginCommandBuffer,      // command buffer, flags.
+  EndCommandBuffer,        // command buffer.
+  CmdBindPipeline,         // command buffer, bind point, pipeline.
+  CmdBindDescriptorSets,   // command buffer, bind point, first set, count,
+                           // sets, dynamic offset count, offsets.
+  CmdDispatch,             // command buffer, x, y, z.
+  CmdCopyBuffer,           // command buffer, src, dst, count,
+                           // (src offset, dst offset, size) of each region.
+  CmdFillBuffer,           // command buffer, buffer, offset, size, data.
+  CmdPipelineBarrier,      // command buffer, src stages, dst stages,
+                           // dependency flags, memory barrier count,
+                           // barriers, buffer barrier count, barriers.
+  CmdSetEvent,             // command buffer, event, stages.
+  CmdResetEvent,           // command buffer, event, stages.
+  CmdWaitEvents,           // command buffer, event count, events, src stages,
+                           // dst stages, memory barrier count, barriers,
+                           // buffer barrier count, barriers.
+  CmdExecuteCommands,      // command buffer, count, command buffers.
+  CmdWriteBufferMarker,    // command buffer, stage, buffer, offset, marker.
+  QueueSubmit,  // queue, fence, submit count, then for each submit: wait
+                // count, (semaphore, stages, value) of each, command buffer
+                // count, command buffers, signal count, (semaphore, value)
+                // of each. Values are 0 without timeline semaphores.
+  QueueWaitIdle,   // queue.
+  WaitForFences,   // count, fences, wait all, timeout.
+  ResetFences,     // count, fences.
+  // A call or object that can't be replayed, the trace is rejected.
+  Unsupported,  // description.
+};
+
+void BeginAndEndCommandBuffer(VulkanDevice* device,
+                              VkCommandBuffer command_buffer);
 
 void WaitOnEventThatNeverSignals(VulkanDevice* device,
                                  VkCommandBuffer command_buffer);
 
+// Writes a VK_AMD_buffer_marker marker, with vkCmdWriteBufferMarker2AMD in
+// --sync2 mode.
+void CmdWriteBufferMarker(VulkanDevice* device, VkCommandBuffer command_buffer,
+                          VkPipelineStageFlagBits stage, VkBuffer buffer,
+                          VkDeviceSize offset, uint32_t marker);
+
+// Records a global memory barrier, with vkCmdPipelineBarrier2KHR in --sync2
+// mode.
+void CmdMemoryBarrier(VulkanDevice* device, VkCommandBuffer command_buffer,
+                      VkPipelineStageFlags src_stages, VkAccessFlags src_access,
+                      VkPipelineStageFlags dst_stages,
+                      VkAccessFlags dst_access);
+
+// Records a dispatch of the --dispatch workgroups, for the dispatches that
+// hang or fault.
+void CmdDispatchFault(VulkanDevice* device, VkCommandBuffer command_buffer);
+
+// Returns the number of invocations in a workgroup of --workgroup_size.
+uint32_t WorkgroupInvocations(const VulkanDevice* device);
+
 VkSubmitInfo CreateSubmitInfo(
     const VkCommandBuffer* command_buffer,
     std::vector<VkSemaphore>* wait_semaphores = nullptr,
@@ -178,15 +597,111 @@ VkBindSparseInfo CreateBindSparseInfo(
     std::vector<VkSemaphore>* wait_semaphores,
     std::vector<VkSemaphore>* signal_semaphores, void* pnext);
 
+// Same as vkQueueSubmit, but timestamps the submission for the run report.
+// In --sync2 mode, the submissions and their timeline semaphore values are
+// translated to vkQueueSubmit2KHR.
+VkResult QueueSubmit(VulkanDevice* device, VkQueue queue, uint32_t submit_count,
+                     const VkSubmitInfo* submits, VkFence fence);
+
+// With --stress_fault_at=K, submits K empty command buffers to queue, once per
+// process. The scenarios call it right before the submission that triggers
+// the fault.
+void RunStressSubmits(VulkanDevice* device, VkQueue queue);
+
+// Same as vkQueueBindSparse, but timestamps the submission for the run report.
+VkResult QueueBindSparse(VulkanDevice* device, VkQueue queue,
+                         uint32_t bind_info_count,
+                         const VkBindSparseInfo* bind_infos, VkFence fence);
+
+// Phases of a hang/crash run. The time of each phase is reported in
+// microseconds since the start of RunWithCrashCheck.
+enum class RunPhase {
+  Submit,          // Last submission before the device was lost.
+  WaitIdleReturn,  // vkQueueWaitIdle returned in RunWithCrashCheck.
+  EmptySubmit,     // The empty command buffer of RunWithCrashCheck submitted.
+  DeviceLost,      // First VK_ERROR_DEVICE_LOST returned by any call.
+  FenceReturn,     // vkWaitForFences returned in RunWithCrashCheck.
+  Count,
+};
+
+// Records the current time for phase. Only the first occurrence of a phase is
+// kept, except for RunPhase::Submit which keeps the last one.
+void RecordRunPhase(RunPhase phase);
+
+// Called by the VK_* result macros with every unsuccessful VkResult.
+void OnVulkanError(VkResult result);
+
+// Sets a top level entry of the run report. json_value must be valid JSON.
+void SetRunReportValue(const std::string& key, const std::string& json_value);
+
+// Adds the VK_EXT_memory_budget usage and budget of each heap of the device
+// of the run report to the report, under memory_budget.point. Only the first
+// sample of a point is kept. Does nothing without VK_EXT_memory_budget.
+// RunWithCrashCheck samples "start", "submitted" and "fault".
+void SampleMemoryBudget(const char* point);
+
+// With --load_queues, starts a thread per load queue of the device keeping it
+// busy with dispatches and copies, and lets them run for --load_warmup_ms.
+// RunWithCrashCheck starts it before the scenario.
+void StartBackgroundLoad(VulkanDevice* device);
+
+// Stops the load threads and adds the throughput of each load queue, before
+// and after the last submission of the scenario, to the run report as
+// background_load.
+void StopBackgroundLoad();
+
+// Writes the run report as JSON to --latency_json, or to the log if the flag
+// is not set. Does nothing if the report did not change since the last write.
+// Also called at exit, so the report is emitted by tests ending in exit(0).
+void WriteRunReport();
+
 // Destroys the device object with the given VkHandle
 void DeleteVulkanDevice(VulkanContext* context, VkDevice vk_device);
 
 // Destroys the device and the instance of the given context.
 void CleanupVulkan(VulkanContext* context);
 
-// Load a SPIRV file and create a new VkShaderModule.
+// SPIR-V of a shader compiled by the add_shader CMake function.
+struct EmbeddedShader {
+  const char* name;  // File name of the SPIR-V, e.g. "read_write.comp.spv".
+  const uint32_t* code;
+  size_t size;  // In bytes.
+};
+
+// Returns the shader embedded into the binary with the given file name, or
+// nullptr if there is none.
+const EmbeddedShader* FindEmbeddedShader(const char* name);
+
+// Create a new VkShaderModule from the SPIRV file in --shader_dir if the flag
+// is set, else from the embedded shader with that name, else from the file.
+// Logs which of them is loaded.
 bool LoadShader(VkDevice device, const char* filename, VkShaderModule& shader);
 
+// Creates a VkShaderModule from raw SPIR-V of codeSize bytes.
+bool CreateShader(VkDevice device, const uint32_t* code, size_t codeSize,
+                  VkShaderModule& shader);
+
+// Creates device->pipelineCache, with the content of the cache file of the
+// physical device in --pipeline_cache_dir if it is valid for the device. Also
+// sets device->cacheKey.
+void CreatePipelineCache(VulkanDevice* device, const PhysicalDeviceInfo& info);
+
+// Writes device->pipelineCache to its cache file if it changed.
+void SavePipelineCache(VulkanDevice* device);
+
+// Creates a compute pipeline running the "main" entry point of shader_module
+// using the pipeline cache of the device, and saves the cache.
+VkResult CreateComputePipeline(VulkanDevice* device,
+                               VkShaderModule shader_module,
+                               VkPipelineLayout layout, VkPipeline* pipeline);
+
+// With --hang_target_ms (or --tdr_ms), sets device->loopCount so that a
+// dispatch of infinite_loop.comp runs for that long. The cost of the loop is
+// measured with timestamps on the first run, and cached per device and driver
+// in --pipeline_cache_dir. Must be called before AllocateInputOutputBuffers.
+// Returns the loop count.
+uint32_t CalibrateLoopCount(VulkanDevice* device);
+
 // Returns the memory type index based on the type and properties
 // requested.  Return -1 if no appropriate type found.
 uint32_t FindMemoryType(VkPhysicalDevice physical_device,
@@ -210,6 +725,7 @@ uint32_t FindMemoryType(VkPhysicalDevice physical_device,
   {                                                                   \
     VkResult res = (f);                                               \
     if (res != VK_SUCCESS) {                                          \
+      OnVulkanError(res);                                             \
       LOG("Fatal : VkResult is %d in %s at line %d\n", res, __FILE__, \
           __LINE__);                                                  \
       assert(res == VK_SUCCESS);                                      \
@@ -223,6 +739,7 @@ uint32_t FindMemoryType(VkPhysicalDevice physical_device,
   {                                                                   \
     VkResult res = (f);                                               \
     if (res != VK_SUCCESS) {                                          \
+      OnVulkanError(res);                                             \
       LOG("Fatal : VkResult is %d in %s at line %d\n", res, __FILE__, \
           __LINE__);                                                  \
       exit(0);                                                        \
@@ -235,6 +752,7 @@ uint32_t FindMemoryType(VkPhysicalDevice physical_device,
   {                                                                     \
     VkResult res = (f);                                                 \
     if (res != VK_SUCCESS) {                                            \
+      OnVulkanError(res);                                               \
       LOG("Warning : VkResult is %d in %s at line %d\n", res, __FILE__, \
           __LINE__);                                                    \
       return res;                                                       \
@@ -244,6 +762,9 @@ uint32_t FindMemoryType(VkPhysicalDevice physical_device,
 void DefineFlag(const char* name, const char* help);
 void InitFlags(int argc, char** argv);
 const char* GetFlag(const char*);
+// Returns the value of an unsigned integer flag, or default_value if the flag
+// is not set.
+uint64_t GetFlagUint(const char* name, uint64_t default_value);
 
 VkResult RunWithCrashCheck(VulkanContext& ctx,
                            std::function<void(VulkanContext&)> f);
@@ -253,7 +774,6 @@ VkResult CreateAndRecordCommandBuffers(VulkanDevice* device,
                                        VkCommandBuffer* secondary,
                                        std::function<void(VkCommandBuffer)> f,
                                        const char* debug_name = nullptr,
-
                                        VkCommandPool pool = VK_NULL_HANDLE);
 
 inline VkResult CreateAndRecordCommandBuffers(
@@ -262,6 +782,31 @@ inline VkResult CreateAndRecordCommandBuffers(
   return CreateAndRecordCommandBuffers(device, primary, nullptr, f);
 }
 
+// Records secondary_count secondary command buffers with f, called with the
+// command buffer and its index, on thread_count threads with a command pool
+// each. Then records primary to execute all of them. f runs concurrently on
+// the threads, once per secondary command buffer, so it must only record into
+// the command buffer it is given and not change shared state without a lock.
+VkResult RecordSecondaryCommandBuffers(
+    VulkanDevice* device, VkCommandBuffer primary, uint32_t secondary_count,
+    uint32_t thread_count, std::function<void(VkCommandBuffer, uint32_t)> f,
+    const char* debug_name = nullptr, VkCommandPool pool = VK_NULL_HANDLE,
+    std::vector<VkCommandBuffer>* secondaries = nullptr);
+
+// With --timestamps, records f into command_buffer between two GPU timestamps
+// and reports their difference as the GPU time of label with
+// ReportTimestamps. Only records f otherwise, or if the queue family can not
+// write timestamps.
+void RecordWithTimestamps(VulkanDevice* device, VkCommandBuffer command_buffer,
+                          uint32_t queue_family_index, const char* label,
+                          std::function<void(VkCommandBuffer)> f);
+
+// Adds the GPU timestamps recorded so far for the device to the run report
+// under key, without waiting on the ones that are not available yet. Called
+// by RunWithCrashCheck.
+void ReportTimestamps(VulkanDevice* device,
+                      const std::string& key = "gpu_timestamps");
+
 void SetObjectDebugName(VulkanDevice* device, uint64_t handle,
                         VkObjectType object_type, const char* name);
 
@@ -0,0 +1,312 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "common.h"
+
+void TestVulkan(VulkanContext& context) {
+  auto device = context.GetSingleDevice();
+  auto vk_device = device->device;
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  const auto& limits = properties.limits;
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(device->physicalDevice, &features);
+  if (!features.shaderStorageBufferArrayDynamicIndexing) {
+    LOG("shaderStorageBufferArrayDynamicIndexing is not supported, "
+        "skipping.\n");
+    return;
+  }
+
+  // The arrays are update after bind when supported, which lifts their size
+  // to the much larger update after bind limits.
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features;
+  GetDescriptorIndexingFeatures(&context, device->physicalDevice,
+                                &indexing_features);
+  const bool update_after_bind =
+      indexing_features.descriptorBindingStorageBufferUpdateAfterBind &&
+      context.GetPhysicalDeviceProperties2 != nullptr;
+  uint32_t max_per_stage = std::min(limits.maxPerStageDescriptorStorageBuffers,
+                                    limits.maxDescriptorSetStorageBuffers);
+  uint32_t max_in_pools = UINT32_MAX;
+  if (update_after_bind) {
+    VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexing_properties = {};
+    indexing_properties.sType =
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+    VkPhysicalDeviceProperties2KHR properties2 = {};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2_KHR;
+    properties2.pNext = &indexing_properties;
+    context.GetPhysicalDeviceProperties2(device->physicalDevice, &properties2);
+    max_per_stage = std::min(
+        indexing_properties.maxPerStageDescriptorUpdateAfterBindStorageBuffers,
+        indexing_properties.maxDescriptorSetUpdateAfterBindStorageBuffers);
+    max_in_pools = indexing_properties.maxUpdateAfterBindDescriptorsInAllPools;
+  }
+
+  // Three arrays of per_set storage buffers are bound per dispatch, next to
+  // the output buffer.
+  uint32_t per_set = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--descriptors_per_set", 64), 1));
+  per_set = std::min(per_set, max_per_stage > 0 ? (max_per_stage - 1) / 3 : 0);
+  per_set = std::min(per_set, limits.maxComputeWorkGroupCount[0]);
+  // Whole dispatches of three sets.
+  const uint32_t set_count =
+      3 * static_cast<uint32_t>(std::max<uint64_t>(
+              GetFlagUint("--descriptor_sets", 3072) / 3, 1));
+  per_set = static_cast<uint32_t>(
+      std::min<uint64_t>(per_set, (max_in_pools - 1) / set_count));
+  const uint64_t descriptor_count = uint64_t(set_count) * per_set;
+  if (per_set == 0 || limits.maxBoundDescriptorSets < 4) {
+    LOG("Not enough storage buffer descriptors per stage, skipping.\n");
+    return;
+  }
+  LOG("%u descriptor sets of %u storage buffers (%llu descriptors%s)\n",
+      set_count, per_set, static_cast<unsigned long long>(descriptor_count),
+      update_after_bind ? ", update after bind" : "");
+
+  auto build_start = std::chrono::steady_clock::now();
+
+  // TEST - Every descriptor points to its own 256 bytes slice of a buffer
+  // whose memory is freed before the submission.
+  const VkDeviceSize slice = std::max<VkDeviceSize>(
+      256, limits.minStorageBufferOffsetAlignment);
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = descriptor_count * slice;
+  bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VkBuffer input_buffer;
+  VK_CHECK_RESULT(
+      vkCreateBuffer(vk_device, &bufferCreateInfo, nullptr, &input_buffer));
+  SetObjectDebugName(device, input_buffer, VK_OBJECT_TYPE_BUFFER,
+                     "Bindless Input Buffer");
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(vk_device, input_buffer, &requirements);
+  VkMemoryAllocateInfo allocateInfo = {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.allocationSize = requirements.size;
+  allocateInfo.memoryTypeIndex =
+      FindMemoryType(device->physicalDevice, requirements.memoryTypeBits,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  if (allocateInfo.memoryTypeIndex == static_cast<uint32_t>(-1)) {
+    LOG("No device local memory type for the input buffer, skipping.\n");
+    vkDestroyBuffer(vk_device, input_buffer, nullptr);
+    return;
+  }
+  VkDeviceMemory input_memory;
+  VK_CHECK_RESULT(
+      vkAllocateMemory(vk_device, &allocateInfo, nullptr, &input_memory));
+  VK_CHECK_RESULT(vkBindBufferMemory(vk_device, input_buffer, input_memory, 0));
+
+  MemoryArena arena;
+  InitMemoryArena(&arena, device, 1 << 16);
+  bufferCreateInfo.size = 64 * sizeof(uint32_t);
+  VkBuffer output_buffer;
+  VK_CHECK_RESULT(ArenaCreateBuffer(&arena, bufferCreateInfo,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                    &output_buffer));
+  SetObjectDebugName(device, output_buffer, VK_OBJECT_TYPE_BUFFER,
+                     "Bindless Output Buffer");
+
+  // Set 0 has the output buffer, sets 1 to 3 an array of input buffers each.
+  VkDescriptorSetLayoutBinding binding = {};
+  binding.binding = 0;
+  binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  binding.descriptorCount = 1;
+  binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = 1;
+  layoutInfo.pBindings = &binding;
+  VkDescriptorSetLayout output_layout, array_layout;
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(vk_device, &layoutInfo, nullptr,
+                                              &output_layout));
+  binding.descriptorCount = per_set;
+  VkDescriptorBindingFlagsEXT binding_flags =
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT;
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo = {};
+  bindingFlagsInfo.sType =
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+  bindingFlagsInfo.bindingCount = 1;
+  bindingFlagsInfo.pBindingFlags = &binding_flags;
+  if (update_after_bind) {
+    layoutInfo.flags =
+        VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+    layoutInfo.pNext = &bindingFlagsInfo;
+  }
+  VK_CHECK_RESULT(vkCreateDescriptorSetLayout(vk_device, &layoutInfo, nullptr,
+                                              &array_layout));
+
+  VkDescriptorSetLayout set_layouts[] = {output_layout, array_layout,
+                                         array_layout, array_layout};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = 4;
+  pipelineLayoutInfo.pSetLayouts = set_layouts;
+  VkPipelineLayout pipeline_layout;
+  VK_CHECK_RESULT(vkCreatePipelineLayout(vk_device, &pipelineLayoutInfo,
+                                         nullptr, &pipeline_layout));
+  VkShaderModule shader_module;
+  if (!LoadShader(vk_device, "bindless.comp.spv", shader_module)) {
+    LOG("Unable to load bindless.comp.spv\n");
+    return;
+  }
+  VkPipeline pipeline;
+  VK_CHECK_RESULT(
+      CreateComputePipeline(device, shader_module, pipeline_layout, &pipeline));
+  SetObjectDebugName(device, pipeline, VK_OBJECT_TYPE_PIPELINE,
+                     "Bindless ComputePipeline");
+
+  VkDescriptorPoolSize pool_size = {
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      static_cast<uint32_t>(descriptor_count + 1)};
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  if (update_after_bind) {
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+  }
+  poolInfo.maxSets = set_count + 1;
+  poolInfo.poolSizeCount = 1;
+  poolInfo.pPoolSizes = &pool_size;
+  VkDescriptorPool descriptor_pool;
+  VK_CHECK_RESULT(vkCreateDescriptorPool(vk_device, &poolInfo, nullptr,
+                                         &descriptor_pool));
+
+  std::vector<VkDescriptorSetLayout> layouts(set_count + 1, array_layout);
+  layouts[0] = output_layout;
+  VkDescriptorSetAllocateInfo setInfo = {};
+  setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  setInfo.descriptorPool = descriptor_pool;
+  setInfo.descriptorSetCount = set_count + 1;
+  setInfo.pSetLayouts = layouts.data();
+  std::vector<VkDescriptorSet> sets(set_count + 1);
+  VK_CHECK_RESULT(vkAllocateDescriptorSets(vk_device, &setInfo, sets.data()));
+
+  std::vector<VkDescriptorBufferInfo> buffer_infos(descriptor_count + 1);
+  std::vector<VkWriteDescriptorSet> writes(set_count + 1);
+  buffer_infos[0] = {output_buffer, 0, VK_WHOLE_SIZE};
+  for (uint64_t i = 0; i < descriptor_count; i++) {
+    buffer_infos[i + 1] = {input_buffer, i * slice, slice};
+  }
+  for (uint32_t i = 0; i <= set_count; i++) {
+    writes[i] = {};
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = sets[i];
+    writes[i].dstBinding = 0;
+    writes[i].descriptorCount = i == 0 ? 1 : per_set;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pBufferInfo = &buffer_infos[i == 0 ? 0 : 1 + (i - 1) * per_set];
+  }
+  vkUpdateDescriptorSets(vk_device, set_count + 1, writes.data(), 0, nullptr);
+  auto build_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - build_start)
+                      .count();
+
+  // One dispatch per three array sets, so that every set gets bound.
+  auto record_start = std::chrono::steady_clock::now();
+  VkCommandBuffer primary_cb, secondary_cb;
+  VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
+      device, &primary_cb, &secondary_cb,
+      [&](VkCommandBuffer cb) {
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   pipeline);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         pipeline_layout, 0, 1, &sets[0], 0,
+                                         nullptr);
+        for (uint32_t i = 1; i <= set_count; i += 3) {
+          device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                           pipeline_layout, 1, 3, &sets[i], 0,
+                                           nullptr);
+          device->vk.CmdDispatch(cb, per_set, 1, 1);
+        }
+      },
+      "Bindless Dispatches"));
+  auto record_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - record_start)
+                       .count();
+
+  char json[256];
+  snprintf(json, sizeof(json),
+           "{\"sets\": %u, \"descriptors_per_set\": %u, \"descriptors\": "
+           "%llu, \"dispatches\": %u, \"build_ms\": %.3f, \"record_ms\": "
+           "%.3f}",
+           set_count, per_set,
+           static_cast<unsigned long long>(descriptor_count), set_count / 3,
+           build_ms, record_ms);
+  SetRunReportValue("descriptors", json);
+  LOG("Built the descriptor sets in %.1f ms, recorded %u dispatches in %.1f "
+      "ms\n",
+      build_ms, set_count / 3, record_ms);
+
+  // Destroy the input buffer AND free the memory backing it.
+  vkDestroyBuffer(vk_device, input_buffer, nullptr);
+  vkFreeMemory(vk_device, input_memory, nullptr);
+
+  RunStressSubmits(device, device->queue);
+  VkSubmitInfo submit_info = CreateSubmitInfo(&primary_cb);
+  LOG("Submit 1...\n");
+  VK_VALIDATE_RESULT(
+      QueueSubmit(device, device->queue, 1, &submit_info, VK_NULL_HANDLE));
+
+  LOG("Wait for idle...\n");
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
+
+  LOG("Done.\n");
+}
+
+// Run our test.
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--descriptor_sets",
+             "Number of descriptor sets of storage buffer arrays, bound three "
+             "per dispatch.");
+  DefineFlag("--descriptors_per_set",
+             "Number of storage buffers of each descriptor set array.");
+  InitFlags(argc, argv);
+
+  VulkanContext context;
+  if (!InitVulkanInstance(&context)) {
+    return 1;
+  }
+  // bindless.comp indexes runtime sized arrays.
+  auto infos = GetPhysicalDeviceInfos(&context);
+  auto info = FindPhysicalDevice(infos, GetFlag("--device"));
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features;
+  if (info != nullptr &&
+      (!GetDescriptorIndexingFeatures(&context, info->physicalDevice,
+                                      &indexing_features) ||
+       !indexing_features.runtimeDescriptorArray)) {
+    LOG("VK_EXT_descriptor_indexing with runtimeDescriptorArray is not "
+        "supported, skipping.\n");
+    CleanupVulkan(&context);
+    Finalize();
+    return 0;
+  }
+  std::vector<const char*> device_extensions;
+  device_extensions.push_back("VK_EXT_descriptor_indexing");
+  device_extensions.push_back("VK_KHR_maintenance3");
+  if (InitVulkanDevice(&context, &device_extensions, "read_write.comp.spv") ==
+      VK_NULL_HANDLE) {
+    return 1;
+  }
+  SetupWatchdogTimer(&context);
+
+  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+
+  Finalize();
+  return 0;
+}
@@ -22,16 +22,22 @@ void TestVulkan(VulkanContext& context) {
 
   AllocateInputOutputBuffers(device, BufferInitialization::Transfer);
 
+  // A single float, or the whole buffer when it is sized with --buffer_size.
+  VkDeviceSize copy_size = GetFlag("--buffer_size") != nullptr
+                               ? device->bufferSize
+                               : sizeof(float);
+
   VkCommandBuffer primary_cb, secondary_cb;
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
-      [device](VkCommandBuffer cb) {
+      [device, copy_size](VkCommandBuffer cb) {
         VkBufferCopy regions = {};
         regions.srcOffset = 0;
         regions.dstOffset = 0;
-        regions.size = 4;
+        regions.size = copy_size;
 
-        vkCmdCopyBuffer(cb, device->bufferIn, device->bufferOut, 1, &regions);
+        device->vk.CmdCopyBuffer(cb, device->bufferIn, device->bufferOut, 1,
+                                 &regions);
       },
       "Copy"));
 
@@ -47,9 +53,10 @@ void TestVulkan(VulkanContext& context) {
   // to detect if we continue executing
   VkSubmitInfo submit_info = CreateSubmitInfo(&primary_cb);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submit_info, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submit_info, VK_NULL_HANDLE));
 }
 
 // Run our test.
@@ -23,17 +23,34 @@ void TestVulkan(VulkanContext& context) {
   AllocateInputOutputBuffers(device, BufferInitialization::_64K);
   CreateDescriptorSets(device);
 
+  // The --dispatch workgroups. With --buffer_size, enough of them to write
+  // the whole output buffer (one float per invocation), as far as the shader
+  // can see it.
+  uint32_t group_count = device->dispatchSize[0];
+  if (GetFlag("--buffer_size") != nullptr) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+    VkDeviceSize range = std::min<VkDeviceSize>(
+        device->bufferSize, properties.limits.maxStorageBufferRange);
+    VkDeviceSize group_size = sizeof(float) * WorkgroupInvocations(device);
+    group_count = static_cast<uint32_t>(std::min<VkDeviceSize>(
+        std::max<VkDeviceSize>(range / group_size, device->dispatchSize[0]),
+        properties.limits.maxComputeWorkGroupCount[0]));
+  }
+
   VkCommandBuffer primary_cb, secondary_cb;
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
-      [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+      [device, group_count](VkCommandBuffer cb) {
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, group_count, device->dispatchSize[1],
+                               device->dispatchSize[2]);
       },
       "Dispatch"));
 
@@ -48,15 +65,16 @@ void TestVulkan(VulkanContext& context) {
   vkDestroyBuffer(vk_device, device->bufferOut, nullptr);
   vkFreeMemory(vk_device, device->bufferMemory, nullptr);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
   // NOTE: this should timeout/hang
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submit_info, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submit_info, VK_NULL_HANDLE));
 
   // NOTE: vkQueueWaitIdle will return VK_SUCCESS when this hang is detected
   // instead of returning VK_ERROR_DEVICE_LOST as expected
   LOG("Wait for idle...\n");
-  VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 
   LOG("Done.\n");
 }
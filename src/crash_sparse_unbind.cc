@@ -0,0 +1,332 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <random>
+
+#include "common.h"
+
+// Binds or unbinds (allocation memory of VK_NULL_HANDLE) the given pages of
+// the sparse buffer, at most pages_per_bind pages per vkQueueBindSparse call,
+// and waits for each call with fence. Returns the number of calls.
+uint32_t BindPages(VulkanDevice* device, VkBuffer buffer,
+                   VkDeviceSize page_size, const std::vector<uint32_t>& pages,
+                   const std::vector<MemoryAllocation>& allocations,
+                   uint32_t pages_per_bind, VkFence fence) {
+  uint32_t calls = 0;
+  for (size_t first = 0; first < pages.size(); first += pages_per_bind) {
+    size_t count = std::min<size_t>(pages_per_bind, pages.size() - first);
+    std::vector<VkSparseMemoryBind> binds(count);
+    for (size_t i = 0; i < count; i++) {
+      binds[i] = {};
+      binds[i].resourceOffset = pages[first + i] * page_size;
+      binds[i].size = page_size;
+      binds[i].memory = allocations[first + i].memory;
+      binds[i].memoryOffset = allocations[first + i].offset;
+    }
+    VkSparseBufferMemoryBindInfo buffer_bind = {};
+    buffer_bind.buffer = buffer;
+    buffer_bind.bindCount = static_cast<uint32_t>(count);
+    buffer_bind.pBinds = binds.data();
+
+    VkBindSparseInfo bind_info =
+        CreateBindSparseInfo(nullptr, nullptr, nullptr);
+    bind_info.bufferBindCount = 1;
+    bind_info.pBufferBinds = &buffer_bind;
+    VK_VALIDATE_RESULT(
+        QueueBindSparse(device, device->queue, 1, &bind_info, fence));
+    VK_VALIDATE_RESULT(
+        device->vk.WaitForFences(device->device, 1, &fence, true,
+                                 30 * 1000 * 1000 * 1000ULL));
+    VK_VALIDATE_RESULT(device->vk.ResetFences(device->device, 1, &fence));
+    calls++;
+  }
+  return calls;
+}
+
+void TestVulkan(VulkanContext& context) {
+  auto device = context.GetSingleDevice();
+  auto vk_device = device->device;
+
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(device->physicalDevice, &features);
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, families.data());
+  if (!features.sparseBinding ||
+      !(families[device->queueFamilyIndices.front()].queueFlags &
+        VK_QUEUE_SPARSE_BINDING_BIT)) {
+    LOG("Sparse binding is not supported on this queue, skipping.\n");
+    return;
+  }
+
+  AllocateInputOutputBuffers(device, BufferInitialization::Default);
+
+  CreateDescriptorSets(device);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  const char* size_flag = GetFlag("--sparse_size");
+  VkDeviceSize size = std::min<VkDeviceSize>(
+      size_flag != nullptr && *size_flag ? ParseSize(size_flag) : 2ull << 30,
+      properties.limits.sparseAddressSpaceSize);
+  const uint32_t pages_per_bind = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--sparse_pages_per_bind", 4096), 1));
+  const uint32_t iterations =
+      static_cast<uint32_t>(GetFlagUint("--sparse_iterations", 8));
+
+  // TEST - Create a multi-GB sparse buffer backed by pages of a memory arena,
+  // churn thousands of its pages per vkQueueBindSparse while compute reads the
+  // input buffer, then read a page that was just unbound.
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.flags = VK_BUFFER_CREATE_SPARSE_BINDING_BIT;
+  bufferCreateInfo.size = size;
+  bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  VkBuffer sparse_buffer;
+  VK_CHECK_RESULT(
+      vkCreateBuffer(vk_device, &bufferCreateInfo, nullptr, &sparse_buffer));
+  SetObjectDebugName(device, sparse_buffer, VK_OBJECT_TYPE_BUFFER,
+                     "Sparse Buffer");
+
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(vk_device, sparse_buffer, &requirements);
+  const VkDeviceSize page_size = requirements.alignment;
+  const uint32_t page_count =
+      static_cast<uint32_t>(requirements.size / page_size);
+  if (page_count < 2) {
+    LOG("The sparse buffer has less than 2 pages, skipping.\n");
+    return;
+  }
+  VkMemoryRequirements page_requirements = requirements;
+  page_requirements.size = page_size;
+  LOG("Sparse buffer of %u pages of %llu bytes\n", page_count,
+      static_cast<unsigned long long>(page_size));
+
+  MemoryArena arena;
+  InitMemoryArena(&arena, device);
+  std::vector<MemoryAllocation> page_memory(page_count);
+  std::vector<uint32_t> all_pages(page_count);
+  for (uint32_t i = 0; i < page_count; i++) {
+    VK_CHECK_RESULT(ArenaAllocate(&arena, page_requirements,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                                  &page_memory[i]));
+    all_pages[i] = i;
+  }
+
+  VkFenceCreateInfo fenceCreateInfo = {};
+  fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  VkFence fence;
+  VK_CHECK_RESULT(vkCreateFence(vk_device, &fenceCreateInfo, nullptr, &fence));
+  SetObjectDebugName(device, fence, VK_OBJECT_TYPE_FENCE, "Sparse Bind Fence");
+
+  // The whole buffer must be bound before it is used.
+  auto bind_start = std::chrono::steady_clock::now();
+  uint32_t bind_calls = BindPages(device, sparse_buffer, page_size, all_pages,
+                                  page_memory, pages_per_bind, fence);
+  double bind_s = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - bind_start)
+                      .count();
+  uint64_t pages_bound = page_count;
+  uint64_t pages_unbound = 0;
+  double unbind_s = 0;
+
+  // Two descriptor sets: one reading the input buffer while the pages churn,
+  // and one reading the page that gets unbound. Without
+  // VK_BUFFER_CREATE_SPARSE_RESIDENCY_BIT the sparse buffer must be fully
+  // bound whenever the device uses it, so only the fault read touches it.
+  VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4};
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 2;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  VkDescriptorPool descriptor_pool;
+  VK_CHECK_RESULT(vkCreateDescriptorPool(vk_device, &pool_info, nullptr,
+                                         &descriptor_pool));
+  VkDescriptorSetLayout layouts[2] = {device->descriptorSetLayout,
+                                      device->descriptorSetLayout};
+  VkDescriptorSetAllocateInfo set_info = {};
+  set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  set_info.descriptorPool = descriptor_pool;
+  set_info.descriptorSetCount = 2;
+  set_info.pSetLayouts = layouts;
+  VkDescriptorSet descriptor_sets[2];
+  VK_CHECK_RESULT(
+      vkAllocateDescriptorSets(vk_device, &set_info, descriptor_sets));
+
+  // Only whole workgroups, of one float per invocation, within a page and the
+  // output buffer.
+  const uint32_t group_count = static_cast<uint32_t>(std::max<VkDeviceSize>(
+      std::min<VkDeviceSize>(page_size, device->bufferSize) /
+          (sizeof(float) * WorkgroupInvocations(device)),
+      1));
+  const VkDeviceSize read_size =
+      std::min<VkDeviceSize>(page_size, device->bufferSize);
+  auto record_read = [&](VkDescriptorSet set, VkBuffer buffer,
+                         VkDeviceSize offset, const char* name) {
+    VkDescriptorBufferInfo buffers[2] = {
+        {buffer, offset, read_size},
+        {device->bufferOut, 0, device->bufferSize}};
+    VkWriteDescriptorSet writes[2] = {};
+    for (uint32_t i = 0; i < 2; i++) {
+      writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+      writes[i].dstSet = set;
+      writes[i].dstBinding = i;
+      writes[i].descriptorCount = 1;
+      writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      writes[i].pBufferInfo = &buffers[i];
+    }
+    vkUpdateDescriptorSets(vk_device, 2, writes, 0, nullptr);
+
+    VkCommandBufferAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocateInfo.commandPool = device->commandPool;
+    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocateInfo.commandBufferCount = 1;
+    VkCommandBuffer cb;
+    VK_CHECK_RESULT(
+        device->vk.AllocateCommandBuffers(vk_device, &allocateInfo, &cb));
+    SetObjectDebugName(device, cb, VK_OBJECT_TYPE_COMMAND_BUFFER, name);
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    VK_CHECK_RESULT(device->vk.BeginCommandBuffer(cb, &beginInfo));
+    device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                               device->pipeline);
+    device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                     device->pipelineLayout, 0, 1, &set, 0,
+                                     nullptr);
+    device->vk.CmdDispatch(cb, group_count, 1, 1);
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(cb));
+    return cb;
+  };
+  VkCommandBuffer overlap_cb = record_read(
+      descriptor_sets[0], device->bufferIn, 0, "Sparse Overlap Read");
+
+  // Churn all but the first page, the arena allocations of the unbound pages
+  // are pooled and reused by the next binds. The pages unbound by an iteration
+  // are rebound by the next one before it unbinds its own batch, so that every
+  // iteration has pages left to unbind.
+  std::mt19937 rng(1);
+  std::vector<uint32_t> bound(all_pages.begin() + 1, all_pages.end());
+  std::vector<MemoryAllocation> free_memory;
+  std::vector<uint32_t> last_unbound;
+  VkSubmitInfo overlap_submit = CreateSubmitInfo(&overlap_cb);
+  for (uint32_t iteration = 0; iteration <= iterations; iteration++) {
+    VK_VALIDATE_RESULT(QueueSubmit(device, device->queue, 1, &overlap_submit,
+                                   VK_NULL_HANDLE));
+
+    // Rebind the pages unbound by the previous iteration with pooled memory.
+    if (!last_unbound.empty()) {
+      std::vector<MemoryAllocation> memory;
+      for (auto page : last_unbound) {
+        page_memory[page] = free_memory.back();
+        free_memory.pop_back();
+        memory.push_back(page_memory[page]);
+      }
+      auto start = std::chrono::steady_clock::now();
+      bind_calls += BindPages(device, sparse_buffer, page_size, last_unbound,
+                              memory, pages_per_bind, fence);
+      bind_s += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+      pages_bound += last_unbound.size();
+      bound.insert(bound.end(), last_unbound.begin(), last_unbound.end());
+    }
+
+    // Unbind a random batch of bound pages.
+    std::shuffle(bound.begin(), bound.end(), rng);
+    size_t count = std::min<size_t>(pages_per_bind, bound.size());
+    last_unbound.assign(bound.end() - count, bound.end());
+    bound.resize(bound.size() - count);
+    for (auto page : last_unbound) {
+      free_memory.push_back(page_memory[page]);
+      page_memory[page] = {};
+    }
+    auto start = std::chrono::steady_clock::now();
+    bind_calls +=
+        BindPages(device, sparse_buffer, page_size, last_unbound,
+                  std::vector<MemoryAllocation>(count), pages_per_bind, fence);
+    unbind_s += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    pages_unbound += count;
+  }
+  if (last_unbound.empty()) {
+    LOG("No page of the sparse buffer was unbound, skipping.\n");
+    return;
+  }
+
+  uint32_t fault_page = last_unbound.back();
+  char json[512];
+  snprintf(json, sizeof(json),
+           "{\"size\": %llu, \"page_size\": %llu, \"pages\": %u, "
+           "\"pages_per_bind\": %u, \"bind_calls\": %u, "
+           "\"pages_bound\": %llu, \"pages_unbound\": %llu, "
+           "\"bind_pages_per_sec\": %.1f, \"unbind_pages_per_sec\": %.1f, "
+           "\"fault_page\": %u, \"fault_offset\": %llu}",
+           static_cast<unsigned long long>(size),
+           static_cast<unsigned long long>(page_size), page_count,
+           pages_per_bind, bind_calls,
+           static_cast<unsigned long long>(pages_bound),
+           static_cast<unsigned long long>(pages_unbound),
+           bind_s > 0 ? pages_bound / bind_s : 0.0,
+           unbind_s > 0 ? pages_unbound / unbind_s : 0.0, fault_page,
+           static_cast<unsigned long long>(fault_page * page_size));
+  SetRunReportValue("sparse_binding", json);
+  LOG("Bound %llu pages (%.1f pages/s), unbound %llu pages (%.1f pages/s) in "
+      "%u calls\n",
+      static_cast<unsigned long long>(pages_bound),
+      bind_s > 0 ? pages_bound / bind_s : 0.0,
+      static_cast<unsigned long long>(pages_unbound),
+      unbind_s > 0 ? pages_unbound / unbind_s : 0.0, bind_calls);
+
+  // Read the page that was unbound last, which should fault.
+  VkCommandBuffer fault_cb =
+      record_read(descriptor_sets[1], sparse_buffer, fault_page * page_size,
+                  "Sparse Unbound Page Read");
+  VkSubmitInfo fault_submit = CreateSubmitInfo(&fault_cb);
+  RunStressSubmits(device, device->queue);
+  LOG("Submit read of unbound page %u...\n", fault_page);
+  VK_VALIDATE_RESULT(
+      QueueSubmit(device, device->queue, 1, &fault_submit, VK_NULL_HANDLE));
+}
+
+// Run our test.
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--sparse_size",
+             "Size of the sparse buffer, e.g. 512M or 8G, default 2G.");
+  DefineFlag("--sparse_pages_per_bind",
+             "Number of pages bound or unbound per vkQueueBindSparse.");
+  DefineFlag("--sparse_iterations",
+             "Number of unbind and rebind rounds before the fault.");
+  InitFlags(argc, argv);
+
+  VulkanContext context;
+  if (!InitVulkan(&context, nullptr, "read_write.comp.spv")) {
+    return 1;
+  }
+
+  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+
+  Finalize();
+  return 0;
+}
@@ -33,13 +33,15 @@ void TestVulkan(VulkanContext& context) {
   commandBufferAllocateInfo.commandBufferCount = 1;
 
   VkCommandBuffer commandBuffer;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer));
   SetObjectDebugName(device, commandBuffer, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 1");
   VkCommandBuffer commandBuffer2;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer2));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer2));
   SetObjectDebugName(device, commandBuffer2, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 2");
 
@@ -47,21 +49,23 @@ void TestVulkan(VulkanContext& context) {
   commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  VK_CHECK_RESULT(
+      device->vk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
   // Dispatch twice to see if the command if executed after event
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
   // TEST - Insert a binary and a timeline semaphore that we never signal.
   // Submits wait on the semaphores and vkQueueWaitIdle never returns.
@@ -87,10 +91,11 @@ void TestVulkan(VulkanContext& context) {
       CreateSubmitInfo(&commandBuffer, &semaphores, &dstStageMasks, nullptr,
                        &timelineSemaphoreSubmitInfo);
 
+  RunStressSubmits(device, device->queue);
   for (int i = 0; i < 5; ++i) {
     LOG("Submitting %d\n", i);
     VK_VALIDATE_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
     std::this_thread::sleep_for(std::chrono::microseconds(500));
   }
 }
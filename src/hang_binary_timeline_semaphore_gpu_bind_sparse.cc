@@ -33,13 +33,15 @@ void TestVulkan(VulkanContext& context) {
   commandBufferAllocateInfo.commandBufferCount = 1;
 
   VkCommandBuffer commandBuffer;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer));
   SetObjectDebugName(device, commandBuffer, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 1");
   VkCommandBuffer commandBuffer2;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer2));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer2));
   SetObjectDebugName(device, commandBuffer2, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 2");
 
@@ -47,21 +49,23 @@ void TestVulkan(VulkanContext& context) {
   commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  VK_CHECK_RESULT(
+      device->vk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
   // Dispatch twice to see if the command if executed after event
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
   /* TEST - To verify that GFR correctly tracks the semaphore signal operations
   submitted in vkQueueBindSparse, we create multiple binary and timeline
@@ -119,15 +123,15 @@ void TestVulkan(VulkanContext& context) {
       CreateSubmitInfo(&commandBuffer, nullptr, nullptr, &semaphores,
                        &timelineSemaphoreSubmitInfo);
 
-  VK_VALIDATE_RESULT(vkQueueSubmit(device->queue, 1, &submitInfo, fence));
+  VK_VALIDATE_RESULT(QueueSubmit(device, device->queue, 1, &submitInfo, fence));
   LOG("Done.\n");
 
   // binary semaphores:    [1  0  0  0  1  0  0  0  0  0]
   // timelines semaphores: [11 10 10 10 12 10 10 10 13 10]
 
   LOG("Waiting for fence from vkQueueSubmit...\n");
-  auto result =
-      vkWaitForFences(vk_device, 1, &fence, true, 30 * 1000 * 1000 * 1000ULL);
+  auto result = device->vk.WaitForFences(vk_device, 1, &fence, true,
+                                         30 * 1000 * 1000 * 1000ULL);
   if (result == VK_TIMEOUT) {
     LOG("TIMEOUT\n");
   } else {
@@ -136,7 +140,7 @@ void TestVulkan(VulkanContext& context) {
   LOG("Fence signal received.\n");
 
   LOG("Resetting the fence...\n");
-  VK_VALIDATE_RESULT(vkResetFences(vk_device, 1, &fence));
+  VK_VALIDATE_RESULT(device->vk.ResetFences(vk_device, 1, &fence));
 
   {
     // Create first VkBindSparseInfo that waits on some of the current semaphore
@@ -157,12 +161,12 @@ void TestVulkan(VulkanContext& context) {
         CreateBindSparseInfo(&waitSemaphoresBind1, &signalSemaphoresBind1,
                              &timelineSemaphoreSubmitInfo1);
     VK_VALIDATE_RESULT(
-        vkQueueBindSparse(device->queue, 1, &bindSparseInfo1, fence));
+        QueueBindSparse(device, device->queue, 1, &bindSparseInfo1, fence));
     LOG("Done.\n");
 
     LOG("Waiting for fence from vkQueueBindSparse1...\n");
-    result =
-        vkWaitForFences(vk_device, 1, &fence, true, 30 * 1000 * 1000 * 1000ULL);
+    result = device->vk.WaitForFences(vk_device, 1, &fence, true,
+                                      30 * 1000 * 1000 * 1000ULL);
     if (result == VK_TIMEOUT) {
       LOG("TIMEOUT\n");
     } else {
@@ -171,7 +175,7 @@ void TestVulkan(VulkanContext& context) {
     LOG("Fence signal received.\n");
 
     LOG("Resetting the fence...\n");
-    VK_VALIDATE_RESULT(vkResetFences(vk_device, 1, &fence));
+    VK_VALIDATE_RESULT(device->vk.ResetFences(vk_device, 1, &fence));
 
     // binary semaphores:    [0  0  1  0  1  0  1  0  0  0]
     // timelines semaphores: [11 14 10 10 12 15 10 10 13 16]
@@ -197,12 +201,12 @@ void TestVulkan(VulkanContext& context) {
                              &timelineSemaphoreSubmitInfo2);
 
     VK_VALIDATE_RESULT(
-        vkQueueBindSparse(device->queue, 1, &bindSparseInfo2, fence));
+        QueueBindSparse(device, device->queue, 1, &bindSparseInfo2, fence));
     LOG("Done.\n");
 
     LOG("Waiting for fence from vkQueueBindSparse2...\n");
-    result =
-        vkWaitForFences(vk_device, 1, &fence, true, 30 * 1000 * 1000 * 1000ULL);
+    result = device->vk.WaitForFences(vk_device, 1, &fence, true,
+                                      30 * 1000 * 1000 * 1000ULL);
     if (result == VK_TIMEOUT) {
       LOG("TIMEOUT\n");
     } else {
@@ -211,7 +215,7 @@ void TestVulkan(VulkanContext& context) {
     LOG("Fence signal received.\n");
 
     // LOG("Resetting the fence...\n");
-    VK_VALIDATE_RESULT(vkResetFences(vk_device, 1, &fence));
+    VK_VALIDATE_RESULT(device->vk.ResetFences(vk_device, 1, &fence));
 
     // binary semaphores:    [0  0  1  0  0  0  1  1  0  0]
     // timelines semaphores: [17 18 19 10 12 15 10 10 13 16]
@@ -238,7 +242,9 @@ void TestVulkan(VulkanContext& context) {
       CreateSubmitInfo(&commandBuffer, &allSemaphores, &dstStageMasks, nullptr,
                        &timelineSemaphoreSubmitInfo2);
 
-  VK_VALIDATE_RESULT(vkQueueSubmit(device->queue, 1, &submitInfo2, fence));
+  RunStressSubmits(device, device->queue);
+  VK_VALIDATE_RESULT(
+      QueueSubmit(device, device->queue, 1, &submitInfo2, fence));
   LOG("Done.\n");
 }
 
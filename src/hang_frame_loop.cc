@@ -0,0 +1,90 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "common.h"
+
+// Records the work of a frame: --frame_dispatches dispatches with barriers
+// between them, and for the faulting frame a wait on an event that never
+// signals half way through.
+static void RecordFrame(VulkanDevice* device, uint32_t dispatches,
+                        VkCommandBuffer cb, uint32_t frame, bool fault) {
+  device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
+  device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
+  for (uint32_t i = 0; i < dispatches; i++) {
+    if (fault && i == dispatches / 2) {
+      LOG("Frame %u waits on an event that never signals\n", frame);
+      WaitOnEventThatNeverSignals(device, cb);
+    }
+    device->vk.CmdDispatch(cb, 1, 1, 1);
+    CmdMemoryBarrier(device, cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                     VK_ACCESS_SHADER_WRITE_BIT,
+                     VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                     VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+  }
+}
+
+void TestVulkan(VulkanContext& context) {
+  auto device = context.GetSingleDevice();
+
+  AllocateInputOutputBuffers(device, BufferInitialization::Default);
+  CreateDescriptorSets(device);
+
+  FrameLoopOptions options;
+  options.frames = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--frames", options.frames), 1));
+  options.framesInFlight = static_cast<uint32_t>(std::max<uint64_t>(
+      GetFlagUint("--frames_in_flight", options.framesInFlight), 1));
+  options.faultFrame =
+      static_cast<uint32_t>(GetFlagUint("--fault_frame", options.frames / 2));
+  options.frameTimeUs = GetFlagUint("--frame_time_us", options.frameTimeUs);
+  const uint32_t dispatches = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--frame_dispatches", 16), 1));
+
+  VK_VALIDATE_RESULT(RunFrameLoop(
+      device, options,
+      [device, dispatches](VkCommandBuffer cb, uint32_t frame, bool fault) {
+        RecordFrame(device, dispatches, cb, frame, fault);
+      }));
+}
+
+// Run our test.
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--frames", "Number of frames, default 600.");
+  DefineFlag("--frames_in_flight", "Number of frames in flight, default 2.");
+  DefineFlag("--fault_frame",
+             "Frame that hangs, default half of --frames. No frame hangs if "
+             "it is not below --frames.");
+  DefineFlag("--frame_time_us",
+             "Time between the starts of the frames, default 16666 (60 fps). "
+             "0 submits them as fast as possible.");
+  DefineFlag("--frame_dispatches", "Dispatches per frame, default 16.");
+  InitFlags(argc, argv);
+
+  VulkanContext context;
+  std::vector<const char*> device_extensions;
+  device_extensions.push_back("VK_KHR_timeline_semaphore");
+  if (!InitVulkan(&context, &device_extensions, "read_write.comp.spv")) {
+    return 1;
+  }
+  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+
+  Finalize();
+  return 0;
+}
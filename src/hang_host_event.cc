@@ -27,18 +27,19 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
 
         WaitOnEventThatNeverSignals(device, cb);
 
         // dispatch again to see if the command is executed after the wait event
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
       },
       "HANG Dispatch and Wait"));
 
@@ -47,13 +48,14 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb2, &secondary_cb2,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
       },
       "Dispatch for validation"));
 
@@ -62,24 +64,25 @@ void TestVulkan(VulkanContext& context) {
   // to detect if we continue executing
   VkSubmitInfo submitInfo = CreateSubmitInfo(&primary_cb);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
 
   // NOTE: vkQueueWaitIdle will return VK_SUCCESS when this hang is detected
   // instead of returning VK_ERROR_DEVICE_LOST as expected
   LOG("Wait for idle...\n");
-  VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 
   LOG("Submit 2...\n");
   VkSubmitInfo submitInfo2 = CreateSubmitInfo(&primary_cb2);
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
 
   LOG("Waiting for idle...\n");
   // NOTE: this vkQueueWaitIdle is not expected to be reached, as a previous
   // Vulkan command is expected to  return VK_ERROR_DEVICE_LOST
-  VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 }
 
 // Run our test.
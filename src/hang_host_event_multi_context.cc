@@ -33,13 +33,15 @@ void TestVulkan(VulkanContext& context, bool run_hang_host_event) {
   commandBufferAllocateInfo.commandBufferCount = 1;
 
   VkCommandBuffer commandBuffer;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer));
   SetObjectDebugName(device, commandBuffer, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 1");
   VkCommandBuffer commandBuffer2;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer2));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer2));
   SetObjectDebugName(device, commandBuffer2, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 2");
 
@@ -49,56 +51,60 @@ void TestVulkan(VulkanContext& context, bool run_hang_host_event) {
   commandBufferBeginInfo.flags = 0;
 
   VK_CHECK_RESULT(
-      vkBeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
+      device->vk.BeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer2,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer2, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer2, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer2));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer2));
 
-  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  VK_CHECK_RESULT(
+      device->vk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
   if (run_hang_host_event) {
     WaitOnEventThatNeverSignals(device, commandBuffer);
 
     // dispatch again to see if the command is executed after the wait event
-    vkCmdDispatch(commandBuffer, 1, 1, 1);
+    device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-    VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
     // first we submit a command buffer with a wait event that never gets set
     // we then wait for the queue to execute, then submit another command buffer
     // to detect if we continue executing
     VkSubmitInfo submitInfo = CreateSubmitInfo(&commandBuffer);
 
+    RunStressSubmits(device, device->queue);
     LOG("Submit 1...\n");
     VK_VALIDATE_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
 
     // NOTE: vkQueueWaitIdle will return VK_SUCCESS when this hang is detected
     // instead of returning VK_ERROR_DEVICE_LOST as expected
     LOG("Wait for idle...\n");
-    VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+    VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 
     LOG("Submit 2...\n");
     VkSubmitInfo submitInfo2 = CreateSubmitInfo(&commandBuffer2);
     VK_VALIDATE_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
   }
 }
 
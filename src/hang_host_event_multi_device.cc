@@ -34,13 +34,15 @@ void TestVulkan(VulkanContext& context, VkDevice vk_device,
   commandBufferAllocateInfo.commandBufferCount = 1;
 
   VkCommandBuffer commandBuffer;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer));
   SetObjectDebugName(device, commandBuffer, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 1");
   VkCommandBuffer commandBuffer2;
-  VK_CHECK_RESULT(vkAllocateCommandBuffers(
-      vk_device, &commandBufferAllocateInfo, &commandBuffer2));
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                        &commandBuffer2));
   SetObjectDebugName(device, commandBuffer2, VK_OBJECT_TYPE_COMMAND_BUFFER,
                      "CommandBuffer 2");
 
@@ -50,73 +52,157 @@ void TestVulkan(VulkanContext& context, VkDevice vk_device,
   commandBufferBeginInfo.flags = 0;
 
   VK_CHECK_RESULT(
-      vkBeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
+      device->vk.BeginCommandBuffer(commandBuffer2, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer2, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer2,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer2, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer2, 1, 1, 1);
 
-  VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer2));
+  VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer2));
 
-  VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
+  VK_CHECK_RESULT(
+      device->vk.BeginCommandBuffer(commandBuffer, &commandBufferBeginInfo));
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                    device->pipeline);
+  device->vk.CmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
 
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-                          device->pipelineLayout, 0, 1, &device->descriptorSet,
-                          0, nullptr);
+  device->vk.CmdBindDescriptorSets(commandBuffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
 
-  vkCmdDispatch(commandBuffer, 1, 1, 1);
+  device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
   if (run_hang_host_event) {
     WaitOnEventThatNeverSignals(device, commandBuffer);
 
     // dispatch again to see if the command is executed after the wait event
-    vkCmdDispatch(commandBuffer, 1, 1, 1);
+    device->vk.CmdDispatch(commandBuffer, 1, 1, 1);
 
-    VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(commandBuffer));
 
     // first we submit a command buffer with a wait event that never gets set
     // we then wait for the queue to execute, then submit another command buffer
     // to detect if we continue executing
     VkSubmitInfo submitInfo = CreateSubmitInfo(&commandBuffer);
 
+    RunStressSubmits(device, device->queue);
     LOG("Submit 1...\n");
     VK_VALIDATE_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
 
     // NOTE: vkQueueWaitIdle will return VK_SUCCESS when this hang is detected
     // instead of returning VK_ERROR_DEVICE_LOST as expected
     LOG("Wait for idle...\n");
-    VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+    VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 
     LOG("Submit 2...\n");
     VkSubmitInfo submitInfo2 = CreateSubmitInfo(&commandBuffer2);
     VK_VALIDATE_RESULT(
-        vkQueueSubmit(device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
+        QueueSubmit(device, device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
   }
 
   LOG("Waiting for idle...\n");
   // NOTE: this vkQueueWaitIdle is not expected to be reached, as a previous
   // Vulkan command is expected to  return VK_ERROR_DEVICE_LOST
-  VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
+}
+
+// Creates num_devices logical devices and runs the workload on each of them
+// from its own thread, then hangs the last one. The time to create the devices
+// and the per thread run and GetDevice lookup times are added to the run
+// report as "multi_device".
+bool TestManyDevices(VulkanContext& context, uint32_t num_devices) {
+  const uint32_t kLookups = 100000;
+  auto create_start = std::chrono::steady_clock::now();
+  std::vector<VkDevice> vk_devices;
+  for (uint32_t i = 0; i < num_devices; i++) {
+    VkDevice vk_device =
+        InitVulkanDevice(&context, nullptr, "read_write.comp.spv");
+    if (vk_device == VK_NULL_HANDLE) {
+      return false;
+    }
+    vk_devices.push_back(vk_device);
+  }
+  auto create_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - create_start)
+                       .count();
+  LOG("Created %u devices in %.1f ms\n", num_devices, create_ms);
+  SetupWatchdogTimer(&context);
+
+  std::vector<double> run_ms(num_devices);
+  std::vector<double> lookup_ns(num_devices);
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < num_devices; i++) {
+    threads.emplace_back([&, i]() {
+      auto start = std::chrono::steady_clock::now();
+      for (uint32_t j = 0; j < kLookups; j++) {
+        if (context.GetDevice(vk_devices[i]) == nullptr) {
+          LOG("Device %u not found\n", i);
+          abort();
+        }
+      }
+      auto lookup_end = std::chrono::steady_clock::now();
+      TestVulkan(context, vk_devices[i], false /* run_hang_host_event */);
+      lookup_ns[i] =
+          std::chrono::duration<double, std::nano>(lookup_end - start).count() /
+          kLookups;
+      run_ms[i] = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - lookup_end)
+                      .count();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::string json = "{\"num_devices\": " + std::to_string(num_devices) +
+                     ", \"create_ms\": " + std::to_string(create_ms) +
+                     ", \"threads\": [";
+  for (uint32_t i = 0; i < num_devices; i++) {
+    LOG("Device %u: run %.1f ms, lookup %.1f ns\n", i, run_ms[i],
+        lookup_ns[i]);
+    json += std::string(i == 0 ? "" : ", ") +
+            "{\"run_ms\": " + std::to_string(run_ms[i]) +
+            ", \"lookup_ns\": " + std::to_string(lookup_ns[i]) + "}";
+  }
+  SetRunReportValue("multi_device", json + "]}");
+  WriteRunReport();
+
+  // Delete every other device, the table must still find the remaining ones.
+  for (uint32_t i = 1; i + 1 < num_devices; i += 2) {
+    DeleteVulkanDevice(&context, vk_devices[i]);
+  }
+  TestVulkan(context, vk_devices.back(), true /* run_hang_host_event */);
+  return true;
 }
 
 // Run our test.
 int main(int argc, char* argv[]) {
   Initialize();
+  DefineFlag("--num_devices",
+             "Create this many devices, each of them running the workload from "
+             "its own thread, before hanging the last one.");
   InitFlags(argc, argv);
 
   VulkanContext context;
   if (!InitVulkanInstance(&context)) {
     return 1;
   }
+  uint64_t num_devices = GetFlagUint("--num_devices", 0);
+  if (num_devices > 0) {
+    bool created = TestManyDevices(
+        context, static_cast<uint32_t>(std::min<uint64_t>(num_devices,
+                                                          kMaxDevices)));
+    Finalize();
+    return created ? 0 : 1;
+  }
   VkDevice device1 = InitVulkanDevice(&context, nullptr, "read_write.comp.spv");
   VkDevice device2 = InitVulkanDevice(&context, nullptr, "read_write.comp.spv");
   VkDevice device3 = InitVulkanDevice(&context, nullptr, "read_write.comp.spv");
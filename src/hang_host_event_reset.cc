@@ -28,18 +28,19 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
 
         WaitOnEventThatNeverSignals(device, cb);
 
         // dispatch again to see if the command is executed after the wait event
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
       },
       "Dispatch and Wait"));
 
@@ -48,13 +49,14 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb2, &secondary_cb2,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        device->vk.CmdDispatch(cb, 1, 1, 1);
       },
       "Dispatch for validation"));
 
@@ -71,22 +73,23 @@ void TestVulkan(VulkanContext& context) {
   // has been executed.  We expect the fence to timeout or return an error.
   VkSubmitInfo submitInfo = CreateSubmitInfo(&primary_cb);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
-  VK_VALIDATE_RESULT(vkQueueSubmit(device->queue, 1, &submitInfo, fence));
+  VK_VALIDATE_RESULT(QueueSubmit(device, device->queue, 1, &submitInfo, fence));
 
   LOG("Sleep...\n");
   std::this_thread::sleep_for(std::chrono::microseconds(1000));
 
   LOG("Reset...\n");
-  vkResetCommandPool(vk_device, device->commandPool, 0);
+  device->vk.ResetCommandPool(vk_device, device->commandPool, 0);
 
   // vkWaitForFences should wait for the queue to finish.
   // 30 second timeout, which should be longer than the kernel/DRM timeout.
   // We expect a VK_ERROR_DEVICE_LOST as the kernel should detect the hung
   // event before the timeout occurs.
   LOG("Wait for fence...\n");
-  auto result =
-      vkWaitForFences(vk_device, 1, &fence, true, 30 * 1000 * 1000 * 1000ULL);
+  auto result = device->vk.WaitForFences(vk_device, 1, &fence, true,
+                                         30 * 1000 * 1000 * 1000ULL);
   if (result == VK_TIMEOUT) {
     LOG("TIMEOUT\n");
   } else {
@@ -96,12 +99,12 @@ void TestVulkan(VulkanContext& context) {
   LOG("Submit 2...\n");
   VkSubmitInfo submitInfo2 = CreateSubmitInfo(&primary_cb2);
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submitInfo2, VK_NULL_HANDLE));
 
   LOG("Waiting for idle...\n");
   // NOTE: this vkQueueWaitIdle is not expected to be reached, as a previous
   // Vulkan command is expected to return VK_ERROR_DEVICE_LOST
-  VK_VALIDATE_RESULT(vkQueueWaitIdle(device->queue));
+  VK_VALIDATE_RESULT(device->vk.QueueWaitIdle(device->queue));
 }
 
 // Run our test.
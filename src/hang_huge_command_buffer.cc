@@ -0,0 +1,288 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <chrono>
+#include <cstring>
+
+#include "common.h"
+
+// The kinds of commands recorded, in this order, by RecordCommands.
+enum class HugeCommand { Dispatch, Barrier, Copy, Marker, Count };
+
+struct HugeCommandBuffer {
+  VulkanDevice* device;
+  uint32_t commands;
+  uint32_t fault_index;
+  bool oob_fault;
+  // Host visible buffer for the markers, VK_NULL_HANDLE without
+  // VK_AMD_buffer_marker, in which case a fill is recorded instead.
+  VkBuffer marker_buffer;
+  uint32_t oob_group_count;
+};
+
+// Records the commands [begin, end) of the huge command buffer into
+// command_buffer, with the fault at fault_index if it is in the range.
+void RecordCommands(const HugeCommandBuffer& h, VkCommandBuffer command_buffer,
+                    uint32_t begin, uint32_t end) {
+  VulkanDevice* device = h.device;
+  device->vk.CmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                             device->pipeline);
+  device->vk.CmdBindDescriptorSets(command_buffer,
+                                   VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipelineLayout, 0, 1,
+                                   &device->descriptorSet, 0, nullptr);
+  const VkPipelineStageFlags stages =
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+  VkBufferCopy copy = {0, 0, 16};
+  for (uint32_t i = begin; i < end; i++) {
+    if (i == h.fault_index) {
+      if (h.oob_fault) {
+        device->vk.CmdDispatch(command_buffer, h.oob_group_count, 1, 1);
+      } else {
+        WaitOnEventThatNeverSignals(device, command_buffer);
+      }
+      continue;
+    }
+    switch (static_cast<HugeCommand>(
+        i % static_cast<uint32_t>(HugeCommand::Count))) {
+      case HugeCommand::Dispatch:
+        device->vk.CmdDispatch(command_buffer, 1, 1, 1);
+        break;
+      case HugeCommand::Barrier:
+        CmdMemoryBarrier(
+            device, command_buffer, stages,
+            VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, stages,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT |
+                VK_ACCESS_TRANSFER_READ_BIT);
+        break;
+      case HugeCommand::Copy:
+        device->vk.CmdCopyBuffer(command_buffer, device->bufferIn,
+                                 device->bufferOut, 1, &copy);
+        break;
+      default:
+        // The marker holds the index of the last command that completed.
+        if (h.marker_buffer != VK_NULL_HANDLE) {
+          CmdWriteBufferMarker(device, command_buffer,
+                               VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                               h.marker_buffer, 0, i);
+        } else {
+          device->vk.CmdFillBuffer(command_buffer, device->bufferOut, 16, 4, i);
+        }
+        break;
+    }
+  }
+}
+
+// Records the huge command buffer into a new primary command buffer, over
+// --secondary_count secondary command buffers with --secondary. Returns the
+// command buffer and sets record_s to the recording time.
+VkCommandBuffer RecordHugeCommandBuffer(const HugeCommandBuffer& h,
+                                        double* record_s) {
+  VulkanDevice* device = h.device;
+  VkCommandBufferAllocateInfo allocateInfo = {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocateInfo.commandPool = device->commandPool;
+  allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocateInfo.commandBufferCount = 1;
+  VkCommandBuffer primary;
+  VK_CHECK_RESULT(
+      device->vk.AllocateCommandBuffers(device->device, &allocateInfo,
+                                        &primary));
+  SetObjectDebugName(device, primary, VK_OBJECT_TYPE_COMMAND_BUFFER,
+                     "Huge Command Buffer");
+
+  auto start = std::chrono::steady_clock::now();
+  if (GetFlag("--secondary") != nullptr) {
+    const uint32_t secondary_count = static_cast<uint32_t>(std::max<uint64_t>(
+        GetFlagUint("--secondary_count", 64), 1));
+    VK_CHECK_RESULT(RecordSecondaryCommandBuffers(
+        device, primary, secondary_count,
+        static_cast<uint32_t>(GetFlagUint("--record_threads", 1)),
+        // Runs on the recording threads, RecordCommands only records into
+        // cb and reads h.
+        [&](VkCommandBuffer cb, uint32_t index) {
+          uint64_t count = h.commands;
+          RecordCommands(h, cb,
+                         static_cast<uint32_t>(count * index / secondary_count),
+                         static_cast<uint32_t>(count * (index + 1) /
+                                               secondary_count));
+        },
+        "Huge Secondary Command Buffer"));
+  } else {
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    VK_CHECK_RESULT(device->vk.BeginCommandBuffer(primary, &beginInfo));
+    RecordCommands(h, primary, 0, h.commands);
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(primary));
+  }
+  *record_s = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+  return primary;
+}
+
+static bool markers_supported = false;
+
+// Creates the context, with layer on top of the ones of --layer unless it is
+// nullptr, and the device of the test.
+static bool InitContext(VulkanContext* context, const char* layer) {
+  if (layer != nullptr) {
+    context->instanceLayers.push_back(layer);
+  }
+  if (!InitVulkanInstance(context)) {
+    return false;
+  }
+  std::vector<const char*> device_extensions;
+  auto infos = GetPhysicalDeviceInfos(context);
+  auto info = FindPhysicalDevice(infos, GetFlag("--device"));
+  markers_supported = info != nullptr && HasDeviceExtension(
+                                             info->physicalDevice,
+                                             "VK_AMD_buffer_marker");
+  if (markers_supported) {
+    device_extensions.push_back("VK_AMD_buffer_marker");
+  } else {
+    LOG("VK_AMD_buffer_marker is not supported, recording fills instead of "
+        "markers.\n");
+  }
+  return InitVulkanDevice(context, &device_extensions,
+                          "read_write.comp.spv") != VK_NULL_HANDLE;
+}
+
+static HugeCommandBuffer InitHugeCommandBuffer(VulkanDevice* device,
+                                               MemoryArena* arena) {
+  AllocateInputOutputBuffers(device, BufferInitialization::Transfer);
+  CreateDescriptorSets(device);
+
+  HugeCommandBuffer h = {};
+  h.device = device;
+  h.commands = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--commands", 100000), 1));
+  h.fault_index = static_cast<uint32_t>(
+      std::min<uint64_t>(GetFlagUint("--fault_index", h.commands / 2),
+                         h.commands - 1));
+  const char* fault = GetFlag("--fault");
+  h.oob_fault = fault != nullptr && strcmp(fault, "oob") == 0;
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+  h.oob_group_count = properties.limits.maxComputeWorkGroupCount[0];
+
+  h.marker_buffer = VK_NULL_HANDLE;
+  if (markers_supported) {
+    VkBufferCreateInfo bufferCreateInfo = {};
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.size = 4;
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    InitMemoryArena(arena, device);
+    VK_CHECK_RESULT(ArenaCreateBuffer(arena, bufferCreateInfo,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                      &h.marker_buffer));
+    SetObjectDebugName(device, h.marker_buffer, VK_OBJECT_TYPE_BUFFER,
+                       "Huge Command Buffer Markers");
+  }
+  return h;
+}
+
+static double baseline_record_s = -1;
+
+void TestVulkan(VulkanContext& context) {
+  MemoryArena arena;
+  HugeCommandBuffer h =
+      InitHugeCommandBuffer(context.GetSingleDevice(), &arena);
+
+  // TEST - Record a command buffer of --commands dispatches, barriers, copies
+  // and markers, with a command at --fault_index that hangs on an event that
+  // never signals or, with --fault=oob, writes far out of bounds.
+  double record_s = 0;
+  VkCommandBuffer command_buffer = RecordHugeCommandBuffer(h, &record_s);
+  VkSubmitInfo submitInfo = CreateSubmitInfo(&command_buffer);
+  RunStressSubmits(h.device, h.device->queue);
+  auto start = std::chrono::steady_clock::now();
+  VK_VALIDATE_RESULT(QueueSubmit(h.device, h.device->queue, 1, &submitInfo,
+                                 VK_NULL_HANDLE));
+  int64_t submit_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+  char json[512];
+  snprintf(json, sizeof(json),
+           "{\"commands\": %u, \"fault_index\": %u, \"fault\": \"%s\", "
+           "\"markers\": %s, \"secondary\": %s, \"record_ms\": %.3f, "
+           "\"record_ns_per_command\": %.1f, \"baseline_record_ms\": %s, "
+           "\"submit_us\": %s}",
+           h.commands, h.fault_index, h.oob_fault ? "oob" : "event",
+           h.marker_buffer != VK_NULL_HANDLE ? "true" : "false",
+           GetFlag("--secondary") != nullptr ? "true" : "false",
+           record_s * 1000.0, record_s * 1e9 / h.commands,
+           baseline_record_s < 0
+               ? "null"
+               : std::to_string(baseline_record_s * 1000.0).c_str(),
+           FormatUs(submit_ns).c_str());
+  SetRunReportValue("huge_command_buffer", json);
+  LOG("Recorded %u commands in %.3f ms, submitted in %s us, fault at command "
+      "%u\n",
+      h.commands, record_s * 1000.0, FormatUs(submit_ns).c_str(),
+      h.fault_index);
+}
+
+// Run our test.
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--commands",
+             "Number of commands of the command buffer, default 100000.");
+  DefineFlag("--fault_index",
+             "Index of the faulting command, default half of --commands.");
+  DefineFlag("--fault",
+             "event to wait on an event that never signals at the faulting "
+             "command (default), oob to write out of bounds.");
+  DefineFlag("--compare_layer",
+             "Layer to record with, after recording once without it.");
+  InitFlags(argc, argv);
+
+  // Record once without the layer, without submitting, for the baseline.
+  const char* compare_layer = GetFlag("--compare_layer");
+  if (compare_layer != nullptr && compare_layer[0] != '\0') {
+    VulkanContext baseline;
+    if (!InitContext(&baseline, nullptr)) {
+      return 1;
+    }
+    MemoryArena arena;
+    HugeCommandBuffer h =
+        InitHugeCommandBuffer(baseline.GetSingleDevice(), &arena);
+    RecordHugeCommandBuffer(h, &baseline_record_s);
+    LOG("Baseline recording of %u commands in %.3f ms\n", h.commands,
+        baseline_record_s * 1000.0);
+    if (h.marker_buffer != VK_NULL_HANDLE) {
+      vkDestroyBuffer(h.device->device, h.marker_buffer, nullptr);
+      DestroyMemoryArena(&arena);
+    }
+    CleanupVulkan(&baseline);
+  } else {
+    compare_layer = nullptr;
+  }
+
+  VulkanContext context;
+  if (!InitContext(&context, compare_layer)) {
+    return 1;
+  }
+  SetupWatchdogTimer(&context);
+
+  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+
+  Finalize();
+  return 0;
+}
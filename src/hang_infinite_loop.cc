@@ -21,6 +21,7 @@
 void TestVulkan(VulkanContext& context) {
   auto device = context.GetSingleDevice();
 
+  CalibrateLoopCount(device);
   AllocateInputOutputBuffers(device, BufferInitialization::_64K);
 
   CreateDescriptorSets(device);
@@ -29,13 +30,14 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        CmdDispatchFault(device, cb);
       },
       "HANG Dispatch"))
 
@@ -43,10 +45,11 @@ void TestVulkan(VulkanContext& context) {
   // the program to hang and return an error
   VkSubmitInfo submitInfo = CreateSubmitInfo(&primary_cb);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
   // NOTE: this should timeout/hang
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
 }
 
 // Run our test.
@@ -18,90 +18,122 @@
 
 #include "common.h"
 
-void TestVulkan(VulkanContext& context) {
+// Records the hanging dispatch for each queue of the device, then submits to
+// all of them at the same moment, each queue from its own thread. How far apart
+// the submissions started and how long each of them took is added to the run
+// report as "queue_fanout".
+void TestVulkan(VulkanContext& context, const std::vector<QueueType>& queues) {
   auto device = context.GetSingleDevice();
 
+  CalibrateLoopCount(device);
   AllocateInputOutputBuffers(device, BufferInitialization::_64K);
 
   CreateDescriptorSets(device);
 
-  VkCommandBuffer gfx_primary_cb, gfx_secondary_cb;
-  VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
-      device, &gfx_primary_cb, &gfx_secondary_cb,
-      [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
-
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
-
-        vkCmdDispatch(cb, 1, 1, 1);
-      },
-      "HANG Dispatch Graphics", device->commandPools[0]))
-
-  VkCommandBuffer compute_primary_cb_1, compute_secondary_cb_1;
-  VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
-      device, &compute_primary_cb_1, &compute_secondary_cb_1,
-      [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
-
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
-
-        vkCmdDispatch(cb, 1, 1, 1);
-      },
-      "HANG Dispatch Compute 1", device->commandPools[1]))
-
-  VkCommandBuffer compute_primary_cb_2, compute_secondary_cb_2;
-  VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
-      device, &compute_primary_cb_2, &compute_secondary_cb_2,
-      [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
-
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
-
-        vkCmdDispatch(cb, 1, 1, 1);
-      },
-      "HANG Dispatch Compute 2", device->commandPools[1]))
-
-  // we submit a command buffer with a long running compute shader and expect
+  std::vector<VkCommandBuffer> primary_cbs(queues.size());
+  std::vector<VkCommandBuffer> secondary_cbs(queues.size());
+  for (size_t i = 0; i < queues.size(); i++) {
+    std::string name = "HANG Dispatch " + std::to_string(i) + " " +
+                       QueueTypeToString(queues[i]);
+    VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
+        device, &primary_cbs[i], &secondary_cbs[i],
+        [device, &queues, i](VkCommandBuffer cb) {
+          // Transfer queues can't dispatch, they submit an empty command
+          // buffer so that their submission is still tracked.
+          if (queues[i] == QueueType::Transfer) {
+            return;
+          }
+          device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                     device->pipeline);
+
+          device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                           device->pipelineLayout, 0, 1,
+                                           &device->descriptorSet, 0, nullptr);
+
+          CmdDispatchFault(device, cb);
+        },
+        name.c_str(), device->commandPools[i]))
+  }
+
+  // we submit command buffers with a long running compute shader and expect
   // the program to hang and return an error
-  VkSubmitInfo gfx_submit_info = CreateSubmitInfo(&gfx_primary_cb);
-  VkSubmitInfo compute_submit_info_1 = CreateSubmitInfo(&compute_primary_cb_1);
-  VkSubmitInfo compute_submit_info_2 = CreateSubmitInfo(&compute_primary_cb_2);
-
-  LOG("Submit Graphics...\n");
-  // NOTE: this should timeout/hang
-  VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queues[0], 1, &gfx_submit_info, VK_NULL_HANDLE));
-
-  LOG("Submit Compute 1/2...\n");
-  VK_VALIDATE_RESULT(vkQueueSubmit(device->queues[1], 1, &compute_submit_info_1,
-                                   VK_NULL_HANDLE));
-  LOG("Submit Compute 2/2...\n");
-  VK_VALIDATE_RESULT(vkQueueSubmit(device->queues[2], 1, &compute_submit_info_2,
-                                   VK_NULL_HANDLE));
+  std::atomic<uint32_t> ready{0};
+  std::atomic<bool> start{false};
+  std::chrono::steady_clock::time_point start_time;
+  std::vector<int64_t> skew_ns(queues.size());
+  std::vector<int64_t> submit_ns(queues.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < queues.size(); i++) {
+    threads.emplace_back([&, i]() {
+      VkSubmitInfo submit_info = CreateSubmitInfo(&primary_cbs[i]);
+      ready++;
+      while (!start.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      auto begin = std::chrono::steady_clock::now();
+      // NOTE: this should timeout/hang
+      VK_VALIDATE_RESULT(QueueSubmit(device, device->queues[i], 1,
+                                     &submit_info, VK_NULL_HANDLE));
+      auto end = std::chrono::steady_clock::now();
+      skew_ns[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       begin - start_time)
+                       .count();
+      submit_ns[i] =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+              .count();
+    });
+  }
+  while (ready.load() < queues.size()) {
+    std::this_thread::yield();
+  }
+  RunStressSubmits(device, device->queues.front());
+  LOG("Submit to %zu queues...\n", queues.size());
+  start_time = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::string json =
+      "{\"queues\": " + std::to_string(queues.size()) + ", \"submits\": [";
+  for (size_t i = 0; i < queues.size(); i++) {
+    LOG("Queue %zu (%s, family %u): submitted after %s us in %s us\n", i,
+        QueueTypeToString(queues[i]), device->queueFamilyIndices[i],
+        FormatUs(skew_ns[i]).c_str(), FormatUs(submit_ns[i]).c_str());
+    json += std::string(i == 0 ? "" : ", ") + "{\"queue\": \"" +
+            QueueTypeToString(queues[i]) + "\", \"family\": " +
+            std::to_string(device->queueFamilyIndices[i]) +
+            ", \"start_skew_us\": " + FormatUs(skew_ns[i]) +
+            ", \"submit_us\": " + FormatUs(submit_ns[i]) + "}";
+  }
+  SetRunReportValue("queue_fanout", json + "]}");
 }
 
 // Run our test.
 int main(int argc, char* argv[]) {
   Initialize();
+  DefineFlag("--queues",
+             "Comma separated queue types to hang, or all for every queue of "
+             "the family selected for each type. Default "
+             "graphics,compute,compute.");
   InitFlags(argc, argv);
 
   VulkanContext context;
   if (!InitVulkanInstance(&context)) {
     return 1;
   }
-  std::vector<QueueType> queues = {QueueType::Graphics, QueueType::Compute,
-                                   QueueType::Compute};
-  if (!InitVulkanDevice(&context, nullptr, "infinite_loop.comp.spv", &queues)) {
+  const char* spec = GetFlag("--queues") && *GetFlag("--queues")
+                         ? GetFlag("--queues")
+                         : "graphics,compute,compute";
+  std::vector<QueueType> queues = ParseQueueList(&context, spec);
+  if (queues.empty() ||
+      !InitVulkanDevice(&context, nullptr, "infinite_loop.comp.spv", &queues)) {
     return 1;
   }
 
-  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+  VK_CHECK_RESULT(RunWithCrashCheck(context, [&queues](VulkanContext& ctx) {
+    TestVulkan(ctx, queues);
+  }));
 
   Finalize();
   return 0;
@@ -0,0 +1,265 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include <random>
+
+#include "common.h"
+
+// A submission of the graph: it waits on the values signaled by earlier nodes
+// and signals the next value of its semaphore.
+struct DagNode {
+  uint32_t queue;
+  uint32_t semaphore;
+  uint64_t value;
+  std::vector<uint32_t> waits;  // Indices of earlier nodes.
+  uint32_t depth = 0;           // Longest wait chain to this node.
+  bool blocked = false;         // Never runs, because of the blocking edge.
+};
+
+// Builds nodes in submission order using --dag_* flags. Each node signals one
+// of semaphore_count semaphores and waits on the previous value of that
+// semaphore, so that its values are signaled in order even across queues, and
+// on up to fan_in - 1 random earlier nodes.
+std::vector<DagNode> BuildDag(uint32_t node_count, uint32_t semaphore_count,
+                              uint32_t queue_count, uint32_t fan_in,
+                              uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<DagNode> nodes(node_count);
+  std::vector<uint64_t> values(semaphore_count, 0);
+  std::vector<int64_t> last_node(semaphore_count, -1);
+  for (uint32_t i = 0; i < node_count; i++) {
+    auto& node = nodes[i];
+    node.queue = rng() % queue_count;
+    node.semaphore = rng() % semaphore_count;
+    node.value = ++values[node.semaphore];
+    if (last_node[node.semaphore] >= 0) {
+      node.waits.push_back(static_cast<uint32_t>(last_node[node.semaphore]));
+    }
+    last_node[node.semaphore] = i;
+    for (uint32_t j = 1; j < fan_in && i > 0; j++) {
+      uint32_t wait = rng() % i;
+      if (std::find(node.waits.begin(), node.waits.end(), wait) ==
+          node.waits.end()) {
+        node.waits.push_back(wait);
+      }
+    }
+    for (auto wait : node.waits) {
+      node.depth = std::max(node.depth, nodes[wait].depth + 1);
+    }
+  }
+  return nodes;
+}
+
+void TestVulkan(VulkanContext& context) {
+  auto device = context.GetSingleDevice();
+  auto vk_device = device->device;
+
+  AllocateInputOutputBuffers(device, BufferInitialization::Default);
+
+  CreateDescriptorSets(device);
+
+  const uint32_t node_count = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--dag_nodes", 4096), 1));
+  const uint32_t semaphore_count = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--dag_semaphores", 256), 1));
+  const uint32_t fan_in = static_cast<uint32_t>(
+      std::max<uint64_t>(GetFlagUint("--dag_fan_in", 3), 1));
+  const uint32_t queue_count = static_cast<uint32_t>(device->loadQueueBegin);
+
+  auto build_start = std::chrono::steady_clock::now();
+  auto nodes = BuildDag(node_count, semaphore_count, queue_count, fan_in,
+                        static_cast<uint32_t>(GetFlagUint("--dag_seed", 1)));
+  uint32_t max_depth = 0;
+  for (const auto& node : nodes) {
+    max_depth = std::max(max_depth, node.depth);
+  }
+
+  // The blocking edge is added to the first node at --dag_block_depth, or the
+  // deepest node if the graph is not that deep.
+  uint32_t block_depth = std::min<uint32_t>(
+      static_cast<uint32_t>(GetFlagUint("--dag_block_depth", max_depth / 2)),
+      max_depth);
+  uint32_t block_node = 0;
+  while (nodes[block_node].depth < block_depth) {
+    block_node++;
+  }
+  uint32_t blocked_count = 0;
+  for (uint32_t i = block_node; i < node_count; i++) {
+    auto& node = nodes[i];
+    node.blocked = i == block_node;
+    for (auto wait : node.waits) {
+      node.blocked = node.blocked || nodes[wait].blocked;
+    }
+    blocked_count += node.blocked ? 1 : 0;
+  }
+
+  std::vector<VkSemaphore> semaphores(semaphore_count);
+  CreateTimelineSemaphores(device, semaphores.data(), semaphore_count, 0);
+  for (uint32_t i = 0; i < semaphore_count; i++) {
+    std::string name = "DAG TimelineSemaphore " + std::to_string(i);
+    SetObjectDebugName(device, semaphores[i], VK_OBJECT_TYPE_SEMAPHORE,
+                       name.c_str());
+  }
+  VkSemaphore never_signaled;
+  CreateTimelineSemaphores(device, &never_signaled, 1, 0);
+  SetObjectDebugName(device, never_signaled, VK_OBJECT_TYPE_SEMAPHORE,
+                     "Never-signaled TimelineSemaphore");
+  auto build_ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - build_start)
+                      .count();
+
+  // All the nodes of a queue run the same command buffer. It is empty on the
+  // queues without compute, whose nodes only wait and signal.
+  uint32_t family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, nullptr);
+  std::vector<VkQueueFamilyProperties> families(family_count);
+  vkGetPhysicalDeviceQueueFamilyProperties(device->physicalDevice,
+                                           &family_count, families.data());
+  VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+  commandBufferAllocateInfo.sType =
+      VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  commandBufferAllocateInfo.commandBufferCount = 1;
+  std::vector<VkCommandBuffer> command_buffers(queue_count);
+  for (uint32_t i = 0; i < queue_count; i++) {
+    commandBufferAllocateInfo.commandPool = device->commandPools[i];
+    VK_CHECK_RESULT(
+        device->vk.AllocateCommandBuffers(vk_device, &commandBufferAllocateInfo,
+                                          &command_buffers[i]));
+    std::string name = "DAG CommandBuffer " + std::to_string(i);
+    SetObjectDebugName(device, command_buffers[i],
+                       VK_OBJECT_TYPE_COMMAND_BUFFER, name.c_str());
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    VK_CHECK_RESULT(
+        device->vk.BeginCommandBuffer(command_buffers[i],
+                                      &commandBufferBeginInfo));
+    if (families[device->queueFamilyIndices[i]].queueFlags &
+        VK_QUEUE_COMPUTE_BIT) {
+      device->vk.CmdBindPipeline(command_buffers[i],
+                                 VK_PIPELINE_BIND_POINT_COMPUTE,
+                                 device->pipeline);
+      device->vk.CmdBindDescriptorSets(command_buffers[i],
+                                       VK_PIPELINE_BIND_POINT_COMPUTE,
+                                       device->pipelineLayout, 0, 1,
+                                       &device->descriptorSet, 0, nullptr);
+      device->vk.CmdDispatch(command_buffers[i], 1, 1, 1);
+    }
+    VK_CHECK_RESULT(device->vk.EndCommandBuffer(command_buffers[i]));
+  }
+
+  LOG("Submitting %u nodes on %u semaphores and %u queues, max depth %u, "
+      "blocking node %u at depth %u blocks %u nodes\n",
+      node_count, semaphore_count, queue_count, max_depth, block_node,
+      block_depth, blocked_count);
+  size_t wait_count = 0;
+  auto submit_start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < node_count; i++) {
+    const auto& node = nodes[i];
+    std::vector<VkSemaphore> wait_semaphores;
+    std::vector<uint64_t> wait_values;
+    for (auto wait : node.waits) {
+      wait_semaphores.push_back(semaphores[nodes[wait].semaphore]);
+      wait_values.push_back(nodes[wait].value);
+    }
+    if (i == block_node) {
+      // TEST - Wait on a timeline semaphore that we never signal
+      wait_semaphores.push_back(never_signaled);
+      wait_values.push_back(1);
+    }
+    if (i == block_node) {
+      RunStressSubmits(device, device->queues[node.queue]);
+    }
+    wait_count += wait_semaphores.size();
+    std::vector<VkPipelineStageFlags> wait_stages(
+        wait_semaphores.size(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    std::vector<VkSemaphore> signal_semaphores{semaphores[node.semaphore]};
+    std::vector<uint64_t> signal_values{node.value};
+
+    auto timelineSubmitInfo =
+        CreateTimelineSemaphoreSubmitInfo(&wait_values, &signal_values);
+    VkSubmitInfo submitInfo =
+        CreateSubmitInfo(&command_buffers[node.queue], &wait_semaphores,
+                         &wait_stages, &signal_semaphores, &timelineSubmitInfo);
+    VK_VALIDATE_RESULT(QueueSubmit(device, device->queues[node.queue], 1,
+                                   &submitInfo, VK_NULL_HANDLE));
+  }
+  auto submit_ms = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - submit_start)
+                       .count();
+  LOG("Built the graph in %.1f ms, submitted it in %.1f ms\n", build_ms,
+      submit_ms);
+
+  // The blocking node waits on the never signaled semaphore, and so never
+  // signals its own.
+  const auto& blocking = nodes[block_node];
+  char json[640];
+  snprintf(json, sizeof(json),
+           "{\"nodes\": %u, \"semaphores\": %u, \"queues\": %u, "
+           "\"waits\": %zu, \"max_depth\": %u, \"block_node\": %u, "
+           "\"block_depth\": %u, \"blocked_nodes\": %u, "
+           "\"blocking_semaphore\": \"Never-signaled TimelineSemaphore\", "
+           "\"blocking_value\": 1, "
+           "\"blocked_semaphore\": \"DAG TimelineSemaphore %u\", "
+           "\"blocked_value\": %llu, \"build_ms\": %.3f, "
+           "\"submit_ms\": %.3f}",
+           node_count, semaphore_count, queue_count, wait_count, max_depth,
+           block_node, block_depth, blocked_count, blocking.semaphore,
+           static_cast<unsigned long long>(blocking.value), build_ms,
+           submit_ms);
+  SetRunReportValue("timeline_dag", json);
+}
+
+// Run our test.
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--dag_nodes", "Number of submissions of the graph.");
+  DefineFlag("--dag_semaphores",
+             "Number of timeline semaphores signaled by the graph.");
+  DefineFlag("--dag_fan_in", "Maximum number of waits of a submission.");
+  DefineFlag("--dag_block_depth",
+             "Depth of the wait that is never satisfied, default half of the "
+             "graph depth.");
+  DefineFlag("--dag_seed", "Seed of the random graph.");
+  DefineFlag("--queues",
+             "Comma separated queue types to submit the graph to, or all for "
+             "every queue of the device. Default graphics,compute.");
+  InitFlags(argc, argv);
+
+  VulkanContext context;
+  if (!InitVulkanInstance(&context)) {
+    return 1;
+  }
+  const char* spec = GetFlag("--queues") && *GetFlag("--queues")
+                         ? GetFlag("--queues")
+                         : "graphics,compute";
+  std::vector<QueueType> queues = ParseQueueList(&context, spec);
+  std::vector<const char*> device_extensions;
+  device_extensions.push_back("VK_KHR_timeline_semaphore");
+  if (queues.empty() ||
+      !InitVulkanDevice(&context, &device_extensions, "read_write.comp.spv",
+                        &queues)) {
+    return 1;
+  }
+  SetupWatchdogTimer(&context);
+  VK_CHECK_RESULT(RunWithCrashCheck(context, TestVulkan));
+
+  Finalize();
+  return 0;
+}
@@ -0,0 +1,836 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+#include "common.h"
+
+#include <sys/stat.h>
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Replays a trace written with --trace: creates the objects of the trace on a
+// new device and issues its calls again, as fast as possible, --loops times.
+
+// A record of the trace, with its operands in place.
+struct ReplayRecord {
+  TraceOp op;
+  const uint64_t* operands;
+  uint32_t words;
+};
+
+// Reads the operands of a record, zeros past its end.
+struct Operands {
+  const uint64_t* next;
+  const uint64_t* end;
+
+  explicit Operands(const ReplayRecord& record)
+      : next(record.operands), end(record.operands + record.words) {}
+
+  uint64_t Next() { return next < end ? *next++ : 0; }
+  uint32_t Next32() { return static_cast<uint32_t>(Next()); }
+
+  // Returns a byte string, and its size in *size.
+  const uint8_t* Bytes(size_t* size) {
+    *size = static_cast<size_t>(Next());
+    size_t words = std::min<size_t>((*size + sizeof(uint64_t) - 1) /
+                                        sizeof(uint64_t),
+                                    end - next);
+    *size = std::min(*size, words * sizeof(uint64_t));
+    auto data = reinterpret_cast<const uint8_t*>(next);
+    next += words;
+    return data;
+  }
+};
+
+// The objects of the trace on the replay device, by their recorded handle.
+struct Replay {
+  VulkanDevice* device;
+  MemoryArena arena;
+  std::unordered_map<uint64_t, VkBuffer> buffers;
+  std::unordered_map<uint64_t, VkPipeline> pipelines;
+  std::unordered_map<uint64_t, VkDescriptorSet> descriptorSets;
+  std::unordered_map<uint64_t, VkSemaphore> semaphores;
+  std::unordered_set<uint64_t> timelineSemaphores;
+  std::unordered_map<uint64_t, VkEvent> events;
+  std::unordered_map<uint64_t, VkFence> fences;
+  std::unordered_map<uint64_t, VkCommandPool> commandPools;
+  std::unordered_map<uint64_t, VkCommandBuffer> commandBuffers;
+  std::unordered_set<uint64_t> secondaryCommandBuffers;
+  std::vector<VkDescriptorPool> descriptorPools;
+
+  // The objects whose handle was reused by a later object of the trace. They
+  // may still be used by pending work, and are destroyed with the others.
+  std::vector<VkBuffer> retiredBuffers;
+  std::vector<VkPipeline> retiredPipelines;
+  std::vector<VkSemaphore> retiredSemaphores;
+  std::vector<VkEvent> retiredEvents;
+  std::vector<VkFence> retiredFences;
+  std::vector<VkCommandPool> retiredCommandPools;
+
+  // Scratch storage of the calls, kept to avoid allocations.
+  std::vector<VkCommandBuffer> commandBufferArgs;
+  std::vector<VkDescriptorSet> descriptorSetArgs;
+  std::vector<VkEvent> eventArgs;
+  std::vector<VkFence> fenceArgs;
+  std::vector<uint32_t> offsetArgs;
+  std::vector<VkBufferCopy> regionArgs;
+  std::vector<VkMemoryBarrier> memoryBarrierArgs;
+  std::vector<VkBufferMemoryBarrier> bufferBarrierArgs;
+};
+
+template <typename T>
+static T Find(const std::unordered_map<uint64_t, T>& handles, uint64_t id) {
+  auto it = handles.find(id);
+  return it == handles.end() ? T() : it->second;
+}
+
+// Maps the recorded handle id to handle, retiring the object it mapped to.
+template <typename T>
+static void Store(std::unordered_map<uint64_t, T>* handles,
+                  std::vector<T>* retired, uint64_t id, T handle) {
+  auto it = handles->find(id);
+  if (it != handles->end()) {
+    retired->push_back(it->second);
+    it->second = handle;
+    return;
+  }
+  (*handles)[id] = handle;
+}
+
+// Maps the trace, or reads it where it can't be mapped. The trace is never
+// unmapped.
+static bool OpenTrace(const char* path, const uint8_t** data, size_t* size) {
+#ifndef WINDOWS
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    LOG("Invalid File '%s' - %d: %s\n", path, errno, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    LOG("Invalid length '%s' - %d: %s\n", path, errno, strerror(errno));
+    close(fd);
+    return false;
+  }
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG("Unable to map '%s' - %d: %s\n", path, errno, strerror(errno));
+    return false;
+  }
+  *data = static_cast<const uint8_t*>(mapped);
+  *size = st.st_size;
+  return true;
+#else
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    LOG("Invalid File '%s' - %d: %s\n", path, errno, strerror(errno));
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  auto fileLen = ftell(f);
+  if (fileLen <= 0) {
+    LOG("Invalid length '%s' - %d: %s\n", path, errno, strerror(errno));
+    fclose(f);
+    return false;
+  }
+  fseek(f, 0, SEEK_SET);
+  // uint64_t storage keeps the operands aligned.
+  static std::vector<uint64_t> buffer;
+  buffer.resize((fileLen + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  fread(buffer.data(), 1, fileLen, f);
+  fclose(f);
+  *data = reinterpret_cast<const uint8_t*>(buffer.data());
+  *size = fileLen;
+  return true;
+#endif
+}
+
+// Splits the trace into its records. Fails if the trace is truncated in the
+// middle of a record, or if it has Unsupported records.
+static bool ParseTrace(const char* path, const uint8_t* data, size_t size,
+                       std::vector<ReplayRecord>* records) {
+  TraceHeader header;
+  if (size < sizeof(header)) {
+    LOG("%s is not a trace\n", path);
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != kTraceMagic || header.version != kTraceVersion) {
+    LOG("%s is not a trace of version %u\n", path, kTraceVersion);
+    return false;
+  }
+
+  bool supported = true;
+  size_t offset = sizeof(header);
+  while (offset + sizeof(TraceRecord) <= size) {
+    TraceRecord record;
+    memcpy(&record, data + offset, sizeof(record));
+    offset += sizeof(record);
+    if (record.words > (size - offset) / sizeof(uint64_t)) {
+      // The process was killed while writing it.
+      LOG("The last record of %s is truncated\n", path);
+      break;
+    }
+    records->push_back({static_cast<TraceOp>(record.op),
+                        reinterpret_cast<const uint64_t*>(data + offset),
+                        record.words});
+    offset += record.words * sizeof(uint64_t);
+
+    if (records->back().op == TraceOp::Unsupported) {
+      Operands operands(records->back());
+      size_t description_size;
+      auto description = operands.Bytes(&description_size);
+      LOG("The trace can't be replayed: %.*s\n",
+          static_cast<int>(description_size), description);
+      supported = false;
+    }
+  }
+  if (records->empty() || records->front().op != TraceOp::Device) {
+    LOG("%s doesn't start with the device\n", path);
+    return false;
+  }
+  return supported;
+}
+
+static void ReadBarriers(Replay* replay, Operands* operands) {
+  replay->memoryBarrierArgs.resize(operands->Next32());
+  for (auto& barrier : replay->memoryBarrierArgs) {
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = operands->Next32();
+    barrier.dstAccessMask = operands->Next32();
+  }
+  replay->bufferBarrierArgs.resize(operands->Next32());
+  for (auto& barrier : replay->bufferBarrierArgs) {
+    barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    barrier.srcAccessMask = operands->Next32();
+    barrier.dstAccessMask = operands->Next32();
+    barrier.srcQueueFamilyIndex = operands->Next32();
+    barrier.dstQueueFamilyIndex = operands->Next32();
+    barrier.buffer = Find(replay->buffers, operands->Next());
+    barrier.offset = operands->Next();
+    barrier.size = operands->Next();
+  }
+}
+
+static VkResult CreateBuffer(Replay* replay, Operands* operands) {
+  uint64_t id = operands->Next();
+  VkBufferCreateInfo buffer_info = {};
+  buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  buffer_info.size = std::max<uint64_t>(operands->Next(), 1);
+  buffer_info.usage = static_cast<VkBufferUsageFlags>(operands->Next()) |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  size_t contents_size;
+  auto contents = operands->Bytes(&contents_size);
+
+  // Host visible, to write the contents.
+  VkBuffer buffer;
+  MemoryAllocation allocation;
+  if (ArenaCreateBuffer(&replay->arena, buffer_info,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                        &buffer, &allocation) != VK_SUCCESS) {
+    VK_RETURN_IF_FAIL(ArenaCreateBuffer(&replay->arena, buffer_info, 0,
+                                        &buffer, &allocation));
+  }
+  if (contents_size > 0) {
+    if (allocation.mapped != nullptr) {
+      memcpy(allocation.mapped, contents,
+             std::min<size_t>(contents_size, buffer_info.size));
+    } else {
+      LOG("No host visible memory for the content of buffer %llx\n",
+          static_cast<unsigned long long>(id));
+    }
+  }
+  Store(&replay->buffers, &replay->retiredBuffers, id, buffer);
+  return VK_SUCCESS;
+}
+
+static VkResult CreatePipeline(Replay* replay, Operands* operands) {
+  auto device = replay->device;
+  uint64_t id = operands->Next();
+  for (auto& size : device->workgroupSize) {
+    size = operands->Next32();
+  }
+  size_t code_size;
+  auto code = operands->Bytes(&code_size);
+  VkShaderModule module;
+  CreateShader(device->device, reinterpret_cast<const uint32_t*>(code),
+               code_size, module);
+  VkPipeline pipeline;
+  VkResult result = CreateComputePipeline(device, module,
+                                          device->pipelineLayout, &pipeline);
+  vkDestroyShaderModule(device->device, module, nullptr);
+  VK_RETURN_IF_FAIL(result);
+  Store(&replay->pipelines, &replay->retiredPipelines, id, pipeline);
+  return VK_SUCCESS;
+}
+
+static VkResult CreateDescriptorSet(Replay* replay, Operands* operands) {
+  auto device = replay->device;
+  auto vk_device = device->device;
+  uint64_t id = operands->Next();
+
+  VkDescriptorPoolSize pool_size = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2};
+  VkDescriptorPoolCreateInfo pool_info = {};
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = 1;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  VkDescriptorPool descriptor_pool;
+  VK_RETURN_IF_FAIL(vkCreateDescriptorPool(vk_device, &pool_info, nullptr,
+                                           &descriptor_pool));
+  replay->descriptorPools.push_back(descriptor_pool);
+
+  VkDescriptorSetAllocateInfo set_info = {};
+  set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  set_info.descriptorPool = descriptor_pool;
+  set_info.descriptorSetCount = 1;
+  set_info.pSetLayouts = &device->descriptorSetLayout;
+  VkDescriptorSet set;
+  VK_RETURN_IF_FAIL(vkAllocateDescriptorSets(vk_device, &set_info, &set));
+
+  VkDescriptorBufferInfo descriptor_buffers[2];
+  VkWriteDescriptorSet writes[2] = {};
+  for (uint32_t i = 0; i < 2; i++) {
+    descriptor_buffers[i].buffer = Find(replay->buffers, operands->Next());
+    descriptor_buffers[i].offset = operands->Next();
+    descriptor_buffers[i].range = operands->Next();
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = set;
+    writes[i].dstBinding = i;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[i].pBufferInfo = &descriptor_buffers[i];
+  }
+  vkUpdateDescriptorSets(vk_device, 2, writes, 0, nullptr);
+  replay->descriptorSets[id] = set;
+  return VK_SUCCESS;
+}
+
+static VkResult Submit(Replay* replay, Operands* operands) {
+  auto device = replay->device;
+  uint32_t queue_index = operands->Next32();
+  VkQueue queue = queue_index < device->queues.size()
+                      ? device->queues[queue_index]
+                      : device->queue;
+  VkFence fence = Find(replay->fences, operands->Next());
+  uint32_t submit_count = operands->Next32();
+
+  // Sized up front, the submits point into them.
+  std::vector<VkSubmitInfo> submits(submit_count);
+  std::vector<VkTimelineSemaphoreSubmitInfoKHR> timelines(submit_count);
+  std::vector<std::vector<VkSemaphore>> waits(submit_count);
+  std::vector<std::vector<VkPipelineStageFlags>> wait_stages(submit_count);
+  std::vector<std::vector<uint64_t>> wait_values(submit_count);
+  std::vector<std::vector<VkCommandBuffer>> command_buffers(submit_count);
+  std::vector<std::vector<VkSemaphore>> signals(submit_count);
+  std::vector<std::vector<uint64_t>> signal_values(submit_count);
+  for (uint32_t i = 0; i < submit_count; i++) {
+    bool timeline = false;
+    uint32_t wait_count = operands->Next32();
+    for (uint32_t j = 0; j < wait_count; j++) {
+      uint64_t id = operands->Next();
+      timeline |= replay->timelineSemaphores.count(id) != 0;
+      waits[i].push_back(Find(replay->semaphores, id));
+      wait_stages[i].push_back(operands->Next32());
+      wait_values[i].push_back(operands->Next());
+    }
+    uint32_t command_buffer_count = operands->Next32();
+    for (uint32_t j = 0; j < command_buffer_count; j++) {
+      command_buffers[i].push_back(
+          Find(replay->commandBuffers, operands->Next()));
+    }
+    uint32_t signal_count = operands->Next32();
+    for (uint32_t j = 0; j < signal_count; j++) {
+      uint64_t id = operands->Next();
+      timeline |= replay->timelineSemaphores.count(id) != 0;
+      signals[i].push_back(Find(replay->semaphores, id));
+      signal_values[i].push_back(operands->Next());
+    }
+
+    if (timeline) {
+      timelines[i].sType =
+          VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+      timelines[i].waitSemaphoreValueCount = wait_count;
+      timelines[i].pWaitSemaphoreValues = wait_values[i].data();
+      timelines[i].signalSemaphoreValueCount = signal_count;
+      timelines[i].pSignalSemaphoreValues = signal_values[i].data();
+    }
+    submits[i] = CreateSubmitInfo(command_buffers[i].data(), &waits[i],
+                                  &wait_stages[i], &signals[i],
+                                  timeline ? &timelines[i] : nullptr);
+    submits[i].commandBufferCount = command_buffer_count;
+  }
+  return QueueSubmit(device, queue, submit_count, submits.data(), fence);
+}
+
+// Creates the object of an object record, or issues the call of a call
+// record. Returns the first error.
+static VkResult ReplayOne(Replay* replay, const ReplayRecord& record) {
+  auto device = replay->device;
+  auto vk_device = device->device;
+  auto& vk = device->vk;
+  Operands operands(record);
+  switch (record.op) {
+    case TraceOp::Device:
+    case TraceOp::Unsupported:
+      return VK_SUCCESS;
+
+    case TraceOp::Buffer:
+      return CreateBuffer(replay, &operands);
+    case TraceOp::Pipeline:
+      return CreatePipeline(replay, &operands);
+    case TraceOp::DescriptorSet:
+      return CreateDescriptorSet(replay, &operands);
+    case TraceOp::Semaphore: {
+      uint64_t id = operands.Next();
+      auto type = static_cast<VkSemaphoreTypeKHR>(operands.Next());
+      uint64_t initial_value = operands.Next();
+      VkSemaphore semaphore;
+      CreateSemaphores(device, &semaphore, 1, type, initial_value);
+      Store(&replay->semaphores, &replay->retiredSemaphores, id, semaphore);
+      if (type == VK_SEMAPHORE_TYPE_TIMELINE_KHR) {
+        replay->timelineSemaphores.insert(id);
+      } else {
+        replay->timelineSemaphores.erase(id);
+      }
+      return VK_SUCCESS;
+    }
+    case TraceOp::Event: {
+      VkEventCreateInfo event_info = {};
+      event_info.sType = VK_STRUCTURE_TYPE_EVENT_CREATE_INFO;
+      VkEvent event;
+      VK_RETURN_IF_FAIL(vkCreateEvent(vk_device, &event_info, nullptr, &event));
+      Store(&replay->events, &replay->retiredEvents, operands.Next(), event);
+      return VK_SUCCESS;
+    }
+    case TraceOp::Fence: {
+      VkFenceCreateInfo fence_info = {};
+      fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+      VkFence fence;
+      VK_RETURN_IF_FAIL(vkCreateFence(vk_device, &fence_info, nullptr, &fence));
+      Store(&replay->fences, &replay->retiredFences, operands.Next(), fence);
+      return VK_SUCCESS;
+    }
+    case TraceOp::CommandPool: {
+      uint64_t id = operands.Next();
+      VkCommandPoolCreateInfo pool_info = {};
+      pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+      // The command buffers may be reset by vkBeginCommandBuffer.
+      pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+      pool_info.queueFamilyIndex = operands.Next32();
+      VkCommandPool pool;
+      VK_RETURN_IF_FAIL(
+          vkCreateCommandPool(vk_device, &pool_info, nullptr, &pool));
+      Store(&replay->commandPools, &replay->retiredCommandPools, id, pool);
+      return VK_SUCCESS;
+    }
+
+    case TraceOp::AllocateCommandBuffers: {
+      VkCommandBufferAllocateInfo allocate_info = {};
+      allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocate_info.commandPool = Find(replay->commandPools, operands.Next());
+      allocate_info.level = static_cast<VkCommandBufferLevel>(operands.Next());
+      allocate_info.commandBufferCount = operands.Next32();
+      auto& command_buffers = replay->commandBufferArgs;
+      command_buffers.resize(allocate_info.commandBufferCount);
+      VK_RETURN_IF_FAIL(vk.AllocateCommandBuffers(vk_device, &allocate_info,
+                                                  command_buffers.data()));
+      for (auto command_buffer : command_buffers) {
+        uint64_t id = operands.Next();
+        replay->commandBuffers[id] = command_buffer;
+        if (allocate_info.level == VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+          replay->secondaryCommandBuffers.insert(id);
+        }
+      }
+      return VK_SUCCESS;
+    }
+    case TraceOp::ResetCommandPool: {
+      VkCommandPool pool = Find(replay->commandPools, operands.Next());
+      return vk.ResetCommandPool(vk_device, pool, operands.Next32());
+    }
+    case TraceOp::BeginCommandBuffer: {
+      uint64_t id = operands.Next();
+      VkCommandBufferInheritanceInfo inheritance_info = {};
+      inheritance_info.sType =
+          VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+      VkCommandBufferBeginInfo begin_info = {};
+      begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+      begin_info.flags = operands.Next32();
+      if (replay->secondaryCommandBuffers.count(id) != 0) {
+        begin_info.pInheritanceInfo = &inheritance_info;
+      }
+      return vk.BeginCommandBuffer(Find(replay->commandBuffers, id),
+                                   &begin_info);
+    }
+    case TraceOp::EndCommandBuffer:
+      return vk.EndCommandBuffer(
+          Find(replay->commandBuffers, operands.Next()));
+    case TraceOp::CmdBindPipeline: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      auto bind_point = static_cast<VkPipelineBindPoint>(operands.Next());
+      vk.CmdBindPipeline(command_buffer, bind_point,
+                         Find(replay->pipelines, operands.Next()));
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdBindDescriptorSets: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      auto bind_point = static_cast<VkPipelineBindPoint>(operands.Next());
+      uint32_t first_set = operands.Next32();
+      auto& sets = replay->descriptorSetArgs;
+      sets.resize(operands.Next32());
+      for (auto& set : sets) {
+        set = Find(replay->descriptorSets, operands.Next());
+      }
+      auto& offsets = replay->offsetArgs;
+      offsets.resize(operands.Next32());
+      for (auto& offset : offsets) {
+        offset = operands.Next32();
+      }
+      vk.CmdBindDescriptorSets(command_buffer, bind_point,
+                               device->pipelineLayout, first_set,
+                               static_cast<uint32_t>(sets.size()),
+                               sets.data(),
+                               static_cast<uint32_t>(offsets.size()),
+                               offsets.data());
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdDispatch: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      uint32_t x = operands.Next32();
+      uint32_t y = operands.Next32();
+      vk.CmdDispatch(command_buffer, x, y, operands.Next32());
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdCopyBuffer: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      VkBuffer src = Find(replay->buffers, operands.Next());
+      VkBuffer dst = Find(replay->buffers, operands.Next());
+      auto& regions = replay->regionArgs;
+      regions.resize(operands.Next32());
+      for (auto& region : regions) {
+        region.srcOffset = operands.Next();
+        region.dstOffset = operands.Next();
+        region.size = operands.Next();
+      }
+      vk.CmdCopyBuffer(command_buffer, src, dst,
+                       static_cast<uint32_t>(regions.size()), regions.data());
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdFillBuffer: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      VkBuffer buffer = Find(replay->buffers, operands.Next());
+      VkDeviceSize offset = operands.Next();
+      VkDeviceSize size = operands.Next();
+      vk.CmdFillBuffer(command_buffer, buffer, offset, size,
+                       operands.Next32());
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdPipelineBarrier: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      VkPipelineStageFlags src_stages = operands.Next32();
+      VkPipelineStageFlags dst_stages = operands.Next32();
+      VkDependencyFlags dependency_flags = operands.Next32();
+      ReadBarriers(replay, &operands);
+      vk.CmdPipelineBarrier(
+          command_buffer, src_stages, dst_stages, dependency_flags,
+          static_cast<uint32_t>(replay->memoryBarrierArgs.size()),
+          replay->memoryBarrierArgs.data(),
+          static_cast<uint32_t>(replay->bufferBarrierArgs.size()),
+          replay->bufferBarrierArgs.data(), 0, nullptr);
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdSetEvent:
+    case TraceOp::CmdResetEvent: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      VkEvent event = Find(replay->events, operands.Next());
+      VkPipelineStageFlags stages = operands.Next32();
+      if (record.op == TraceOp::CmdSetEvent) {
+        vk.CmdSetEvent(command_buffer, event, stages);
+      } else {
+        vk.CmdResetEvent(command_buffer, event, stages);
+      }
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdWaitEvents: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      auto& events = replay->eventArgs;
+      events.resize(operands.Next32());
+      for (auto& event : events) {
+        event = Find(replay->events, operands.Next());
+      }
+      VkPipelineStageFlags src_stages = operands.Next32();
+      VkPipelineStageFlags dst_stages = operands.Next32();
+      ReadBarriers(replay, &operands);
+      vk.CmdWaitEvents(
+          command_buffer, static_cast<uint32_t>(events.size()), events.data(),
+          src_stages, dst_stages,
+          static_cast<uint32_t>(replay->memoryBarrierArgs.size()),
+          replay->memoryBarrierArgs.data(),
+          static_cast<uint32_t>(replay->bufferBarrierArgs.size()),
+          replay->bufferBarrierArgs.data(), 0, nullptr);
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdExecuteCommands: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      auto& secondaries = replay->commandBufferArgs;
+      secondaries.resize(operands.Next32());
+      for (auto& secondary : secondaries) {
+        secondary = Find(replay->commandBuffers, operands.Next());
+      }
+      vk.CmdExecuteCommands(command_buffer,
+                            static_cast<uint32_t>(secondaries.size()),
+                            secondaries.data());
+      return VK_SUCCESS;
+    }
+    case TraceOp::CmdWriteBufferMarker: {
+      auto command_buffer = Find(replay->commandBuffers, operands.Next());
+      auto stage = static_cast<VkPipelineStageFlagBits>(operands.Next());
+      VkBuffer buffer = Find(replay->buffers, operands.Next());
+      VkDeviceSize offset = operands.Next();
+      CmdWriteBufferMarker(device, command_buffer, stage, buffer, offset,
+                           operands.Next32());
+      return VK_SUCCESS;
+    }
+    case TraceOp::QueueSubmit:
+      return Submit(replay, &operands);
+    case TraceOp::QueueWaitIdle: {
+      uint32_t queue_index = operands.Next32();
+      return vk.QueueWaitIdle(queue_index < device->queues.size()
+                                  ? device->queues[queue_index]
+                                  : device->queue);
+    }
+    case TraceOp::WaitForFences:
+    case TraceOp::ResetFences: {
+      auto& fences = replay->fenceArgs;
+      fences.resize(operands.Next32());
+      for (auto& fence : fences) {
+        fence = Find(replay->fences, operands.Next());
+      }
+      if (record.op == TraceOp::ResetFences) {
+        return vk.ResetFences(vk_device, static_cast<uint32_t>(fences.size()),
+                              fences.data());
+      }
+      VkBool32 wait_all = operands.Next32();
+      VkResult result = vk.WaitForFences(
+          vk_device, static_cast<uint32_t>(fences.size()), fences.data(),
+          wait_all, operands.Next());
+      // The scenarios may wait with a timeout on purpose.
+      return result == VK_TIMEOUT ? VK_SUCCESS : result;
+    }
+  }
+  LOG("Unknown trace record %u\n", static_cast<uint32_t>(record.op));
+  return VK_SUCCESS;
+}
+
+// Waits for the queues and destroys the objects of the last loop.
+static void DestroyReplayObjects(Replay* replay) {
+  auto device = replay->device;
+  auto vk_device = device->device;
+  for (auto queue : device->queues) {
+    VK_CHECK_RESULT(device->vk.QueueWaitIdle(queue));
+  }
+  for (const auto& kv : replay->commandPools) {
+    vkDestroyCommandPool(vk_device, kv.second, nullptr);
+  }
+  for (auto pool : replay->retiredCommandPools) {
+    vkDestroyCommandPool(vk_device, pool, nullptr);
+  }
+  for (auto descriptor_pool : replay->descriptorPools) {
+    vkDestroyDescriptorPool(vk_device, descriptor_pool, nullptr);
+  }
+  for (const auto& kv : replay->pipelines) {
+    vkDestroyPipeline(vk_device, kv.second, nullptr);
+  }
+  for (auto pipeline : replay->retiredPipelines) {
+    vkDestroyPipeline(vk_device, pipeline, nullptr);
+  }
+  for (const auto& kv : replay->buffers) {
+    vkDestroyBuffer(vk_device, kv.second, nullptr);
+  }
+  for (auto buffer : replay->retiredBuffers) {
+    vkDestroyBuffer(vk_device, buffer, nullptr);
+  }
+  for (const auto& kv : replay->semaphores) {
+    vkDestroySemaphore(vk_device, kv.second, nullptr);
+  }
+  for (auto semaphore : replay->retiredSemaphores) {
+    vkDestroySemaphore(vk_device, semaphore, nullptr);
+  }
+  for (const auto& kv : replay->events) {
+    vkDestroyEvent(vk_device, kv.second, nullptr);
+  }
+  for (auto event : replay->retiredEvents) {
+    vkDestroyEvent(vk_device, event, nullptr);
+  }
+  for (const auto& kv : replay->fences) {
+    vkDestroyFence(vk_device, kv.second, nullptr);
+  }
+  for (auto fence : replay->retiredFences) {
+    vkDestroyFence(vk_device, fence, nullptr);
+  }
+  DestroyMemoryArena(&replay->arena);
+  replay->commandPools.clear();
+  replay->commandBuffers.clear();
+  replay->secondaryCommandBuffers.clear();
+  replay->descriptorPools.clear();
+  replay->descriptorSets.clear();
+  replay->pipelines.clear();
+  replay->buffers.clear();
+  replay->semaphores.clear();
+  replay->timelineSemaphores.clear();
+  replay->events.clear();
+  replay->fences.clear();
+  replay->retiredBuffers.clear();
+  replay->retiredPipelines.clear();
+  replay->retiredSemaphores.clear();
+  replay->retiredEvents.clear();
+  replay->retiredFences.clear();
+  replay->retiredCommandPools.clear();
+}
+
+// Replays the records loops times, each loop with new objects, and adds the
+// replay times to the run report. Stops at the first error.
+static void ReplayTrace(VulkanDevice* device,
+                        const std::vector<ReplayRecord>& records,
+                        uint64_t loops) {
+  Replay replay;
+  replay.device = device;
+  InitMemoryArena(&replay.arena, device);
+
+  size_t calls = 0;
+  for (const auto& record : records) {
+    calls += record.op >= TraceOp::AllocateCommandBuffers &&
+             record.op != TraceOp::Unsupported;
+  }
+  LOG("Replaying %zu records, %zu calls, %llu times\n", records.size(), calls,
+      static_cast<unsigned long long>(loops));
+
+  std::vector<int64_t> loop_ns;
+  VkResult result = VK_SUCCESS;
+  for (uint64_t loop = 0; loop < loops && result == VK_SUCCESS; loop++) {
+    if (loop > 0) {
+      DestroyReplayObjects(&replay);
+      InitMemoryArena(&replay.arena, device);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& record : records) {
+      result = ReplayOne(&replay, record);
+      if (result != VK_SUCCESS) {
+        LOG("Loop %llu stopped at a %u record: %d\n",
+            static_cast<unsigned long long>(loop),
+            static_cast<uint32_t>(record.op), result);
+        OnVulkanError(result);
+        break;
+      }
+    }
+    if (result == VK_SUCCESS) {
+      loop_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+      LOG("Loop %llu replayed in %s us\n",
+          static_cast<unsigned long long>(loop),
+          FormatUs(loop_ns.back()).c_str());
+    }
+  }
+
+  int64_t total_ns = 0;
+  for (auto ns : loop_ns) {
+    total_ns += ns;
+  }
+  std::string json =
+      "{\"records\": " + std::to_string(records.size()) +
+      ", \"calls\": " + std::to_string(calls) +
+      ", \"loops\": " + std::to_string(loops) +
+      ", \"completed_loops\": " + std::to_string(loop_ns.size()) +
+      ", \"mean_loop_us\": " +
+      FormatUs(loop_ns.empty() ? -1 : total_ns / (int64_t)loop_ns.size()) +
+      ", \"min_loop_us\": " +
+      FormatUs(loop_ns.empty()
+                   ? -1
+                   : *std::min_element(loop_ns.begin(), loop_ns.end())) +
+      ", \"max_loop_us\": " +
+      FormatUs(loop_ns.empty()
+                   ? -1
+                   : *std::max_element(loop_ns.begin(), loop_ns.end())) +
+      "}";
+  SetRunReportValue("replay", json);
+}
+
+int main(int argc, char* argv[]) {
+  Initialize();
+  DefineFlag("--replay", "Trace written with --trace to replay.");
+  DefineFlag("--loops",
+             "Number of times the trace is replayed, each time with new "
+             "objects, default 1.");
+  InitFlags(argc, argv);
+
+  const char* path = GetFlag("--replay");
+  if (path == nullptr || *path == '\0') {
+    LOG("Usage: hcf_replay --replay=trace [--loops=N]\n");
+    return 1;
+  }
+  const uint8_t* data;
+  size_t size;
+  std::vector<ReplayRecord> records;
+  if (!OpenTrace(path, &data, &size) ||
+      !ParseTrace(path, data, size, &records)) {
+    return 1;
+  }
+
+  // The queues and extensions of the traced device.
+  Operands operands(records.front());
+  std::vector<QueueType> queues(operands.Next32());
+  for (auto& queue : queues) {
+    queue = static_cast<QueueType>(operands.Next32());
+  }
+  std::vector<std::string> extension_names(operands.Next32());
+  std::vector<const char*> device_extensions;
+  for (auto& name : extension_names) {
+    size_t name_size;
+    auto name_data = operands.Bytes(&name_size);
+    name.assign(reinterpret_cast<const char*>(name_data), name_size);
+    device_extensions.push_back(name.c_str());
+  }
+
+  // The shader gives the device the descriptor set and pipeline layouts of
+  // the traced pipelines.
+  VulkanContext context;
+  if (!InitVulkan(&context, &device_extensions, "read_write.comp.spv",
+                  &queues)) {
+    return 1;
+  }
+  const uint64_t loops = std::max<uint64_t>(GetFlagUint("--loops", 1), 1);
+  VK_CHECK_RESULT(RunWithCrashCheck(context, [&](VulkanContext& ctx) {
+    ReplayTrace(ctx.GetSingleDevice(), records, loops);
+  }));
+
+  Finalize();
+  return 0;
+}
@@ -28,23 +28,25 @@ void TestVulkan(VulkanContext& context) {
   VK_CHECK_RESULT(CreateAndRecordCommandBuffers(
       device, &primary_cb, &secondary_cb,
       [device](VkCommandBuffer cb) {
-        vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE, device->pipeline);
+        device->vk.CmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                   device->pipeline);
 
-        vkCmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
-                                device->pipelineLayout, 0, 1,
-                                &device->descriptorSet, 0, nullptr);
+        device->vk.CmdBindDescriptorSets(cb, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                         device->pipelineLayout, 0, 1,
+                                         &device->descriptorSet, 0, nullptr);
 
-        vkCmdDispatch(cb, 1, 1, 1);
+        CmdDispatchFault(device, cb);
       },
       "CRASH Dispatch"));
 
   // submit buffer to queue
   VkSubmitInfo submitInfo = CreateSubmitInfo(&primary_cb);
 
+  RunStressSubmits(device, device->queue);
   LOG("Submit 1...\n");
   // NOTE: this should timeout/hang
   VK_VALIDATE_RESULT(
-      vkQueueSubmit(device->queue, 1, &submitInfo, VK_NULL_HANDLE));
+      QueueSubmit(device, device->queue, 1, &submitInfo, VK_NULL_HANDLE));
 }
 
 // Run our test.
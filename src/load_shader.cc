@@ -16,19 +16,494 @@
 
 #include "common.h"
 
+#include <sys/stat.h>
+#ifndef WINDOWS
+#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <set>
+
 void PrintUsage() {
   fprintf(stderr,
           "USAGE: [-v vulkan version] [-d device extensions] [-i instance "
-          "extension] [-l layer] spriv-file\n");
+          "extension] [-l layer] [-p] spriv-file\n");
+  fprintf(stderr,
+          "       [...] -b [-p] [-c] [-j jobs] [-J journal [-r]] directory or "
+          "list-file\n");
 
   fprintf(stderr,
           "\tMultiple extensions and layer can be enabled by passing multiple "
           "-i/-d/-l options\n");
+  fprintf(stderr,
+          "\t-p also creates a compute pipeline with the default layout, "
+          "through the pipeline cache\n");
+  fprintf(stderr,
+          "\t-b creates the modules of every .spv file of the directory, or "
+          "of every path of the list file, on -j threads (default one per "
+          "core)\n");
+  fprintf(stderr,
+          "\t   -p then creates a compute pipeline for each compute shader, "
+          "with a layout matching its resources, and -c creates them "
+          "through the pipeline cache\n");
+  fprintf(stderr,
+          "\t   -J appends the shaders started and done to a journal, and -r "
+          "skips the ones done or started but not done in it\n");
+}
+
+// Batch mode
+
+// A SPIR-V file of the batch, and how long it took to compile.
+struct BatchShader {
+  std::string path;
+  int64_t module_ns = -1;
+  int64_t pipeline_ns = -1;  // -1 if no pipeline was created.
+  VkResult result = VK_SUCCESS;
+};
+
+// What a compute pipeline needs from a shader module, read from its SPIR-V.
+struct ShaderReflection {
+  std::string entryPoint;  // Empty if there is no GLCompute entry point.
+  // The bindings of each descriptor set.
+  std::map<uint32_t, std::vector<VkDescriptorSetLayoutBinding>> sets;
+  bool pushConstants = false;
+};
+
+// Reads the GLCompute entry point, the descriptor bindings and the use of push
+// constants of a SPIR-V module. Returns false if code is not SPIR-V.
+static bool ReflectShader(const std::vector<uint32_t>& code,
+                          ShaderReflection* reflection) {
+  // Opcodes, decorations and storage classes of the SPIR-V specification.
+  enum : uint32_t {
+    OpEntryPoint = 15,
+    OpTypeImage = 25,
+    OpTypeSampler = 26,
+    OpTypeSampledImage = 27,
+    OpTypeArray = 28,
+    OpTypeRuntimeArray = 29,
+    OpTypeStruct = 30,
+    OpTypePointer = 32,
+    OpConstant = 43,
+    OpVariable = 59,
+    OpDecorate = 71,
+    DecorationBlock = 2,
+    DecorationBufferBlock = 3,
+    DecorationBinding = 33,
+    DecorationDescriptorSet = 34,
+    StorageClassUniformConstant = 0,
+    StorageClassUniform = 2,
+    StorageClassPushConstant = 9,
+    StorageClassStorageBuffer = 12,
+    ExecutionModelGLCompute = 5,
+    DimBuffer = 5,
+  };
+  if (code.size() < 5 || code[0] != 0x07230203) {
+    return false;
+  }
+
+  std::map<uint32_t, std::vector<uint32_t>> types;  // Operands by result id.
+  std::map<uint32_t, uint32_t> constants;
+  std::map<uint32_t, uint32_t> sets, bindings;
+  std::set<uint32_t> blocks, buffer_blocks;
+  std::vector<std::vector<uint32_t>> variables;
+  for (size_t i = 5; i < code.size();) {
+    const uint32_t count = code[i] >> 16;
+    const uint32_t opcode = code[i] & 0xffff;
+    if (count == 0 || i + count > code.size()) {
+      return false;
+    }
+    std::vector<uint32_t> operands(code.begin() + i + 1,
+                                   code.begin() + i + count);
+    i += count;
+    switch (opcode) {
+      case OpEntryPoint:
+        if (operands.size() >= 3 && operands[0] == ExecutionModelGLCompute &&
+            reflection->entryPoint.empty()) {
+          const char* name = reinterpret_cast<const char*>(&operands[2]);
+          reflection->entryPoint.assign(
+              name, strnlen(name, (operands.size() - 2) * sizeof(uint32_t)));
+        }
+        break;
+      case OpDecorate:
+        if (operands.size() >= 3 && operands[1] == DecorationDescriptorSet) {
+          sets[operands[0]] = operands[2];
+        } else if (operands.size() >= 3 && operands[1] == DecorationBinding) {
+          bindings[operands[0]] = operands[2];
+        } else if (operands.size() >= 2 && operands[1] == DecorationBlock) {
+          blocks.insert(operands[0]);
+        } else if (operands.size() >= 2 &&
+                   operands[1] == DecorationBufferBlock) {
+          buffer_blocks.insert(operands[0]);
+        }
+        break;
+      case OpConstant:
+        if (operands.size() >= 3) {
+          constants[operands[1]] = operands[2];
+        }
+        break;
+      case OpVariable:
+        if (operands.size() >= 3) {
+          variables.push_back(operands);
+        }
+        break;
+      case OpTypeImage:
+      case OpTypeSampler:
+      case OpTypeSampledImage:
+      case OpTypeArray:
+      case OpTypeRuntimeArray:
+      case OpTypeStruct:
+      case OpTypePointer:
+        if (!operands.empty()) {
+          std::vector<uint32_t> type(operands.begin() + 1, operands.end());
+          type.insert(type.begin(), opcode);
+          types[operands[0]] = type;
+        }
+        break;
+    }
+  }
+
+  for (const auto& variable : variables) {
+    const uint32_t id = variable[1];
+    const uint32_t storage_class = variable[2];
+    if (storage_class == StorageClassPushConstant) {
+      reflection->pushConstants = true;
+      continue;
+    }
+    if (sets.count(id) == 0 || bindings.count(id) == 0) {
+      continue;
+    }
+    // The pointee of the variable, without its array dimensions.
+    auto pointer = types.find(variable[0]);
+    if (pointer == types.end() || pointer->second.size() < 3) {
+      continue;
+    }
+    uint32_t type_id = pointer->second[2];
+    uint32_t descriptor_count = 1;
+    auto type = types.find(type_id);
+    while (type != types.end() && (type->second[0] == OpTypeArray ||
+                                   type->second[0] == OpTypeRuntimeArray)) {
+      if (type->second[0] == OpTypeArray && type->second.size() >= 3) {
+        descriptor_count *= std::max<uint32_t>(constants[type->second[2]], 1);
+      }
+      type_id = type->second.size() >= 2 ? type->second[1] : 0;
+      type = types.find(type_id);
+    }
+    if (type == types.end()) {
+      continue;
+    }
+
+    VkDescriptorType descriptor_type;
+    const auto& t = type->second;
+    if (storage_class == StorageClassStorageBuffer ||
+        (storage_class == StorageClassUniform &&
+         buffer_blocks.count(type_id))) {
+      descriptor_type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    } else if (storage_class == StorageClassUniform) {
+      descriptor_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    } else if (storage_class != StorageClassUniformConstant) {
+      continue;
+    } else if (t[0] == OpTypeSampler) {
+      descriptor_type = VK_DESCRIPTOR_TYPE_SAMPLER;
+    } else if (t[0] == OpTypeSampledImage) {
+      descriptor_type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    } else if (t[0] == OpTypeImage && t.size() >= 7) {
+      // Operands: sampled type, dim, depth, arrayed, ms, sampled.
+      const bool buffer = t[2] == DimBuffer;
+      const bool sampled = t[6] == 1;
+      if (buffer) {
+        descriptor_type = sampled ? VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER
+                                  : VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
+      } else {
+        descriptor_type = sampled ? VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE
+                                  : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+      }
+    } else {
+      continue;
+    }
+    auto& set_bindings = reflection->sets[sets[id]];
+    if (std::any_of(set_bindings.begin(), set_bindings.end(),
+                    [&](const VkDescriptorSetLayoutBinding& b) {
+                      return b.binding == bindings[id];
+                    })) {
+      continue;  // Aliased variables share the binding.
+    }
+    VkDescriptorSetLayoutBinding binding = {};
+    binding.binding = bindings[id];
+    binding.descriptorType = descriptor_type;
+    binding.descriptorCount = descriptor_count;
+    binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    set_bindings.push_back(binding);
+  }
+  return true;
+}
+
+// Reads a whole SPIR-V file.
+static bool ReadSpirv(const std::string& path, std::vector<uint32_t>* code) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    LOG("Invalid File '%s' - %d: %s\n", path.c_str(), errno, strerror(errno));
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  // uint32_t storage keeps the code aligned as vkCreateShaderModule expects.
+  code->assign(size > 0 ? (size + 3) / 4 : 0, 0);
+  bool read = size > 0 && fread(code->data(), 1, size, f) == size_t(size);
+  fclose(f);
+  if (!read || size % 4 != 0) {
+    LOG("Invalid length '%s'\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Returns the .spv files of a directory, sorted, or the paths listed one per
+// line in a file. Empty lines and lines starting with # are skipped.
+static std::vector<std::string> ListShaders(const std::string& path) {
+  std::vector<std::string> paths;
+#ifndef WINDOWS
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(path.c_str());
+    while (dir != nullptr) {
+      dirent* entry = readdir(dir);
+      if (entry == nullptr) {
+        closedir(dir);
+        break;
+      }
+      std::string name = entry->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".spv") == 0) {
+        paths.push_back(path + "/" + name);
+      }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+#endif
+  std::ifstream list(path);
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty() && line[0] != '#') {
+      paths.push_back(line);
+    }
+  }
+  return paths;
+}
+
+// Journal of a batch: "start <path>" before a shader is compiled, and
+// "done <path> <module us> <pipeline us> <VkResult>" after, flushed at once, so
+// that the shaders in flight when the driver crashed the process can be told
+// from it.
+struct Journal {
+  FILE* file = nullptr;
+  std::mutex lock;
+
+  void Write(const std::string& line) {
+    if (file == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    fprintf(file, "%s\n", line.c_str());
+    fflush(file);
+  }
+};
+
+// Reads the shaders done, and started but not done, in a journal.
+static void ReadJournal(const char* path, std::set<std::string>* done,
+                        std::set<std::string>* started) {
+  std::ifstream journal(path);
+  std::string line;
+  while (std::getline(journal, line)) {
+    if (line.compare(0, 6, "start ") == 0) {
+      started->insert(line.substr(6));
+    } else if (line.compare(0, 5, "done ") == 0) {
+      // The path is followed by three numbers.
+      std::string path = line.substr(5);
+      for (int i = 0; i < 3; i++) {
+        path = path.substr(0, path.find_last_of(' '));
+      }
+      done->insert(path);
+      started->erase(path);
+    }
+  }
+}
+
+// Creates the module of the shader, and with create_pipeline a compute
+// pipeline for it with a layout matching its resources, through cache unless
+// it is VK_NULL_HANDLE.
+static void CompileShader(VulkanDevice* device, bool create_pipeline,
+                          VkPipelineCache cache, BatchShader* shader) {
+  auto vk_device = device->device;
+  std::vector<uint32_t> code;
+  if (!ReadSpirv(shader->path, &code)) {
+    shader->result = VK_ERROR_INITIALIZATION_FAILED;
+    return;
+  }
+
+  VkShaderModuleCreateInfo module_info = {};
+  module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  module_info.codeSize = code.size() * sizeof(uint32_t);
+  module_info.pCode = code.data();
+  VkShaderModule module;
+  auto start = std::chrono::steady_clock::now();
+  shader->result =
+      vkCreateShaderModule(vk_device, &module_info, nullptr, &module);
+  shader->module_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  if (shader->result != VK_SUCCESS) {
+    return;
+  }
+
+  ShaderReflection reflection;
+  if (create_pipeline && ReflectShader(code, &reflection) &&
+      !reflection.entryPoint.empty()) {
+    // A descriptor set layout for each set up to the last one used.
+    std::vector<VkDescriptorSetLayout> set_layouts;
+    uint32_t set_count =
+        reflection.sets.empty() ? 0 : reflection.sets.rbegin()->first + 1;
+    for (uint32_t set = 0; set < set_count; set++) {
+      const auto& bindings = reflection.sets[set];
+      VkDescriptorSetLayoutCreateInfo set_info = {};
+      set_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+      set_info.bindingCount = static_cast<uint32_t>(bindings.size());
+      set_info.pBindings = bindings.data();
+      VkDescriptorSetLayout set_layout;
+      VK_CHECK_RESULT(vkCreateDescriptorSetLayout(vk_device, &set_info,
+                                                  nullptr, &set_layout));
+      set_layouts.push_back(set_layout);
+    }
+    // The push constants are given the whole range, their block is not read.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device->physicalDevice, &properties);
+    VkPushConstantRange push_range = {VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                                      properties.limits.maxPushConstantsSize};
+    VkPipelineLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    layout_info.setLayoutCount = set_count;
+    layout_info.pSetLayouts = set_layouts.data();
+    layout_info.pushConstantRangeCount = reflection.pushConstants ? 1 : 0;
+    layout_info.pPushConstantRanges = &push_range;
+    VkPipelineLayout layout;
+    VK_CHECK_RESULT(
+        vkCreatePipelineLayout(vk_device, &layout_info, nullptr, &layout));
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType =
+        VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = reflection.entryPoint.c_str();
+    pipeline_info.layout = layout;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    start = std::chrono::steady_clock::now();
+    shader->result = vkCreateComputePipelines(
+        vk_device, cache, 1, &pipeline_info, nullptr, &pipeline);
+    shader->pipeline_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    if (shader->result == VK_SUCCESS) {
+      vkDestroyPipeline(vk_device, pipeline, nullptr);
+    }
+    vkDestroyPipelineLayout(vk_device, layout, nullptr);
+    for (auto set_layout : set_layouts) {
+      vkDestroyDescriptorSetLayout(vk_device, set_layout, nullptr);
+    }
+  }
+  vkDestroyShaderModule(vk_device, module, nullptr);
+}
+
+// Compiles the shaders on jobs threads, until they are all done or the device
+// is lost. Returns the exit code.
+static int RunBatch(VulkanDevice* device, std::vector<BatchShader>* shaders,
+                    uint32_t jobs, bool create_pipeline, bool use_cache,
+                    Journal* journal) {
+  VkPipelineCache cache = use_cache ? device->pipelineCache : VK_NULL_HANDLE;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> done{0};
+  std::atomic<bool> lost{false};
+  auto start = std::chrono::steady_clock::now();
+  auto worker = [&]() {
+    for (size_t i = next++; i < shaders->size() && !lost; i = next++) {
+      auto& shader = (*shaders)[i];
+      journal->Write("start " + shader.path);
+      CompileShader(device, create_pipeline, cache, &shader);
+      journal->Write("done " + shader.path + " " +
+                     std::to_string(shader.module_ns / 1000) + " " +
+                     std::to_string(shader.pipeline_ns < 0
+                                        ? -1
+                                        : shader.pipeline_ns / 1000) +
+                     " " + std::to_string(shader.result));
+      LOG("[%zu/%zu] %s: module %.3f ms, pipeline %s ms, VkResult %d\n",
+          ++done, shaders->size(), shader.path.c_str(), shader.module_ns / 1e6,
+          shader.pipeline_ns < 0
+              ? "-"
+              : std::to_string(shader.pipeline_ns / 1e6).c_str(),
+          shader.result);
+      if (shader.result == VK_ERROR_DEVICE_LOST) {
+        LOG("Device lost compiling %s\n", shader.path.c_str());
+        lost = true;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < jobs; i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  size_t failed = 0;
+  std::vector<const BatchShader*> by_time;
+  for (const auto& shader : *shaders) {
+    if (shader.module_ns < 0) {
+      continue;
+    }
+    failed += shader.result != VK_SUCCESS;
+    by_time.push_back(&shader);
+  }
+  auto compile_ns = [](const BatchShader* shader) {
+    return shader->module_ns + std::max<int64_t>(shader->pipeline_ns, 0);
+  };
+  std::sort(by_time.begin(), by_time.end(),
+            [&](const BatchShader* a, const BatchShader* b) {
+              return compile_ns(a) > compile_ns(b);
+            });
+  LOG("%zu of %zu shaders compiled in %lld ms on %u threads, %zu failed\n",
+      by_time.size(), shaders->size(), static_cast<long long>(elapsed), jobs,
+      failed);
+  for (size_t i = 0; i < by_time.size() && i < 10; i++) {
+    LOG("Slowest %zu: %s, %.3f ms\n", i + 1, by_time[i]->path.c_str(),
+        compile_ns(by_time[i]) / 1e6);
+  }
+  if (use_cache) {
+    SavePipelineCache(device);
+  }
+  return lost ? 2 : failed ? 1 : 0;
 }
 
 // Run our test.
 int main(int argc, char* argv[]) {
   VulkanContext context;
+  std::vector<const char*> device_extensions;
+  bool create_pipeline = false;
+  bool batch = false;
+  bool use_cache = false;
+  bool resume = false;
+  uint32_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  const char* journal_path = nullptr;
 
   if (argc < 2) {
     PrintUsage();
@@ -46,7 +521,7 @@ int main(int argc, char* argv[]) {
                (i < argc - 2)) {
       ++i;
       printf("Using device extension: \"%s\"\n", argv[i]);
-      context.GetSingleDevice()->deviceExtensions->push_back(argv[i]);
+      device_extensions.push_back(argv[i]);
     } else if ((0 == strcmp("-l", argv[i]) ||
                 0 == strcmp("--layer", argv[i])) &&
                (i < argc - 2)) {
@@ -67,18 +542,92 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Unknown Vulkan version \"%s\"\n", argv[i]);
         exit(-1);
       }
+    } else if (0 == strcmp("-p", argv[i]) ||
+               0 == strcmp("--pipeline", argv[i])) {
+      create_pipeline = true;
+    } else if (0 == strcmp("-b", argv[i]) || 0 == strcmp("--batch", argv[i])) {
+      batch = true;
+    } else if (0 == strcmp("-c", argv[i]) || 0 == strcmp("--cache", argv[i])) {
+      use_cache = true;
+    } else if (0 == strcmp("-r", argv[i]) ||
+               0 == strcmp("--resume", argv[i])) {
+      resume = true;
+    } else if ((0 == strcmp("-j", argv[i]) ||
+                0 == strcmp("--jobs", argv[i])) &&
+               (i < argc - 2)) {
+      ++i;
+      jobs = std::max(static_cast<uint32_t>(strtoul(argv[i], nullptr, 10)), 1u);
+    } else if ((0 == strcmp("-J", argv[i]) ||
+                0 == strcmp("--journal", argv[i])) &&
+               (i < argc - 2)) {
+      ++i;
+      journal_path = argv[i];
     }
   }
 
   auto fname = argv[argc - 1];
+  if (batch) {
+    std::set<std::string> done, started;
+    if (resume && journal_path != nullptr) {
+      ReadJournal(journal_path, &done, &started);
+      for (const auto& path : started) {
+        printf("Skipping \"%s\", in flight when the previous run stopped\n",
+               path.c_str());
+      }
+    }
+    std::vector<BatchShader> shaders;
+    for (const auto& path : ListShaders(fname)) {
+      if (done.count(path) == 0 && started.count(path) == 0) {
+        shaders.push_back({path});
+      }
+    }
+    printf("Loading %zu shaders from \"%s\" on %u threads\n", shaders.size(),
+           fname, jobs);
+
+    // No watchdog, the batch may run for hours.
+    if (!InitVulkanInstance(&context) ||
+        InitVulkanDevice(&context, &device_extensions) == VK_NULL_HANDLE) {
+      return 1;
+    }
+    Journal journal;
+    if (journal_path != nullptr) {
+      journal.file = fopen(journal_path, "a");
+      if (journal.file == nullptr) {
+        fprintf(stderr, "Unable to open the journal \"%s\"\n", journal_path);
+        return 1;
+      }
+    }
+    int result = RunBatch(context.GetSingleDevice(), &shaders, jobs,
+                          create_pipeline, use_cache, &journal);
+    if (journal.file != nullptr) {
+      fclose(journal.file);
+    }
+    CleanupVulkan(&context);
+    FlushLogs();
+    return result;
+  }
+
   printf("Loading shader \"%s\"\n", fname);
 
-  if (!InitVulkan(&context)) {
+  // With -p the default pipeline is created from the shader, through the
+  // pipeline cache.
+  if (!InitVulkan(&context, &device_extensions,
+                  create_pipeline ? fname : nullptr)) {
     return 1;
   }
 
-  VkShaderModule shaderModule;
-  LoadShader(context.GetSingleDevice()->device, fname, shaderModule);
+  int result = 0;
+  if (!create_pipeline) {
+    auto vk_device = context.GetSingleDevice()->device;
+    VkShaderModule shaderModule;
+    if (LoadShader(vk_device, fname, shaderModule)) {
+      vkDestroyShaderModule(vk_device, shaderModule, nullptr);
+    } else {
+      result = 1;
+    }
+  }
 
-  return 0;
+  CleanupVulkan(&context);
+  FlushLogs();
+  return result;
 }
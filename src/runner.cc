@@ -0,0 +1,804 @@
+/*
+ Copyright 2020 Google Inc.
+
+ Licensed under the Apache License, Version 2.0 (the "License");
+ you may not use this file except in compliance with the License.
+ You may obtain a copy of the License at
+
+ http://www.apache.org/licenses/LICENSE-2.0
+
+ Unless required by applicable law or agreed to in writing, software
+ distributed under the License is distributed on an "AS IS" BASIS,
+ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ See the License for the specific language governing permissions and
+ limitations under the License.
+*/
+
+// hcf_runner runs every scenario of the project as an isolated child process.
+// Scenarios are scheduled on "lanes": by default one lane per physical device,
+// so that only one program hangs a GPU at a time, or with
+// --parallel=queue_family one lane per queue family of every device, where
+// each child is told which queue to fault on through --queue. The scenario
+// list is sharded over the lanes of all the devices, each child is pointed to
+// its device with --device and has its own timeout. A JSON summary of all the
+// runs is written at the end.
+//
+// With --matrix, each scenario is expanded into one cell per combination of
+// the given common flags (--queue, --secondary, --debug_utils, --sync2). The
+// outcome of each cell is cached, keyed by the hash of the executable, the
+// device UUID, the driver version, the instance layer versions and the
+// arguments of the cell, and cells whose key did not change are not run again.
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "common.h"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// The queues a scenario can be pointed at with --queue.
+enum LaneMask : uint32_t {
+  kGraphicsLane = 1 << 0,
+  kComputeLane = 1 << 1,
+  kTransferLane = 1 << 2,
+  kAnyComputeLane = kGraphicsLane | kComputeLane,
+  kAnyLane = kGraphicsLane | kComputeLane | kTransferLane,
+};
+
+struct Scenario {
+  const char* name;  // Name of the scenario and of its executable.
+  uint32_t lanes;    // Queues the scenario can run its fault on.
+  bool exclusive;    // Uses several queues, so it needs the whole device.
+  bool secondary;    // Records through CreateAndRecordCommandBuffers.
+};
+
+// Every TestVulkan entry point of the project.
+const Scenario kScenarios[] = {
+    {"crash_copy", kAnyLane, false, true},
+    {"crash_shader", kAnyComputeLane, false, true},
+    {"crash_sparse_unbind", kGraphicsLane, false, false},
+    {"crash_bindless_descriptors", kAnyComputeLane, false, true},
+    {"hang_infinite_loop", kAnyComputeLane, false, true},
+    {"hang_multi_queue", kAnyComputeLane, true, true},
+    {"hang_host_event", kAnyComputeLane, false, true},
+    {"hang_host_event_multi_context", kAnyComputeLane, false, false},
+    {"hang_host_event_multi_device", kAnyComputeLane, false, false},
+    {"hang_host_event_reset", kAnyComputeLane, false, true},
+    {"hang_semaphore", kAnyComputeLane, false, false},
+    {"hang_binary_timeline_semaphore_gpu", kAnyComputeLane, false, false},
+    {"hang_binary_timeline_semaphore_gpu_bind_sparse", kGraphicsLane, false,
+     false},
+    {"hang_timeline_semaphore_gpu", kAnyComputeLane, false, false},
+    {"hang_timeline_semaphore_host", kAnyComputeLane, false, false},
+    {"hang_timeline_semaphore_dag", kAnyComputeLane, true, false},
+    {"hang_huge_command_buffer", kAnyComputeLane, false, true},
+    {"hang_frame_loop", kAnyComputeLane, false, false},
+    {"invalid_local_array_index", kAnyComputeLane, false, true},
+    {"buffer_marker_test", kAnyComputeLane, false, false},
+    {"buffer_marker_hang", kAnyComputeLane, false, false},
+};
+
+// A scenario with the flags of a cell of the --matrix.
+struct Cell {
+  const Scenario* scenario;
+  std::string name;  // Scenario name followed by the flags, e.g. ".secondary".
+  // Queue of the queue axis, Undefined for the lane's queue.
+  QueueType queue = QueueType::Undefined;
+  std::vector<std::string> args;
+};
+
+struct Job;
+
+struct Lane {
+  uint32_t device_index;
+  std::string device;  // Value of --device for the children.
+  // Queue passed to the child through --queue, Undefined to use the
+  // scenario's default queue.
+  QueueType queue;
+  uint32_t mask;
+  uint32_t driver_version;
+  Job* job = nullptr;
+};
+
+struct Job {
+  const Cell* cell;
+  Lane* lane;
+  pid_t pid;
+  std::chrono::steady_clock::time_point start;
+  std::string log_path;
+  std::string report_path;  // Passed to the child as --latency_json.
+  std::string cache_key;
+};
+
+struct Result {
+  std::string name;
+  std::string scenario;
+  uint32_t device_index;
+  std::string device;
+  QueueType queue;
+  int exit_code = -1;
+  int signal = 0;
+  bool timed_out = false;
+  bool launched = true;
+  // The runner couldn't wait for the scenario, its outcome is unknown.
+  bool runner_error = false;
+  bool device_lost = false;
+  bool watchdog_expired = false;
+  uint64_t duration_ms = 0;
+  // Peak resident set size of the scenario process, killed or not.
+  uint64_t peak_rss_kb = 0;
+  std::string log_path;
+  std::string report;  // JSON run report of the child, empty if none.
+  // Summary entry of a previous sweep with the same cache key, if any.
+  std::string cached;
+};
+
+// Instance layers and their versions, part of the cache keys.
+std::string layer_versions;
+
+uint32_t ParseUint(const char* flag, uint32_t default_value) {
+  const char* value = GetFlag(flag);
+  if (value == nullptr || *value == '\0') {
+    return default_value;
+  }
+  return static_cast<uint32_t>(strtoul(value, nullptr, 0));
+}
+
+std::string DirectoryOf(const char* path) {
+  char resolved[PATH_MAX];
+  std::string p = realpath(path, resolved) ? resolved : path;
+  auto slash = p.rfind('/');
+  if (slash == std::string::npos) {
+    return ".";
+  }
+  return p.substr(0, slash);
+}
+
+bool IsSelected(const Scenario& scenario, const char* selection) {
+  if (selection == nullptr || *selection == '\0') {
+    return true;
+  }
+  std::stringstream ss(selection);
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    if (name == scenario.name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IsDeviceSelected(uint32_t index, const char* selection) {
+  if (selection == nullptr || *selection == '\0') {
+    return true;
+  }
+  std::stringstream ss(selection);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (strtoul(item.c_str(), nullptr, 10) == index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Builds the lanes of every selected physical device.
+std::vector<Lane> CreateLanes(bool per_queue_family) {
+  std::vector<Lane> lanes;
+  VulkanContext context;
+  if (!InitVulkanInstance(&context)) {
+    exit(EXIT_FAILURE);
+  }
+  for (const auto& info : GetPhysicalDeviceInfos(&context)) {
+    if (!IsDeviceSelected(info.index, GetFlag("--devices"))) {
+      continue;
+    }
+    // Prefer the UUID, the enumeration order is not guaranteed to be the same
+    // in the children.
+    std::string device = info.hasDeviceUUID ? UUIDToString(info.deviceUUID)
+                                            : std::to_string(info.index);
+    LOG("Device %u: %s [--device=%s]\n", info.index,
+        info.properties.deviceName, device.c_str());
+    uint32_t driver_version = info.properties.driverVersion;
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(info.physicalDevice,
+                                             &family_count, nullptr);
+    const std::pair<QueueType, uint32_t> lane_types[] = {
+        {QueueType::Graphics, kGraphicsLane},
+        {QueueType::Compute, kComputeLane},
+        {QueueType::Transfer, kTransferLane},
+    };
+    // A device lane runs the cells of every queue type of the device.
+    uint32_t device_mask = 0;
+    for (auto& lane_type : lane_types) {
+      if (SelectQueue(info.physicalDevice, lane_type.first) < family_count) {
+        device_mask |= lane_type.second;
+        if (per_queue_family) {
+          lanes.push_back({info.index, device, lane_type.first,
+                           lane_type.second, driver_version});
+        }
+      }
+    }
+    if (!per_queue_family) {
+      lanes.push_back({info.index, device, QueueType::Undefined, device_mask,
+                       driver_version});
+    }
+  }
+
+  uint32_t layer_count = 0;
+  vkEnumerateInstanceLayerProperties(&layer_count, nullptr);
+  std::vector<VkLayerProperties> layers(layer_count);
+  vkEnumerateInstanceLayerProperties(&layer_count, layers.data());
+  for (const auto& layer : layers) {
+    layer_versions += std::string(layer.layerName) + ":" +
+                      std::to_string(layer.specVersion) + ":" +
+                      std::to_string(layer.implementationVersion) + ";";
+  }
+  // Don't keep the instance around while the children use the GPUs.
+  vkDestroyInstance(context.instance, nullptr);
+  return lanes;
+}
+
+// Queue of a cell on a lane, Undefined for the scenario's default queue.
+QueueType CellQueue(const Cell& cell, const Lane& lane) {
+  return lane.queue != QueueType::Undefined ? lane.queue : cell.queue;
+}
+
+// Arguments of a cell on a lane, except its output paths.
+std::vector<std::string> CellArgs(const Cell& cell, const Lane& lane) {
+  std::vector<std::string> args = {"--device=" + lane.device};
+  QueueType queue = CellQueue(cell, lane);
+  if (queue != QueueType::Undefined) {
+    args.push_back(std::string("--queue=") + QueueTypeToString(queue));
+  }
+  if (GetFlag("--layer") != nullptr) {
+    args.push_back(std::string("--layer=") + GetFlag("--layer"));
+  }
+  args.insert(args.end(), cell.args.begin(), cell.args.end());
+  return args;
+}
+
+pid_t Launch(const std::string& bin_dir, const Cell& cell, const Lane& lane,
+             const std::string& log_path, const std::string& report_path) {
+  std::string binary = bin_dir + "/" + cell.scenario->name;
+  std::vector<std::string> args = {binary, "--latency_json=" + report_path};
+  for (auto& arg : CellArgs(cell, lane)) {
+    args.push_back(arg);
+  }
+  std::vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Only async-signal-safe calls until exec. Run the child next to its
+    // binary, where it writes its own files.
+    int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    if (chdir(bin_dir.c_str()) != 0) {
+      _exit(127);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  return pid;
+}
+
+// Collects what the scenario reported from its log.
+void ScanLog(Result* result) {
+  std::ifstream log(result->log_path);
+  std::string line;
+  char device_lost[32];
+  snprintf(device_lost, sizeof(device_lost), "VkResult is %d",
+           VK_ERROR_DEVICE_LOST);
+  while (std::getline(log, line)) {
+    if (line.find(device_lost) != std::string::npos) {
+      result->device_lost = true;
+    }
+    if (line.find("Test watchdog expired") != std::string::npos) {
+      result->watchdog_expired = true;
+    }
+  }
+}
+
+// Reads the run report written by the scenario, if any.
+void ReadReport(Result* result, const std::string& report_path) {
+  std::ifstream report(report_path);
+  std::string line;
+  if (std::getline(report, line) && !line.empty() && line[0] == '{') {
+    result->report = line;
+  }
+}
+
+// wait4, retried when interrupted by a signal.
+pid_t Wait4(pid_t pid, int* status, int options, struct rusage* usage) {
+  pid_t result;
+  do {
+    result = wait4(pid, status, options, usage);
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+// JSON object of a result in the summary, which is also what the cache keeps.
+std::string SummaryEntry(const Result& r) {
+  char buffer[2048];
+  snprintf(buffer, sizeof(buffer),
+           "{\"name\": \"%s\", \"scenario\": \"%s\", \"device\": %u, "
+           "\"device_id\": \"%s\", \"queue\": \"%s\", "
+           "\"launched\": %s, \"runner_error\": %s, \"exit_code\": %d, "
+           "\"signal\": %d, \"timed_out\": %s, \"device_lost\": %s, "
+           "\"watchdog_expired\": %s, \"duration_ms\": %llu, "
+           "\"peak_rss_kb\": %llu, \"log\": \"%s\", \"report\": ",
+           JsonEscape(r.name).c_str(), JsonEscape(r.scenario).c_str(),
+           r.device_index, JsonEscape(r.device).c_str(),
+           QueueTypeToString(r.queue), r.launched ? "true" : "false",
+           r.runner_error ? "true" : "false", r.exit_code, r.signal,
+           r.timed_out ? "true" : "false",
+           r.device_lost ? "true" : "false",
+           r.watchdog_expired ? "true" : "false",
+           static_cast<unsigned long long>(r.duration_ms),
+           static_cast<unsigned long long>(r.peak_rss_kb),
+           JsonEscape(r.log_path).c_str());
+  return buffer + (r.report.empty() ? "null" : r.report) + "}";
+}
+
+void WriteSummary(const char* path, const std::vector<Result>& results,
+                  uint64_t total_ms) {
+  FILE* f = fopen(path, "w");
+  if (f == nullptr) {
+    LOG("Unable to write summary '%s' - %d: %s\n", path, errno,
+        strerror(errno));
+    return;
+  }
+  fprintf(f, "{\n  \"total_ms\": %llu,\n  \"scenarios\": [",
+          static_cast<unsigned long long>(total_ms));
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto& r = results[i];
+    if (r.cached.empty()) {
+      fprintf(f, "%s\n    %s", i == 0 ? "" : ",", SummaryEntry(r).c_str());
+    } else {
+      // Mark the entry of the previous sweep as cached.
+      fprintf(f, "%s\n    {\"cached\": true, %s", i == 0 ? "" : ",",
+              r.cached.c_str() + 1);
+    }
+  }
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+}
+
+// Expands a scenario into the cells of the matrix axes, a comma separated list
+// of queue, secondary, debug_utils and sync2. The queue axis only applies to
+// lanes without a queue of their own (--parallel=device).
+std::vector<Cell> ExpandMatrix(const Scenario& scenario, const char* axes,
+                               bool per_queue_family) {
+  std::vector<Cell> cells = {{&scenario, scenario.name}};
+  if (axes == nullptr) {
+    return cells;
+  }
+  std::stringstream ss(axes);
+  std::string axis;
+  while (std::getline(ss, axis, ',')) {
+    std::vector<Cell> expanded;
+    for (const auto& cell : cells) {
+      if (axis == "queue") {
+        if (per_queue_family || scenario.exclusive) {
+          expanded.push_back(cell);
+          continue;
+        }
+        const std::pair<QueueType, uint32_t> queues[] = {
+            {QueueType::Graphics, kGraphicsLane},
+            {QueueType::Compute, kComputeLane},
+            {QueueType::Transfer, kTransferLane},
+        };
+        for (auto& queue : queues) {
+          if (scenario.lanes & queue.second) {
+            Cell c = cell;
+            c.queue = queue.first;
+            c.name += std::string(".") + QueueTypeToString(queue.first);
+            expanded.push_back(c);
+          }
+        }
+      } else if (axis == "secondary" || axis == "debug_utils" ||
+                 axis == "sync2") {
+        expanded.push_back(cell);
+        if (axis == "secondary" && !scenario.secondary) {
+          continue;
+        }
+        Cell c = cell;
+        c.name += "." + axis;
+        c.args.push_back("--" + axis);
+        expanded.push_back(c);
+      } else {
+        fprintf(stderr, "Unknown --matrix axis: %s\n", axis.c_str());
+        exit(EXIT_FAILURE);
+      }
+    }
+    cells = expanded;
+  }
+  return cells;
+}
+
+// 64-bit FNV-1a.
+uint64_t Hash(const void* data, size_t size,
+              uint64_t hash = 14695981039346656037ull) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<const uint8_t*>(data)[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Hash of the content of a file, 0 if it can not be read.
+uint64_t HashFile(const std::string& path) {
+  static std::map<std::string, uint64_t> hashes;
+  auto it = hashes.find(path);
+  if (it != hashes.end()) {
+    return it->second;
+  }
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return hashes[path] = 0;
+  }
+  uint64_t hash = Hash(nullptr, 0);
+  char buffer[64 * 1024];
+  while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+    hash = Hash(buffer, static_cast<size_t>(file.gcount()), hash);
+  }
+  return hashes[path] = hash;
+}
+
+// Key of the outcome of a cell on a lane, empty if the binary can not be read.
+std::string CacheKey(const std::string& bin_dir, const Cell& cell,
+                     const Lane& lane, uint64_t timeout_ms) {
+  uint64_t binary = HashFile(bin_dir + "/" + cell.scenario->name);
+  if (binary == 0) {
+    return "";
+  }
+  std::string inputs = std::to_string(binary) + " " +
+                       std::to_string(lane.driver_version) + " " +
+                       lane.device + " " + layer_versions + " " +
+                       std::to_string(timeout_ms);
+  for (auto& arg : CellArgs(cell, lane)) {
+    inputs += " " + arg;
+  }
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx",
+           static_cast<unsigned long long>(Hash(inputs.data(), inputs.size())));
+  return key;
+}
+
+// The cache file has a line per cell, its key followed by its summary entry.
+std::map<std::string, std::string> ReadCache(const std::string& path) {
+  std::map<std::string, std::string> cache;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    auto space = line.find(' ');
+    if (space != std::string::npos && space + 1 < line.size() &&
+        line[space + 1] == '{') {
+      cache[line.substr(0, space)] = line.substr(space + 1);
+    }
+  }
+  return cache;
+}
+
+void WriteCache(const std::string& path,
+                const std::map<std::string, std::string>& cache) {
+  std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream file(tmp_path);
+  for (auto& entry : cache) {
+    file << entry.first << " " << entry.second << "\n";
+  }
+  file.close();
+  if (!file || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG("Unable to write cache '%s'\n", path.c_str());
+    unlink(tmp_path.c_str());
+  }
+}
+
+uint32_t LaneMaskOf(QueueType queue) {
+  switch (queue) {
+    case QueueType::Graphics:
+      return kGraphicsLane;
+    case QueueType::Compute:
+      return kComputeLane;
+    case QueueType::Transfer:
+      return kTransferLane;
+    default:
+      return kAnyLane;
+  }
+}
+
+bool CanRun(const Cell& cell, const Lane& lane,
+            const std::vector<Lane>& lanes) {
+  const Scenario& scenario = *cell.scenario;
+  if (lane.job != nullptr ||
+      (scenario.lanes & LaneMaskOf(cell.queue) & lane.mask) == 0) {
+    return false;
+  }
+  if (scenario.exclusive) {
+    for (auto& other : lanes) {
+      if (other.device_index == lane.device_index && other.job != nullptr) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void Occupy(std::vector<Lane>& lanes, Job* job) {
+  for (auto& lane : lanes) {
+    if (&lane == job->lane ||
+        (job->cell->scenario->exclusive &&
+         lane.device_index == job->lane->device_index)) {
+      lane.job = job;
+    }
+  }
+}
+
+void Release(std::vector<Lane>& lanes, Job* job) {
+  for (auto& lane : lanes) {
+    if (lane.job == job) {
+      lane.job = nullptr;
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  DefineFlag("--scenarios", "Comma separated scenarios to run, default all.");
+  DefineFlag("--list", "List the scenarios and exit.");
+  DefineFlag("--parallel",
+             "Scheduling granularity, device (default) runs one scenario per "
+             "device, queue_family one per queue family.");
+  DefineFlag("--jobs", "Maximum number of concurrent scenarios.");
+  DefineFlag("--devices",
+             "Comma separated indices of the physical devices to use, default "
+             "all.");
+  DefineFlag("--timeout_ms", "Time after which a scenario is killed.");
+  DefineFlag("--bin_dir", "Directory of the scenario executables.");
+  DefineFlag("--log_dir", "Directory for the scenario logs.");
+  DefineFlag("--summary", "Path of the JSON summary.");
+  DefineFlag("--matrix",
+             "Comma separated flags to expand every scenario with: queue, "
+             "secondary, debug_utils, sync2.");
+  DefineFlag("--cache",
+             "Path of the outcome cache, default cache.txt in --log_dir.");
+  DefineFlag("--no_cache", "Run every cell, ignoring the cached outcomes.");
+  InitFlags(argc, argv);
+
+  if (GetFlag("--list") != nullptr) {
+    for (auto& scenario : kScenarios) {
+      printf("%s\n", scenario.name);
+    }
+    return 0;
+  }
+
+  const char* parallel = GetFlag("--parallel");
+  bool per_queue_family =
+      parallel != nullptr && std::string(parallel) == "queue_family";
+  if (parallel != nullptr && !per_queue_family &&
+      std::string(parallel) != "device") {
+    fprintf(stderr, "Unknown --parallel mode: %s\n", parallel);
+    return EXIT_FAILURE;
+  }
+
+  std::string bin_dir = GetFlag("--bin_dir") && *GetFlag("--bin_dir")
+                            ? GetFlag("--bin_dir")
+                            : DirectoryOf(argv[0]);
+  std::string log_dir = GetFlag("--log_dir") && *GetFlag("--log_dir")
+                            ? GetFlag("--log_dir")
+                            : "hcf_logs";
+  const char* summary_path = GetFlag("--summary") && *GetFlag("--summary")
+                                 ? GetFlag("--summary")
+                                 : "hcf_summary.json";
+  // Leave the child watchdog time to fire before killing the scenario.
+  auto timeout = std::chrono::milliseconds(
+      ParseUint("--timeout_ms", kTestTerminationTimerMsDefault + 30000));
+  mkdir(log_dir.c_str(), 0755);
+  // The children run from bin_dir, give them an absolute report path.
+  char resolved_log_dir[PATH_MAX];
+  if (realpath(log_dir.c_str(), resolved_log_dir) != nullptr) {
+    log_dir = resolved_log_dir;
+  }
+
+  std::vector<Lane> lanes = CreateLanes(per_queue_family);
+  if (lanes.empty()) {
+    LOG("No usable device found.\n");
+    return EXIT_FAILURE;
+  }
+  uint32_t max_jobs =
+      ParseUint("--jobs", static_cast<uint32_t>(lanes.size()));
+
+  std::deque<Cell> cells;
+  for (auto& scenario : kScenarios) {
+    if (IsSelected(scenario, GetFlag("--scenarios"))) {
+      for (auto& cell :
+           ExpandMatrix(scenario, GetFlag("--matrix"), per_queue_family)) {
+        cells.push_back(cell);
+      }
+    }
+  }
+  std::deque<const Cell*> pending;
+  for (auto& cell : cells) {
+    pending.push_back(&cell);
+  }
+
+  std::string cache_path = GetFlag("--cache") && *GetFlag("--cache")
+                               ? GetFlag("--cache")
+                               : log_dir + "/cache.txt";
+  bool use_cache = GetFlag("--no_cache") == nullptr;
+  auto cache = ReadCache(cache_path);
+  size_t cached_count = 0;
+
+  std::vector<Result> results;
+  std::vector<Job*> running;
+  auto sweep_start = std::chrono::steady_clock::now();
+  while (!pending.empty() || !running.empty()) {
+    // Start as many scenarios as there are free lanes.
+    for (auto it = pending.begin();
+         it != pending.end() && running.size() < max_jobs;) {
+      Lane* lane = nullptr;
+      for (auto& l : lanes) {
+        if (CanRun(**it, l, lanes)) {
+          lane = &l;
+          break;
+        }
+      }
+      if (lane == nullptr) {
+        ++it;
+        continue;
+      }
+      const Cell& cell = **it;
+      std::string cache_key = CacheKey(
+          bin_dir, cell, *lane, static_cast<uint64_t>(timeout.count()));
+      auto cached = cache.find(cache_key);
+      if (use_cache && !cache_key.empty() && cached != cache.end()) {
+        LOG("Skipping %s, its inputs did not change\n", cell.name.c_str());
+        Result result;
+        result.name = cell.name;
+        result.cached = cached->second;
+        results.push_back(result);
+        cached_count++;
+        it = pending.erase(it);
+        continue;
+      }
+
+      std::string log_base = log_dir + "/" + cell.name;
+      auto job = new Job{&cell,
+                         lane,
+                         0,
+                         std::chrono::steady_clock::now(),
+                         log_base + ".log",
+                         log_base + ".json",
+                         cache_key};
+      // Don't pick up the report of a previous sweep.
+      unlink(job->report_path.c_str());
+      job->pid =
+          Launch(bin_dir, cell, *lane, job->log_path, job->report_path);
+      if (job->pid < 0) {
+        LOG("Unable to start %s - %d: %s\n", cell.name.c_str(), errno,
+            strerror(errno));
+        Result result;
+        result.name = cell.name;
+        result.scenario = cell.scenario->name;
+        result.device_index = lane->device_index;
+        result.device = lane->device;
+        result.queue = CellQueue(cell, *lane);
+        result.launched = false;
+        results.push_back(result);
+        delete job;
+      } else {
+        LOG("Started %s [pid %d, device %u, queue %s]\n", cell.name.c_str(),
+            job->pid, lane->device_index,
+            QueueTypeToString(CellQueue(cell, *lane)));
+        Occupy(lanes, job);
+        running.push_back(job);
+      }
+      it = pending.erase(it);
+    }
+
+    // Reap the finished scenarios and kill the ones that timed out.
+    std::this_thread::sleep_for(20ms);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = running.begin(); it != running.end();) {
+      Job* job = *it;
+      int status = 0;
+      struct rusage usage = {};
+      bool timed_out = false;
+      pid_t pid = Wait4(job->pid, &status, WNOHANG, &usage);
+      int wait_errno = errno;
+      if (pid == 0) {
+        if (now - job->start > timeout) {
+          LOG("%s timed out, killing it.\n", job->cell->name.c_str());
+          kill(job->pid, SIGKILL);
+          timed_out = true;
+          pid = Wait4(job->pid, &status, 0, &usage);
+          wait_errno = errno;
+        } else {
+          ++it;
+          continue;
+        }
+      }
+
+      Result result;
+      result.name = job->cell->name;
+      result.scenario = job->cell->scenario->name;
+      result.device_index = job->lane->device_index;
+      result.device = job->lane->device;
+      result.queue = CellQueue(*job->cell, *job->lane);
+      result.log_path = job->log_path;
+      result.duration_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(now -
+                                                                job->start)
+              .count();
+      result.timed_out = timed_out;
+      result.peak_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+      result.peak_rss_kb /= 1024;  // Bytes on macOS.
+#endif
+      if (pid < 0) {
+        LOG("Unable to wait for %s - %d: %s\n", result.name.c_str(),
+            wait_errno, strerror(wait_errno));
+        result.runner_error = true;
+      } else if (WIFEXITED(status)) {
+        result.exit_code = WEXITSTATUS(status);
+        result.launched = result.exit_code != 127;
+      } else if (WIFSIGNALED(status)) {
+        result.signal = WTERMSIG(status);
+      }
+      ScanLog(&result);
+      ReadReport(&result, job->report_path);
+      LOG("Finished %s [exit %d, signal %d, %llu ms]\n", result.name.c_str(),
+          result.exit_code, result.signal,
+          static_cast<unsigned long long>(result.duration_ms));
+      results.push_back(result);
+      // Only complete runs are cached, not the ones the runner had to kill.
+      if (result.launched && !result.timed_out && !result.runner_error &&
+          !job->cache_key.empty()) {
+        cache[job->cache_key] = SummaryEntry(result);
+      }
+
+      Release(lanes, job);
+      delete job;
+      it = running.erase(it);
+    }
+  }
+  auto total_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - sweep_start)
+                      .count();
+
+  WriteSummary(summary_path, results, total_ms);
+  WriteCache(cache_path, cache);
+  LOG("Ran %zu scenarios (%zu cached) in %llu ms, summary written to %s\n",
+      results.size(), cached_count, static_cast<unsigned long long>(total_ms),
+      summary_path);
+
+  for (auto& result : results) {
+    if (!result.launched || result.runner_error) {
+      return EXIT_FAILURE;
+    }
+  }
+  return 0;
+}